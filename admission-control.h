@@ -0,0 +1,429 @@
+/* Admission of new RTSP sessions within a bandwidth and CPU budget
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   AdmissionControl *ac = admission_control_new (client_stats, 40.0, 80);
+ *   admission_control_set_redirect (ac, "rtsp://other-host:8554");
+ *   admission_control_attach (ac, server);
+ *   admission_control_watch_media (ac, media);     (from "prepared")
+ *
+ * Every viewer of a shared media costs its own payload copies and socket
+ * writes, so past some number of viewers all of them stutter. Once a
+ * second the egress rate and the CPU load are measured:
+ *
+ *   egress  the bit rate out of each stream's payloader, times the
+ *           clients playing that stream, whatever their transport; a
+ *           client plays from its PLAY until its PAUSE or TEARDOWN
+ *   load    CPU time of the whole process, streaming threads included,
+ *           as a share of all cores
+ *
+ * A DESCRIBE or a SETUP that starts a new session is rejected when one
+ * more viewer at the current average per viewer would exceed the egress
+ * budget (453 Not Enough Bandwidth), or when the load is over its budget
+ * (503 Service Unavailable). Sessions admitted since the last tick are not
+ * measured yet: each counts as one more viewer at the average until the
+ * tick that sees it playing, or for at most two ticks if it never plays,
+ * so a burst of SETUPs within one tick cannot all pass on the same
+ * numbers. With a redirect URL the client gets
+ * 302 Moved Temporarily to the same path there instead. Requests within
+ * a session the server still has always pass, so the viewers already
+ * admitted keep their quality. A SETUP after the TEARDOWN of its session
+ * starts a new one and is checked again.
+ *
+ * A budget of 0 is not enforced.
+ */
+
+#ifndef __ADMISSION_CONTROL_H__
+#define __ADMISSION_CONTROL_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include "rtsp-client-stats.h"
+
+G_BEGIN_DECLS
+
+#define ADMISSION_CONTROL_TICK_SECONDS 1
+
+typedef struct
+{
+  RtspClientStats *clients;
+  gdouble max_egress_bps;
+  gdouble max_load;
+  gchar *redirect;
+
+  /* main thread */
+  guint tick_id;
+  gint64 last_tick_us;
+  clock_t last_cpu;
+
+  /* read by the RTSP clients and metrics, atomics */
+  guint64 egress_bps;
+  guint64 load_permille;
+  guint viewers;
+  guint pending;                /* admitted since the last tick */
+  guint pending_last;           /* admitted the tick before, not playing */
+  guint64 admitted;
+  guint64 rejected_bandwidth;
+  guint64 rejected_load;
+  guint64 redirected;
+} AdmissionControl;
+
+/* Bytes out of a stream's payloader */
+typedef struct
+{
+  guint64 bytes;                /* atomic */
+  guint64 last_bytes;
+  gint64 last_us;
+  gdouble bps;
+} AdmissionStream;
+
+static gboolean admission_control_tick (AdmissionControl * ac);
+
+/* @max_egress_mbps in Mbit/s, @max_load_percent of all cores */
+static AdmissionControl * G_GNUC_UNUSED
+admission_control_new (RtspClientStats * clients, gdouble max_egress_mbps,
+    gint max_load_percent)
+{
+  AdmissionControl *ac = g_new0 (AdmissionControl, 1);
+
+  ac->clients = clients;
+  ac->max_egress_bps = max_egress_mbps * 1e6;
+  ac->max_load = max_load_percent / 100.0;
+  ac->last_tick_us = g_get_monotonic_time ();
+  ac->last_cpu = clock ();
+  ac->tick_id = g_timeout_add_seconds (ADMISSION_CONTROL_TICK_SECONDS,
+      (GSourceFunc) admission_control_tick, ac);
+
+  return ac;
+}
+
+/* Send rejected clients to the same path under @url */
+static void G_GNUC_UNUSED
+admission_control_set_redirect (AdmissionControl * ac, const gchar * url)
+{
+  g_free (ac->redirect);
+  ac->redirect = g_strdup (url);
+}
+
+static void G_GNUC_UNUSED
+admission_control_free (AdmissionControl * ac)
+{
+  g_source_remove (ac->tick_id);
+  g_free (ac->redirect);
+  g_free (ac);
+}
+
+static GstPadProbeReturn
+admission_control_count_probe (GstPad * pad, GstPadProbeInfo * info,
+    AdmissionStream * as)
+{
+  guint64 bytes = 0;
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+    bytes = gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info));
+  else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+    bytes = gst_buffer_list_calculate_size (GST_PAD_PROBE_INFO_BUFFER_LIST
+        (info));
+  __atomic_add_fetch (&as->bytes, bytes, __ATOMIC_RELAXED);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Measure the streams of @media; call once it is prepared */
+static void G_GNUC_UNUSED
+admission_control_watch_media (AdmissionControl * ac, GstRTSPMedia * media)
+{
+  guint i;
+
+  for (i = 0; i < gst_rtsp_media_n_streams (media); i++) {
+    GstRTSPStream *stream = gst_rtsp_media_get_stream (media, i);
+    GstPad *pad = gst_rtsp_stream_get_srcpad (stream);
+    AdmissionStream *as;
+
+    if (!pad || g_object_get_data (G_OBJECT (stream), "admission-stream")) {
+      if (pad)
+        gst_object_unref (pad);
+      continue;
+    }
+    /* the stream owns it, the probe goes with the media */
+    as = g_new0 (AdmissionStream, 1);
+    as->last_us = g_get_monotonic_time ();
+    g_object_set_data_full (G_OBJECT (stream), "admission-stream", as,
+        g_free);
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+        GST_PAD_PROBE_TYPE_BUFFER_LIST,
+        (GstPadProbeCallback) admission_control_count_probe, as, NULL);
+    gst_object_unref (pad);
+  }
+}
+
+/* Rate of a stream since the last tick, once per tick */
+static void
+admission_control_add_stream (GstRTSPStream * stream, gpointer user_data)
+{
+  GHashTable *rates = user_data;
+  AdmissionStream *as = g_object_get_data (G_OBJECT (stream),
+      "admission-stream");
+  gint64 now = g_get_monotonic_time ();
+  guint64 bytes;
+
+  if (!as)
+    return;
+  if (!g_hash_table_contains (rates, as)) {
+    bytes = __atomic_load_n (&as->bytes, __ATOMIC_RELAXED);
+    if (now > as->last_us)
+      as->bps = (bytes - as->last_bytes) * 8 * 1e6 / (now - as->last_us);
+    as->last_bytes = bytes;
+    as->last_us = now;
+    g_hash_table_insert (rates, as, GUINT_TO_POINTER (0));
+  }
+  /* one more client gets this stream */
+  g_hash_table_insert (rates, as, GUINT_TO_POINTER (GPOINTER_TO_UINT
+          (g_hash_table_lookup (rates, as)) + 1));
+}
+
+static gboolean
+admission_control_tick (AdmissionControl * ac)
+{
+  GHashTable *rates = g_hash_table_new (NULL, NULL);
+  GHashTableIter iter;
+  gpointer key, value;
+  gint64 now = g_get_monotonic_time ();
+  clock_t cpu = clock ();
+  gdouble egress = 0, load;
+  guint viewers, started, pending, pending_last;
+
+  /* only the clients streaming, set up or paused ones cost nothing */
+  viewers = rtsp_client_stats_foreach_stream (ac->clients,
+      admission_control_add_stream, rates);
+  g_hash_table_iter_init (&iter, rates);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    egress += ((AdmissionStream *) key)->bps * GPOINTER_TO_UINT (value);
+  g_hash_table_unref (rates);
+
+  /* the new viewers are the oldest admitted sessions starting to play */
+  started = viewers > ac->viewers ? viewers - ac->viewers : 0;
+  pending_last = __atomic_load_n (&ac->pending_last, __ATOMIC_RELAXED);
+  pending = __atomic_exchange_n (&ac->pending, 0, __ATOMIC_RELAXED);
+  started -= MIN (started, pending_last);
+  pending -= MIN (started, pending);
+
+  load = (gdouble) (cpu - ac->last_cpu) / CLOCKS_PER_SEC /
+      ((now - ac->last_tick_us) / 1e6) / g_get_num_processors ();
+  ac->last_cpu = cpu;
+  ac->last_tick_us = now;
+
+  __atomic_store_n (&ac->egress_bps, (guint64) egress, __ATOMIC_RELAXED);
+  __atomic_store_n (&ac->load_permille, (guint64) (load * 1000),
+      __ATOMIC_RELAXED);
+  __atomic_store_n (&ac->viewers, viewers, __ATOMIC_RELAXED);
+  /* what is left from the tick before never played and expires */
+  __atomic_store_n (&ac->pending_last, pending, __ATOMIC_RELAXED);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* OK, or the status a new session is refused with, when @pending
+ * sessions not measured yet come before it */
+static GstRTSPStatusCode
+admission_control_check (AdmissionControl * ac, guint pending)
+{
+  gdouble egress = __atomic_load_n (&ac->egress_bps, __ATOMIC_RELAXED);
+  gdouble load = __atomic_load_n (&ac->load_permille, __ATOMIC_RELAXED) /
+      1000.0;
+  guint viewers = __atomic_load_n (&ac->viewers, __ATOMIC_RELAXED);
+
+  pending += __atomic_load_n (&ac->pending_last, __ATOMIC_RELAXED);
+  if (ac->max_egress_bps > 0 &&
+      egress + (viewers ? egress / viewers * (pending + 1) : 0) >
+      ac->max_egress_bps) {
+    __atomic_add_fetch (&ac->rejected_bandwidth, 1, __ATOMIC_RELAXED);
+    return GST_RTSP_STS_NOT_ENOUGH_BANDWIDTH;
+  }
+  if (ac->max_load > 0 && load > ac->max_load) {
+    __atomic_add_fetch (&ac->rejected_load, 1, __ATOMIC_RELAXED);
+    return GST_RTSP_STS_SERVICE_UNAVAILABLE;
+  }
+  return GST_RTSP_STS_OK;
+}
+
+/* Whether the Session header @header names a session of @client's server;
+ * a TEARDOWN removes it, and any client can send an old or made up one */
+static gboolean
+admission_control_has_session (GstRTSPClient * client, const gchar * header)
+{
+  GstRTSPSessionPool *pool = gst_rtsp_client_get_session_pool (client);
+  GstRTSPSession *session = NULL;
+  gchar *id;
+
+  if (!pool)
+    return FALSE;
+  /* "id;timeout=60" */
+  id = g_strndup (header, strcspn (header, ";"));
+  session = gst_rtsp_session_pool_find (pool, g_strstrip (id));
+  g_free (id);
+  g_object_unref (pool);
+  if (!session)
+    return FALSE;
+  g_object_unref (session);
+  return TRUE;
+}
+
+static GstRTSPStatusCode
+admission_control_pre_request (GstRTSPClient * client, GstRTSPContext * ctx,
+    AdmissionControl * ac, gboolean setup)
+{
+  GstRTSPStatusCode code;
+  gchar *session;
+  guint pending;
+
+  /* a further SETUP of an admitted viewer */
+  if (gst_rtsp_message_get_header (ctx->request, GST_RTSP_HDR_SESSION,
+          &session, 0) == GST_RTSP_OK &&
+      admission_control_has_session (client, session))
+    return GST_RTSP_STS_OK;
+
+  /* the session starts with the SETUP, a DESCRIBE comes before it; a
+   * SETUP admitted on stale numbers is checked again */
+  do {
+    pending = __atomic_load_n (&ac->pending, __ATOMIC_RELAXED);
+    code = admission_control_check (ac, pending);
+  } while (code == GST_RTSP_STS_OK && setup &&
+      !__atomic_compare_exchange_n (&ac->pending, &pending, pending + 1,
+          FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  if (code == GST_RTSP_STS_OK) {
+    if (setup)
+      __atomic_add_fetch (&ac->admitted, 1, __ATOMIC_RELAXED);
+    return code;
+  }
+
+  g_print ("refusing a new session from %s: %s\n",
+      gst_rtsp_connection_get_ip (gst_rtsp_client_get_connection (client)),
+      gst_rtsp_status_as_text (code));
+  if (!ac->redirect || !ctx->uri)
+    return code;
+  __atomic_add_fetch (&ac->redirected, 1, __ATOMIC_RELAXED);
+  return GST_RTSP_STS_MOVED_TEMPORARILY;
+}
+
+static GstRTSPStatusCode
+admission_control_pre_describe (GstRTSPClient * client, GstRTSPContext * ctx,
+    AdmissionControl * ac)
+{
+  return admission_control_pre_request (client, ctx, ac, FALSE);
+}
+
+static GstRTSPStatusCode
+admission_control_pre_setup (GstRTSPClient * client, GstRTSPContext * ctx,
+    AdmissionControl * ac)
+{
+  return admission_control_pre_request (client, ctx, ac, TRUE);
+}
+
+/* The response to a redirected request gets its Location */
+static void
+admission_control_send_message (GstRTSPClient * client, GstRTSPContext * ctx,
+    GstRTSPMessage * message, AdmissionControl * ac)
+{
+  GstRTSPStatusCode code;
+  gchar *location;
+
+  if (!ac->redirect || !ctx || !ctx->uri ||
+      gst_rtsp_message_get_type (message) != GST_RTSP_MESSAGE_RESPONSE ||
+      gst_rtsp_message_parse_response (message, &code, NULL, NULL) !=
+      GST_RTSP_OK || code != GST_RTSP_STS_MOVED_TEMPORARILY)
+    return;
+
+  location = g_strconcat (ac->redirect, ctx->uri->abspath, NULL);
+  gst_rtsp_message_add_header (message, GST_RTSP_HDR_LOCATION, location);
+  g_free (location);
+}
+
+static void
+admission_control_connected (GstRTSPServer * server, GstRTSPClient * client,
+    AdmissionControl * ac)
+{
+  g_signal_connect (client, "pre-describe-request",
+      G_CALLBACK (admission_control_pre_describe), ac);
+  g_signal_connect (client, "pre-setup-request",
+      G_CALLBACK (admission_control_pre_setup), ac);
+  g_signal_connect (client, "send-message",
+      G_CALLBACK (admission_control_send_message), ac);
+}
+
+/* Apply to the clients @server accepts from now on */
+static void G_GNUC_UNUSED
+admission_control_attach (AdmissionControl * ac, GstRTSPServer * server)
+{
+  g_signal_connect (server, "client-connected",
+      G_CALLBACK (admission_control_connected), ac);
+}
+
+static void G_GNUC_UNUSED
+admission_control_print_summary (AdmissionControl * ac, FILE * out)
+{
+  fprintf (out, "admission: %" G_GUINT64_FORMAT " sessions admitted, %"
+      G_GUINT64_FORMAT " refused for bandwidth, %" G_GUINT64_FORMAT
+      " for CPU load, %" G_GUINT64_FORMAT " of them redirected\n",
+      __atomic_load_n (&ac->admitted, __ATOMIC_RELAXED),
+      __atomic_load_n (&ac->rejected_bandwidth, __ATOMIC_RELAXED),
+      __atomic_load_n (&ac->rejected_load, __ATOMIC_RELAXED),
+      __atomic_load_n (&ac->redirected, __ATOMIC_RELAXED));
+}
+
+static void G_GNUC_UNUSED
+admission_control_collect_metrics (StreamMetricsScrape * scrape,
+    gpointer user_data)
+{
+  AdmissionControl *ac = user_data;
+
+  stream_metrics_emit (scrape, "admission_egress_bps", "gauge",
+      "Payload bit rate sent to all viewers", NULL,
+      __atomic_load_n (&ac->egress_bps, __ATOMIC_RELAXED));
+  stream_metrics_emit (scrape, "admission_egress_budget_bps", "gauge",
+      "Egress budget for admitting new sessions, 0 for none", NULL,
+      ac->max_egress_bps);
+  stream_metrics_emit (scrape, "admission_cpu_load", "gauge",
+      "CPU time of the server as a share of all cores (0-1)", NULL,
+      __atomic_load_n (&ac->load_permille, __ATOMIC_RELAXED) / 1000.0);
+  stream_metrics_emit (scrape, "admission_viewers", "gauge",
+      "Clients playing", NULL,
+      __atomic_load_n (&ac->viewers, __ATOMIC_RELAXED));
+  stream_metrics_emit (scrape, "admission_pending_viewers", "gauge",
+      "Sessions admitted and not measured playing yet", NULL,
+      __atomic_load_n (&ac->pending, __ATOMIC_RELAXED) +
+      __atomic_load_n (&ac->pending_last, __ATOMIC_RELAXED));
+  stream_metrics_emit (scrape, "admission_admitted_total", "counter",
+      "New sessions admitted", NULL,
+      __atomic_load_n (&ac->admitted, __ATOMIC_RELAXED));
+  stream_metrics_emit (scrape, "admission_rejected_total", "counter",
+      "New sessions refused", "reason=\"bandwidth\"",
+      __atomic_load_n (&ac->rejected_bandwidth, __ATOMIC_RELAXED));
+  stream_metrics_emit (scrape, "admission_rejected_total", "counter", NULL,
+      "reason=\"cpu\"", __atomic_load_n (&ac->rejected_load,
+          __ATOMIC_RELAXED));
+  stream_metrics_emit (scrape, "admission_redirected_total", "counter",
+      "Refused sessions redirected", NULL,
+      __atomic_load_n (&ac->redirected, __ATOMIC_RELAXED));
+}
+
+G_END_DECLS
+
+#endif /* __ADMISSION_CONTROL_H__ */
@@ -18,23 +18,216 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
 
 #include <gst/gst.h>
+#include <glib-unix.h>
 #include <gst/net/gstnet.h>
+#include <gst/video/video.h>
 
-#define PLAYBACK_DELAY_MS 200
-
+#include "stream-metrics.h"
+#include "startup-timing.h"
+#include "plugin-preload.h"
+#include "decode-qos.h"
+#include "sync-skew.h"
+#include "jitter-stats.h"
+#include "clock-slew.h"
 
+#define PLAYBACK_DELAY_MS 200
+/* frames since the last keyframe kept per channel for switching */
+#define GOP_CACHE_MAX 300
+/* frames early for this long before decoding steps back up */
+#define DECODE_RECOVER_MS 2000
+/* a channel without RTP for this long has lost its server */
+#define RECONNECT_STALL_MS 1000
+#define RECONNECT_CONNECT_MS 3000
+#define RECONNECT_CHECK_MS 250
+/* the first attempt is immediate, then this doubling up to the max */
+#define RECONNECT_MIN_MS 250
+#define RECONNECT_MAX_MS 8000
+
+static gchar *metrics_address = NULL;
+static gint switch_interval = 0;
+static gboolean convert_bench = FALSE;
+static gboolean headless = FALSE;
+static gint n_receivers = 1;
+static gchar *render_log = NULL;
+static FILE *render_log_file;
+static GstCaps *ntp_caps;
+static gint clock_jitter_ms = 0;
+static gdouble sync_target_ms = 10.0;
+static gint duration = 0;
+static SyncSkew *skew;
+static gchar *jitter_log = NULL;
+static gint jitter_interval_ms = 1000;
+static JitterStats *jitter_stats;
+static gint drop_every = 0;
+static gint drop_for_ms = 2000;
+static gint64 drop_until_us;
+static gboolean wait_sync = FALSE;
+static ClockSlew *slew;
+static PluginPreload preload;
+static StartupTimer *startup;
+
+/* elements of an RTSP H.264 + L16 receiver, preloaded with --fast-start;
+ * the display sinks come last so --headless can cut them off */
+static const gchar *client_factories[] = {
+  "rtspsrc", "rtpbin", "rtpjitterbuffer", "rtph264depay", "h264parse",
+  "avdec_h264", "rtpL16depay", "input-selector", "decodebin", "queue",
+  "videoconvert", "audioconvert", "audioresample", "fakesink",
+  "osxvideosink", "autoaudiosink", NULL
+};
+
+#define CLIENT_DISPLAY_FACTORIES 2
+
+static GOptionEntry entries[] = {
+  {"metrics", 0, 0, G_OPTION_ARG_STRING, &metrics_address,
+      "Serve Prometheus metrics on [HOST:]PORT or unix:PATH", "ADDRESS"},
+  {"switch-interval", 0, 0, G_OPTION_ARG_INT, &switch_interval,
+      "Switch to the next URI every SECONDS (default 0, only on request)",
+        "SECONDS"},
+  {"convert-bench", 0, 0, G_OPTION_ARG_NONE, &convert_bench,
+      "Measure the CPU time per 1080p frame of the videoconvert in front of "
+        "the video sink, and exit", NULL},
+  {"headless", 0, 0, G_OPTION_ARG_NONE, &headless,
+      "Decode into fakesinks synchronised to the net clock, no display or "
+        "audio device needed", NULL},
+  {"receivers", 0, 0, G_OPTION_ARG_INT, &n_receivers,
+      "Run N receiver pipelines of the URIs in this process (default 1)",
+        "N"},
+  {"render-log", 0, 0, G_OPTION_ARG_FILENAME, &render_log,
+      "Write the net clock time each video frame is rendered at to FILE as "
+        "CSV (with --headless)", "FILE"},
+  {"clock-jitter", 0, 0, G_OPTION_ARG_INT, &clock_jitter_ms,
+      "Give each receiver its own clock, off the net clock by a random "
+        "offset of up to MS either way", "MS"},
+  {"sync-target", 0, 0, G_OPTION_ARG_DOUBLE, &sync_target_ms,
+      "Skew between headless receivers that counts as in sync (default 10)",
+        "MS"},
+  {"duration", 0, 0, G_OPTION_ARG_INT, &duration,
+      "Stop after SECONDS and print the reports (default 0, run until "
+        "interrupted)", "SECONDS"},
+  {"jitter-log", 0, 0, G_OPTION_ARG_FILENAME, &jitter_log,
+      "Write the jitter buffer statistics to FILE as CSV", "FILE"},
+  {"jitter-interval", 0, 0, G_OPTION_ARG_INT, &jitter_interval_ms,
+      "Poll the jitter buffers for --jitter-log every MS (default 1000)",
+        "MS"},
+  {"drop-every", 0, 0, G_OPTION_ARG_INT, &drop_every,
+      "Simulate a network drop every SECONDS by discarding all RTP received "
+        "(default 0, never)", "SECONDS"},
+  {"drop-for", 0, 0, G_OPTION_ARG_INT, &drop_for_ms,
+      "Length of the simulated network drops (default 2000)", "MS"},
+  {"wait-sync", 0, 0, G_OPTION_ARG_NONE, &wait_sync,
+      "Wait for the net clock to sync before playing instead of starting "
+        "on a provisional clock", NULL},
+  {NULL}
+};
+
+
+
+typedef struct _CustomData CustomData;
+
+/* A track slot such as "audio1", the second audio stream of whichever
+ * channel plays: an input-selector with a pad per channel, followed by a
+ * decodebin whose decoded pads each get their own branch */
+typedef struct
+{
+  gchar *name;
+  GstElement *selector, *decode;
+} Track;
 
+/* One stream of a channel, linked to its track's selector */
+typedef struct
+{
+  Track *track;
+  GstPad *pad;                  /* selector request pad */
+  GstElement *depay, *parse;    /* NULL when decodebin depayloads */
+} ChannelTrack;
+
+/* One RTSP source. Only its rtspsrc and depayloaders are per channel; the
+ * parsed streams feed input-selectors in front of the shared decoders and
+ * sinks. */
+typedef struct
+{
+  CustomData *data;
+  guint index;
+  GstElement *src;
+  GPtrArray *tracks;            /* ChannelTrack, under lock */
+  guint n_video, n_audio, n_other;
+  GstPad *video_pad;            /* of the first video track */
+
+  /* the channel's streaming thread */
+  GMutex lock;
+  GQueue gop;                   /* buffers since the last keyframe */
+  gint64 last_key_us;
+  gint64 gop_us;                /* keyframe interval */
+  gboolean activate;            /* make active with the next buffer */
+  gboolean replaying;
+  gboolean key_requested;
+
+  gint64 created_us;
+  gint64 last_rtp_us;           /* atomic */
+} Channel;
 
 /* Structure to contain all our information, so we can pass it to callbacks */
-typedef struct _CustomData {
-    GstElement *pipe, *src, *videoconvert, *filter, *videosink;
-    GstElement *aud_conv, *audio_sink;
+struct _CustomData {
+    guint index;
+    gchar *labels;  /* metrics labels, NULL with a single receiver */
+    GstClock *clock;  /* with --clock-jitter, the play clock plus offset */
+    GstClockTimeDiff jitter_offset;
+    GstElement *pipe, *videosink;
     GstClock *net_clock;
+    GstClock *play_clock;  /* the net clock, or the clock slewing onto it */
     GMainLoop *loop;  /* GLib's Main Loop */
-} CustomData;
+
+    /* last gst-netclock-statistics from the net clock */
+    GMutex stats_lock;
+    GstClockTime clock_rtt;
+    gint64 clock_offset;
+
+    StreamMetrics *metrics;
+    DecodeQos *decode_qos;
+
+    /* Track slots, created as channels expose streams; videosink is the
+     * sink of the first video branch */
+    GMutex tracks_lock;
+    GPtrArray *tracks;
+
+    /* channel switching, main thread */
+    gchar **uris;
+    guint n_uris;
+    Channel *current, *next, *previous;
+
+    /* switch to first frame, video streaming threads */
+    gint64 switch_start_us;
+    guint switch_replayed;
+    GstSegment switch_segment;
+    gboolean switch_have_segment;
+    gint64 switch_gop_us;
+    /* read by metrics, atomics */
+    guint64 switches;
+    guint64 switch_us;
+    guint64 switch_last_us;
+    guint64 switch_within_gop;
+    guint video_branches;
+    guint video_converted;
+
+    /* reconnecting after an outage, main thread */
+    guint reconnect_id;
+    guint reconnect_attempts;
+    gint64 outage_start_us;  /* atomic, 0 again once the picture is back */
+    /* read by metrics, atomics */
+    guint64 reconnects;
+    guint64 outage_us;
+    guint64 outage_last_us;
+};
+
+/* n_receivers of them, sharing the net clock and the main loop */
+static CustomData *receivers;
 
 
 /* Handler for the pad-added signal */
@@ -46,13 +239,573 @@ source_created (GstElement * pipe, GstElement * source)
 {
     g_object_set (source, "latency", PLAYBACK_DELAY_MS,
                   "ntp-time-source", 3, "buffer-mode", 4, "ntp-sync", TRUE, "rtcp-sync-send-time", FALSE,  NULL);
+    /* the sender's NTP time of each frame identifies it across receivers */
+    if ((render_log || headless) && g_object_class_find_property (G_OBJECT_GET_CLASS
+            (source), "add-reference-timestamp-meta"))
+        g_object_set (source, "add-reference-timestamp-meta", TRUE, NULL);
+}
+
+static void channel_activated (Channel * ch);
+
+/* Runs for every parsed video buffer of a channel. Keeps the frames since
+ * the last keyframe, and when the channel is switched to, activates its
+ * selector pads from this thread and replays those frames ahead of a delta
+ * frame so the decoder has its references. The replayed frames are late
+ * and only decoded, the live frame right after them is the first shown.
+ * A new connection has no keyframe to replay yet: it asks the sender for
+ * one and holds its delta frames back until it comes. */
+static GstPadProbeReturn
+channel_video_probe (GstPad * pad, GstPadProbeInfo * info, Channel * ch)
+{
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  gboolean key = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  CustomData *data = ch->data;
+  GQueue replay = G_QUEUE_INIT;
+  gboolean activate;
+  GstBuffer *cached;
+  GList *l;
+  guint i;
+
+  if (ch->replaying)
+    return GST_PAD_PROBE_OK;
+
+  /* only this thread sets last_key_us */
+  if (!key && !ch->last_key_us) {
+    if (!ch->key_requested) {
+      ch->key_requested = TRUE;
+      /* rtpbin turns it into a PLI to the sender */
+      gst_pad_send_event (pad,
+          gst_video_event_new_upstream_force_key_unit (GST_CLOCK_TIME_NONE,
+              TRUE, 0));
+    }
+    return GST_PAD_PROBE_DROP;
+  }
+
+  g_mutex_lock (&ch->lock);
+  if (key) {
+    gint64 now = g_get_monotonic_time ();
+
+    g_queue_clear_full (&ch->gop, (GDestroyNotify) gst_buffer_unref);
+    if (ch->last_key_us)
+      ch->gop_us = now - ch->last_key_us;
+    ch->last_key_us = now;
+  }
+  activate = ch->activate;
+  ch->activate = FALSE;
+  if (activate && !key)
+    for (l = ch->gop.head; l; l = l->next)
+      g_queue_push_tail (&replay, gst_buffer_ref (l->data));
+  if (g_queue_get_length (&ch->gop) < GOP_CACHE_MAX)
+    g_queue_push_tail (&ch->gop, gst_buffer_ref (buffer));
+  g_mutex_unlock (&ch->lock);
+
+  if (!activate)
+    return GST_PAD_PROBE_OK;
+
+  data->switch_replayed = replay.length;
+  data->switch_gop_us = ch->gop_us;
+  data->switch_have_segment = FALSE;
+  g_mutex_lock (&ch->lock);
+  for (i = 0; i < ch->tracks->len; i++) {
+    ChannelTrack *ct = g_ptr_array_index (ch->tracks, i);
+
+    g_object_set (ct->track->selector, "active-pad", ct->pad, NULL);
+  }
+  g_mutex_unlock (&ch->lock);
+
+  ch->replaying = TRUE;
+  while ((cached = g_queue_pop_head (&replay)))
+    gst_pad_push (pad, cached);
+  ch->replaying = FALSE;
+
+  g_idle_add_full (G_PRIORITY_DEFAULT, (GSourceFunc) channel_activated, ch,
+      NULL);
+  return GST_PAD_PROBE_OK;
+}
+
+/* The elements belong to the pipeline */
+static void
+track_free (Track * track)
+{
+  g_free (track->name);
+  g_free (track);
+}
+
+static void
+track_element_added (GstBin * decode, GstElement * element, CustomData * data)
+{
+  GstElementFactory *factory = gst_element_get_factory (element);
+
+  if (factory && gst_element_factory_list_is_type (factory,
+          GST_ELEMENT_FACTORY_TYPE_DECODER |
+          GST_ELEMENT_FACTORY_TYPE_MEDIA_VIDEO))
+    decode_qos_attach (data->decode_qos, element);
+}
+
+/* The track slot @name, created on first use */
+static Track *
+track_get (CustomData * data, const gchar * name)
+{
+  Track *track;
+  guint i;
+
+  g_mutex_lock (&data->tracks_lock);
+  for (i = 0; i < data->tracks->len; i++) {
+    track = g_ptr_array_index (data->tracks, i);
+    if (strcmp (track->name, name) == 0)
+      goto done;
+  }
+
+  track = g_new0 (Track, 1);
+  track->name = g_strdup (name);
+  track->selector = gst_element_factory_make ("input-selector", NULL);
+  track->decode = gst_element_factory_make ("decodebin", NULL);
+  /* inactive channels are dropped at once instead of waiting for the
+   * active one's running time */
+  g_object_set (track->selector, "sync-streams", FALSE, NULL);
+  g_signal_connect (track->decode, "pad-added",
+      G_CALLBACK (pad_added_handler), data);
+  g_signal_connect (track->decode, "element-added",
+      G_CALLBACK (track_element_added), data);
+  gst_bin_add_many (GST_BIN (data->pipe), track->selector, track->decode,
+      NULL);
+  gst_element_link (track->selector, track->decode);
+  gst_element_sync_state_with_parent (track->decode);
+  gst_element_sync_state_with_parent (track->selector);
+  g_ptr_array_add (data->tracks, track);
+
+done:
+  g_mutex_unlock (&data->tracks_lock);
+  return track;
+}
+
+/* Link @pad through the depayloader and parser of @ct, if any, to a new
+ * request pad of its track's selector */
+static void
+channel_link (Channel * ch, GstPad * pad, ChannelTrack * ct)
+{
+  CustomData *data = ch->data;
+  GstElement *first = ct->depay, *last = ct->parse ? ct->parse : ct->depay;
+  GstPad *sink, *src;
+
+  ct->pad = gst_element_request_pad_simple (ct->track->selector, "sink_%u");
+  if (first) {
+    gst_bin_add (GST_BIN (data->pipe), first);
+    if (ct->parse) {
+      gst_bin_add (GST_BIN (data->pipe), ct->parse);
+      gst_element_link (first, ct->parse);
+    }
+    src = gst_element_get_static_pad (last, "src");
+    gst_pad_link (src, ct->pad);
+    if (ct->parse && !ch->video_pad) {
+      ch->video_pad = ct->pad;
+      gst_pad_add_probe (src, GST_PAD_PROBE_TYPE_BUFFER,
+          (GstPadProbeCallback) channel_video_probe, ch, NULL);
+    }
+    gst_object_unref (src);
+    if (ct->parse)
+      gst_element_sync_state_with_parent (ct->parse);
+    gst_element_sync_state_with_parent (first);
+    sink = gst_element_get_static_pad (first, "sink");
+  } else {
+    sink = gst_object_ref (ct->pad);
+  }
+
+  if (GST_PAD_LINK_FAILED (gst_pad_link (pad, sink)))
+    g_printerr ("Could not link %s of channel %u\n", GST_PAD_NAME (pad),
+        ch->index);
+  gst_object_unref (sink);
+}
+
+/* Everything the channel receives, after its jitter buffer. Notes when
+ * the server was last heard from, and drops it all during a simulated
+ * network drop. */
+static GstPadProbeReturn
+channel_rtp_probe (GstPad * pad, GstPadProbeInfo * info, Channel * ch)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if (now < __atomic_load_n (&drop_until_us, __ATOMIC_RELAXED))
+    return GST_PAD_PROBE_DROP;
+  __atomic_store_n (&ch->last_rtp_us, now, __ATOMIC_RELAXED);
+  return GST_PAD_PROBE_OK;
+}
+
+/* Every stream of the channel gets a track slot; H.264 and L16 are
+ * depayloaded here so the shared decodebin only ever sees the elementary
+ * stream, anything else is depayloaded by the decodebin */
+static void
+channel_pad_added (GstElement * src, GstPad * pad, Channel * ch)
+{
+  GstCaps *caps = gst_pad_query_caps (pad, NULL);
+  GstStructure *s = gst_caps_get_structure (caps, 0);
+  const gchar *media = gst_structure_get_string (s, "media");
+  const gchar *encoding = gst_structure_get_string (s, "encoding-name");
+  ChannelTrack *ct = g_new0 (ChannelTrack, 1);
+  gchar *name;
+
+  g_mutex_lock (&ch->lock);
+  if (g_strcmp0 (media, "video") == 0)
+    name = g_strdup_printf ("video%u", ch->n_video++);
+  else if (g_strcmp0 (media, "audio") == 0)
+    name = g_strdup_printf ("audio%u", ch->n_audio++);
+  else
+    name = g_strdup_printf ("other%u", ch->n_other++);
+  g_mutex_unlock (&ch->lock);
+
+  if (g_strcmp0 (encoding, "H264") == 0) {
+    ct->depay = gst_element_factory_make ("rtph264depay", NULL);
+    ct->parse = gst_element_factory_make ("h264parse", NULL);
+    /* every keyframe carries SPS/PPS, so replay can start at any of them */
+    g_object_set (ct->parse, "config-interval", -1, NULL);
+  } else if (g_strcmp0 (encoding, "L16") == 0) {
+    ct->depay = gst_element_factory_make ("rtpL16depay", NULL);
+  }
+  g_print ("channel %u: %s stream as %s\n", ch->index,
+      encoding ? encoding : "unknown", name);
+
+  ct->track = track_get (ch->data, name);
+  g_free (name);
+  channel_link (ch, pad, ct);
+  g_mutex_lock (&ch->lock);
+  g_ptr_array_add (ch->tracks, ct);
+  g_mutex_unlock (&ch->lock);
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+      GST_PAD_PROBE_TYPE_BUFFER_LIST, (GstPadProbeCallback) channel_rtp_probe,
+      ch, NULL);
+  gst_caps_unref (caps);
+}
+
+static Channel *
+channel_new (CustomData * data, guint index)
+{
+  Channel *ch = g_new0 (Channel, 1);
+
+  ch->data = data;
+  ch->index = index;
+  ch->created_us = g_get_monotonic_time ();
+  ch->tracks = g_ptr_array_new ();
+  g_mutex_init (&ch->lock);
+  g_queue_init (&ch->gop);
+  ch->src = gst_element_factory_make ("rtspsrc", NULL);
+  g_object_set (ch->src, "location", data->uris[index], NULL);
+  source_created (data->pipe, ch->src);
+  g_signal_connect (ch->src, "pad-added", G_CALLBACK (channel_pad_added), ch);
+  gst_bin_add (GST_BIN (data->pipe), ch->src);
+  gst_element_sync_state_with_parent (ch->src);
+
+  return ch;
+}
+
+static void
+channel_remove (GstElement * bin, GstElement * element)
+{
+  if (!element)
+    return;
+  gst_element_set_state (element, GST_STATE_NULL);
+  gst_bin_remove (GST_BIN (bin), element);
+}
+
+static void
+channel_free (Channel * ch)
+{
+  CustomData *data = ch->data;
+  guint i;
+
+  channel_remove (data->pipe, ch->src);
+  for (i = 0; i < ch->tracks->len; i++) {
+    ChannelTrack *ct = g_ptr_array_index (ch->tracks, i);
+
+    channel_remove (data->pipe, ct->depay);
+    channel_remove (data->pipe, ct->parse);
+    gst_element_release_request_pad (ct->track->selector, ct->pad);
+    gst_object_unref (ct->pad);
+    g_free (ct);
+  }
+  g_ptr_array_unref (ch->tracks);
+  g_queue_clear_full (&ch->gop, (GDestroyNotify) gst_buffer_unref);
+  g_mutex_clear (&ch->lock);
+  g_free (ch);
+}
+
+/* The next channel is kept playing behind an inactive selector pad so
+ * switching to it needs no RTSP setup */
+static void
+channel_prebuffer_next (CustomData * data)
+{
+  if (data->n_uris > 1 && !data->next)
+    data->next = channel_new (data, (data->current->index + 1) % data->n_uris);
+}
+
+/* Main thread, once @ch streams; the channel it replaced can go */
+static gboolean
+channel_activated (Channel * ch)
+{
+  CustomData *data = ch->data;
+
+  if (data->previous && data->previous != ch) {
+    if (data->previous->index == (ch->index + 1) % data->n_uris &&
+        !data->next)
+      data->next = data->previous;
+    else
+      channel_free (data->previous);
+  }
+  data->previous = NULL;
+  channel_prebuffer_next (data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+switch_channel (CustomData * data, guint index)
+{
+  Channel *ch;
+
+  index %= data->n_uris;
+  if (data->current && data->current->index == index)
+    return;
+  /* one switch at a time */
+  if (data->previous)
+    return;
+
+  g_print ("switching to %s\n", data->uris[index]);
+  if (data->next && data->next->index == index) {
+    ch = data->next;
+    data->next = NULL;
+  } else {
+    ch = channel_new (data, index);
+  }
+  __atomic_store_n (&data->switch_start_us, g_get_monotonic_time (),
+      __ATOMIC_RELEASE);
+  data->previous = data->current;
+  data->current = ch;
+  g_mutex_lock (&ch->lock);
+  ch->activate = TRUE;
+  g_mutex_unlock (&ch->lock);
+}
+
+/* Watches the video sink input: the first frame after the switch that is
+ * not late is the first one shown */
+static GstPadProbeReturn
+switch_sink_probe (GstPad * pad, GstPadProbeInfo * info, CustomData * data)
+{
+  GstClockTime running_time, now;
+  GstClock *clock;
+  GstBuffer *buffer;
+  gint64 elapsed;
+
+  if (!__atomic_load_n (&data->switch_start_us, __ATOMIC_ACQUIRE))
+    return GST_PAD_PROBE_OK;
+
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+
+    if (GST_EVENT_TYPE (event) == GST_EVENT_SEGMENT) {
+      gst_event_copy_segment (event, &data->switch_segment);
+      data->switch_have_segment = TRUE;
+    }
+    return GST_PAD_PROBE_OK;
+  }
+
+  buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  clock = gst_element_get_clock (data->pipe);
+  if (!data->switch_have_segment || !clock)
+    goto done;
+  running_time = gst_segment_to_running_time (&data->switch_segment,
+      GST_FORMAT_TIME, GST_BUFFER_PTS (buffer));
+  now = gst_clock_get_time (clock) - gst_element_get_base_time (data->pipe);
+  if (!GST_CLOCK_TIME_IS_VALID (running_time) || running_time +
+      gst_pipeline_get_latency (GST_PIPELINE (data->pipe)) < now)
+    goto done;
+
+  elapsed = g_get_monotonic_time () - data->switch_start_us;
+  __atomic_store_n (&data->switch_start_us, 0, __ATOMIC_RELEASE);
+  if (__atomic_load_n (&data->outage_start_us, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n (&data->outage_start_us, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch (&data->reconnects, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&data->outage_us, elapsed, __ATOMIC_RELAXED);
+    __atomic_store_n (&data->outage_last_us, elapsed, __ATOMIC_RELAXED);
+    g_print ("receiver %u: outage to first frame %.1f ms, %u attempts\n",
+        data->index, elapsed / 1000.0, data->reconnect_attempts);
+    goto done;
+  }
+  __atomic_add_fetch (&data->switches, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&data->switch_us, elapsed, __ATOMIC_RELAXED);
+  __atomic_store_n (&data->switch_last_us, elapsed, __ATOMIC_RELAXED);
+  if (data->switch_gop_us && elapsed <= data->switch_gop_us)
+    __atomic_add_fetch (&data->switch_within_gop, 1, __ATOMIC_RELAXED);
+  g_print ("switch to first frame %.1f ms, GOP %.1f ms, %u frames "
+      "replayed\n", elapsed / 1000.0, data->switch_gop_us / 1000.0,
+      data->switch_replayed);
+
+done:
+  if (clock)
+    gst_object_unref (clock);
+  return GST_PAD_PROBE_OK;
+}
+
+/* Switching applies to every receiver */
+static gboolean
+switch_next (gpointer user_data)
+{
+  gint i;
+
+  for (i = 0; i < n_receivers; i++)
+    if (receivers[i].current)
+      switch_channel (&receivers[i], receivers[i].current->index + 1);
+  return G_SOURCE_CONTINUE;
+}
+
+/* "n" next, "p" previous, a number switches to that URI */
+static gboolean
+switch_command (GIOChannel * source, GIOCondition condition,
+    gpointer user_data)
+{
+  gchar *line = NULL;
+  gint i;
+
+  if (g_io_channel_read_line (source, &line, NULL, NULL, NULL) !=
+      G_IO_STATUS_NORMAL)
+    return G_SOURCE_REMOVE;
+
+  g_strstrip (line);
+  for (i = 0; i < n_receivers; i++) {
+    CustomData *data = &receivers[i];
+    guint current = data->current ? data->current->index : 0;
+
+    if (strcmp (line, "n") == 0)
+      switch_channel (data, current + 1);
+    else if (strcmp (line, "p") == 0)
+      switch_channel (data, current + data->n_uris - 1);
+    else if (g_ascii_isdigit (line[0]))
+      switch_channel (data, atoi (line));
+  }
+  g_free (line);
+
+  return G_SOURCE_CONTINUE;
+}
+
+
+/* Replaces the current channel by a new connection to the same URI. The
+ * tracks, decoders and sinks stay, and so does the net clock, which keeps
+ * its sync; the new rtspsrc maps its RTCP times onto it and starts at the
+ * live edge. Its GOP cache starts empty, so the picture comes back with
+ * the keyframe channel_video_probe requests. */
+static gboolean
+channel_reconnect (CustomData * data)
+{
+  guint index = data->current->index;
+  Channel *ch;
+
+  data->reconnect_id = 0;
+  data->reconnect_attempts++;
+  if (data->previous) {
+    channel_free (data->previous);
+    data->previous = NULL;
+  }
+  channel_free (data->current);
+  ch = channel_new (data, index);
+  data->current = ch;
+  /* the first frame shown ends the outage, see switch_sink_probe */
+  __atomic_store_n (&data->switch_start_us,
+      __atomic_load_n (&data->outage_start_us, __ATOMIC_ACQUIRE),
+      __ATOMIC_RELEASE);
+  g_mutex_lock (&ch->lock);
+  ch->activate = TRUE;
+  g_mutex_unlock (&ch->lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* The current channel failed or went quiet around @since_us */
+static void
+reconnect_schedule (CustomData * data, gint64 since_us)
+{
+  guint delay = 0;
+
+  if (data->reconnect_id)
+    return;
+  if (!__atomic_load_n (&data->outage_start_us, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n (&data->outage_start_us, since_us, __ATOMIC_RELEASE);
+    data->reconnect_attempts = 0;
+  } else {
+    delay = MIN (RECONNECT_MIN_MS << MIN (data->reconnect_attempts - 1, 8),
+        RECONNECT_MAX_MS);
+  }
+
+  g_print ("receiver %u: lost %s, reconnecting in %u ms\n", data->index,
+      data->uris[data->current->index], delay);
+  data->reconnect_id = g_timeout_add (delay, (GSourceFunc) channel_reconnect,
+      data);
+}
+
+/* rtspsrc only errors out once its connection times out, the RTP
+ * stopping is noticed much sooner */
+static gboolean
+reconnect_watchdog (CustomData * data)
+{
+  Channel *ch = data->current;
+  gint64 now = g_get_monotonic_time (), last;
+
+  /* leave a switch in progress alone */
+  if (!ch || data->reconnect_id || data->previous)
+    return G_SOURCE_CONTINUE;
+
+  last = __atomic_load_n (&ch->last_rtp_us, __ATOMIC_RELAXED);
+  if (last && now - last > RECONNECT_STALL_MS * 1000)
+    reconnect_schedule (data, last);
+  else if (!last && now - ch->created_us > RECONNECT_CONNECT_MS * 1000)
+    reconnect_schedule (data, ch->created_us);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+channel_owns (Channel * ch, GstObject * object)
+{
+  return ch && (object == GST_OBJECT (ch->src) ||
+      gst_object_has_as_ancestor (object, GST_OBJECT (ch->src)));
 }
 
+/* TRUE when the error @message belongs to a channel and was handled */
+static gboolean
+channel_error (CustomData * data, GstMessage * message)
+{
+  GstObject *src = GST_MESSAGE_SRC (message);
+
+  /* from a channel that is gone already */
+  if (!gst_object_has_as_ancestor (src, GST_OBJECT (data->pipe)))
+    return TRUE;
+
+  if (channel_owns (data->current, src)) {
+    gint64 last = __atomic_load_n (&data->current->last_rtp_us,
+        __ATOMIC_RELAXED);
+
+    reconnect_schedule (data, last ? last : g_get_monotonic_time ());
+    return TRUE;
+  }
+  /* prebuffered again once the current channel is back */
+  if (channel_owns (data->next, src)) {
+    channel_free (data->next);
+    data->next = NULL;
+    return TRUE;
+  }
+  return channel_owns (data->previous, src);
+}
 
 static gboolean
-message (GstBus * bus, GstMessage * message, gpointer user_data)
+drop_start (gpointer user_data)
 {
-  GMainLoop *loop = user_data;
+  g_print ("simulating a network drop of %d ms\n", drop_for_ms);
+  __atomic_store_n (&drop_until_us, g_get_monotonic_time () +
+      drop_for_ms * (gint64) 1000, __ATOMIC_RELAXED);
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+message (GstBus * bus, GstMessage * message, CustomData * data)
+{
+  GMainLoop *loop = data->loop;
 
   switch (GST_MESSAGE_TYPE (message)) {
     case GST_MESSAGE_ERROR:{
@@ -70,7 +823,8 @@ message (GstBus * bus, GstMessage * message, gpointer user_data)
       g_free (debug);
       g_free (name);
 
-      g_main_loop_quit (loop);
+      if (!channel_error (data, message))
+        g_main_loop_quit (loop);
       break;
     }
     case GST_MESSAGE_WARNING:{
@@ -93,6 +847,22 @@ message (GstBus * bus, GstMessage * message, gpointer user_data)
       g_print ("Got EOS\n");
       g_main_loop_quit (loop);
       break;
+    case GST_MESSAGE_STATE_CHANGED:{
+      GstState state;
+
+      gst_message_parse_state_changed (message, NULL, &state, NULL);
+      if (state == GST_STATE_PLAYING && GST_IS_PIPELINE (message->src) &&
+          startup_timer_get_ms (startup, "first-pipeline-playing") < 0) {
+        gchar *summary;
+
+        startup_timer_mark (startup, "first-pipeline-playing");
+        summary = startup_timer_summary (startup);
+        g_print ("startup (%s registry): %s\n",
+            plugin_preload_describe (&preload), summary);
+        g_free (summary);
+      }
+      break;
+    }
     default:
       break;
   }
@@ -100,28 +870,392 @@ message (GstBus * bus, GstMessage * message, gpointer user_data)
   return TRUE;
 }
 
+static gboolean
+clock_stats (GstBus * bus, GstMessage * message, CustomData * data)
+{
+  const GstStructure *s = gst_message_get_structure (message);
+
+  if (s && gst_structure_has_name (s, "gst-netclock-statistics")) {
+    g_mutex_lock (&data->stats_lock);
+    gst_structure_get_uint64 (s, "rtt-average", &data->clock_rtt);
+    gst_structure_get_int64 (s, "local-clock-offset", &data->clock_offset);
+    g_mutex_unlock (&data->stats_lock);
+  }
+
+  return TRUE;
+}
+
+static void
+collect_client_metrics (StreamMetricsScrape * scrape, CustomData * data)
+{
+  guint64 switches = __atomic_load_n (&data->switches, __ATOMIC_RELAXED);
+  guint64 reconnects = __atomic_load_n (&data->reconnects, __ATOMIC_RELAXED);
+  gdouble rtt, offset;
+
+  /* the receivers share the net clock, its statistics go to the first */
+  if (data->index == 0) {
+    g_mutex_lock (&data->stats_lock);
+    rtt = (gdouble) data->clock_rtt / GST_SECOND;
+    offset = (gdouble) data->clock_offset / GST_SECOND;
+    g_mutex_unlock (&data->stats_lock);
+
+    stream_metrics_emit (scrape, "netclock_synced", "gauge",
+        "Whether the net clock is synchronised", NULL,
+        gst_clock_is_synced (data->net_clock));
+    stream_metrics_emit (scrape, "netclock_offset_seconds", "gauge",
+        "Offset of the net clock from the local clock", NULL, offset);
+    stream_metrics_emit (scrape, "netclock_rtt_seconds", "gauge",
+        "Average round trip to the clock server", NULL, rtt);
+  }
+  stream_metrics_emit (scrape, "client_switches_total", "counter",
+      "Channel switches that reached their first frame", data->labels,
+      switches);
+  stream_metrics_emit (scrape, "client_switch_seconds", "gauge",
+      "Last switch request to first frame time", data->labels,
+      __atomic_load_n (&data->switch_last_us, __ATOMIC_RELAXED) / 1e6);
+  stream_metrics_emit (scrape, "client_switch_seconds_avg", "gauge",
+      "Average switch request to first frame time", data->labels,
+      switches ? __atomic_load_n (&data->switch_us, __ATOMIC_RELAXED) / 1e6 /
+      switches : 0.0);
+  stream_metrics_emit (scrape, "client_switches_within_gop_total", "counter",
+      "Switches whose first frame came within one GOP", data->labels,
+      __atomic_load_n (&data->switch_within_gop, __ATOMIC_RELAXED));
+  stream_metrics_emit (scrape, "client_reconnects_total", "counter",
+      "Outages recovered from by reconnecting", data->labels, reconnects);
+  stream_metrics_emit (scrape, "client_outage_seconds", "gauge",
+      "Last outage to first frame time", data->labels,
+      __atomic_load_n (&data->outage_last_us, __ATOMIC_RELAXED) / 1e6);
+  stream_metrics_emit (scrape, "client_outage_seconds_avg", "gauge",
+      "Average outage to first frame time", data->labels,
+      reconnects ? __atomic_load_n (&data->outage_us, __ATOMIC_RELAXED) / 1e6 /
+      reconnects : 0.0);
+  stream_metrics_emit (scrape, "client_video_branches", "gauge",
+      "Decoded video streams being rendered", data->labels,
+      __atomic_load_n (&data->video_branches, __ATOMIC_RELAXED));
+  stream_metrics_emit (scrape, "client_video_converted_branches", "gauge",
+      "Decoded video streams converted before rendering", data->labels,
+      __atomic_load_n (&data->video_converted, __ATOMIC_RELAXED));
+}
+
+/* CPU time of running @launch to EOS, as fast as it goes */
+static gdouble
+convert_bench_run (const gchar * launch)
+{
+  GstElement *pipeline;
+  GstBus *bus;
+  GstMessage *msg;
+  GError *error = NULL;
+  clock_t cpu_start;
+
+  pipeline = gst_parse_launch (launch, &error);
+  if (error) {
+    g_printerr ("Unable to build bench pipeline: %s\n", error->message);
+    g_clear_error (&error);
+    if (pipeline)
+      gst_object_unref (pipeline);
+    return -1.0;
+  }
+
+  cpu_start = clock ();
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  bus = gst_element_get_bus (pipeline);
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    gst_message_parse_error (msg, &error, NULL);
+    g_printerr ("Bench pipeline failed: %s\n", error->message);
+    g_clear_error (&error);
+  }
+  gst_message_unref (msg);
+  gst_object_unref (bus);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+
+  return (gdouble) (clock () - cpu_start) / CLOCKS_PER_SEC;
+}
+
+/* The format videoconvert negotiates for @format in front of the video
+ * sink the client would use: @format itself when the sink renders it, or
+ * NULL when there is no such sink */
+static gchar *
+convert_bench_target (const gchar * format)
+{
+  GstElement *sink = gst_element_factory_make (headless ? "fakesink" :
+      "osxvideosink", NULL);
+  GstCaps *caps, *sink_caps;
+  GstPad *pad;
+  gchar *target = NULL;
+
+  if (!sink)
+    return NULL;
+  gst_object_ref_sink (sink);
+  pad = gst_element_get_static_pad (sink, "sink");
+  sink_caps = gst_pad_query_caps (pad, NULL);
+  caps = gst_caps_new_simple ("video/x-raw", "format", G_TYPE_STRING, format,
+      NULL);
+
+  if (gst_caps_can_intersect (caps, sink_caps)) {
+    target = g_strdup (format);
+  } else if (!gst_caps_is_empty (sink_caps)) {
+    GstCaps *fixed = gst_caps_fixate (gst_caps_copy (sink_caps));
+
+    target = g_strdup (gst_structure_get_string (gst_caps_get_structure
+            (fixed, 0), "format"));
+    gst_caps_unref (fixed);
+  }
+
+  gst_caps_unref (caps);
+  gst_caps_unref (sink_caps);
+  gst_object_unref (pad);
+  gst_object_unref (sink);
+  return target;
+}
+
+/* For each format the decoder may output, render 1080p frames into a
+ * fakesink once through videoconvert into the format the client's video
+ * sink takes, as every video branch does, and once without it. When the
+ * sink renders the decoder's format the videoconvert passes through, and
+ * the difference is its overhead. */
+static gint
+run_convert_bench (void)
+{
+  const gchar *formats[] = { "I420", "NV12" };
+  const gint frames = 200;
+  guint i;
+
+  g_print ("Convert bench: %d frames at 1920x1080 for %s\n", frames,
+      headless ? "fakesink" : "osxvideosink");
+  g_print ("%-6s %-6s %16s %15s %14s\n", "format", "sink", "converted ms/fr",
+      "direct ms/fr", "saved ms/fr");
+
+  for (i = 0; i < G_N_ELEMENTS (formats); i++) {
+    gchar *target = convert_bench_target (formats[i]);
+    gchar *src, *converted, *direct;
+    gdouble cpu[2];
+
+    if (!target) {
+      g_printerr ("No video sink to negotiate %s with\n", formats[i]);
+      return -1;
+    }
+    src = g_strdup_printf ("videotestsrc num-buffers=%d "
+        "pattern=smpte ! video/x-raw, format=%s, width=1920, height=1080, "
+        "framerate=30/1", frames, formats[i]);
+    converted = g_strdup_printf ("%s ! videoconvert ! "
+        "video/x-raw, format=%s ! fakesink sync=false", src, target);
+    direct = g_strdup_printf ("%s ! fakesink sync=false", src);
+
+    cpu[0] = convert_bench_run (converted);
+    cpu[1] = convert_bench_run (direct);
+    g_free (src);
+    g_free (converted);
+    g_free (direct);
+    if (cpu[0] < 0 || cpu[1] < 0) {
+      g_free (target);
+      return -1;
+    }
+
+    g_print ("%-6s %-6s %16.2f %15.2f %14.2f\n", formats[i], target,
+        cpu[0] * 1000 / frames, cpu[1] * 1000 / frames,
+        (cpu[0] - cpu[1]) * 1000 / frames);
+    g_free (target);
+  }
+
+  return 0;
+}
+
+/* Keeps the clock of receiver @data at the play clock plus its offset */
+static gboolean
+receiver_clock_calibrate (CustomData * data)
+{
+  gst_clock_set_calibration (data->clock,
+      gst_clock_get_internal_time (data->clock),
+      gst_clock_get_time (data->play_clock) + data->jitter_offset, 1, 1);
+  return G_SOURCE_CONTINUE;
+}
+
+/* A receiver clock that is off by up to @jitter_ms, as if this receiver
+ * had synchronised to the net clock that badly */
+static void
+receiver_clock_new (CustomData * data, gint jitter_ms)
+{
+  gchar *name = g_strdup_printf ("receiver%u_clock", data->index);
+
+  data->jitter_offset = g_random_int_range (-jitter_ms, jitter_ms + 1) *
+      GST_MSECOND;
+  data->clock = g_object_new (GST_TYPE_SYSTEM_CLOCK, "name", name, NULL);
+  gst_object_ref_sink (data->clock);
+  g_free (name);
+  receiver_clock_calibrate (data);
+  /* the system clock drifts from the net clock, follow it */
+  g_timeout_add_seconds (1, (GSourceFunc) receiver_clock_calibrate, data);
+  g_print ("receiver %u clock offset %+.1f ms\n", data->index,
+      (gdouble) data->jitter_offset / GST_MSECOND);
+}
+
+static void
+clock_converged (ClockSlew * cs, gpointer user_data)
+{
+  startup_timer_end (startup, "clock-sync");
+  g_print ("clock converged on the net clock after %.1f ms\n",
+      startup_timer_get_ms (startup, "clock-sync"));
+}
+
+static gboolean
+quit_loop (GMainLoop * loop)
+{
+  g_main_loop_quit (loop);
+  return G_SOURCE_REMOVE;
+}
+
+/* Builds the pipeline of receiver @data on the shared net clock, and
+ * starts it with the first URI */
+static gboolean
+receiver_start (CustomData * data)
+{
+  gchar *name = g_strdup_printf ("receiver%u", data->index);
 
+  data->pipe = gst_pipeline_new (name);
+  g_free (name);
+  if (!data->pipe) {
+    g_printerr ("Not all elements could be created.\n");
+    return FALSE;
+  }
+  if (n_receivers > 1)
+    data->labels = g_strdup_printf ("receiver=\"%u\"", data->index);
+
+  /* tracks, and the branches behind them, are added as channels expose
+   * their streams */
+  g_mutex_init (&data->tracks_lock);
+  data->tracks = g_ptr_array_new_with_free_func ((GDestroyNotify) track_free);
+  switch_channel (data, 0);
+
+  name = g_strdup_printf ("client%u", data->index);
+  if (data->metrics) {
+    stream_metrics_watch_pipeline (data->metrics, data->pipe,
+        n_receivers > 1 ? name : "client");
+    stream_metrics_add_collector (data->metrics,
+        (StreamMetricsCollectFunc) collect_client_metrics, data);
+  }
+  if (jitter_stats)
+    jitter_stats_watch_pipeline (jitter_stats, data->pipe,
+        n_receivers > 1 ? name : "client");
+  g_free (name);
+
+  if (clock_jitter_ms > 0)
+    receiver_clock_new (data, clock_jitter_ms);
+  gst_pipeline_use_clock (GST_PIPELINE (data->pipe),
+      data->clock ? data->clock : data->play_clock);
 
+  /* Set this high enough so that it's higher than the minimum latency
+   * on all receivers */
+  gst_pipeline_set_latency (GST_PIPELINE (data->pipe), 1500 * GST_MSECOND);
+
+  if (gst_element_set_state (data->pipe,
+          GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+    g_print ("Failed to set state to PLAYING\n");
+    return FALSE;
+  }
 
+  gst_bus_add_signal_watch (GST_ELEMENT_BUS (data->pipe));
+  g_signal_connect (GST_ELEMENT_BUS (data->pipe), "message",
+      G_CALLBACK (message), data);
+  g_timeout_add (RECONNECT_CHECK_MS, (GSourceFunc) reconnect_watchdog, data);
+
+  return TRUE;
+}
+
+/* Call with the pipeline of @data in NULL */
+static void
+receiver_free_channels (CustomData * data)
+{
+  if (!data->tracks)
+    return;
+  if (data->previous)
+    channel_free (data->previous);
+  if (data->next)
+    channel_free (data->next);
+  if (data->current)
+    channel_free (data->current);
+  if (data->videosink)
+    gst_object_unref (data->videosink);
+  g_ptr_array_free (data->tracks, TRUE);
+  g_mutex_clear (&data->tracks_lock);
+  g_free (data->labels);
+  if (data->clock)
+    gst_object_unref (data->clock);
+}
 
 int
 main (int argc, char *argv[])
 {
 
   gchar *server;
-  gint clock_port;
-  CustomData data;
-
-
+  gint clock_port, i;
+  GstClock *net_clock;
+  GMainLoop *loop;
+  StreamMetrics *metrics = NULL;
+  FILE *jitter_log_file = NULL;
+  DecodeQos *decode_qos;
+  GOptionContext *optctx;
+  GstBus *clock_bus;
+  GError *error = NULL;
+
+  startup = startup_timer_new ();
+  startup_timer_begin (startup, "gst-init");
+  optctx = g_option_context_new ("rtsp://URI [rtsp://URI ...] - net clock "
+      "synchronised client switching between the URIs");
+  g_option_context_add_main_entries (optctx, entries, NULL);
+  g_option_context_add_group (optctx,
+      plugin_preload_get_option_group (&preload));
+  g_option_context_add_group (optctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (optctx, &argc, &argv, &error)) {
+    g_printerr ("Error parsing options: %s\n", error->message);
+    g_option_context_free (optctx);
+    g_clear_error (&error);
+    return -1;
+  }
+  g_option_context_free (optctx);
+  startup_timer_end (startup, "gst-init");
+  if (headless)
+    client_factories[G_N_ELEMENTS (client_factories) - 1 -
+        CLIENT_DISPLAY_FACTORIES] = NULL;
+  if (preload.enabled) {
+    startup_timer_begin (startup, "registry");
+    plugin_preload_validate (&preload, client_factories);
+    startup_timer_end (startup, "registry");
+    startup_timer_begin (startup, "preload");
+    plugin_preload_load (client_factories);
+    startup_timer_end (startup, "preload");
+  }
 
-  gst_init (&argc, &argv);
+  if (convert_bench)
+    return run_convert_bench ();
 
-  /*if (argc < 2) {
-    g_print ("usage: %s rtsp://URI clock-IP clock-PORT\n"
-        "example: %s rtsp://localhost:8554/test 127.0.0.1 8554\n",
+  if (argc < 2 || n_receivers < 1) {
+    g_print ("usage: %s rtsp://URI [rtsp://URI ...]\n"
+        "example: %s rtsp://localhost:8554/cam0 rtsp://localhost:8554/cam1\n",
         argv[0], argv[0]);
     return -1;
-  }*/
+  }
+  if (render_log) {
+    render_log_file = fopen (render_log, "w");
+    if (!render_log_file) {
+      g_printerr ("Could not open %s\n", render_log);
+      return -1;
+    }
+    fprintf (render_log_file,
+        "receiver,frame_ntp_ns,pts_ns,render_ns,lateness_ns\n");
+    ntp_caps = gst_caps_new_empty_simple ("timestamp/x-ntp");
+  }
+  if (jitter_log) {
+    jitter_log_file = fopen (jitter_log, "w");
+    if (!jitter_log_file) {
+      g_printerr ("Could not open %s\n", jitter_log);
+      return -1;
+    }
+  }
+  receivers = g_new0 (CustomData, n_receivers);
+  g_mutex_init (&receivers[0].stats_lock);
 
   //server = argv[2];
   //clock_port = atoi (argv[3]);
@@ -129,158 +1263,435 @@ main (int argc, char *argv[])
   //net_clock = gst_net_client_clock_new ("net_clock", server, clock_port, 0);
   server="se.pool.ntp.org";
     clock_port= 123;
-    data.net_clock = gst_ntp_clock_new ("net_clock", server, clock_port, 0);
-  if (data.net_clock == NULL) {
+    net_clock = gst_ntp_clock_new ("net_clock", server, clock_port, 0);
+  if (net_clock == NULL) {
     g_print ("Failed to create net clock client for %s:%d\n",
         server, clock_port);
     return 1;
   }
 
-  /* Wait for the clock to stabilise */
-  gst_clock_wait_for_sync (data.net_clock, GST_CLOCK_TIME_NONE);
-
-  data.loop = g_main_loop_new (NULL, FALSE);
-
-
-    /* Create the elements */
-
-    data.src=gst_element_factory_make ("uridecodebin", "src");
-    data.videoconvert = gst_element_factory_make ("videoconvert", "video_convert");
-    data.filter = gst_element_factory_make("capsfilter", "filter");
-    data.videosink = gst_element_factory_make ("osxvideosink", "video_sink");
+  /* the clock posts its sync statistics here */
+  clock_bus = gst_bus_new ();
+  g_object_set (net_clock, "bus", clock_bus, NULL);
+  gst_bus_add_watch (clock_bus, (GstBusFunc) clock_stats, &receivers[0]);
+  gst_object_unref (clock_bus);
+
+  startup_timer_begin (startup, "clock-sync");
+  if (wait_sync) {
+    /* Wait for the clock to stabilise */
+    gst_clock_wait_for_sync (net_clock, GST_CLOCK_TIME_NONE);
+    startup_timer_end (startup, "clock-sync");
+  } else {
+    /* play at once, the slew clock converges on the net clock later */
+    slew = clock_slew_new (net_clock, CLOCK_SLEW_NTP_EPOCH);
+    clock_slew_set_converged_func (slew, clock_converged, NULL);
+  }
 
-    data.aud_conv = gst_element_factory_make ("audioconvert", "aud_conv");
-    data.audio_sink = gst_element_factory_make ("autoaudiosink", "audio_sink");
+  loop = g_main_loop_new (NULL, FALSE);
+  decode_qos = decode_qos_new (DECODE_RECOVER_MS);
+  /* headless receivers render the same frames, compare when */
+  if (headless && n_receivers > 1)
+    skew = sync_skew_new (n_receivers, sync_target_ms);
+  if (metrics_address || jitter_log_file)
+    jitter_stats = jitter_stats_new ();
+  if (metrics_address) {
+    metrics = stream_metrics_new ();
+    stream_metrics_add_collector (metrics,
+        startup_timer_collect_metrics, startup);
+    stream_metrics_add_collector (metrics,
+        decode_qos_collect_metrics, decode_qos);
+    if (skew)
+      stream_metrics_add_collector (metrics, sync_skew_collect_metrics, skew);
+    stream_metrics_add_collector (metrics, jitter_stats_collect_metrics,
+        jitter_stats);
+    if (slew)
+      stream_metrics_add_collector (metrics, clock_slew_collect_metrics, slew);
+  }
 
-    GstCaps *new_caps;
-    /*new_caps = gst_caps_new_simple ("video/x-raw",
-        "width", G_TYPE_INT, 480,
-        "height", G_TYPE_INT, 270,
-        "format", G_TYPE_STRING, "ARGB"
-        , NULL);
-*/
-new_caps= gst_caps_from_string("video/x-raw, format=ARGB");
-    g_object_set (data.filter,
-        "caps", new_caps,
-        NULL);
+  startup_timer_begin (startup, "first-pipeline");
+  for (i = 0; i < n_receivers; i++) {
+    CustomData *data = &receivers[i];
+
+    data->index = i;
+    data->net_clock = net_clock;
+    data->play_clock = slew ? clock_slew_get_clock (slew) : net_clock;
+    data->loop = loop;
+    data->metrics = metrics;
+    data->decode_qos = decode_qos;
+    /* every argument is a channel, the first one plays first */
+    data->uris = argv + 1;
+    data->n_uris = argc - 1;
+    if (!receiver_start (data))
+      goto exit;
+  }
+  startup_timer_end (startup, "first-pipeline");
+  if (jitter_log_file)
+    jitter_stats_start_log (jitter_stats, jitter_log_file,
+        jitter_interval_ms);
+
+  if (metrics &&
+      !stream_metrics_listen (metrics, metrics_address, &error)) {
+    g_printerr ("Failed to serve metrics: %s\n", error->message);
+    g_clear_error (&error);
+  }
 
+  if (argc - 1 > 1) {
+    GIOChannel *input = g_io_channel_unix_new (0);
 
-    /* Create the empty pipeline */
-    data.pipe = gst_pipeline_new ("test-pipeline");
+    g_io_add_watch (input, G_IO_IN, switch_command, NULL);
+    g_io_channel_unref (input);
+    g_unix_signal_add (SIGUSR1, switch_next, NULL);
+    if (switch_interval > 0)
+      g_timeout_add_seconds (switch_interval, switch_next, NULL);
+    g_print ("%u channels: n next, p previous, N channel N (or SIGUSR1)\n",
+        argc - 1);
+  }
 
-    if (!data.pipe || !data.src || !data.videoconvert || !data.videosink || !data.aud_conv || !data.audio_sink ) {
-        g_printerr ("Not all elements could be created.\n");
-        return -1;
-    }
+  /* interrupting still prints the reports */
+  g_unix_signal_add (SIGINT, (GSourceFunc) quit_loop, loop);
+  if (duration > 0)
+    g_timeout_add_seconds (duration, (GSourceFunc) quit_loop, loop);
+  if (drop_every > 0)
+    g_timeout_add_seconds (drop_every, drop_start, NULL);
 
+  g_main_loop_run (loop);
 
-   /* Add and Link all elements that can be automatically linked because they have "Always" pads */
-    gst_bin_add_many (GST_BIN (data.pipe), data.src, data.videoconvert, data.videosink, data.aud_conv, data.audio_sink, NULL);
+exit:
+  for (i = 0; i < n_receivers; i++)
+    if (receivers[i].pipe)
+      gst_element_set_state (receivers[i].pipe, GST_STATE_NULL);
+  decode_qos_print_summary (decode_qos, stdout);
+  if (skew)
+    sync_skew_print_report (skew, stdout);
+  if (slew)
+    clock_slew_print_summary (slew, stdout);
+  for (i = 0; i < n_receivers; i++)
+    receiver_free_channels (&receivers[i]);
+  if (metrics)
+    stream_metrics_free (metrics);
+  for (i = 0; i < n_receivers; i++)
+    if (receivers[i].pipe)
+      gst_object_unref (receivers[i].pipe);
+  decode_qos_free (decode_qos);
+  if (skew)
+    sync_skew_free (skew);
+  if (jitter_stats)
+    jitter_stats_free (jitter_stats);
+  if (slew)
+    clock_slew_free (slew);
+  gst_object_unref (net_clock);
+  if (jitter_log_file)
+    fclose (jitter_log_file);
+  if (render_log_file)
+    fclose (render_log_file);
+  g_free (receivers);
+  g_main_loop_unref (loop);
+  startup_timer_free (startup);
 
-    if (gst_element_link_many ( data.videoconvert,  data.videosink, NULL) != TRUE ||
-        gst_element_link_many ( data.aud_conv,  data.audio_sink, NULL) != TRUE)
-    {
-        g_printerr ("Elements could not be linked.\n");
-        gst_object_unref (data.pipe);
-        return -1;
-    }
+  return 0;
+}
 
 
 
 
+/* Whether @sink takes @caps as they are. The sink is still in NULL, so
+ * this checks its template, which is what it will accept once open. */
+static gboolean
+sink_accepts_caps (GstElement * sink, GstCaps * caps)
+{
+  GstPad *pad = gst_element_get_static_pad (sink, "sink");
+  GstCaps *sink_caps = gst_pad_query_caps (pad, NULL);
+  gboolean accepts = gst_caps_is_fixed (caps) &&
+      gst_caps_can_intersect (caps, sink_caps);
 
+  gst_caps_unref (sink_caps);
+  gst_object_unref (pad);
 
-  g_object_set (data.src, "uri", argv[1], NULL);
+  return accepts;
+}
 
+/* Any thread, when audio of any receiver is played for the first time */
+static void
+first_audio_played (void)
+{
+  static gint marked = 0;
 
-    /* connect uridecode bin signal*/
-  g_signal_connect (data.src, "source-setup", G_CALLBACK (source_created), NULL);
-   /* connect pad-added signal from uridecodebin*/
-  g_signal_connect (data.src, "pad-added", G_CALLBACK (pad_added_handler), &data);
+  if (!g_atomic_int_compare_and_exchange (&marked, 0, 1))
+    return;
+  startup_timer_mark (startup, "first-audio");
+  g_print ("first audio after %.1f ms\n",
+      startup_timer_get_ms (startup, "first-audio"));
+}
 
+/* Headless audio sinks, after the sink waited for the buffer's time */
+static void
+first_audio_handoff (GstElement * sink, GstBuffer * buffer, GstPad * pad,
+    gpointer user_data)
+{
+  first_audio_played ();
+  g_signal_handlers_disconnect_by_func (sink, first_audio_handoff, user_data);
+}
 
-  gst_pipeline_use_clock (GST_PIPELINE (data.pipe), data.net_clock);
+static gboolean
+first_audio_due (GstClock * clock, GstClockTime time, GstClockID id,
+    gpointer user_data)
+{
+  first_audio_played ();
+  return TRUE;
+}
 
-  /* Set this high enough so that it's higher than the minimum latency
-   * on all receivers */
-  gst_pipeline_set_latency (GST_PIPELINE (data.pipe), 1500 * GST_MSECOND);
+/* Audio sinks write ahead into their ring buffer instead of waiting for
+ * each buffer, so the first one is played when the clock reaches its
+ * render time, not when it arrives: waits for that time on the clock */
+static GstPadProbeReturn
+first_audio_probe (GstPad * pad, GstPadProbeInfo * info, CustomData * data)
+{
+  GstElement *sink = GST_PAD_PARENT (pad);
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime running_time = GST_CLOCK_TIME_NONE;
+  GstClock *clock = gst_element_get_clock (sink);
+  GstEvent *event = gst_pad_get_sticky_event (pad, GST_EVENT_SEGMENT, 0);
+  GstClockID id;
+
+  if (event) {
+    const GstSegment *segment;
+
+    gst_event_parse_segment (event, &segment);
+    running_time = gst_segment_to_running_time (segment, GST_FORMAT_TIME,
+        GST_BUFFER_PTS (buffer));
+    gst_event_unref (event);
+  }
+  /* not playing yet, the next buffer tells */
+  if (!clock || !GST_CLOCK_TIME_IS_VALID (running_time)) {
+    if (clock)
+      gst_object_unref (clock);
+    return GST_PAD_PROBE_OK;
+  }
 
-  if (gst_element_set_state (data.pipe,
-          GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
-    g_print ("Failed to set state to PLAYING\n");
-    goto exit;
-  };
+  id = gst_clock_new_single_shot_id (clock, running_time +
+      gst_element_get_base_time (sink) +
+      gst_pipeline_get_latency (GST_PIPELINE (data->pipe)));
+  gst_clock_id_wait_async (id, first_audio_due, NULL, NULL);
+  gst_clock_id_unref (id);
+  gst_object_unref (clock);
 
-  gst_bus_add_signal_watch (GST_ELEMENT_BUS (data.pipe));
-  g_signal_connect (GST_ELEMENT_BUS (data.pipe), "message", G_CALLBACK (message),
-      data.loop);
+  return GST_PAD_PROBE_REMOVE;
+}
 
-  g_main_loop_run (data.loop);
+/* Headless video sinks, after the sink waited for the frame's time: logs
+ * the play clock time the frame is rendered at. The play clock is the
+ * reference every receiver shares even when its own clock is jittered.
+ * The frame is identified by the sender's NTP time when rtspsrc adds it,
+ * which is the same in every receiver; otherwise frame_ntp_ns is -1 and
+ * the render is counted as unmeasured, nothing else identifies the same
+ * frame exactly across receivers. */
+static void
+render_handoff (GstElement * sink, GstBuffer * buffer, GstPad * pad,
+    CustomData * data)
+{
+  GstReferenceTimestampMeta *meta;
+  GstClockTime frame = GST_CLOCK_TIME_NONE, now, render, running_time;
+  GstClockTime target = GST_CLOCK_TIME_NONE;
+  GstClockTimeDiff lateness = 0;
+  GstClock *clock = gst_element_get_clock (sink);
+  GstEvent *event;
+
+  if (!clock)
+    return;
+  now = gst_clock_get_time (clock);
+  render = clock == data->play_clock ? now :
+      gst_clock_get_time (data->play_clock);
+  gst_object_unref (clock);
+
+  meta = gst_buffer_get_reference_timestamp_meta (buffer, ntp_caps);
+  if (meta)
+    frame = meta->timestamp;
+
+  event = gst_pad_get_sticky_event (pad, GST_EVENT_SEGMENT, 0);
+  if (event) {
+    const GstSegment *segment;
+
+    gst_event_parse_segment (event, &segment);
+    running_time = gst_segment_to_running_time (segment, GST_FORMAT_TIME,
+        GST_BUFFER_PTS (buffer));
+    if (GST_CLOCK_TIME_IS_VALID (running_time)) {
+      target = running_time + gst_element_get_base_time (sink) +
+          gst_pipeline_get_latency (GST_PIPELINE (data->pipe));
+      lateness = GST_CLOCK_DIFF (target, now);
+    }
+    gst_event_unref (event);
+  }
 
-exit:
-  gst_element_set_state (data.pipe, GST_STATE_NULL);
-  gst_object_unref (data.pipe);
-  g_main_loop_unref (data.loop);
+  if (skew && GST_CLOCK_TIME_IS_VALID (frame))
+    sync_skew_add (skew, data->index, frame, render);
+  else if (skew)
+    sync_skew_add_unmeasured (skew);
 
-  return 0;
+  /* one fprintf per frame, stdio keeps the lines whole across threads */
+  if (render_log_file)
+    fprintf (render_log_file, "%u,%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT
+        ",%" G_GUINT64_FORMAT ",%" G_GINT64_FORMAT "\n", data->index,
+        (gint64) frame, (gint64) GST_BUFFER_PTS (buffer), render, lateness);
 }
 
+/* Tracks whether the videoconvert of a video branch converts, on every
+ * caps event: it passes frames through while the sink renders the
+ * decoder's format, I420 or NV12 from avdec_h264 */
+static GstPadProbeReturn
+convert_caps_probe (GstPad * pad, GstPadProbeInfo * info, CustomData * data)
+{
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+  GstElement *convert, *sink = NULL;
+  GstPad *srcpad, *peer;
+  GstCaps *caps;
+  gboolean converting, was;
+
+  if (GST_EVENT_TYPE (event) != GST_EVENT_CAPS)
+    return GST_PAD_PROBE_OK;
+
+  gst_event_parse_caps (event, &caps);
+  convert = gst_pad_get_parent_element (pad);
+  srcpad = gst_element_get_static_pad (convert, "src");
+  peer = gst_pad_get_peer (srcpad);
+  if (peer)
+    sink = gst_pad_get_parent_element (peer);
+  converting = sink && !sink_accepts_caps (sink, caps);
+
+  was = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (convert),
+          "converting"));
+  if (converting != was) {
+    g_object_set_data (G_OBJECT (convert), "converting",
+        GINT_TO_POINTER (converting));
+    __atomic_add_fetch (&data->video_converted, converting ? 1 : -1,
+        __ATOMIC_RELAXED);
+  }
+  g_print (converting ? "  Sink cannot render %s, converting\n" :
+      "  Rendering %s as decoded\n",
+      gst_structure_get_string (gst_caps_get_structure (caps, 0), "format"));
+
+  if (sink)
+    gst_object_unref (sink);
+  if (peer)
+    gst_object_unref (peer);
+  gst_object_unref (srcpad);
+  gst_object_unref (convert);
+  return GST_PAD_PROBE_OK;
+}
 
-
-
+/* Every decoded stream gets its own branch, queue ! convert ! sink, so
+ * each one converts and renders in its own streaming thread while the
+ * decoders keep going. Video branches keep their videoconvert even when
+ * the sink renders the decoder's format: it passes through then, and a
+ * later caps change still negotiates. Headless, every stream goes to a
+ * fakesink that still waits for its render time on the net clock. */
 static void pad_added_handler (GstElement *src, GstPad *new_pad, CustomData *data) {
-    GstPad *audio_sink_pad = gst_element_get_static_pad (data->aud_conv, "sink");
-    GstPad *video_sink_pad = gst_element_get_static_pad (data->videoconvert, "sink");
-
-    GstPadLinkReturn ret;
-    GstCaps *new_pad_caps = NULL;
-    GstStructure *new_pad_struct = NULL;
-    const gchar *new_pad_type = NULL;
-    g_print ("\n Received new pad '%s' from '%s':\n", GST_PAD_NAME (new_pad), GST_ELEMENT_NAME (src));
-
-    /* If our converter is already linked, we have nothing to do here */
-    if (gst_pad_is_linked (audio_sink_pad) && gst_pad_is_linked (video_sink_pad)) {
-        g_print ("  We are already linked. Ignoring.\n");
-        goto exit;
+    GstElement *queue, *convert = NULL, *resample = NULL, *sink;
+    GstPad *queue_pad;
+    GstCaps *new_pad_caps;
+    const gchar *new_pad_type;
+    gboolean first_video = FALSE, linked;
+
+    new_pad_caps = gst_pad_get_current_caps (new_pad);
+    if (!new_pad_caps)
+        new_pad_caps = gst_pad_query_caps (new_pad, NULL);
+    new_pad_type = gst_structure_get_name (gst_caps_get_structure (new_pad_caps, 0));
+    g_print ("\n Received new pad '%s' from '%s': %s\n", GST_PAD_NAME (new_pad),
+        GST_ELEMENT_NAME (src), new_pad_type);
+
+    queue = gst_element_factory_make ("queue", NULL);
+    if (headless) {
+        sink = gst_element_factory_make ("fakesink", NULL);
+        g_object_set (sink, "enable-last-sample", FALSE, NULL);
     }
-
-    /* Check the new pad's type */
-    new_pad_caps = gst_pad_query_caps (new_pad, NULL);
-    new_pad_struct = gst_caps_get_structure (new_pad_caps, 0);
-    new_pad_type = gst_structure_get_name (new_pad_struct);
-    g_print ("  New pad type is:  '%s' ", new_pad_type);
-
-    if (g_str_has_prefix (new_pad_type, "audio/x-raw") ) {
-        /* Attempt the link */
-        ret = gst_pad_link (new_pad, audio_sink_pad);
-        if (GST_PAD_LINK_FAILED (ret)) {
-            g_print ("  Type is '%s' but link failed.\n", new_pad_type);
-        } else {
-            g_print ("  Link succeeded (type '%s').\n", new_pad_type);
+    if (g_str_has_prefix (new_pad_type, "video/x-raw")) {
+        if (!headless)
+            sink = gst_element_factory_make ("osxvideosink", NULL);
+        else if (render_log_file || skew) {
+            g_object_set (sink, "signal-handoffs", TRUE, NULL);
+            g_signal_connect (sink, "handoff", G_CALLBACK (render_handoff),
+                data);
         }
-
-    } else if(g_str_has_prefix (new_pad_type, "video/x-raw"))
-    {
-        g_print ("  Attempting to link video pad\n");
-
-        /* Attempt the  link */
-        ret = gst_pad_link (new_pad, video_sink_pad);
-        if (GST_PAD_LINK_FAILED (ret)) {
-            g_print ("  Type is '%s' but link failed.\n", new_pad_type);
-        } else {
-            g_print ("  Link succeeded (type '%s').\n", new_pad_type);
+        __atomic_add_fetch (&data->video_branches, 1, __ATOMIC_RELAXED);
+        convert = gst_element_factory_make ("videoconvert", NULL);
+        {
+            GstPad *pad = gst_element_get_static_pad (convert, "sink");
+
+            gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                (GstPadProbeCallback) convert_caps_probe, data, NULL);
+            gst_object_unref (pad);
         }
+        g_mutex_lock (&data->tracks_lock);
+        if (!data->videosink) {
+            data->videosink = gst_object_ref (sink);
+            first_video = TRUE;
+        }
+        g_mutex_unlock (&data->tracks_lock);
+    } else if (headless) {
+        /* not rendered, only synchronised */
+    } else if (g_str_has_prefix (new_pad_type, "audio/x-raw")) {
+        convert = gst_element_factory_make ("audioconvert", NULL);
+        resample = gst_element_factory_make ("audioresample", NULL);
+        sink = gst_element_factory_make ("autoaudiosink", NULL);
+    } else {
+        g_print ("  No renderer for '%s', discarding it\n", new_pad_type);
+        sink = gst_element_factory_make ("fakesink", NULL);
+    }
+    /* renders against the net clock like the other sinks */
+    g_object_set (sink, "sync", TRUE, NULL);
+    /* video frames later than that are dropped, and the QoS events tell
+     * the decoder to lower its effort */
+    if (g_str_has_prefix (new_pad_type, "video/x-raw"))
+        g_object_set (sink, "qos", TRUE, "max-lateness", 20 * GST_MSECOND,
+            NULL);
+
+    if (first_video) {
+        GstPad *pad = gst_element_get_static_pad (sink, "sink");
+
+        gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+            GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+            (GstPadProbeCallback) switch_sink_probe, data, NULL);
+        gst_object_unref (pad);
+    }
+    if (g_str_has_prefix (new_pad_type, "audio/x-raw") && headless) {
+        g_object_set (sink, "signal-handoffs", TRUE, NULL);
+        g_signal_connect (sink, "handoff", G_CALLBACK (first_audio_handoff),
+            NULL);
+    } else if (g_str_has_prefix (new_pad_type, "audio/x-raw")) {
+        GstPad *pad = gst_element_get_static_pad (sink, "sink");
+
+        gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+            (GstPadProbeCallback) first_audio_probe, data, NULL);
+        gst_object_unref (pad);
+    }
 
-
-    }else goto exit;
-
-
-exit:
-    /* Unreference the new pad's caps, if we got them */
-    if (new_pad_caps != NULL)
-        gst_caps_unref (new_pad_caps);
-
-    /* Unreference the sink pad */
-    // gst_object_unref (audio_sink_pad);
-    gst_object_unref (video_sink_pad);
+    gst_bin_add_many (GST_BIN (data->pipe), queue, sink, NULL);
+    if (convert)
+        gst_bin_add (GST_BIN (data->pipe), convert);
+    if (resample)
+        gst_bin_add (GST_BIN (data->pipe), resample);
+    if (resample)
+        linked = gst_element_link_many (queue, convert, resample, sink, NULL);
+    else if (convert)
+        linked = gst_element_link_many (queue, convert, sink, NULL);
+    else
+        linked = gst_element_link (queue, sink);
+    if (!linked)
+        g_printerr ("  Could not build the branch for '%s'\n", new_pad_type);
+
+    /* downstream first so the queue never pushes into a stopped element */
+    gst_element_sync_state_with_parent (sink);
+    if (resample)
+        gst_element_sync_state_with_parent (resample);
+    if (convert)
+        gst_element_sync_state_with_parent (convert);
+    gst_element_sync_state_with_parent (queue);
+
+    queue_pad = gst_element_get_static_pad (queue, "sink");
+    if (GST_PAD_LINK_FAILED (gst_pad_link (new_pad, queue_pad)))
+        g_print ("  Type is '%s' but link failed.\n", new_pad_type);
+    else
+        g_print ("  Link succeeded (type '%s').\n", new_pad_type);
+
+    gst_object_unref (queue_pad);
+    gst_caps_unref (new_pad_caps);
 }
@@ -0,0 +1,217 @@
+/* A clock that runs at once and slews onto a network clock once it syncs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   ClockSlew *cs = clock_slew_new (ntp_clock, CLOCK_SLEW_NTP_EPOCH);
+ *   clock_slew_set_converged_func (cs, converged, user_data);
+ *   gst_pipeline_use_clock (pipeline, clock_slew_get_clock (cs));
+ *
+ * Waiting for a network clock to sync takes seconds, and forever when its
+ * server cannot be reached. The clock of a ClockSlew is usable at once: it
+ * starts on a provisional time, the system's wall clock plus an epoch
+ * offset, which is close to the network time on hosts that keep their
+ * time with NTP anyway.
+ *
+ * Once the target clock reports it is synced, the difference is removed by
+ * running the clock slightly faster or slower, at most CLOCK_SLEW_MAX_PPM,
+ * so sinks see no jump in time. Only a difference beyond CLOCK_SLEW_STEP_MS
+ * is stepped; a step back holds the clock until the target catches up,
+ * since a GstClock never goes backwards. Within CLOCK_SLEW_CONVERGED_US
+ * the clock has converged, and keeps following the target the same way.
+ *
+ * The clock is marked as needing a startup sync and is set synced on
+ * convergence, so gst_clock_is_synced() tells the two phases apart.
+ *
+ * The corrections run from the default main context.
+ */
+
+#ifndef __CLOCK_SLEW_H__
+#define __CLOCK_SLEW_H__
+
+#include <stdio.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/* from the Unix epoch to the NTP epoch of 1900 */
+#define CLOCK_SLEW_NTP_EPOCH (G_GINT64_CONSTANT (2208988800) * GST_SECOND)
+
+#define CLOCK_SLEW_INTERVAL_MS 100
+/* how fast a difference is removed, in ns per s */
+#define CLOCK_SLEW_MAX_PPM 5000
+#define CLOCK_SLEW_STEP_MS 500
+#define CLOCK_SLEW_CONVERGED_US 1000
+
+typedef struct _ClockSlew ClockSlew;
+
+typedef void (*ClockSlewFunc) (ClockSlew * cs, gpointer user_data);
+
+struct _ClockSlew
+{
+  GstClock *clock;
+  GstClock *target;
+  guint tick_id;
+
+  ClockSlewFunc converged_func;
+  gpointer converged_data;
+
+  /* main thread */
+  gint64 start_us;
+  gint64 synced_us;             /* when the target synced */
+  gint64 converged_us;
+  GstClockTimeDiff initial_error;       /* at the target's sync */
+  guint steps;
+
+  /* read by metrics, atomics */
+  gint64 error;                 /* target minus clock, ns */
+  gint64 rate_ppm;
+};
+
+static gboolean clock_slew_tick (ClockSlew * cs);
+
+/* A clock on the wall clock plus @epoch_offset until @target syncs */
+static ClockSlew * G_GNUC_UNUSED
+clock_slew_new (GstClock * target, GstClockTimeDiff epoch_offset)
+{
+  ClockSlew *cs = g_new0 (ClockSlew, 1);
+
+  cs->target = gst_object_ref (target);
+  cs->start_us = g_get_monotonic_time ();
+  cs->clock = g_object_new (GST_TYPE_SYSTEM_CLOCK, "name", "slew_clock",
+      NULL);
+  gst_object_ref_sink (cs->clock);
+  GST_OBJECT_FLAG_SET (cs->clock, GST_CLOCK_FLAG_NEEDS_STARTUP_SYNC);
+  gst_clock_set_calibration (cs->clock,
+      gst_clock_get_internal_time (cs->clock),
+      g_get_real_time () * GST_USECOND + epoch_offset, 1, 1);
+  cs->tick_id = g_timeout_add (CLOCK_SLEW_INTERVAL_MS,
+      (GSourceFunc) clock_slew_tick, cs);
+
+  return cs;
+}
+
+/* @func is called once, from the main context, when the clock converged */
+static void G_GNUC_UNUSED
+clock_slew_set_converged_func (ClockSlew * cs, ClockSlewFunc func,
+    gpointer user_data)
+{
+  cs->converged_func = func;
+  cs->converged_data = user_data;
+}
+
+static GstClock * G_GNUC_UNUSED
+clock_slew_get_clock (ClockSlew * cs)
+{
+  return cs->clock;
+}
+
+/* Free once no pipeline uses the clock anymore */
+static void G_GNUC_UNUSED
+clock_slew_free (ClockSlew * cs)
+{
+  g_source_remove (cs->tick_id);
+  gst_object_unref (cs->clock);
+  gst_object_unref (cs->target);
+  g_free (cs);
+}
+
+static gboolean
+clock_slew_tick (ClockSlew * cs)
+{
+  GstClockTime internal, now, target, c_internal, c_external, num, denom;
+  GstClockTimeDiff error, max;
+  gint64 ppm = 0;
+
+  if (!gst_clock_is_synced (cs->target))
+    return G_SOURCE_CONTINUE;
+
+  /* the new rate starts where the current one is now */
+  gst_clock_get_calibration (cs->clock, &c_internal, &c_external, &num,
+      &denom);
+  internal = gst_clock_get_internal_time (cs->clock);
+  now = gst_clock_adjust_with_calibration (cs->clock, internal, c_internal,
+      c_external, num, denom);
+  target = gst_clock_get_time (cs->target);
+  error = GST_CLOCK_DIFF (now, target);
+  if (!cs->synced_us) {
+    cs->synced_us = g_get_monotonic_time ();
+    cs->initial_error = error;
+  }
+
+  if (ABS (error) > CLOCK_SLEW_STEP_MS * GST_MSECOND) {
+    GST_INFO_OBJECT (cs->clock, "stepping by %" GST_STIME_FORMAT,
+        GST_STIME_ARGS (error));
+    gst_clock_set_calibration (cs->clock, internal, target, 1, 1);
+    cs->steps++;
+  } else {
+    /* remove the error over the next second, as fast as allowed */
+    max = CLOCK_SLEW_MAX_PPM * GST_USECOND;
+    ppm = CLAMP (error, -max, max) / GST_USECOND;
+    gst_clock_set_calibration (cs->clock, internal, now,
+        GST_SECOND + ppm * GST_USECOND, GST_SECOND);
+  }
+  __atomic_store_n (&cs->error, error, __ATOMIC_RELAXED);
+  __atomic_store_n (&cs->rate_ppm, ppm, __ATOMIC_RELAXED);
+
+  if (!cs->converged_us && ABS (error) <= CLOCK_SLEW_CONVERGED_US *
+      GST_USECOND) {
+    cs->converged_us = g_get_monotonic_time ();
+    gst_clock_set_synced (cs->clock, TRUE);
+    if (cs->converged_func)
+      cs->converged_func (cs, cs->converged_data);
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void G_GNUC_UNUSED
+clock_slew_print_summary (ClockSlew * cs, FILE * out)
+{
+  if (!cs->synced_us) {
+    fprintf (out, "clock: provisional, the network clock never synced\n");
+    return;
+  }
+  fprintf (out, "clock: off by %+.1f ms when the network clock synced "
+      "after %.1f ms, ", (gdouble) cs->initial_error / GST_MSECOND,
+      (cs->synced_us - cs->start_us) / 1000.0);
+  if (cs->converged_us)
+    fprintf (out, "converged after %.1f ms (%u steps)\n",
+        (cs->converged_us - cs->start_us) / 1000.0, cs->steps);
+  else
+    fprintf (out, "not converged\n");
+}
+
+#ifdef __STREAM_METRICS_H__
+static void G_GNUC_UNUSED
+clock_slew_collect_metrics (StreamMetricsScrape * scrape, gpointer user_data)
+{
+  ClockSlew *cs = user_data;
+
+  stream_metrics_emit (scrape, "clock_slew_converged", "gauge",
+      "Whether the playback clock converged on the network clock", NULL,
+      gst_clock_is_synced (cs->clock));
+  stream_metrics_emit (scrape, "clock_slew_error_seconds", "gauge",
+      "Network clock minus playback clock", NULL,
+      __atomic_load_n (&cs->error, __ATOMIC_RELAXED) / 1e9);
+  stream_metrics_emit (scrape, "clock_slew_rate_ppm", "gauge",
+      "Rate correction of the playback clock", NULL,
+      __atomic_load_n (&cs->rate_ppm, __ATOMIC_RELAXED));
+}
+#endif
+
+G_END_DECLS
+
+#endif /* __CLOCK_SLEW_H__ */
@@ -0,0 +1,147 @@
+/* Spreading encoders of several streams across the CPU cores
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * With one encoder per camera, each x264enc starts as many worker threads
+ * as there are cores, and N encoders oversubscribe the machine N times.
+ * cpu_affinity_spread_encoder() gives encoder number @slot of @n_slots its
+ * own share of the cores: its "threads" property is set to that share, and
+ * on Linux (and Android) the streaming thread feeding it is pinned to those
+ * cores when the stream starts. The encoder's own workers are created later,
+ * from that thread, and inherit the pinning. That thread comes from a pool
+ * and outlives the stream, so its previous cores are given back at EOS, at
+ * a flush and when the encoder goes away; a stream that starts again is
+ * pinned again.
+ */
+
+#ifndef __CPU_AFFINITY_H__
+#define __CPU_AFFINITY_H__
+
+#include <gst/gst.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+G_BEGIN_DECLS
+
+#ifdef __linux__
+#define CPU_AFFINITY_MAX_CPUS (8 * sizeof (unsigned long))
+
+typedef struct
+{
+  GMutex lock;
+  unsigned long mask;
+
+  /* the pinned thread and the cores it had before, tid 0 when none */
+  pid_t tid;
+  unsigned long saved;
+} CpuAffinityPin;
+
+/* Call with the lock held. Another stream may have pinned the thread
+ * since, it is only given back while it still has our cores. */
+static void
+cpu_affinity_restore (CpuAffinityPin * pin)
+{
+  unsigned long current = 0;
+
+  if (pin->tid == 0)
+    return;
+
+  if (syscall (__NR_sched_getaffinity, pin->tid, sizeof (current),
+          &current) >= 0 && current == pin->mask)
+    syscall (__NR_sched_setaffinity, pin->tid, sizeof (pin->saved),
+        &pin->saved);
+  GST_DEBUG ("Thread %d back on CPUs 0x%lx", (gint) pin->tid, pin->saved);
+  pin->tid = 0;
+}
+
+static void
+cpu_affinity_pin_free (CpuAffinityPin * pin)
+{
+  g_mutex_lock (&pin->lock);
+  cpu_affinity_restore (pin);
+  g_mutex_unlock (&pin->lock);
+  g_mutex_clear (&pin->lock);
+  g_free (pin);
+}
+
+static GstPadProbeReturn
+cpu_affinity_probe (GstPad * pad, GstPadProbeInfo * info,
+    CpuAffinityPin * pin)
+{
+  switch (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info))) {
+    case GST_EVENT_STREAM_START:
+      g_mutex_lock (&pin->lock);
+      cpu_affinity_restore (pin);
+      /* pid 0 is the calling thread */
+      if (syscall (__NR_sched_getaffinity, 0, sizeof (pin->saved),
+              &pin->saved) < 0
+          || syscall (__NR_sched_setaffinity, 0, sizeof (pin->mask),
+              &pin->mask) < 0) {
+        GST_WARNING_OBJECT (pad, "Could not pin encoder thread to CPUs 0x%lx",
+            pin->mask);
+      } else {
+        pin->tid = syscall (__NR_gettid);
+        GST_INFO_OBJECT (pad, "Encoder thread pinned to CPUs 0x%lx",
+            pin->mask);
+      }
+      g_mutex_unlock (&pin->lock);
+      break;
+    case GST_EVENT_EOS:
+    case GST_EVENT_FLUSH_START:
+      g_mutex_lock (&pin->lock);
+      cpu_affinity_restore (pin);
+      g_mutex_unlock (&pin->lock);
+      break;
+    default:
+      break;
+  }
+  return GST_PAD_PROBE_OK;
+}
+#endif
+
+static void G_GNUC_UNUSED
+cpu_affinity_spread_encoder (GstElement * encoder, guint slot, guint n_slots)
+{
+  guint n_cpus = g_get_num_processors ();
+  guint share;
+
+  if (n_slots < 2 || n_cpus < 2)
+    return;
+
+  share = MAX (n_cpus / n_slots, 1);
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (encoder), "threads"))
+    g_object_set (encoder, "threads", share, NULL);
+
+#ifdef __linux__
+  if (n_cpus <= CPU_AFFINITY_MAX_CPUS) {
+    CpuAffinityPin *pin = g_new0 (CpuAffinityPin, 1);
+    GstPad *pad = gst_element_get_static_pad (encoder, "sink");
+    guint first = (slot * share) % n_cpus, i;
+
+    g_mutex_init (&pin->lock);
+    for (i = 0; i < share; i++)
+      pin->mask |= 1UL << ((first + i) % n_cpus);
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM |
+        GST_PAD_PROBE_TYPE_EVENT_FLUSH, (GstPadProbeCallback)
+        cpu_affinity_probe, pin, (GDestroyNotify) cpu_affinity_pin_free);
+    gst_object_unref (pad);
+  }
+#endif
+}
+
+G_END_DECLS
+
+#endif /* __CPU_AFFINITY_H__ */
@@ -0,0 +1,395 @@
+/* Degrading video decoding under CPU pressure, driven by sink QoS
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   DecodeQos *dq = decode_qos_new (2000);
+ *   decode_qos_attach (dq, decoder);
+ *
+ * A synchronised video sink sends a QoS event upstream for every frame it
+ * renders, with how late the frame was and how fast frames come compared
+ * to real time. When frames keep coming late, frames are dropped before
+ * they reach the decoder, one level at a time:
+ *
+ *   1  H.264 frames that no other frame references (nal_ref_idc 0); the
+ *      picture stays intact. Streams without any, such as x264enc with
+ *      tune=zerolatency, gain nothing from this level
+ *   2  every delta frame, only keyframes are decoded; the picture holds
+ *      still between keyframes but is never corrupt
+ *
+ * Once frames come early again for the recovery time, it steps back down a
+ * level. Delta frames pass again from the next keyframe on, as those before
+ * it reference frames that were dropped. Nothing is decoded with missing
+ * references, and the decoder's own QoS and the sink's dropping of late
+ * frames stay as they are, so playback stays on the clock.
+ */
+
+#ifndef __DECODE_QOS_H__
+#define __DECODE_QOS_H__
+
+#include <stdio.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define DECODE_QOS_MAX_LEVEL 2
+/* late QoS events in a row before the next level */
+#define DECODE_QOS_LATE_RUN 3
+
+typedef struct
+{
+  gint64 recover_us;
+
+  /* level changes, from the sinks' streaming threads */
+  GMutex lock;
+  guint n_degraded;             /* decoders above level 0 */
+  gint64 degraded_since_us;
+
+  /* read by reports, atomics */
+  guint64 frames_in;
+  guint64 frames_out;
+  guint64 late;
+  guint64 degrades;
+  guint64 degraded_us;
+} DecodeQos;
+
+/* One decoder */
+typedef struct
+{
+  DecodeQos *dq;
+  GstElement *decoder;
+  gint level;                   /* atomic, set from the sink's thread */
+
+  /* streaming thread of the sink */
+  guint late_run;
+  gint64 headroom_since_us;
+
+  /* streaming thread feeding the decoder */
+  gboolean h264;
+  guint nal_length_size;        /* 0 for byte-stream */
+  gboolean waiting_key;
+} DecodeQosStream;
+
+/* Step back up after @recover_ms of frames coming early */
+static DecodeQos * G_GNUC_UNUSED
+decode_qos_new (guint recover_ms)
+{
+  DecodeQos *dq = g_new0 (DecodeQos, 1);
+
+  dq->recover_us = recover_ms * (gint64) 1000;
+  g_mutex_init (&dq->lock);
+
+  return dq;
+}
+
+/* Free once the pipelines using @dq are back in NULL */
+static void G_GNUC_UNUSED
+decode_qos_free (DecodeQos * dq)
+{
+  g_mutex_clear (&dq->lock);
+  g_free (dq);
+}
+
+/* Accounts for @qs going from its level to @level */
+static void
+decode_qos_count_level (DecodeQosStream * qs, gint level)
+{
+  DecodeQos *dq = qs->dq;
+  gint64 now = g_get_monotonic_time ();
+
+  g_mutex_lock (&dq->lock);
+  if (!qs->level && level) {
+    if (!dq->n_degraded++)
+      dq->degraded_since_us = now;
+  } else if (qs->level && !level) {
+    if (!--dq->n_degraded)
+      __atomic_add_fetch (&dq->degraded_us, now - dq->degraded_since_us,
+          __ATOMIC_RELAXED);
+  }
+  g_mutex_unlock (&dq->lock);
+
+  if (level > qs->level)
+    __atomic_add_fetch (&dq->degrades, 1, __ATOMIC_RELAXED);
+}
+
+static void
+decode_qos_set_level (DecodeQosStream * qs, gint level)
+{
+  decode_qos_count_level (qs, level);
+  GST_INFO_OBJECT (qs->decoder, "decode level %d -> %d", qs->level, level);
+  g_atomic_int_set (&qs->level, level);
+  qs->late_run = 0;
+  qs->headroom_since_us = 0;
+}
+
+static GstPadProbeReturn
+decode_qos_event_probe (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  DecodeQosStream *qs = user_data;
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+  GstQOSType type;
+  gdouble proportion;
+  GstClockTimeDiff diff;
+  GstClockTime timestamp;
+
+  if (GST_EVENT_TYPE (event) != GST_EVENT_QOS)
+    return GST_PAD_PROBE_OK;
+
+  gst_event_parse_qos (event, &type, &proportion, &diff, &timestamp);
+  if (diff > 0)
+    __atomic_add_fetch (&qs->dq->late, 1, __ATOMIC_RELAXED);
+
+  /* late, or rendering slower than real time: the decoder is behind */
+  if (diff > 0 || proportion > 1.1) {
+    qs->headroom_since_us = 0;
+    if (++qs->late_run >= DECODE_QOS_LATE_RUN &&
+        qs->level < DECODE_QOS_MAX_LEVEL)
+      decode_qos_set_level (qs, qs->level + 1);
+  } else if (qs->level && diff < 0 && proportion < 0.9) {
+    gint64 now = g_get_monotonic_time ();
+
+    qs->late_run = 0;
+    if (!qs->headroom_since_us)
+      qs->headroom_since_us = now;
+    else if (now - qs->headroom_since_us >= qs->dq->recover_us)
+      decode_qos_set_level (qs, qs->level - 1);
+  } else {
+    qs->late_run = 0;
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Whether the H.264 access unit in @buffer is referenced by other frames,
+ * from the nal_ref_idc of its first slice; TRUE when it cannot tell */
+static gboolean
+decode_qos_h264_is_reference (DecodeQosStream * qs, GstBuffer * buffer)
+{
+  GstMapInfo map;
+  gboolean ref = TRUE;
+  gsize i = 0, nal, len;
+  guint j, type;
+
+  if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+    return TRUE;
+
+  while (i < map.size) {
+    if (qs->nal_length_size) {
+      if (i + qs->nal_length_size >= map.size)
+        break;
+      for (len = 0, j = 0; j < qs->nal_length_size; j++)
+        len = len << 8 | map.data[i + j];
+      nal = i + qs->nal_length_size;
+      i = nal + len;
+    } else {
+      /* the next 00 00 01 start code */
+      while (i + 3 < map.size && (map.data[i] || map.data[i + 1] ||
+              map.data[i + 2] != 1))
+        i++;
+      if (i + 3 >= map.size)
+        break;
+      nal = i + 3;
+      i = nal;
+    }
+    type = map.data[nal] & 0x1f;
+    /* a non-IDR or IDR slice */
+    if (type == 1 || type == 5) {
+      ref = (map.data[nal] & 0x60) != 0;
+      break;
+    }
+  }
+
+  gst_buffer_unmap (buffer, &map);
+  return ref;
+}
+
+static void
+decode_qos_parse_caps (DecodeQosStream * qs, GstCaps * caps)
+{
+  GstStructure *st = gst_caps_get_structure (caps, 0);
+  const gchar *format = gst_structure_get_string (st, "stream-format");
+  const GValue *codec_data;
+  GstMapInfo map;
+
+  qs->h264 = gst_structure_has_name (st, "video/x-h264");
+  qs->nal_length_size = 0;
+  if (!qs->h264 || !format || !g_str_has_prefix (format, "avc"))
+    return;
+
+  qs->nal_length_size = 4;
+  codec_data = gst_structure_get_value (st, "codec_data");
+  if (codec_data && GST_VALUE_HOLDS_BUFFER (codec_data) &&
+      gst_buffer_map (gst_value_get_buffer (codec_data), &map,
+          GST_MAP_READ)) {
+    if (map.size > 4)
+      qs->nal_length_size = (map.data[4] & 3) + 1;
+    gst_buffer_unmap (gst_value_get_buffer (codec_data), &map);
+  }
+}
+
+static GstPadProbeReturn
+decode_qos_in_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  DecodeQosStream *qs = user_data;
+  GstBuffer *buffer;
+  gboolean delta;
+  gint level;
+
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+    GstCaps *caps;
+
+    if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS) {
+      gst_event_parse_caps (event, &caps);
+      decode_qos_parse_caps (qs, caps);
+    }
+    return GST_PAD_PROBE_OK;
+  }
+
+  buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  __atomic_add_fetch (&qs->dq->frames_in, 1, __ATOMIC_RELAXED);
+  delta = GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  level = g_atomic_int_get (&qs->level);
+
+  if (!delta) {
+    qs->waiting_key = FALSE;
+    return GST_PAD_PROBE_OK;
+  }
+  if (qs->waiting_key)
+    return GST_PAD_PROBE_DROP;
+  if (level >= 2) {
+    /* everything up to the next keyframe references this one */
+    qs->waiting_key = TRUE;
+    return GST_PAD_PROBE_DROP;
+  }
+  if (level >= 1 && qs->h264 && !decode_qos_h264_is_reference (qs, buffer))
+    return GST_PAD_PROBE_DROP;
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+decode_qos_out_probe (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  DecodeQosStream *qs = user_data;
+
+  __atomic_add_fetch (&qs->dq->frames_out, 1, __ATOMIC_RELAXED);
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+decode_qos_stream_free (DecodeQosStream * qs)
+{
+  /* a decoder removed while degraded no longer counts; it is being
+   * disposed, so only the accounting is undone */
+  if (qs->level)
+    decode_qos_count_level (qs, 0);
+  g_free (qs);
+}
+
+/* Drop frames ahead of @decoder when the frames it outputs are rendered
+ * late; call before it starts, e.g. from decodebin's "element-added" */
+static void G_GNUC_UNUSED
+decode_qos_attach (DecodeQos * dq, GstElement * decoder)
+{
+  DecodeQosStream *qs = g_new0 (DecodeQosStream, 1);
+  GstPad *pad;
+
+  qs->dq = dq;
+  qs->decoder = decoder;
+
+  pad = gst_element_get_static_pad (decoder, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+      GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, decode_qos_in_probe, qs, NULL);
+  gst_object_unref (pad);
+
+  /* the src probe owns @qs, it goes with the decoder */
+  pad = gst_element_get_static_pad (decoder, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, decode_qos_out_probe, qs,
+      NULL);
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM,
+      decode_qos_event_probe, qs, (GDestroyNotify) decode_qos_stream_free);
+  gst_object_unref (pad);
+}
+
+typedef struct
+{
+  guint64 frames_in, frames_out;
+  guint64 skipped;
+  guint64 late;
+  guint64 degrades;
+  guint degraded;
+  gdouble degraded_seconds;
+} DecodeQosStats;
+
+static void G_GNUC_UNUSED
+decode_qos_get_stats (DecodeQos * dq, DecodeQosStats * s)
+{
+  s->frames_in = __atomic_load_n (&dq->frames_in, __ATOMIC_RELAXED);
+  s->frames_out = __atomic_load_n (&dq->frames_out, __ATOMIC_RELAXED);
+  /* frames that arrived and never came out, dropped ahead of the decoder
+   * or by its own QoS */
+  s->skipped = s->frames_in > s->frames_out ? s->frames_in - s->frames_out : 0;
+  s->late = __atomic_load_n (&dq->late, __ATOMIC_RELAXED);
+  s->degrades = __atomic_load_n (&dq->degrades, __ATOMIC_RELAXED);
+
+  g_mutex_lock (&dq->lock);
+  s->degraded = dq->n_degraded;
+  s->degraded_seconds = __atomic_load_n (&dq->degraded_us, __ATOMIC_RELAXED);
+  if (dq->n_degraded)
+    s->degraded_seconds += g_get_monotonic_time () - dq->degraded_since_us;
+  g_mutex_unlock (&dq->lock);
+  s->degraded_seconds /= 1e6;
+}
+
+static void G_GNUC_UNUSED
+decode_qos_print_summary (DecodeQos * dq, FILE * out)
+{
+  DecodeQosStats s;
+
+  decode_qos_get_stats (dq, &s);
+  fprintf (out, "decode QoS: %.1f s degraded (%" G_GUINT64_FORMAT
+      " times), %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+      " frames skipped, %" G_GUINT64_FORMAT " late at the sink\n",
+      s.degraded_seconds, s.degrades, s.skipped, s.frames_in, s.late);
+}
+
+#ifdef __STREAM_METRICS_H__
+static void G_GNUC_UNUSED
+decode_qos_collect_metrics (StreamMetricsScrape * scrape, gpointer user_data)
+{
+  DecodeQos *dq = user_data;
+  DecodeQosStats s;
+
+  decode_qos_get_stats (dq, &s);
+  stream_metrics_emit (scrape, "decode_qos_degraded", "gauge",
+      "Video decoders currently degraded", NULL, s.degraded);
+  stream_metrics_emit (scrape, "decode_qos_degraded_seconds_total", "counter",
+      "Time any video decoder was degraded", NULL, s.degraded_seconds);
+  stream_metrics_emit (scrape, "decode_qos_degrades_total", "counter",
+      "Steps up in frame dropping ahead of a decoder", NULL, s.degrades);
+  stream_metrics_emit (scrape, "decode_qos_frames_skipped_total", "counter",
+      "Frames that reached a video decoder and were not output", NULL,
+      s.skipped);
+  stream_metrics_emit (scrape, "decode_qos_late_renders_total", "counter",
+      "Video frames that reached the sink after their time", NULL, s.late);
+}
+#endif
+
+G_END_DECLS
+
+#endif /* __DECODE_QOS_H__ */
@@ -0,0 +1,656 @@
+/* Runtime control of the RTSP video encoder
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   EncoderControl *ec = encoder_control_new ();
+ *   encoder_control_attach (ec, encoder);        (from media-configure)
+ *   encoder_control_set (ec, "bitrate=1200 speed-preset=veryfast", &error);
+ *   encoder_control_listen (ec, "unix:/tmp/encoder", &error);
+ *
+ * Settings are "name=value" pairs of encoder properties, separated by spaces
+ * or commas: bitrate, speed-preset, qp-min, qp-max and key-int-max (the
+ * keyframe interval). Values take the same form as in a launch line.
+ *
+ * Properties the encoder accepts while PLAYING (bitrate on x264enc) are set
+ * directly. For the others the next buffer is blocked on the pad feeding
+ * the encoder, and a worker thread cycles only the encoder through READY
+ * with the new settings. The sticky events of that pad are sent again, the
+ * block is removed, and the stream carries on with a keyframe. The rest of
+ * the media and the RTSP sessions are untouched. One restart runs at a
+ * time, a set that needs another one meanwhile is answered "error: busy".
+ * The new SPS/PPS only reach playing clients in-band, so the payloader
+ * needs config-interval=-1.
+ *
+ * Encode time per frame is measured between the encoder pads over the last
+ * ENCODER_CONTROL_WINDOW frames. Each change records the time before it, and
+ * the same window after it, skipping the first frames after a restart.
+ *
+ * The control socket takes one command per line and answers with one line:
+ *   get                     current settings and encode time
+ *   set NAME=VALUE ...      retune, answers "ok" or "error: ..."
+ *   report                  encode time before and after the last change
+ *
+ * encoder_control_add_command() adds commands of the program's own to the
+ * same socket.
+ */
+
+#ifndef __ENCODER_CONTROL_H__
+#define __ENCODER_CONTROL_H__
+
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gio/gio.h>
+
+#include "stream-metrics.h"
+
+G_BEGIN_DECLS
+
+#define ENCODER_CONTROL_WINDOW 100
+#define ENCODER_CONTROL_WARMUP 3
+
+static const gchar *encoder_control_properties[] = {
+  "bitrate", "speed-preset", "qp-min", "qp-max", "key-int-max", NULL
+};
+
+/* The one-line reply to a command added to the socket, freed with g_free() */
+typedef gchar *(*EncoderControlCommandFunc) (const gchar * args,
+    gpointer user_data);
+
+typedef struct
+{
+  gchar *name;
+  EncoderControlCommandFunc func;
+  gpointer user_data;
+} EncoderControlCommand;
+
+typedef struct
+{
+  GMutex lock;
+  GWeakRef encoder;
+  GSocketService *service;
+  GArray *commands;             /* EncoderControlCommand, set before listen */
+
+  /* encode timing, streaming thread */
+  gint64 start_us;
+  gint64 durations[ENCODER_CONTROL_WINDOW];
+  guint n_durations;
+  guint next_duration;
+
+  /* restart, under the lock */
+  gboolean restarting;
+  gpointer restart_encoder;     /* only compared, for a stale restart */
+  GThread *restart_thread;
+
+  /* last change, under the lock */
+  gchar *last_settings;
+  gdouble before_ms;
+  gboolean measuring;
+  guint warmup;
+  gint64 after_us;
+  guint after_frames;
+} EncoderControl;
+
+typedef struct
+{
+  EncoderControl *ec;
+  guint n;
+  gchar **names;
+  GValue *values;
+
+  /* restart only */
+  GstElement *encoder;
+  GstPad *blocked;              /* the pad feeding the encoder */
+  gulong probe_id;
+  gint scheduled;
+} EncoderControlChange;
+
+static EncoderControl * G_GNUC_UNUSED
+encoder_control_new (void)
+{
+  EncoderControl *ec = g_new0 (EncoderControl, 1);
+
+  g_mutex_init (&ec->lock);
+  g_weak_ref_init (&ec->encoder, NULL);
+  ec->commands = g_array_new (FALSE, FALSE, sizeof (EncoderControlCommand));
+
+  return ec;
+}
+
+/* Free once the encoders it controls stopped */
+static void G_GNUC_UNUSED
+encoder_control_free (EncoderControl * ec)
+{
+  guint i;
+
+  if (ec->service) {
+    g_socket_service_stop (ec->service);
+    g_socket_listener_close (G_SOCKET_LISTENER (ec->service));
+    g_object_unref (ec->service);
+  }
+  if (ec->restart_thread)
+    g_thread_join (ec->restart_thread);
+  for (i = 0; i < ec->commands->len; i++)
+    g_free (g_array_index (ec->commands, EncoderControlCommand, i).name);
+  g_array_unref (ec->commands);
+  g_weak_ref_clear (&ec->encoder);
+  g_mutex_clear (&ec->lock);
+  g_free (ec->last_settings);
+  g_free (ec);
+}
+
+/* Answer "@name [ARGS]" on the socket with @func; add before listening */
+static void G_GNUC_UNUSED
+encoder_control_add_command (EncoderControl * ec, const gchar * name,
+    EncoderControlCommandFunc func, gpointer user_data)
+{
+  EncoderControlCommand command = { g_strdup (name), func, user_data };
+
+  g_array_append_val (ec->commands, command);
+}
+
+/* The reply of an added command, or NULL when @line is none of them */
+static gchar *
+encoder_control_run_command (EncoderControl * ec, const gchar * line)
+{
+  guint i;
+
+  for (i = 0; i < ec->commands->len; i++) {
+    EncoderControlCommand *command =
+        &g_array_index (ec->commands, EncoderControlCommand, i);
+    gsize len = strlen (command->name);
+
+    if (strncmp (line, command->name, len) == 0 &&
+        (line[len] == '\0' || line[len] == ' '))
+      return command->func (line + len + (line[len] ? 1 : 0),
+          command->user_data);
+  }
+  return NULL;
+}
+
+static void
+encoder_control_change_free (EncoderControlChange * change)
+{
+  guint i;
+
+  for (i = 0; i < change->n; i++)
+    g_value_unset (&change->values[i]);
+  g_free (change->values);
+  g_strfreev (change->names);
+  if (change->encoder)
+    gst_object_unref (change->encoder);
+  if (change->blocked)
+    gst_object_unref (change->blocked);
+  g_free (change);
+}
+
+/* average over the window, call with the lock held */
+static gdouble
+encoder_control_average_ms (EncoderControl * ec)
+{
+  gint64 sum = 0;
+  guint i;
+
+  for (i = 0; i < ec->n_durations; i++)
+    sum += ec->durations[i];
+  return ec->n_durations ? sum / 1000.0 / ec->n_durations : 0.0;
+}
+
+/*
+ * Timing
+ */
+static GstPadProbeReturn
+encoder_control_sink_probe (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  EncoderControl *ec = user_data;
+
+  ec->start_us = g_get_monotonic_time ();
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+encoder_control_src_probe (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  EncoderControl *ec = user_data;
+  gint64 duration;
+
+  /* tune=zerolatency outputs each frame within its chain call */
+  if (!ec->start_us)
+    return GST_PAD_PROBE_OK;
+  duration = g_get_monotonic_time () - ec->start_us;
+  ec->start_us = 0;
+
+  g_mutex_lock (&ec->lock);
+  ec->durations[ec->next_duration] = duration;
+  ec->next_duration = (ec->next_duration + 1) % ENCODER_CONTROL_WINDOW;
+  ec->n_durations = MIN (ec->n_durations + 1, ENCODER_CONTROL_WINDOW);
+
+  if (ec->measuring) {
+    if (ec->warmup > 0) {
+      ec->warmup--;
+    } else {
+      ec->after_us += duration;
+      if (++ec->after_frames == ENCODER_CONTROL_WINDOW) {
+        ec->measuring = FALSE;
+        GST_INFO ("encoder %s: %.2f ms/frame before, %.2f ms/frame after",
+            ec->last_settings, ec->before_ms,
+            ec->after_us / 1000.0 / ec->after_frames);
+      }
+    }
+  }
+  g_mutex_unlock (&ec->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Control @encoder from now on; call again for the encoder of each new
+ * media. Settings are not carried over to the new encoder. */
+static void G_GNUC_UNUSED
+encoder_control_attach (EncoderControl * ec, GstElement * encoder)
+{
+  GstPad *pad;
+
+  g_weak_ref_set (&ec->encoder, encoder);
+  ec->start_us = 0;
+
+  pad = gst_element_get_static_pad (encoder, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      encoder_control_sink_probe, ec, NULL);
+  gst_object_unref (pad);
+
+  pad = gst_element_get_static_pad (encoder, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      encoder_control_src_probe, ec, NULL);
+  gst_object_unref (pad);
+}
+
+/*
+ * Retuning
+ */
+static void
+encoder_control_apply (EncoderControlChange * change, GstElement * encoder)
+{
+  guint i;
+
+  for (i = 0; i < change->n; i++)
+    g_object_set_property (G_OBJECT (encoder), change->names[i],
+        &change->values[i]);
+}
+
+static gboolean
+encoder_control_resend_event (GstPad * peer, GstEvent ** event,
+    gpointer user_data)
+{
+  GstPad *sinkpad = user_data;
+
+  if (GST_EVENT_TYPE (*event) != GST_EVENT_EOS)
+    gst_pad_send_event (sinkpad, gst_event_ref (*event));
+  return TRUE;
+}
+
+/* Cycle the encoder through READY with @change applied. The pad feeding
+ * it is blocked, so nothing is inside the encoder meanwhile. Runs on its
+ * own thread: the streaming thread cannot deactivate the pads it is in. */
+static gpointer
+encoder_control_restart (EncoderControlChange * change)
+{
+  EncoderControl *ec = change->ec;
+  GstElement *encoder = gst_object_ref (change->encoder);
+  GstPad *blocked = gst_object_ref (change->blocked);
+  GstPad *sinkpad = gst_element_get_static_pad (encoder, "sink");
+
+  gst_element_set_state (encoder, GST_STATE_READY);
+  encoder_control_apply (change, encoder);
+  gst_element_sync_state_with_parent (encoder);
+
+  /* deactivating the sink pad dropped its caps and segment */
+  gst_pad_sticky_events_foreach (blocked, encoder_control_resend_event,
+      sinkpad);
+  /* lets the held buffer through and frees @change */
+  gst_pad_remove_probe (blocked, change->probe_id);
+
+  g_mutex_lock (&ec->lock);
+  ec->restarting = FALSE;
+  g_mutex_unlock (&ec->lock);
+
+  gst_object_unref (sinkpad);
+  gst_object_unref (blocked);
+  gst_object_unref (encoder);
+  return NULL;
+}
+
+/* Runs in the streaming thread with the next buffer held on the pad
+ * feeding the encoder. The pad stays blocked until the worker thread
+ * has restarted the encoder and removed the probe. */
+static GstPadProbeReturn
+encoder_control_restart_probe (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  EncoderControlChange *change = user_data;
+  EncoderControl *ec = change->ec;
+
+  if (!g_atomic_int_compare_and_exchange (&change->scheduled, 0, 1))
+    return GST_PAD_PROBE_OK;
+
+  change->probe_id = GST_PAD_PROBE_INFO_ID (info);
+  change->blocked = gst_object_ref (pad);
+  /* the set that scheduled this joined the previous restart's thread */
+  g_mutex_lock (&ec->lock);
+  ec->restart_thread = g_thread_new ("encoder-restart",
+      (GThreadFunc) encoder_control_restart, change);
+  g_mutex_unlock (&ec->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+encoder_control_is_allowed (const gchar * name)
+{
+  return g_strv_contains ((const gchar * const *) encoder_control_properties,
+      name);
+}
+
+/* Retune the running encoder with "name=value" pairs */
+static gboolean G_GNUC_UNUSED
+encoder_control_set (EncoderControl * ec, const gchar * settings,
+    GError ** error)
+{
+  EncoderControlChange *change;
+  GstElement *encoder;
+  GThread *finished = NULL;
+  gboolean restart = FALSE;
+  gchar **pairs, **p;
+  GPtrArray *names;
+  GArray *values;
+
+  encoder = g_weak_ref_get (&ec->encoder);
+  if (!encoder) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+        "No encoder is running, a client has to connect first");
+    return FALSE;
+  }
+
+  names = g_ptr_array_new ();
+  values = g_array_new (FALSE, TRUE, sizeof (GValue));
+  g_array_set_clear_func (values, (GDestroyNotify) g_value_unset);
+  pairs = g_strsplit_set (settings, " ,", -1);
+  for (p = pairs; *p; p++) {
+    gchar *eq = strchr (*p, '=');
+    GParamSpec *pspec;
+    GValue value = G_VALUE_INIT;
+
+    if (**p == '\0')
+      continue;
+    if (!eq) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+          "Expected NAME=VALUE, got '%s'", *p);
+      goto failed;
+    }
+    *eq = '\0';
+    pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (encoder), *p);
+    if (!encoder_control_is_allowed (*p) || !pspec) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+          "Cannot set '%s' on %s", *p, GST_OBJECT_NAME (encoder));
+      goto failed;
+    }
+    g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspec));
+    if (!gst_value_deserialize (&value, eq + 1) ||
+        g_param_value_validate (pspec, &value)) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+          "Invalid value '%s' for %s", eq + 1, *p);
+      g_value_unset (&value);
+      goto failed;
+    }
+    if (!(pspec->flags & GST_PARAM_MUTABLE_PLAYING))
+      restart = TRUE;
+    g_ptr_array_add (names, g_strdup (*p));
+    g_array_append_val (values, value);
+  }
+
+  if (names->len == 0) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+        "Nothing to set");
+    goto failed;
+  }
+
+  restart = restart && GST_STATE (encoder) > GST_STATE_READY;
+  g_mutex_lock (&ec->lock);
+  /* a restart of an encoder already replaced never runs */
+  if (restart && ec->restarting && ec->restart_encoder == encoder) {
+    g_mutex_unlock (&ec->lock);
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_BUSY, "busy");
+    goto failed;
+  }
+  if (restart) {
+    ec->restarting = TRUE;
+    ec->restart_encoder = encoder;
+    finished = ec->restart_thread;
+    ec->restart_thread = NULL;
+  }
+  g_mutex_unlock (&ec->lock);
+  /* done apart from returning, before the probe can start the next one */
+  if (finished)
+    g_thread_join (finished);
+
+  change = g_new0 (EncoderControlChange, 1);
+  change->ec = ec;
+  change->n = names->len;
+  g_ptr_array_add (names, NULL);
+  change->names = (gchar **) g_ptr_array_free (names, FALSE);
+  g_array_set_clear_func (values, NULL);
+  change->values = (GValue *) g_array_free (values, FALSE);
+
+  g_mutex_lock (&ec->lock);
+  g_free (ec->last_settings);
+  ec->last_settings = g_strstrip (g_strdup (settings));
+  ec->before_ms = encoder_control_average_ms (ec);
+  ec->measuring = TRUE;
+  ec->warmup = restart ? ENCODER_CONTROL_WARMUP : 0;
+  ec->after_us = 0;
+  ec->after_frames = 0;
+  g_mutex_unlock (&ec->lock);
+
+  if (restart) {
+    GstPad *pad = gst_element_get_static_pad (encoder, "sink");
+    GstPad *peer = gst_pad_get_peer (pad);
+
+    change->encoder = gst_object_ref (encoder);
+    if (peer) {
+      /* blocked upstream of the encoder, whose pads are deactivated */
+      gst_pad_add_probe (peer, GST_PAD_PROBE_TYPE_BLOCK |
+          GST_PAD_PROBE_TYPE_BUFFER, encoder_control_restart_probe, change,
+          (GDestroyNotify) encoder_control_change_free);
+      gst_object_unref (peer);
+    } else {
+      /* nothing can stream into an unlinked encoder */
+      gst_element_set_state (encoder, GST_STATE_READY);
+      encoder_control_apply (change, encoder);
+      gst_element_sync_state_with_parent (encoder);
+      encoder_control_change_free (change);
+      g_mutex_lock (&ec->lock);
+      ec->restarting = FALSE;
+      g_mutex_unlock (&ec->lock);
+    }
+    gst_object_unref (pad);
+  } else {
+    encoder_control_apply (change, encoder);
+    encoder_control_change_free (change);
+  }
+
+  g_strfreev (pairs);
+  gst_object_unref (encoder);
+  return TRUE;
+
+failed:
+  g_ptr_array_foreach (names, (GFunc) g_free, NULL);
+  g_ptr_array_free (names, TRUE);
+  g_array_free (values, TRUE);
+  g_strfreev (pairs);
+  gst_object_unref (encoder);
+  return FALSE;
+}
+
+/* Current settings and encode time, "name=value ... encode-ms=N" */
+static gchar * G_GNUC_UNUSED
+encoder_control_get (EncoderControl * ec)
+{
+  GstElement *encoder = g_weak_ref_get (&ec->encoder);
+  GString *s = g_string_new (NULL);
+  const gchar **name;
+
+  if (!encoder)
+    return g_string_free (s, FALSE);
+
+  for (name = encoder_control_properties; *name; name++) {
+    GParamSpec *pspec =
+        g_object_class_find_property (G_OBJECT_GET_CLASS (encoder), *name);
+    GValue value = G_VALUE_INIT;
+    gchar *str;
+
+    if (!pspec)
+      continue;
+    g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspec));
+    g_object_get_property (G_OBJECT (encoder), *name, &value);
+    str = gst_value_serialize (&value);
+    g_string_append_printf (s, "%s=%s ", *name, str);
+    g_free (str);
+    g_value_unset (&value);
+  }
+  g_mutex_lock (&ec->lock);
+  g_string_append_printf (s, "encode-ms=%.2f", encoder_control_average_ms (ec));
+  g_mutex_unlock (&ec->lock);
+
+  gst_object_unref (encoder);
+  return g_string_free (s, FALSE);
+}
+
+/* Encode time per frame before and after the last change */
+static gchar * G_GNUC_UNUSED
+encoder_control_report (EncoderControl * ec)
+{
+  gchar *report;
+
+  g_mutex_lock (&ec->lock);
+  if (!ec->last_settings)
+    report = g_strdup ("no change yet");
+  else if (ec->measuring)
+    report = g_strdup_printf ("%s: %.2f ms/frame before, after: measuring "
+        "(%u of %d frames)", ec->last_settings, ec->before_ms,
+        ec->after_frames, ENCODER_CONTROL_WINDOW);
+  else
+    report = g_strdup_printf ("%s: %.2f ms/frame before, %.2f ms/frame after",
+        ec->last_settings, ec->before_ms,
+        ec->after_us / 1000.0 / ec->after_frames);
+  g_mutex_unlock (&ec->lock);
+
+  return report;
+}
+
+/*
+ * Control socket
+ */
+static gboolean
+encoder_control_serve (GThreadedSocketService * service,
+    GSocketConnection * connection, GObject * source_object,
+    EncoderControl * ec)
+{
+  GDataInputStream *in;
+  GOutputStream *out;
+  gchar *line;
+
+  in = g_data_input_stream_new (g_io_stream_get_input_stream (G_IO_STREAM
+          (connection)));
+  out = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+
+  while ((line = g_data_input_stream_read_line_utf8 (in, NULL, NULL, NULL))) {
+    GError *error = NULL;
+    gchar *reply;
+
+    g_strstrip (line);
+    if (g_str_equal (line, "get"))
+      reply = encoder_control_get (ec);
+    else if (g_str_equal (line, "report"))
+      reply = encoder_control_report (ec);
+    else if (g_str_has_prefix (line, "set "))
+      reply = encoder_control_set (ec, line + 4, &error) ? g_strdup ("ok") :
+          g_strdup_printf ("error: %s", error->message);
+    else if (!(reply = encoder_control_run_command (ec, line)))
+      reply = g_strdup ("error: commands are get, set NAME=VALUE ..., report");
+    g_clear_error (&error);
+    g_free (line);
+
+    line = g_strconcat (reply, "\n", NULL);
+    g_free (reply);
+    if (!g_output_stream_write_all (out, line, strlen (line), NULL, NULL,
+            NULL)) {
+      g_free (line);
+      break;
+    }
+    g_free (line);
+  }
+
+  g_object_unref (in);
+  return TRUE;
+}
+
+/* Accept commands on @address, in the forms of stream_metrics_listen() */
+static gboolean G_GNUC_UNUSED
+encoder_control_listen (EncoderControl * ec, const gchar * address,
+    GError ** error)
+{
+  GSocketAddress *saddr;
+
+  saddr = stream_metrics_parse_address (address, error);
+  if (!saddr)
+    return FALSE;
+
+  ec->service = g_threaded_socket_service_new (2);
+  if (!g_socket_listener_add_address (G_SOCKET_LISTENER (ec->service),
+          saddr, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+          error)) {
+    g_clear_object (&ec->service);
+    g_object_unref (saddr);
+    return FALSE;
+  }
+  g_object_unref (saddr);
+
+  g_signal_connect (ec->service, "run", G_CALLBACK (encoder_control_serve),
+      ec);
+  g_socket_service_start (ec->service);
+
+  return TRUE;
+}
+
+static void G_GNUC_UNUSED
+encoder_control_collect_metrics (StreamMetricsScrape * scrape,
+    gpointer user_data)
+{
+  EncoderControl *ec = user_data;
+  gdouble ms;
+
+  g_mutex_lock (&ec->lock);
+  ms = encoder_control_average_ms (ec);
+  g_mutex_unlock (&ec->lock);
+
+  stream_metrics_emit (scrape, "encoder_frame_seconds", "gauge",
+      "Average encode time per frame over the last 100 frames", NULL,
+      ms / 1000);
+}
+
+G_END_DECLS
+
+#endif /* __ENCODER_CONTROL_H__ */
@@ -0,0 +1,294 @@
+/* Polling of rtpjitterbuffer statistics for metrics and a CSV log
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   JitterStats *js = jitter_stats_new ();
+ *   jitter_stats_watch_pipeline (js, pipeline, "client");
+ *   jitter_stats_start_log (js, file, 1000);
+ *
+ * Every rtpjitterbuffer in the pipeline, including the ones rtspsrc
+ * creates inside its rtpbin later on, is polled for its "stats" and
+ * "percent": packets pushed, lost, late and duplicated, retransmission
+ * requests and how many of them arrived in time, the average jitter, and
+ * how full the buffer is relative to its latency. The CSV gets one line
+ * per jitter buffer per interval, with cumulative counters, so packet
+ * arrival patterns can be replayed against other latency settings.
+ */
+
+#ifndef __JITTER_STATS_H__
+#define __JITTER_STATS_H__
+
+#include <stdio.h>
+#include <string.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct
+{
+  GWeakRef jitterbuffer;
+  gchar *pipeline;
+  gchar *element;
+} JitterStatsEntry;
+
+typedef struct
+{
+  GMutex lock;
+  GPtrArray *entries;           /* JitterStatsEntry */
+
+  /* main thread */
+  FILE *log;
+  gint64 start_us;
+  guint log_id;
+} JitterStats;
+
+typedef struct
+{
+  guint64 pushed;
+  guint64 lost;
+  guint64 late;
+  guint64 duplicates;
+  guint64 rtx_requests;
+  guint64 rtx_success;
+  GstClockTime avg_jitter;
+  gint percent;
+} JitterStatsSample;
+
+typedef void (*JitterStatsFunc) (JitterStatsEntry * entry,
+    JitterStatsSample * s, gpointer user_data);
+
+static void
+jitter_stats_entry_free (JitterStatsEntry * entry)
+{
+  g_weak_ref_clear (&entry->jitterbuffer);
+  g_free (entry->pipeline);
+  g_free (entry->element);
+  g_free (entry);
+}
+
+static JitterStats * G_GNUC_UNUSED
+jitter_stats_new (void)
+{
+  JitterStats *js = g_new0 (JitterStats, 1);
+
+  g_mutex_init (&js->lock);
+  js->entries = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      jitter_stats_entry_free);
+
+  return js;
+}
+
+static void G_GNUC_UNUSED
+jitter_stats_free (JitterStats * js)
+{
+  if (js->log_id)
+    g_source_remove (js->log_id);
+  g_ptr_array_unref (js->entries);
+  g_mutex_clear (&js->lock);
+  g_free (js);
+}
+
+static void
+jitter_stats_watch_element (JitterStats * js, GstElement * element,
+    const gchar * pipeline)
+{
+  GstElementFactory *factory = gst_element_get_factory (element);
+  JitterStatsEntry *entry;
+
+  if (!factory || !g_str_equal (GST_OBJECT_NAME (factory), "rtpjitterbuffer"))
+    return;
+
+  entry = g_new0 (JitterStatsEntry, 1);
+  g_weak_ref_init (&entry->jitterbuffer, element);
+  entry->pipeline = g_strdup (pipeline);
+  entry->element = gst_element_get_name (element);
+
+  g_mutex_lock (&js->lock);
+  g_ptr_array_add (js->entries, entry);
+  g_mutex_unlock (&js->lock);
+}
+
+static void
+jitter_stats_deep_element_added (GstBin * bin, GstBin * sub_bin,
+    GstElement * element, JitterStats * js)
+{
+  jitter_stats_watch_element (js, element,
+      g_object_get_data (G_OBJECT (bin), "jitter-stats-label"));
+}
+
+/* Poll the jitter buffers of @pipeline now and as rtpbin creates them */
+static void G_GNUC_UNUSED
+jitter_stats_watch_pipeline (JitterStats * js, GstElement * pipeline,
+    const gchar * label)
+{
+  GstIterator *it;
+  GValue item = G_VALUE_INIT;
+  gboolean done = FALSE;
+
+  g_object_set_data_full (G_OBJECT (pipeline), "jitter-stats-label",
+      g_strdup (label), g_free);
+  g_signal_connect (pipeline, "deep-element-added",
+      G_CALLBACK (jitter_stats_deep_element_added), js);
+
+  it = gst_bin_iterate_recurse (GST_BIN (pipeline));
+  while (!done) {
+    switch (gst_iterator_next (it, &item)) {
+      case GST_ITERATOR_OK:
+        jitter_stats_watch_element (js, g_value_get_object (&item), label);
+        g_value_reset (&item);
+        break;
+      case GST_ITERATOR_RESYNC:
+        gst_iterator_resync (it);
+        break;
+      default:
+        done = TRUE;
+        break;
+    }
+  }
+  g_value_unset (&item);
+  gst_iterator_free (it);
+}
+
+static void
+jitter_stats_sample (GstElement * jitterbuffer, JitterStatsSample * s)
+{
+  GstStructure *stats = NULL;
+
+  memset (s, 0, sizeof (*s));
+  g_object_get (jitterbuffer, "stats", &stats, "percent", &s->percent, NULL);
+  if (!stats)
+    return;
+
+  gst_structure_get_uint64 (stats, "num-pushed", &s->pushed);
+  gst_structure_get_uint64 (stats, "num-lost", &s->lost);
+  gst_structure_get_uint64 (stats, "num-late", &s->late);
+  gst_structure_get_uint64 (stats, "num-duplicates", &s->duplicates);
+  gst_structure_get_uint64 (stats, "rtx-count", &s->rtx_requests);
+  gst_structure_get_uint64 (stats, "rtx-success-count", &s->rtx_success);
+  gst_structure_get_uint64 (stats, "avg-jitter", &s->avg_jitter);
+  gst_structure_free (stats);
+}
+
+/* Calls @func for every jitter buffer still alive and forgets the others */
+static void
+jitter_stats_foreach (JitterStats * js, JitterStatsFunc func,
+    gpointer user_data)
+{
+  guint i;
+
+  g_mutex_lock (&js->lock);
+  for (i = 0; i < js->entries->len;) {
+    JitterStatsEntry *entry = g_ptr_array_index (js->entries, i);
+    GstElement *jitterbuffer = g_weak_ref_get (&entry->jitterbuffer);
+    JitterStatsSample s;
+
+    if (!jitterbuffer) {
+      g_ptr_array_remove_index (js->entries, i);
+      continue;
+    }
+    jitter_stats_sample (jitterbuffer, &s);
+    gst_object_unref (jitterbuffer);
+    func (entry, &s, user_data);
+    i++;
+  }
+  g_mutex_unlock (&js->lock);
+}
+
+static void
+jitter_stats_log_entry (JitterStatsEntry * entry, JitterStatsSample * s,
+    gpointer user_data)
+{
+  JitterStats *js = user_data;
+
+  fprintf (js->log, "%.3f,%s,%s,%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT
+      ",%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT
+      ",%" G_GUINT64_FORMAT ",%d,%.3f\n",
+      (g_get_monotonic_time () - js->start_us) / 1e6, entry->pipeline,
+      entry->element, s->pushed, s->lost, s->late, s->duplicates,
+      s->rtx_requests, s->rtx_success, s->percent,
+      (gdouble) s->avg_jitter / GST_MSECOND);
+}
+
+static gboolean
+jitter_stats_log_tick (JitterStats * js)
+{
+  jitter_stats_foreach (js, jitter_stats_log_entry, js);
+  fflush (js->log);
+  return G_SOURCE_CONTINUE;
+}
+
+/* Append a CSV line per jitter buffer to @log every @interval_ms, from the
+ * default main context */
+static void G_GNUC_UNUSED
+jitter_stats_start_log (JitterStats * js, FILE * log, guint interval_ms)
+{
+  js->log = log;
+  js->start_us = g_get_monotonic_time ();
+  fprintf (log, "time_s,pipeline,element,pushed,lost,late,duplicates,"
+      "rtx_requests,rtx_success,fill_percent,avg_jitter_ms\n");
+  js->log_id = g_timeout_add (MAX (interval_ms, 10),
+      (GSourceFunc) jitter_stats_log_tick, js);
+}
+
+#ifdef __STREAM_METRICS_H__
+static void
+jitter_stats_emit_entry (JitterStatsEntry * entry, JitterStatsSample * s,
+    gpointer user_data)
+{
+  StreamMetricsScrape *scrape = user_data;
+  gchar *pipeline, *element, *labels;
+
+  pipeline = stream_metrics_escape_label (entry->pipeline);
+  element = stream_metrics_escape_label (entry->element);
+  labels = g_strdup_printf ("pipeline=\"%s\",element=\"%s\"", pipeline,
+      element);
+  g_free (element);
+  g_free (pipeline);
+
+  stream_metrics_emit (scrape, "jitterbuffer_pushed_total", "counter",
+      "RTP packets pushed out of a jitter buffer", labels, s->pushed);
+  stream_metrics_emit (scrape, "jitterbuffer_lost_total", "counter",
+      "RTP packets a jitter buffer gave up on", labels, s->lost);
+  stream_metrics_emit (scrape, "jitterbuffer_late_total", "counter",
+      "RTP packets that arrived after their time was pushed",
+      labels, s->late);
+  stream_metrics_emit (scrape, "jitterbuffer_duplicates_total", "counter",
+      "Duplicate RTP packets dropped", labels, s->duplicates);
+  stream_metrics_emit (scrape, "jitterbuffer_rtx_requests_total", "counter",
+      "Retransmission requests sent", labels, s->rtx_requests);
+  stream_metrics_emit (scrape, "jitterbuffer_rtx_success_total", "counter",
+      "Retransmitted packets that arrived in time", labels,
+      s->rtx_success);
+  stream_metrics_emit (scrape, "jitterbuffer_fill_ratio", "gauge",
+      "How full a jitter buffer is relative to its latency (0-1)",
+      labels, s->percent / 100.0);
+  stream_metrics_emit (scrape, "jitterbuffer_jitter_seconds", "gauge",
+      "Average packet arrival jitter", labels,
+      (gdouble) s->avg_jitter / GST_SECOND);
+  g_free (labels);
+}
+
+static void G_GNUC_UNUSED
+jitter_stats_collect_metrics (StreamMetricsScrape * scrape,
+    gpointer user_data)
+{
+  jitter_stats_foreach (user_data, jitter_stats_emit_entry, scrape);
+}
+#endif
+
+G_END_DECLS
+
+#endif /* __JITTER_STATS_H__ */
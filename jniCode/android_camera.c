@@ -34,6 +34,54 @@
 #include <gst/net/gstnettimeprovider.h>
 #include <gst/rtsp-server/rtsp-server.h>
 #include <gst/video/video.h>
+#include <gst/app/gstappsink.h>
+
+#include "../pipeline-trace.h"
+#include "../stream-metrics.h"
+#include "../queue-policy.h"
+#include "../motion-detect.h"
+#include "../roi-encode.h"
+#include "../static-throttle.h"
+#include "../encoder-control.h"
+#include "../cpu-affinity.h"
+#include "../startup-timing.h"
+#include "../plugin-preload.h"
+
+/* ports of the first camera; camera n serves on RTSP_PORT + n and
+ * METRICS_PORT + n */
+#define RTSP_PORT 8554
+/* local endpoint for the Prometheus metrics of the capture and RTSP pipelines */
+#define METRICS_PORT 9100
+/* cameras one process can host at once */
+#define MAX_INSTANCES 8
+/* startup targets, from app_function to the first preview frame and to the
+ * RTSP mount being served; a slower startup logs a warning */
+#define STARTUP_PREVIEW_BUDGET_MS 1500
+#define STARTUP_RTSP_BUDGET_MS 1000
+/* analysis time allowed per camera frame for motion detection */
+#define MOTION_BUDGET_US 2000
+/* QP difference between moving regions and the rest of the encoded frame */
+#define ROI_DELTA_QP 8
+/* time without any motion before nativeSetStaticFps applies, which is off
+ * until the app turns it on */
+#define STATIC_HOLD_MS 2000
+
+/* elements of the RTSP media, loaded while the capture pipeline is built */
+static const gchar *rtsp_factories[] = {
+  "intervideosrc", "videoscale", "videoconvert", "capsfilter", "queue",
+  "x264enc", "rtph264pay", "openslessrc", "audioconvert", "rtpL16pay",
+  "rtpbin", NULL
+};
+
+/* name=policy[:max-latency-ms] for the queues of both pipelines */
+static const gchar *queue_policies[] = {
+  "preview_queue=leak-oldest:100",
+  "tap_queue=leak-oldest:100",
+  "motion_queue=leak-oldest:66",
+  "enc_queue=leak-oldest:200",
+  "audio_queue=block:200",
+  NULL
+};
 
 GST_DEBUG_CATEGORY_STATIC (debug_category);
 #define GST_CAT_DEFAULT debug_category
@@ -103,6 +151,52 @@ custom_setup_rtpbin (GstRTSPMedia * media, GstElement * rtpbin)
 
 
 
+typedef enum
+{
+  JNI_EVENT_STATE_CHANGED,
+  JNI_EVENT_ERROR,
+  JNI_EVENT_INITIALIZED,
+  JNI_EVENT_FRAME,
+  JNI_EVENT_SNAPSHOT
+} JniEventType;
+
+typedef struct _JniEvent
+{
+  struct _JniEvent *next;
+  JniEventType type;
+  GstState state;
+  gchar *message;
+  gint frame;
+  gboolean ok;
+} JniEvent;
+
+/* frames lent to Java by the tap, at most this many at once */
+#define TAP_MAX_FRAMES 3
+
+typedef struct _TapFrame
+{
+  GstSample *sample;
+  GstMapInfo map;
+} TapFrame;
+
+/* snapshot requests served by one JPEG encode of one frame */
+/* What a snapshot batch may cost the live streams */
+typedef struct _SnapshotImpact
+{
+  guint64 preview_dropped;      /* preview_queue */
+  guint64 stream_dropped;       /* enc_queue, ahead of the RTSP encoder */
+  guint64 sink_late;            /* frames vidsink rendered late */
+  gint64 sink_lateness;         /* ns, of the last frame vidsink rendered */
+} SnapshotImpact;
+
+typedef struct _SnapshotJob
+{
+  GPtrArray *paths;
+  GstSample *sample;
+  gint64 requested;
+  SnapshotImpact before;
+} SnapshotJob;
+
 typedef struct _GstAhc
 {
   jobject app;
@@ -115,21 +209,83 @@ typedef struct _GstAhc
   GstElement *vfilter1, *vfilter2;// *filter3;
   GstElement *vsink;
   gboolean initialized;
+  pthread_t app_thread;
+
+  /* camera n of this process, and the Android camera it opens (-1 for the
+   * default one) */
+  guint index;
+  gint camera_id;
+  gchar *channel;
      /*For RTSP SERVER*/
 
     GstRTSPServer *server;
     GstRTSPMountPoints *mounts;
     GstRTSPMediaFactory *factory;
+    GSource *server_source;
+    gchar *mount;
+    /* medias not unprepared yet, they use the encoder helpers */
+    GMutex medias_lock;
+    GPtrArray *medias;
+
+    /* startup; the clock and the RTSP plugins load in their own threads,
+     * the server starts from the main loop once the preview can run */
+    GMainContext *context;
+    StartupTimer *startup;
+    GThread *clock_thread, *preload_thread;
+    gboolean clock_ready;
+    gint startup_reported;
+
+    StreamMetrics *metrics;
+    gint n_clients;
+
+    /* Java callback dispatch */
+    JniEvent *jni_events;
+    pthread_t jni_thread;
+    GMutex jni_lock;
+    GCond jni_cond;
+    gboolean jni_running;
+    GstState jni_state;
+
+    /* analytics frame tap */
+    GstElement *tap_valve, *tap_rate, *tap_filter, *tap_sink;
+    GMutex tap_lock;
+    TapFrame tap_frames[TAP_MAX_FRAMES];
+    guint64 tap_dropped;
+
+    /* still capture */
+    GMutex snap_lock;
+    SnapshotJob *snap_pending;
+    gint snap_armed;
+    GThreadPool *snap_pool;
+    guint64 snap_requests, snap_encodes;
+    gint64 snap_last_encode_us;
+    SnapshotImpact snap_before, snap_after;     /* the last batch */
+    SnapshotImpact snap_total;  /* added up over the batches */
+    guint64 sink_late;          /* atomic */
+    gint64 sink_lateness;       /* atomic */
+
+    /* motion analytics */
+    MotionDetector *motion;
+    gboolean motion_active;
+    RoiEncoder *roi;
+    StaticThrottle *throttle;
+    EncoderControl *encoder_control;
 
 } GstAhc;
 
-static pthread_t gst_app_thread;
+/* camera slots in use, bit n for camera n */
+static GMutex instances_lock;
+static guint instances_used;
+static gint n_instances;
 static pthread_key_t current_jni_env;
 static JavaVM *java_vm;
 static jfieldID native_android_camera_field_id;
 static jmethodID on_error_method_id;
 static jmethodID on_state_changed_method_id;
 static jmethodID on_gstreamer_initialized_method_id;
+static jmethodID on_frame_available_method_id;
+static jmethodID on_snapshot_method_id;
+static jmethodID as_read_only_buffer_method_id;
 
 
 
@@ -175,33 +331,191 @@ get_jni_env (void)
   return env;
 }
 
+/*
+ * Java callbacks are not made from the GStreamer main loop, which also runs
+ * the RTSP server: events are pushed onto a lock-free list and delivered in
+ * batches by a dedicated thread attached to the VM, so a slow Java handler
+ * only delays other Java callbacks.
+ */
+static void
+post_jni_event (GstAhc * ahc, JniEvent * event)
+{
+  JniEvent *head;
+
+  do {
+    head = g_atomic_pointer_get (&ahc->jni_events);
+    event->next = head;
+  } while (!g_atomic_pointer_compare_and_exchange (&ahc->jni_events, head,
+          event));
+
+  /* only the first event of a batch needs to wake the dispatcher up */
+  if (head == NULL) {
+    g_mutex_lock (&ahc->jni_lock);
+    g_cond_signal (&ahc->jni_cond);
+    g_mutex_unlock (&ahc->jni_lock);
+  }
+}
+
+/* Take everything posted so far, oldest first. */
+static JniEvent *
+take_jni_events (GstAhc * ahc)
+{
+  JniEvent *head, *fifo = NULL, *next;
+
+  do {
+    head = g_atomic_pointer_get (&ahc->jni_events);
+  } while (head
+      && !g_atomic_pointer_compare_and_exchange (&ahc->jni_events, head, NULL));
+
+  for (; head; head = next) {
+    next = head->next;
+    head->next = fifo;
+    fifo = head;
+  }
+  return fifo;
+}
+
+static void release_tap_frame (GstAhc * ahc, gint id, GstSample * sample);
+
+static void
+deliver_jni_events (GstAhc * ahc, JNIEnv * env, JniEvent * batch)
+{
+  JniEvent *event, *last_state = NULL, *next;
+  jstring jmessage;
+  jobject jbuffer, jdirect;
+  TapFrame *frame;
+  GstSample *sample;
+  GstMapInfo map;
+  GstVideoInfo info;
+  GstVideoMeta *meta;
+  gint stride;
+
+  /* only the latest state of a batch is worth telling Java about */
+  for (event = batch; event; event = event->next)
+    if (event->type == JNI_EVENT_STATE_CHANGED)
+      last_state = event;
+
+  for (event = batch; event; event = next) {
+    next = event->next;
+
+    switch (event->type) {
+      case JNI_EVENT_STATE_CHANGED:
+        if (event != last_state || event->state == ahc->jni_state)
+          break;
+        ahc->jni_state = event->state;
+        GST_DEBUG ("State changed to %s, notifying application",
+            gst_element_state_get_name (event->state));
+        (*env)->CallVoidMethod (env, ahc->app, on_state_changed_method_id,
+            event->state);
+        break;
+      case JNI_EVENT_ERROR:
+        jmessage = (*env)->NewStringUTF (env, event->message);
+        (*env)->CallVoidMethod (env, ahc->app, on_error_method_id, jmessage);
+        (*env)->DeleteLocalRef (env, jmessage);
+        break;
+      case JNI_EVENT_INITIALIZED:
+        (*env)->CallVoidMethod (env, ahc->app,
+            on_gstreamer_initialized_method_id);
+        break;
+      case JNI_EVENT_FRAME:
+        /* Java may hand the slot back at any time, keep the frame alive */
+        g_mutex_lock (&ahc->tap_lock);
+        frame = &ahc->tap_frames[event->frame];
+        sample = frame->sample ? gst_sample_ref (frame->sample) : NULL;
+        map = frame->map;
+        g_mutex_unlock (&ahc->tap_lock);
+        if (!sample)
+          break;
+        if (!on_frame_available_method_id || !as_read_only_buffer_method_id ||
+            !gst_video_info_from_caps (&info, gst_sample_get_caps (sample))) {
+          release_tap_frame (ahc, event->frame, sample);
+          gst_sample_unref (sample);
+          break;
+        }
+        /* pools may pad rows, the meta has the real layout */
+        meta = gst_buffer_get_video_meta (gst_sample_get_buffer (sample));
+        stride = meta ? meta->stride[0] : GST_VIDEO_INFO_PLANE_STRIDE (&info, 0);
+        /* Java reads the mapped memory directly until nativeReleaseFrame;
+         * it is mapped for reading only, so Java gets a read-only view */
+        jbuffer = NULL;
+        jdirect = (*env)->NewDirectByteBuffer (env, map.data, map.size);
+        if (jdirect) {
+          jbuffer = (*env)->CallObjectMethod (env, jdirect,
+              as_read_only_buffer_method_id);
+          (*env)->DeleteLocalRef (env, jdirect);
+        }
+        if (jbuffer) {
+          (*env)->CallVoidMethod (env, ahc->app, on_frame_available_method_id,
+              jbuffer, event->frame, GST_VIDEO_INFO_WIDTH (&info),
+              GST_VIDEO_INFO_HEIGHT (&info), stride,
+              (jlong) GST_BUFFER_PTS (gst_sample_get_buffer (sample)));
+          (*env)->DeleteLocalRef (env, jbuffer);
+        }
+        /* a Java that threw may never hand the frame back */
+        if (!jbuffer || (*env)->ExceptionCheck (env))
+          release_tap_frame (ahc, event->frame, sample);
+        gst_sample_unref (sample);
+        break;
+      case JNI_EVENT_SNAPSHOT:
+        if (!on_snapshot_method_id)
+          break;
+        jmessage = (*env)->NewStringUTF (env, event->message);
+        (*env)->CallVoidMethod (env, ahc->app, on_snapshot_method_id,
+            jmessage, (jboolean) event->ok);
+        (*env)->DeleteLocalRef (env, jmessage);
+        break;
+    }
+    if ((*env)->ExceptionCheck (env)) {
+      (*env)->ExceptionDescribe (env);
+      GST_ERROR ("Failed to call Java method");
+      (*env)->ExceptionClear (env);
+    }
+
+    g_free (event->message);
+    g_free (event);
+  }
+}
+
+static void *
+jni_dispatch_function (void *userdata)
+{
+  GstAhc *ahc = (GstAhc *) userdata;
+  JNIEnv *env = get_jni_env ();
+  JniEvent *batch;
+
+  while (TRUE) {
+    g_mutex_lock (&ahc->jni_lock);
+    while (g_atomic_pointer_get (&ahc->jni_events) == NULL
+        && ahc->jni_running)
+      g_cond_wait (&ahc->jni_cond, &ahc->jni_lock);
+    g_mutex_unlock (&ahc->jni_lock);
+
+    batch = take_jni_events (ahc);
+    if (batch == NULL)
+      break;
+    deliver_jni_events (ahc, env, batch);
+  }
+
+  return NULL;
+}
+
 static void
 on_error (GstBus * bus, GstMessage * message, GstAhc * ahc)
 {
-  gchar *message_string;
+  JniEvent *event = g_new0 (JniEvent, 1);
   GError *err;
   gchar *debug_info;
-  jstring jmessage;
-  JNIEnv *env = get_jni_env ();
 
   gst_message_parse_error (message, &err, &debug_info);
-  message_string =
+  event->type = JNI_EVENT_ERROR;
+  event->message =
       g_strdup_printf ("Error received from element %s: %s",
       GST_OBJECT_NAME (message->src), err->message);
 
   g_clear_error (&err);
   g_free (debug_info);
 
-  jmessage = (*env)->NewStringUTF (env, message_string);
-
-  (*env)->CallVoidMethod (env, ahc->app, on_error_method_id, jmessage);
-  if ((*env)->ExceptionCheck (env)) {
-    GST_ERROR ("Failed to call Java method");
-    (*env)->ExceptionClear (env);
-  }
-  (*env)->DeleteLocalRef (env, jmessage);
-
-  g_free (message_string);
+  post_jni_event (ahc, event);
   gst_element_set_state (ahc->pipeline, GST_STATE_NULL);
 }
 
@@ -212,32 +526,51 @@ eos_cb (GstBus * bus, GstMessage * msg, GstAhc * data)
   gst_element_set_state (data->pipeline, GST_STATE_PAUSED);
 }
 
+/* Motion messages come from the analytics branch; only the edges are logged
+ * here, consumers read the block masks from the bus themselves */
+static void
+motion_cb (GstBus * bus, GstMessage * msg, GstAhc * ahc)
+{
+  const GstStructure *s = gst_message_get_structure (msg);
+  gboolean active = FALSE;
+  gint x = 0, y = 0, w = 0, h = 0;
+
+  if (!gst_structure_has_name (s, "motion"))
+    return;
+
+  gst_structure_get_boolean (s, "active", &active);
+  if (active == ahc->motion_active)
+    return;
+  ahc->motion_active = active;
+
+  gst_structure_get (s, "x", G_TYPE_INT, &x, "y", G_TYPE_INT, &y,
+      "width", G_TYPE_INT, &w, "height", G_TYPE_INT, &h, NULL);
+  GST_INFO ("Motion %s, region %dx%d+%d+%d", active ? "started" : "stopped",
+      w, h, x, y);
+}
+
 static void
 state_changed_cb (GstBus * bus, GstMessage * msg, GstAhc * ahc)
 {
-  JNIEnv *env = get_jni_env ();
   GstState old_state, new_state, pending_state;
+  JniEvent *event;
 
   gst_message_parse_state_changed (msg, &old_state, &new_state, &pending_state);
   /* Only pay attention to messages coming from the pipeline, not its children */
   if (GST_MESSAGE_SRC (msg) == GST_OBJECT (ahc->pipeline)) {
     ahc->state = new_state;
-    GST_DEBUG ("State changed to %s, notifying application",
-        gst_element_state_get_name (new_state));
-    (*env)->CallVoidMethod (env, ahc->app, on_state_changed_method_id,
-        new_state);
-    if ((*env)->ExceptionCheck (env)) {
-      (*env)->ExceptionDescribe (env);
-      GST_ERROR ("Failed to call Java method");
-      (*env)->ExceptionClear (env);
-    }
+    event = g_new0 (JniEvent, 1);
+    event->type = JNI_EVENT_STATE_CHANGED;
+    event->state = new_state;
+    post_jni_event (ahc, event);
   }
 }
 
 static void
 check_initialization_complete (GstAhc * data)
 {
-  JNIEnv *env = get_jni_env ();
+  JniEvent *event;
+
   /* Check if all conditions are met to report GStreamer as initialized.
    * These conditions will change depending on the application */
   if (!data->initialized && data->native_window && data->main_loop) {
@@ -245,17 +578,276 @@ check_initialization_complete (GstAhc * data)
         ("Initialization complete, notifying application. native_window:%p main_loop:%p",
         data->native_window, data->main_loop);
     data->initialized = TRUE;
-    (*env)->CallVoidMethod (env, data->app, on_gstreamer_initialized_method_id);
-    if ((*env)->ExceptionCheck (env)) {
-      GST_ERROR ("Failed to call Java method");
-      (*env)->ExceptionClear (env);
-    }
+    event = g_new0 (JniEvent, 1);
+    event->type = JNI_EVENT_INITIALIZED;
+    post_jni_event (data, event);
+  }
+}
+
+
+
+
+
+/*
+ * Frame tap: an appsink branch on the tee that lends mapped frames to Java.
+ * The buffers stay owned by their pool until Java hands them back, so no
+ * pixel is copied on the way.
+ */
+static GstFlowReturn
+tap_new_sample (GstAppSink * sink, gpointer user_data)
+{
+  GstAhc *ahc = (GstAhc *) user_data;
+  GstSample *sample = gst_app_sink_pull_sample (sink);
+  JniEvent *event;
+  gint i;
+
+  if (sample == NULL)
+    return GST_FLOW_EOS;
+
+  g_mutex_lock (&ahc->tap_lock);
+  for (i = 0; i < TAP_MAX_FRAMES && ahc->tap_frames[i].sample; i++);
+  if (i == TAP_MAX_FRAMES) {
+    /* Java still holds every slot, it is too slow for this rate */
+    ahc->tap_dropped++;
+    g_mutex_unlock (&ahc->tap_lock);
+    gst_sample_unref (sample);
+    return GST_FLOW_OK;
+  }
+  if (!gst_buffer_map (gst_sample_get_buffer (sample), &ahc->tap_frames[i].map,
+          GST_MAP_READ)) {
+    g_mutex_unlock (&ahc->tap_lock);
+    gst_sample_unref (sample);
+    return GST_FLOW_OK;
+  }
+  ahc->tap_frames[i].sample = sample;
+  g_mutex_unlock (&ahc->tap_lock);
+
+  event = g_new0 (JniEvent, 1);
+  event->type = JNI_EVENT_FRAME;
+  event->frame = i;
+  post_jni_event (ahc, event);
+
+  return GST_FLOW_OK;
+}
+
+/* Empty slot @id; when @sample is given, only while the slot still holds
+ * it, since Java may have released it and the tap filled it again. */
+static void
+release_tap_frame (GstAhc * ahc, gint id, GstSample * sample)
+{
+  TapFrame *frame;
+
+  if (id < 0 || id >= TAP_MAX_FRAMES)
+    return;
+
+  g_mutex_lock (&ahc->tap_lock);
+  frame = &ahc->tap_frames[id];
+  if (frame->sample && (!sample || frame->sample == sample)) {
+    gst_buffer_unmap (gst_sample_get_buffer (frame->sample), &frame->map);
+    gst_sample_unref (frame->sample);
+    frame->sample = NULL;
   }
+  g_mutex_unlock (&ahc->tap_lock);
+}
+
+/* vidsink reports how late each frame reached it upstream in its QoS
+ * events */
+static GstPadProbeReturn
+sink_qos_probe (GstPad * pad, GstPadProbeInfo * info, GstAhc * ahc)
+{
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+  GstClockTimeDiff diff;
+
+  if (GST_EVENT_TYPE (event) != GST_EVENT_QOS)
+    return GST_PAD_PROBE_OK;
+
+  gst_event_parse_qos (event, NULL, NULL, &diff, NULL);
+  __atomic_store_n (&ahc->sink_lateness, MAX (diff, 0), __ATOMIC_RELAXED);
+  if (diff > 0)
+    __atomic_add_fetch (&ahc->sink_late, 1, __ATOMIC_RELAXED);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+snapshot_impact_sample (GstAhc * ahc, SnapshotImpact * impact)
+{
+  impact->preview_dropped = queue_policy_dropped_total ("preview_queue");
+  impact->stream_dropped = queue_policy_dropped_total ("enc_queue");
+  impact->sink_late = __atomic_load_n (&ahc->sink_late, __ATOMIC_RELAXED);
+  impact->sink_lateness = __atomic_load_n (&ahc->sink_lateness,
+      __ATOMIC_RELAXED);
 }
 
+/* Keep @after as the last batch and add what changed since @before */
+static void
+snapshot_impact_record (GstAhc * ahc, const SnapshotImpact * before,
+    const SnapshotImpact * after)
+{
+  g_mutex_lock (&ahc->snap_lock);
+  ahc->snap_before = *before;
+  ahc->snap_after = *after;
+  ahc->snap_total.preview_dropped +=
+      after->preview_dropped - before->preview_dropped;
+  ahc->snap_total.stream_dropped +=
+      after->stream_dropped - before->stream_dropped;
+  ahc->snap_total.sink_late += after->sink_late - before->sink_late;
+  g_mutex_unlock (&ahc->snap_lock);
+}
+
+/*
+ * Still capture: a request arms a probe on the tee input, the next frame
+ * is referenced (not copied) and encoded to JPEG on a worker thread. Every
+ * request made before that frame arrives shares the same encode.
+ */
+static GstPadProbeReturn
+snapshot_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  GstAhc *ahc = (GstAhc *) user_data;
+  SnapshotJob *job;
+  GstCaps *caps;
+
+  if (!g_atomic_int_get (&ahc->snap_armed))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock (&ahc->snap_lock);
+  job = ahc->snap_pending;
+  ahc->snap_pending = NULL;
+  g_atomic_int_set (&ahc->snap_armed, 0);
+  g_mutex_unlock (&ahc->snap_lock);
 
+  if (job == NULL)
+    return GST_PAD_PROBE_OK;
 
+  snapshot_impact_sample (ahc, &job->before);
+  caps = gst_pad_get_current_caps (pad);
+  job->sample = gst_sample_new (GST_PAD_PROBE_INFO_BUFFER (info), caps, NULL,
+      NULL);
+  if (caps)
+    gst_caps_unref (caps);
+  g_thread_pool_push (ahc->snap_pool, job, NULL);
 
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+post_snapshot_result (GstAhc * ahc, const gchar * path, gboolean ok)
+{
+  JniEvent *event = g_new0 (JniEvent, 1);
+
+  event->type = JNI_EVENT_SNAPSHOT;
+  event->message = g_strdup (path);
+  event->ok = ok;
+  post_jni_event (ahc, event);
+}
+
+static void
+snapshot_encode (gpointer data, gpointer user_data)
+{
+  SnapshotJob *job = (SnapshotJob *) data;
+  GstAhc *ahc = (GstAhc *) user_data;
+  GstCaps *jpeg_caps;
+  GstSample *jpeg;
+  GstMapInfo map;
+  GError *err = NULL;
+  gint64 start = g_get_monotonic_time ();
+  SnapshotImpact after;
+  gboolean ok = FALSE;
+  guint i;
+
+  jpeg_caps = gst_caps_new_empty_simple ("image/jpeg");
+  jpeg = gst_video_convert_sample (job->sample, jpeg_caps, 5 * GST_SECOND,
+      &err);
+  gst_caps_unref (jpeg_caps);
+
+  if (jpeg == NULL) {
+    GST_ERROR ("Snapshot encode failed: %s", err ? err->message : "unknown");
+    g_clear_error (&err);
+  } else if (gst_buffer_map (gst_sample_get_buffer (jpeg), &map,
+          GST_MAP_READ)) {
+    ok = TRUE;
+    g_mutex_lock (&ahc->snap_lock);
+    ahc->snap_encodes++;
+    ahc->snap_last_encode_us = g_get_monotonic_time () - start;
+    g_mutex_unlock (&ahc->snap_lock);
+    GST_DEBUG ("Snapshot of %u request(s) encoded in %" G_GINT64_FORMAT
+        " us, %" G_GINT64_FORMAT " us after the first request",
+        job->paths->len, g_get_monotonic_time () - start,
+        g_get_monotonic_time () - job->requested);
+
+    for (i = 0; i < job->paths->len; i++) {
+      const gchar *path = g_ptr_array_index (job->paths, i);
+
+      post_snapshot_result (ahc, path,
+          g_file_set_contents (path, (const gchar *) map.data, map.size,
+              NULL));
+    }
+    gst_buffer_unmap (gst_sample_get_buffer (jpeg), &map);
+  }
+
+  if (!ok)
+    for (i = 0; i < job->paths->len; i++)
+      post_snapshot_result (ahc, g_ptr_array_index (job->paths, i), FALSE);
+
+  /* from the frame taken to the files written */
+  snapshot_impact_sample (ahc, &after);
+  snapshot_impact_record (ahc, &job->before, &after);
+
+  if (jpeg)
+    gst_sample_unref (jpeg);
+  gst_sample_unref (job->sample);
+  g_ptr_array_unref (job->paths);
+  g_free (job);
+}
+
+static void
+collect_snapshot_metrics (StreamMetricsScrape * scrape, GstAhc * ahc)
+{
+  guint64 requests, encodes;
+  gint64 last;
+  SnapshotImpact before, after, total;
+
+  g_mutex_lock (&ahc->snap_lock);
+  requests = ahc->snap_requests;
+  encodes = ahc->snap_encodes;
+  last = ahc->snap_last_encode_us;
+  before = ahc->snap_before;
+  after = ahc->snap_after;
+  total = ahc->snap_total;
+  g_mutex_unlock (&ahc->snap_lock);
+
+  stream_metrics_emit (scrape, "snapshot_requests_total", "counter",
+      "Still capture requests", NULL, requests);
+  stream_metrics_emit (scrape, "snapshot_encodes_total", "counter",
+      "JPEG encodes done for still capture requests", NULL, encodes);
+  stream_metrics_emit (scrape, "snapshot_encode_seconds", "gauge",
+      "Duration of the last still capture encode", NULL,
+      (gdouble) last / G_USEC_PER_SEC);
+
+  /* the live streams around the batches */
+  stream_metrics_emit (scrape, "snapshot_queue_dropped_total", "counter",
+      "Buffers the live queues dropped while a snapshot batch ran",
+      "queue=\"preview_queue\"", total.preview_dropped);
+  stream_metrics_emit (scrape, "snapshot_queue_dropped_total", "counter",
+      NULL, "queue=\"enc_queue\"", total.stream_dropped);
+  stream_metrics_emit (scrape, "snapshot_sink_late_total", "counter",
+      "Frames the preview sink rendered late while a snapshot batch ran",
+      NULL, total.sink_late);
+  stream_metrics_emit (scrape, "snapshot_queue_dropped", "gauge",
+      "Buffers the live queues had dropped, around the last snapshot batch",
+      "queue=\"preview_queue\",when=\"before\"", before.preview_dropped);
+  stream_metrics_emit (scrape, "snapshot_queue_dropped", "gauge", NULL,
+      "queue=\"preview_queue\",when=\"after\"", after.preview_dropped);
+  stream_metrics_emit (scrape, "snapshot_queue_dropped", "gauge", NULL,
+      "queue=\"enc_queue\",when=\"before\"", before.stream_dropped);
+  stream_metrics_emit (scrape, "snapshot_queue_dropped", "gauge", NULL,
+      "queue=\"enc_queue\",when=\"after\"", after.stream_dropped);
+  stream_metrics_emit (scrape, "snapshot_sink_lateness_seconds", "gauge",
+      "Lateness of the preview sink, around the last snapshot batch",
+      "when=\"before\"", (gdouble) before.sink_lateness / GST_SECOND);
+  stream_metrics_emit (scrape, "snapshot_sink_lateness_seconds", "gauge",
+      NULL, "when=\"after\"", (gdouble) after.sink_lateness / GST_SECOND);
+}
 
 /* called when a new media pipeline is prepared. */
 static void
@@ -304,12 +896,117 @@ media_prepared (GstRTSPMedia *media, GstAhc *     user_data)
 
 
 
+/* called once the media is prepared, its rtpbin sessions exist by now */
+static void
+media_prepared_metrics (GstRTSPMedia * media, GstAhc * ahc)
+{
+  guint i;
+
+  for (i = 0; i < gst_rtsp_media_n_streams (media); i++) {
+    GstRTSPStream *stream = gst_rtsp_media_get_stream (media, i);
+    GObject *session = gst_rtsp_stream_get_rtpsession (stream);
+    gchar *labels;
+
+    labels = g_strdup_printf ("pipeline=\"rtsp\",stream=\"%u\"", i);
+    stream_metrics_add_entry (ahc->metrics, STREAM_METRICS_ROLE_RTP_SESSION,
+        session, labels);
+    g_free (labels);
+    g_object_unref (session);
+  }
+}
+
+static GstRTSPFilterResult
+remove_client (GstRTSPServer * server, GstRTSPClient * client,
+    gpointer user_data)
+{
+  return GST_RTSP_FILTER_REMOVE;
+}
+
+static GstRTSPFilterResult
+remove_session (GstRTSPSessionPool * pool, GstRTSPSession * session,
+    gpointer user_data)
+{
+  return GST_RTSP_FILTER_REMOVE;
+}
+
+/* Close every client and session and unprepare every media, so no
+ * streaming thread runs into the helpers freed after this. The server
+ * itself stays for the metrics collector until the metrics are freed. */
+static void
+rtsp_server_stop (GstAhc * ahc)
+{
+  GstRTSPMountPoints *mounts;
+  GstRTSPSessionPool *pool;
+  GPtrArray *prepared;
+  guint i;
+
+  if (!ahc->server)
+    return;
+  if (ahc->server_source) {
+    g_source_destroy (ahc->server_source);
+    g_source_unref (ahc->server_source);
+    ahc->server_source = NULL;
+  }
+  mounts = gst_rtsp_server_get_mount_points (ahc->server);
+  if (ahc->mount)
+    gst_rtsp_mount_points_remove_factory (mounts, ahc->mount);
+  g_object_unref (mounts);
+
+  gst_rtsp_server_client_filter (ahc->server, remove_client, NULL);
+  pool = gst_rtsp_server_get_session_pool (ahc->server);
+  gst_rtsp_session_pool_filter (pool, remove_session, NULL);
+  g_object_unref (pool);
+
+  /* the shared media prepared for a DESCRIBE has no session; "unprepared"
+   * takes the lock, so unprepare from a stolen array */
+  g_mutex_lock (&ahc->medias_lock);
+  prepared = ahc->medias;
+  ahc->medias = g_ptr_array_new_with_free_func (g_object_unref);
+  g_mutex_unlock (&ahc->medias_lock);
+  for (i = 0; i < prepared->len; i++) {
+    GstRTSPMedia *media = g_ptr_array_index (prepared, i);
+
+    if (gst_rtsp_media_get_status (media) != GST_RTSP_MEDIA_STATUS_UNPREPARED)
+      gst_rtsp_media_unprepare (media);
+  }
+  g_ptr_array_unref (prepared);
+}
+
+static void
+client_closed (GstRTSPClient * client, GstAhc * ahc)
+{
+  g_atomic_int_add (&ahc->n_clients, -1);
+}
+
+static void
+client_connected (GstRTSPServer * server, GstRTSPClient * client, GstAhc * ahc)
+{
+  g_atomic_int_inc (&ahc->n_clients);
+  g_signal_connect (client, "closed", (GCallback) client_closed, ahc);
+}
+
+static void
+collect_server_metrics (StreamMetricsScrape * scrape, GstAhc * ahc)
+{
+  GstRTSPSessionPool *pool = gst_rtsp_server_get_session_pool (ahc->server);
+
+  stream_metrics_emit (scrape, "rtsp_sessions", "gauge",
+      "Active RTSP sessions", NULL, gst_rtsp_session_pool_get_n_sessions (pool));
+  stream_metrics_emit (scrape, "rtsp_clients", "gauge",
+      "Connected RTSP clients", NULL, g_atomic_int_get (&ahc->n_clients));
+  g_object_unref (pool);
+}
+
 static void on_media_unprepared (GstRTSPMedia *media, GstAhc *     user_data)
 
 {
 
 g_print("Stream Removed !! \n \n");
 
+  g_mutex_lock (&user_data->medias_lock);
+  g_ptr_array_remove_fast (user_data->medias, media);
+  g_mutex_unlock (&user_data->medias_lock);
+
 
 }
 
@@ -326,43 +1023,153 @@ media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media,
 
     user_data->vfilter2 = gst_bin_get_by_name_recurse_up (GST_BIN (rtsp_pipeline), "filter2");
 
+    queue_policy_apply_specs (rtsp_pipeline, (gchar **) queue_policies);
+    {
+      GstElement *encoder =
+          gst_bin_get_by_name (GST_BIN (rtsp_pipeline), "encoder");
+
+      /* first, so the frames it holds back are never traced nor encoded */
+      static_throttle_attach (user_data->throttle, encoder);
+      /* each camera's encoder gets its share of the cores */
+      cpu_affinity_spread_encoder (encoder, user_data->index,
+          g_atomic_int_get (&n_instances));
+      encoder_control_attach (user_data->encoder_control, encoder);
+      roi_encoder_attach (user_data->roi, encoder);
+      gst_object_unref (encoder);
+    }
+    pipeline_trace_attach (rtsp_pipeline, "rtsp");
+    stream_metrics_watch_pipeline (user_data->metrics, rtsp_pipeline, "rtsp");
+    g_signal_connect (media, "prepared", (GCallback) media_prepared_metrics,
+        user_data);
 
 
     g_signal_connect (media, "prepared", (GCallback) media_prepared,
            user_data);
 
     g_signal_connect ( media, "unprepared", (GCallback) on_media_unprepared, user_data);
+    g_mutex_lock (&user_data->medias_lock);
+    g_ptr_array_add (user_data->medias, g_object_ref (media));
+    g_mutex_unlock (&user_data->medias_lock);
 
 }
 
-static void *
-app_function (void *userdata)
+/* Log the startup phases once both targets are reached */
+static void
+startup_report (GstAhc * ahc)
 {
-  JavaVMAttachArgs args;
-  GstBus *bus;
-  GstMessage *msg;
-  GstAhc *ahc = (GstAhc *) userdata;
-  GSource *bus_source;
-  GMainContext *context;
+  gdouble preview_ms, rtsp_ms;
+  gchar *summary;
 
+  preview_ms = startup_timer_get_ms (ahc->startup, "first-preview-frame");
+  rtsp_ms = startup_timer_get_ms (ahc->startup, "rtsp-ready");
+  if (preview_ms < 0 || rtsp_ms < 0 ||
+      !g_atomic_int_compare_and_exchange (&ahc->startup_reported, 0, 1))
+    return;
 
-  GST_DEBUG ("Creating pipeline in GstAhc at %p", ahc);
-  GError *err = NULL;
-  /* create our own GLib Main Context, so we do not interfere with other libraries using GLib */
-  context = g_main_context_new ();
+  summary = startup_timer_summary (ahc->startup);
+  g_print ("startup: %s\n", summary);
+  g_free (summary);
+  if (preview_ms > STARTUP_PREVIEW_BUDGET_MS)
+    GST_WARNING ("first preview frame after %.0f ms, budget %d ms",
+        preview_ms, STARTUP_PREVIEW_BUDGET_MS);
+  if (rtsp_ms > STARTUP_RTSP_BUDGET_MS)
+    GST_WARNING ("RTSP ready after %.0f ms, budget %d ms", rtsp_ms,
+        STARTUP_RTSP_BUDGET_MS);
+}
 
+static GstPadProbeReturn
+first_frame_probe (GstPad * pad, GstPadProbeInfo * info, GstAhc * ahc)
+{
+  startup_timer_mark (ahc->startup, "first-preview-frame");
+  startup_report (ahc);
+  return GST_PAD_PROBE_REMOVE;
+}
 
-  ahc->vsink = gst_element_factory_make ("glimagesink", "vsink");
-//  ahc->filter = gst_element_factory_make ("capsfilter", NULL);
+/* Load the plugins of the RTSP media ahead of the first client */
+static gpointer
+startup_preload_thread (GstAhc * ahc)
+{
+  startup_timer_begin (ahc->startup, "plugins");
+  plugin_preload_load (rtsp_factories);
+  startup_timer_end (ahc->startup, "plugins");
 
+  return NULL;
+}
 
-   global_clock = gst_ntp_clock_new ("pool", "se.pool.ntp.org", 123, 0);
+/* Serve the mount once the server listens and the clock exists, so no
+ * client gets a media without the shared clock */
+static void
+rtsp_server_mount (GstAhc * ahc)
+{
+  if (!ahc->server_source || !ahc->clock_ready || ahc->mount)
+    return;
+
+  gst_rtsp_media_factory_set_clock (ahc->factory, global_clock);
+  /* the first camera keeps the /test url, the others are /cam<n> */
+  ahc->mount = ahc->index == 0 ? g_strdup ("/test") :
+      g_strdup_printf ("/cam%u", ahc->index);
+  gst_rtsp_mount_points_add_factory (ahc->mounts, ahc->mount,
+      g_object_ref (ahc->factory));
+  /* don't need the ref to the mapper anymore */
+  g_object_unref (ahc->mounts);
+  ahc->mounts = NULL;
+
+  startup_timer_mark (ahc->startup, "rtsp-ready");
+  /* start serving */
+  g_print ("stream ready at rtsp://127.0.0.1:%u%s\n",
+      RTSP_PORT + ahc->index, ahc->mount);
+  startup_report (ahc);
+}
+
+static gboolean
+startup_clock_ready (GstAhc * ahc)
+{
+  ahc->clock_ready = TRUE;
+  rtsp_server_mount (ahc);
+  return G_SOURCE_REMOVE;
+}
+
+/* The NTP clock resolves its server before it returns; done here it does
+ * not hold back the preview */
+static gpointer
+startup_clock_thread (GstAhc * ahc)
+{
+  GSource *source;
+
+  startup_timer_begin (ahc->startup, "clock");
+  /* every camera of the process shares one clock */
+  g_mutex_lock (&instances_lock);
+  if (!global_clock)
+    global_clock = gst_ntp_clock_new ("pool", "se.pool.ntp.org", 123, 0);
+  g_mutex_unlock (&instances_lock);
+  startup_timer_end (ahc->startup, "clock");
+
+  /* Wait for the clock to stabilise */
+  // gst_clock_wait_for_sync (global_clock, GST_CLOCK_TIME_NONE);
+
+  /* not g_main_context_invoke(), which may run it right here while the
+   * app thread does not run its loop yet */
+  source = g_idle_source_new ();
+  g_source_set_callback (source, (GSourceFunc) startup_clock_ready, ahc,
+      NULL);
+  g_source_attach (source, ahc->context);
+  g_source_unref (source);
+  return NULL;
+}
 
-    /* Wait for the clock to stabilise */
-   // gst_clock_wait_for_sync (global_clock, GST_CLOCK_TIME_NONE);
+/* Runs from the main loop, after Java was told the preview can start */
+static gboolean
+start_rtsp_server (GstAhc * ahc)
+{
+  GError *error = NULL;
+  gchar *launch, *service, *metrics_address;
 
+  startup_timer_begin (ahc->startup, "server");
     /* create a server instance */
    ahc->server = gst_rtsp_server_new ();
+   service = g_strdup_printf ("%u", RTSP_PORT + ahc->index);
+   gst_rtsp_server_set_service (ahc->server, service);
+   g_free (service);
     /* get the mount points for this server, every server has a default object
    * that be used to map uri mount points to media factories */
    ahc->mounts= gst_rtsp_server_get_mount_points (ahc->server);
@@ -376,52 +1183,179 @@ app_function (void *userdata)
     /*this profile ensures quicker re-syncing but streams cant be played by vlc of ffplay. */// I added this to fix audio/video lag in viewfinder version. but it did not work
     //gst_rtsp_media_factory_set_profiles (ahc->factory, GST_RTSP_PROFILE_AVPF);
 
+/*
+ * gst_rtsp_media_factory_set_launch should be conditioned on the playing state of the pipeline. I think, Study this !
+ *
+ * */
+   // if (ahc->state == GST_STATE_PLAYING)
+    launch = g_strdup_printf ("(  intervideosrc do-timestamp=true channel=%s ! videoscale  !  videoconvert ! video/x-raw, framerate=25/1 ! capsfilter name=filter2  ! queue name=enc_queue  ! x264enc name=encoder tune=zerolatency  qp-min=18 qp-max=30 speed-preset=superfast bitrate=800  !  rtph264pay name=pay0 pt=96 config-interval=-1  openslessrc  ! queue name=audio_queue ! audioconvert ! audio/x-raw, channels=1, depth=16, width=16, rate=16000 ! rtpL16pay name=pay1 pt=11  )", ahc->channel);
+    gst_rtsp_media_factory_set_launch ( ahc->factory, launch);
+    g_free (launch);
 
-    /* NULL will force pipeline to run as fast as possible without any clock*/
-    gst_pipeline_use_clock((GstPipeline*)ahc->pipeline,global_clock);
-    //gst_element_set_start_time (ahc->pipeline, GST_CLOCK_TIME_NONE);
+    //intervideosrc channel=liveling videotestsrc pattern=18
+    //gst_rtsp_media_factory_set_launch ( ahc->factory, "( ahcsrc ! videoconvert ! videoscale ! video/x-raw,width=(int)640,height=(int)360,format=(string)I420 ! x264enc tune=zerolatency !  rtph264pay name=pay0 pt=96 )");
 
+    /* notify when our media is ready, This is called whenever someone asks for
+   * the media and a new pipeline with our appsrc is created */
+   g_signal_connect (ahc->factory, "media-configure", (GCallback) media_configure, ahc);
+    gst_rtsp_media_factory_set_shared (ahc->factory, TRUE);
+    gst_rtsp_media_factory_set_media_gtype (ahc->factory, TEST_TYPE_RTSP_MEDIA);
+
+    /* attach the server to the default maincontext */
+    //gst_rtsp_server_attach (ahc->server, context);
+    ahc->server_source = gst_rtsp_server_create_source (ahc->server, NULL,
+        &error);
+    if (!ahc->server_source) {
+      GST_ERROR ("Failed to start the RTSP server: %s", error->message);
+      g_clear_error (&error);
+    } else {
+      g_source_attach (ahc->server_source, ahc->context);
+    }
 
+    g_signal_connect (ahc->server, "client-connected",
+        (GCallback) client_connected, ahc);
+    stream_metrics_add_collector (ahc->metrics,
+        (StreamMetricsCollectFunc) collect_server_metrics, ahc);
+    stream_metrics_add_collector (ahc->metrics, queue_policy_collect_metrics,
+        NULL);
+    stream_metrics_add_collector (ahc->metrics,
+        (StreamMetricsCollectFunc) collect_snapshot_metrics, ahc);
+    stream_metrics_add_collector (ahc->metrics,
+        motion_detector_collect_metrics, ahc->motion);
+    stream_metrics_add_collector (ahc->metrics, roi_encoder_collect_metrics,
+        ahc->roi);
+    stream_metrics_add_collector (ahc->metrics,
+        static_throttle_collect_metrics, ahc->throttle);
+    stream_metrics_add_collector (ahc->metrics,
+        encoder_control_collect_metrics, ahc->encoder_control);
+    stream_metrics_add_collector (ahc->metrics,
+        startup_timer_collect_metrics, ahc->startup);
+    metrics_address = g_strdup_printf ("127.0.0.1:%u",
+        METRICS_PORT + ahc->index);
+    if (!stream_metrics_listen (ahc->metrics, metrics_address, &error)) {
+      GST_ERROR ("Failed to serve metrics: %s", error->message);
+      g_clear_error (&error);
+    }
+    g_free (metrics_address);
+  startup_timer_end (ahc->startup, "server");
 
+  rtsp_server_mount (ahc);
+  return G_SOURCE_REMOVE;
+}
 
+static void *
+app_function (void *userdata)
+{
+  GstBus *bus;
+  GstAhc *ahc = (GstAhc *) userdata;
+  GSource *bus_source, *idle_source;
+  GMainContext *context;
+  gchar *launch;
+
+
+  GST_DEBUG ("Creating pipeline in GstAhc at %p", ahc);
+  GError *err = NULL;
+  ahc->startup = startup_timer_new ();
+  /* create our own GLib Main Context, so we do not interfere with other libraries using GLib */
+  context = g_main_context_new ();
+  ahc->context = context;
+  /* the metrics endpoint attaches its sources to the thread-default context */
+  g_main_context_push_thread_default (context);
+  ahc->metrics = stream_metrics_new ();
+
+  /* the clock and the RTSP plugins are needed only once the server starts,
+   * get them ready while the capture pipeline is built */
+  ahc->clock_thread = g_thread_new ("startup-clock",
+      (GThreadFunc) startup_clock_thread, ahc);
+  ahc->preload_thread = g_thread_new ("startup-preload",
+      (GThreadFunc) startup_preload_thread, ahc);
 
+    //gst_element_set_start_time (ahc->pipeline, GST_CLOCK_TIME_NONE);
 
-    ahc->pipeline= gst_parse_launch( " ahcsrc name=camera !  videoscale ! videoconvert ! video/x-raw, framerate=30/1 ! capsfilter name=filter1 caps=video/x-raw,width=960,height=540 ! tee name=t ! queue  ! glimagesink name=vidsink t. ! intervideosink  channel=liveling  sync=false  ", &err );
+    startup_timer_begin (ahc->startup, "pipeline");
+    launch = g_strdup_printf (" ahcsrc name=camera !  videoscale ! videoconvert ! video/x-raw, framerate=30/1 ! capsfilter name=filter1 caps=video/x-raw,width=960,height=540 ! tee name=t ! queue name=preview_queue ! glimagesink name=vidsink t. ! intervideosink  channel=%s  sync=false  t. ! queue name=tap_queue ! valve name=tapvalve drop=true ! videorate name=taprate drop-only=true max-rate=5 ! videoscale ! capsfilter name=tapfilter caps=video/x-raw,width=320,height=180 ! appsink name=tap max-buffers=1 drop=true sync=false  t. ! queue name=motion_queue ! fakesink name=motion sync=false async=false ", ahc->channel);
+    ahc->pipeline= gst_parse_launch( launch, &err );
+    g_free (launch);
 
 
     if (err) {
         g_print("Unable to build pipeline: %s", err->message);
         g_clear_error (&err);
 
+        /* the startup threads use the timer and the context */
+        g_thread_join (ahc->clock_thread);
+        g_thread_join (ahc->preload_thread);
+        ahc->clock_thread = ahc->preload_thread = NULL;
+        if (ahc->pipeline)
+          gst_object_unref (ahc->pipeline);
+        ahc->pipeline = NULL;
+        stream_metrics_free (ahc->metrics);
+        ahc->metrics = NULL;
+        g_main_context_pop_thread_default (context);
+        g_main_context_unref (context);
+        ahc->context = NULL;
+        startup_timer_free (ahc->startup);
+        ahc->startup = NULL;
+
         return 0;
     }
     else {
 
         ahc->vsink=gst_bin_get_by_name(GST_BIN(ahc->pipeline), "vidsink");
         ahc->ahcsrc=gst_bin_get_by_name(GST_BIN(ahc->pipeline), "camera");
+        if (ahc->camera_id >= 0) {
+          gchar *device = g_strdup_printf ("%d", ahc->camera_id);
+
+          g_object_set (ahc->ahcsrc, "device", device, NULL);
+          g_free (device);
+        }
         ahc->vfilter1=gst_bin_get_by_name(GST_BIN(ahc->pipeline), "filter1");
+        ahc->tap_valve=gst_bin_get_by_name(GST_BIN(ahc->pipeline), "tapvalve");
+        ahc->tap_rate=gst_bin_get_by_name(GST_BIN(ahc->pipeline), "taprate");
+        ahc->tap_filter=gst_bin_get_by_name(GST_BIN(ahc->pipeline), "tapfilter");
+        ahc->tap_sink=gst_bin_get_by_name(GST_BIN(ahc->pipeline), "tap");
+        {
+          GstAppSinkCallbacks tap_callbacks = { NULL, NULL, tap_new_sample };
+          GstElement *tee = gst_bin_get_by_name (GST_BIN (ahc->pipeline), "t");
+          GstPad *tee_sink = gst_element_get_static_pad (tee, "sink");
+
+          gst_pad_add_probe (tee_sink, GST_PAD_PROBE_TYPE_BUFFER,
+              snapshot_probe, ahc, NULL);
+          gst_object_unref (tee_sink);
+          gst_object_unref (tee);
+
+          gst_app_sink_set_callbacks (GST_APP_SINK (ahc->tap_sink),
+              &tap_callbacks, ahc, NULL);
+        }
+        {
+          GstPad *vsink_pad = gst_element_get_static_pad (ahc->vsink, "sink");
+
+          gst_pad_add_probe (vsink_pad, GST_PAD_PROBE_TYPE_BUFFER,
+              (GstPadProbeCallback) first_frame_probe, ahc, NULL);
+          gst_pad_add_probe (vsink_pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM,
+              (GstPadProbeCallback) sink_qos_probe, ahc, NULL);
+          gst_object_unref (vsink_pad);
+        }
+        {
+          GstElement *motion_sink =
+              gst_bin_get_by_name (GST_BIN (ahc->pipeline), "motion");
+
+          ahc->motion = motion_detector_attach (motion_sink, MOTION_BUDGET_US);
+          ahc->roi = roi_encoder_new (ROI_DELTA_QP);
+          roi_encoder_set_motion (ahc->roi, ahc->motion);
+          ahc->throttle = static_throttle_new (ahc->motion, STATIC_HOLD_MS, 0);
+          ahc->encoder_control = encoder_control_new ();
+          gst_object_unref (motion_sink);
+        }
+        queue_policy_apply_specs (ahc->pipeline, (gchar **) queue_policies);
+        pipeline_trace_attach (ahc->pipeline, "capture");
+        stream_metrics_watch_pipeline (ahc->metrics, ahc->pipeline, "capture");
         //gst_element_set_state(ahc->pipeline, GST_STATE_PLAYING);
          g_print("\n Playing !!!!!!! \n");
 
     }
 
 
-
-/*
- * gst_rtsp_media_factory_set_launch should be conditioned on the playing state of the pipeline. I think, Study this !
- *
- * */
-   // if (ahc->state == GST_STATE_PLAYING)
-    gst_rtsp_media_factory_set_launch ( ahc->factory, "(  intervideosrc do-timestamp=true channel=liveling ! videoscale  !  videoconvert ! video/x-raw, framerate=25/1 ! capsfilter name=filter2  ! queue leaky=downstream  ! x264enc name=encoder tune=zerolatency  qp-min=18 qp-max=30 speed-preset=superfast bitrate=800  !  rtph264pay name=pay0 pt=96  openslessrc  ! queue  ! audioconvert ! audio/x-raw, channels=1, depth=16, width=16, rate=16000 ! rtpL16pay name=pay1 pt=11  )");
-
-    //intervideosrc channel=liveling videotestsrc pattern=18
-    //gst_rtsp_media_factory_set_launch ( ahc->factory, "( ahcsrc ! videoconvert ! videoscale ! video/x-raw,width=(int)640,height=(int)360,format=(string)I420 ! x264enc tune=zerolatency !  rtph264pay name=pay0 pt=96 )");
-
-    /* notify when our media is ready, This is called whenever someone asks for
-   * the media and a new pipeline with our appsrc is created */
-   g_signal_connect (ahc->factory, "media-configure", (GCallback) media_configure, ahc);
-
-
   if (ahc->native_window) {
     GST_DEBUG ("Native window already received, notifying the vsink about it.");
     gst_video_overlay_set_window_handle (GST_VIDEO_OVERLAY (ahc->vsink),
@@ -440,30 +1374,19 @@ app_function (void *userdata)
   g_signal_connect (G_OBJECT (bus), "message::eos", (GCallback) eos_cb, ahc);
   g_signal_connect (G_OBJECT (bus), "message::state-changed",
       (GCallback) state_changed_cb, ahc);
+  g_signal_connect (G_OBJECT (bus), "message::element",
+      (GCallback) motion_cb, ahc);
   gst_object_unref (bus);
+  startup_timer_end (ahc->startup, "pipeline");
 
-    gst_rtsp_media_factory_set_shared (ahc->factory, TRUE);
-    gst_rtsp_media_factory_set_media_gtype (ahc->factory, TEST_TYPE_RTSP_MEDIA);
-    gst_rtsp_media_factory_set_clock (ahc->factory, global_clock);
-
-
-    /* attach the test factory to the /test url */
-    gst_rtsp_mount_points_add_factory (ahc->mounts, "/test", ahc->factory);
-
-    /* don't need the ref to the mapper anymore */
-    g_object_unref (ahc->mounts);
-
-    /* attach the server to the default maincontext */
-    //gst_rtsp_server_attach (ahc->server, context);
-    GError *error=NULL;
-    GSource *gsource;
-    gsource = gst_rtsp_server_create_source (ahc->server, NULL, &error);
-    g_source_attach(gsource, context);
-
-
+  /* the server starts once the loop runs, and is mounted when the clock
+   * thread is done */
+  idle_source = g_idle_source_new ();
+  g_source_set_callback (idle_source, (GSourceFunc) start_rtsp_server, ahc,
+      NULL);
+  g_source_attach (idle_source, context);
+  g_source_unref (idle_source);
 
-    /* start serving */
-    g_print ("stream ready at rtsp://127.0.0.1:8554/test\n");
   /* Create a GLib Main Loop and set it to run */
   GST_DEBUG ("Entering main loop... (GstAhc:%p)", ahc);
   ahc->main_loop = g_main_loop_new (context, FALSE);
@@ -483,14 +1406,44 @@ app_function (void *userdata)
 
 
   /* Free resources */
-  g_source_unref(gsource);
+  g_thread_join (ahc->clock_thread);
+  g_thread_join (ahc->preload_thread);
+  /* the media and the clients use the helpers freed below */
+  rtsp_server_stop (ahc);
+  if (ahc->mounts)
+    g_object_unref (ahc->mounts);
+  if (ahc->factory)
+    g_object_unref (ahc->factory);
+  g_free (ahc->mount);
+  g_main_context_pop_thread_default (context);
   g_main_context_unref (context);
+  ahc->context = NULL;
   gst_element_set_state (ahc->pipeline, GST_STATE_NULL);
   gst_object_unref (ahc->vsink);
   gst_object_unref (ahc->vfilter1);
   gst_object_unref (ahc->vfilter2);
   gst_object_unref (ahc->ahcsrc);
+  gst_object_unref (ahc->tap_valve);
+  gst_object_unref (ahc->tap_rate);
+  gst_object_unref (ahc->tap_filter);
+  gst_object_unref (ahc->tap_sink);
   gst_object_unref (ahc->pipeline);
+  /* its probes on the capture pipeline are gone with the NULL state */
+  stream_metrics_free (ahc->metrics);
+  ahc->metrics = NULL;
+  if (ahc->server)
+    g_object_unref (ahc->server);
+  ahc->server = NULL;
+  static_throttle_free (ahc->throttle);
+  ahc->throttle = NULL;
+  encoder_control_free (ahc->encoder_control);
+  ahc->encoder_control = NULL;
+  roi_encoder_free (ahc->roi);
+  ahc->roi = NULL;
+  motion_detector_free (ahc->motion);
+  ahc->motion = NULL;
+  startup_timer_free (ahc->startup);
+  ahc->startup = NULL;
 
   return NULL;
 }
@@ -498,31 +1451,123 @@ app_function (void *userdata)
 /*
  * Java Bindings
  */
-void
-gst_native_init (JNIEnv * env, jobject thiz)
+
+/* Take the lowest free camera slot, or -1 when all are in use */
+static gint
+instance_index_acquire (void)
 {
-  GstAhc *data = (GstAhc *) g_malloc0 (sizeof (GstAhc));
+  gint index = -1, i;
+
+  g_mutex_lock (&instances_lock);
+  for (i = 0; i < MAX_INSTANCES; i++) {
+    if (!(instances_used & (1u << i))) {
+      instances_used |= 1u << i;
+      g_atomic_int_inc (&n_instances);
+      index = i;
+      break;
+    }
+  }
+  g_mutex_unlock (&instances_lock);
 
+  return index;
+}
+
+static void
+instance_index_release (guint index)
+{
+  g_mutex_lock (&instances_lock);
+  instances_used &= ~(1u << index);
+  g_atomic_int_add (&n_instances, -1);
+  g_mutex_unlock (&instances_lock);
+}
+
+/* One GstAhc per camera; each runs its pipelines, RTSP server and metrics
+ * endpoint on its own thread */
+static void
+native_init (JNIEnv * env, jobject thiz, gint camera_id)
+{
+  GstAhc *data;
+  gint index = instance_index_acquire ();
+
+  if (index < 0) {
+    GST_ERROR ("Already %d cameras open", MAX_INSTANCES);
+    return;
+  }
+
+  data = (GstAhc *) g_malloc0 (sizeof (GstAhc));
+  data->index = index;
+  data->camera_id = camera_id;
+  data->channel = index == 0 ? g_strdup ("liveling") :
+      g_strdup_printf ("liveling%d", index);
   SET_CUSTOM_DATA (env, thiz, native_android_camera_field_id, data);
   GST_DEBUG ("Created GstAhc at %p", data);
   data->app = (*env)->NewGlobalRef (env, thiz);
   GST_DEBUG ("Created GlobalRef for app object at %p", data->app);
-  pthread_create (&gst_app_thread, NULL, &app_function, data);
+  g_mutex_init (&data->tap_lock);
+  g_mutex_init (&data->snap_lock);
+  g_mutex_init (&data->medias_lock);
+  data->medias = g_ptr_array_new_with_free_func (g_object_unref);
+  /* one encoder thread; snapshot batches are encoded one after the other */
+  data->snap_pool = g_thread_pool_new (snapshot_encode, data, 1, FALSE, NULL);
+  g_mutex_init (&data->jni_lock);
+  g_cond_init (&data->jni_cond);
+  data->jni_running = TRUE;
+  pthread_create (&data->jni_thread, NULL, &jni_dispatch_function, data);
+  pthread_create (&data->app_thread, NULL, &app_function, data);
+}
+
+void
+gst_native_init (JNIEnv * env, jobject thiz)
+{
+  native_init (env, thiz, -1);
+}
+
+/* Like nativeInit, capturing from Android camera @camera_id */
+void
+gst_native_init_camera (JNIEnv * env, jobject thiz, jint camera_id)
+{
+  native_init (env, thiz, camera_id);
 }
 
 void
 gst_native_finalize (JNIEnv * env, jobject thiz)
 {
   GstAhc *data = GET_CUSTOM_DATA (env, thiz, native_android_camera_field_id);
+  gint i;
 
   if (!data)
     return;
   GST_DEBUG ("Quitting main loop...");
   g_main_loop_quit (data->main_loop);
   GST_DEBUG ("Waiting for thread to finish...");
-  pthread_join (gst_app_thread, NULL);
+  pthread_join (data->app_thread, NULL);
+  GST_DEBUG ("Waiting for pending snapshots...");
+  g_thread_pool_free (data->snap_pool, FALSE, TRUE);
+  if (data->snap_pending) {
+    for (i = 0; i < data->snap_pending->paths->len; i++)
+      post_snapshot_result (data,
+          g_ptr_array_index (data->snap_pending->paths, i), FALSE);
+    g_ptr_array_unref (data->snap_pending->paths);
+    g_free (data->snap_pending);
+  }
+  g_mutex_clear (&data->snap_lock);
+  GST_DEBUG ("Waiting for pending Java callbacks...");
+  g_mutex_lock (&data->jni_lock);
+  data->jni_running = FALSE;
+  g_cond_signal (&data->jni_cond);
+  g_mutex_unlock (&data->jni_lock);
+  pthread_join (data->jni_thread, NULL);
+  for (i = 0; i < TAP_MAX_FRAMES; i++)
+    release_tap_frame (data, i, NULL);
+  g_mutex_clear (&data->tap_lock);
+  g_ptr_array_unref (data->medias);
+  g_mutex_clear (&data->medias_lock);
+  g_mutex_clear (&data->jni_lock);
+  g_cond_clear (&data->jni_cond);
   GST_DEBUG ("Deleting GlobalRef at %p", data->app);
   (*env)->DeleteGlobalRef (env, data->app);
+  instance_index_release (data->index);
+  g_free (data->channel);
   GST_DEBUG ("Freeing GstAhc at %p", data);
   g_free (data);
   SET_CUSTOM_DATA (env, thiz, native_android_camera_field_id, NULL);
@@ -569,6 +1614,32 @@ gst_class_init (JNIEnv * env, jclass klass)
       (*env)->GetMethodID (env, klass, "onStateChanged", "(I)V");
   GST_DEBUG ("The MethodID for the onStateChanged method is %p",
       on_state_changed_method_id);
+  /* optional, only needed by apps using the frame tap */
+  on_frame_available_method_id =
+      (*env)->GetMethodID (env, klass, "onFrameAvailable",
+      "(Ljava/nio/ByteBuffer;IIIIJ)V");
+  if ((*env)->ExceptionCheck (env))
+    (*env)->ExceptionClear (env);
+  GST_DEBUG ("The MethodID for the onFrameAvailable method is %p",
+      on_frame_available_method_id);
+  {
+    jclass byte_buffer = (*env)->FindClass (env, "java/nio/ByteBuffer");
+
+    if (byte_buffer) {
+      as_read_only_buffer_method_id =
+          (*env)->GetMethodID (env, byte_buffer, "asReadOnlyBuffer",
+          "()Ljava/nio/ByteBuffer;");
+      (*env)->DeleteLocalRef (env, byte_buffer);
+    }
+    if ((*env)->ExceptionCheck (env))
+      (*env)->ExceptionClear (env);
+  }
+  on_snapshot_method_id =
+      (*env)->GetMethodID (env, klass, "onSnapshot", "(Ljava/lang/String;Z)V");
+  if ((*env)->ExceptionCheck (env))
+    (*env)->ExceptionClear (env);
+  GST_DEBUG ("The MethodID for the onSnapshot method is %p",
+      on_snapshot_method_id);
 
   if (!native_android_camera_field_id || !on_error_method_id ||
       !on_gstreamer_initialized_method_id || !on_state_changed_method_id) {
@@ -671,6 +1742,52 @@ gst_native_change_resolution (JNIEnv * env, jobject thiz, jint width, jint heigh
   gst_element_set_state (ahc->pipeline, GST_STATE_PAUSED);
 }
 
+/* Retune the RTSP encoder in place, e.g. "bitrate=1200 speed-preset=fast",
+ * see encoder-control.h */
+jboolean
+gst_native_set_encoder_params (JNIEnv * env, jobject thiz, jstring params)
+{
+  GstAhc *ahc = GET_CUSTOM_DATA (env, thiz, native_android_camera_field_id);
+  const gchar *params_str;
+  GError *error = NULL;
+  gboolean ok;
+
+  if (!ahc || !ahc->encoder_control)
+    return JNI_FALSE;
+
+  params_str = (*env)->GetStringUTFChars (env, params, NULL);
+  ok = encoder_control_set (ahc->encoder_control, params_str, &error);
+  if (!ok) {
+    GST_WARNING ("Cannot retune encoder: %s", error->message);
+    g_clear_error (&error);
+  }
+  (*env)->ReleaseStringUTFChars (env, params, params_str);
+
+  return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+/* Encode time per frame before and after the last retune */
+jstring
+gst_native_encoder_report (JNIEnv * env, jobject thiz)
+{
+  GstAhc *ahc = GET_CUSTOM_DATA (env, thiz, native_android_camera_field_id);
+  gchar *current, *change, *report;
+  jstring result;
+
+  if (!ahc || !ahc->encoder_control)
+    return NULL;
+
+  current = encoder_control_get (ahc->encoder_control);
+  change = encoder_control_report (ahc->encoder_control);
+  report = g_strdup_printf ("%s\n%s", current, change);
+  result = (*env)->NewStringUTF (env, report);
+  g_free (report);
+  g_free (change);
+  g_free (current);
+
+  return result;
+}
+
 void
 gst_native_set_white_balance (JNIEnv * env, jobject thiz, jint wb_mode)
 {
@@ -699,8 +1816,144 @@ gst_native_set_rotate_method (JNIEnv * env, jobject thiz, jint method)
   g_print("Setting rotate-method (%d)\n", method) ;
 }
 
+/* Encode at @fps once the scene has been static for STATIC_HOLD_MS, and at
+ * full rate again on the first motion; 0, the default, turns it off. */
+void
+gst_native_set_static_fps (JNIEnv * env, jobject thiz, jint fps)
+{
+  GstAhc *ahc = GET_CUSTOM_DATA (env, thiz, native_android_camera_field_id);
+
+  if (!ahc || !ahc->throttle)
+    return;
+
+  static_throttle_set_fps (ahc->throttle, MAX (fps, 0));
+  GST_DEBUG ("Static frame rate set to %d fps", MAX (fps, 0));
+}
+
+/* Tracing covers the capture pipeline and every RTSP media configured
+ * after this call. */
+void
+gst_native_trace_start (JNIEnv * env, jobject thiz)
+{
+  GstAhc *ahc = GET_CUSTOM_DATA (env, thiz, native_android_camera_field_id);
+
+  pipeline_trace_enable ();
+  if (ahc && ahc->pipeline)
+    pipeline_trace_attach (ahc->pipeline, "capture");
+}
+
+/* Writes <prefix>.txt (summary table) and <prefix>.json (Chrome trace). */
+jboolean
+gst_native_trace_report (JNIEnv * env, jobject thiz, jstring prefix)
+{
+  const gchar *prefix_str;
+  gchar *path;
+  FILE *f;
+  GError *error = NULL;
+  jboolean ret = JNI_FALSE;
+
+  prefix_str = (*env)->GetStringUTFChars (env, prefix, NULL);
+
+  path = g_strdup_printf ("%s.txt", prefix_str);
+  f = fopen (path, "w");
+  if (f) {
+    pipeline_trace_report (f);
+    fclose (f);
+  } else {
+    GST_ERROR ("Could not open %s", path);
+  }
+  g_free (path);
+
+  path = g_strdup_printf ("%s.json", prefix_str);
+  if (f && pipeline_trace_write_chrome (path, &error)) {
+    ret = JNI_TRUE;
+  } else if (error) {
+    GST_ERROR ("Failed to write trace: %s", error->message);
+    g_clear_error (&error);
+  }
+  g_free (path);
+
+  (*env)->ReleaseStringUTFChars (env, prefix, prefix_str);
+  return ret;
+}
+
+/* Start lending frames of @width x @height to onFrameAvailable at no more
+ * than @fps frames per second. Calling it again retunes the running tap. */
+void
+gst_native_tap_start (JNIEnv * env, jobject thiz, jint width, jint height,
+    jint fps)
+{
+  GstAhc *ahc = GET_CUSTOM_DATA (env, thiz, native_android_camera_field_id);
+  GstCaps *caps;
+
+  if (!ahc || !ahc->tap_valve)
+    return;
+
+  caps = gst_caps_new_simple ("video/x-raw",
+      "width", G_TYPE_INT, width, "height", G_TYPE_INT, height, NULL);
+  g_object_set (ahc->tap_filter, "caps", caps, NULL);
+  gst_caps_unref (caps);
+  g_object_set (ahc->tap_rate, "max-rate", MAX (1, fps), NULL);
+  g_object_set (ahc->tap_valve, "drop", FALSE, NULL);
+  GST_DEBUG ("Frame tap started at %dx%d, %d fps", width, height, fps);
+}
+
+void
+gst_native_tap_stop (JNIEnv * env, jobject thiz)
+{
+  GstAhc *ahc = GET_CUSTOM_DATA (env, thiz, native_android_camera_field_id);
+
+  if (!ahc || !ahc->tap_valve)
+    return;
+
+  g_object_set (ahc->tap_valve, "drop", TRUE, NULL);
+  GST_DEBUG ("Frame tap stopped, %" G_GUINT64_FORMAT
+      " frames dropped while Java held every slot", ahc->tap_dropped);
+}
+
+/* Hand a frame from onFrameAvailable back; its ByteBuffer must not be
+ * touched afterwards. */
+void
+gst_native_release_frame (JNIEnv * env, jobject thiz, jint id)
+{
+  GstAhc *ahc = GET_CUSTOM_DATA (env, thiz, native_android_camera_field_id);
+
+  if (!ahc)
+    return;
+
+  release_tap_frame (ahc, id, NULL);
+}
+
+/* Write the next camera frame to @path as JPEG without pausing the stream.
+ * Completion is reported through onSnapshot(path, ok). */
+void
+gst_native_snapshot (JNIEnv * env, jobject thiz, jstring path)
+{
+  GstAhc *ahc = GET_CUSTOM_DATA (env, thiz, native_android_camera_field_id);
+  const gchar *path_str;
+
+  if (!ahc)
+    return;
+
+  path_str = (*env)->GetStringUTFChars (env, path, NULL);
+
+  g_mutex_lock (&ahc->snap_lock);
+  if (ahc->snap_pending == NULL) {
+    ahc->snap_pending = g_new0 (SnapshotJob, 1);
+    ahc->snap_pending->paths = g_ptr_array_new_with_free_func (g_free);
+    ahc->snap_pending->requested = g_get_monotonic_time ();
+  }
+  g_ptr_array_add (ahc->snap_pending->paths, g_strdup (path_str));
+  ahc->snap_requests++;
+  g_atomic_int_set (&ahc->snap_armed, 1);
+  g_mutex_unlock (&ahc->snap_lock);
+
+  (*env)->ReleaseStringUTFChars (env, path, path_str);
+}
+
 static JNINativeMethod native_methods[] = {
   {"nativeInit", "()V", (void *) gst_native_init},
+  {"nativeInitCamera", "(I)V", (void *) gst_native_init_camera},
   {"nativeFinalize", "()V", (void *) gst_native_finalize},
   {"nativePlay", "()V", (void *) gst_native_play},
   {"nativePause", "()V", (void *) gst_native_pause},
@@ -711,10 +1964,22 @@ static JNINativeMethod native_methods[] = {
       (void *) gst_native_surface_finalize},
   {"nativeChangeResolution", "(II)V",
       (void *) gst_native_change_resolution},
+  {"nativeSetEncoderParams", "(Ljava/lang/String;)Z",
+      (void *) gst_native_set_encoder_params},
+  {"nativeEncoderReport", "()Ljava/lang/String;",
+      (void *) gst_native_encoder_report},
   {"nativeSetRotateMethod", "(I)V",
       (void *) gst_native_set_rotate_method},
   {"nativeSetWhiteBalance", "(I)V",
-      (void *) gst_native_set_white_balance}
+      (void *) gst_native_set_white_balance},
+  {"nativeSetStaticFps", "(I)V", (void *) gst_native_set_static_fps},
+  {"nativeSnapshot", "(Ljava/lang/String;)V", (void *) gst_native_snapshot},
+  {"nativeTapStart", "(III)V", (void *) gst_native_tap_start},
+  {"nativeTapStop", "()V", (void *) gst_native_tap_stop},
+  {"nativeReleaseFrame", "(I)V", (void *) gst_native_release_frame},
+  {"nativeTraceStart", "()V", (void *) gst_native_trace_start},
+  {"nativeTraceReport", "(Ljava/lang/String;)Z",
+      (void *) gst_native_trace_report}
 };
 
 jint
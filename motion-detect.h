@@ -0,0 +1,471 @@
+/* Tiny-luma motion detection for the capture tee
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage, on a branch of the capture tee:
+ *
+ *   t. ! queue name=motion_queue ! fakesink name=motion sync=false async=false
+ *
+ *   motion_detector_attach (fakesink, 2000);
+ *
+ * Every frame is point-sampled straight from its Y plane into a 160x90 luma
+ * image, no videoscale or videoconvert involved; packed RGB input has luma
+ * computed for the sampled pixels only. The image is compared
+ * against a running background in 16x10 blocks with SSE2 / NEON SAD
+ * kernels, and a "motion" element message is posted on the bus:
+ *
+ *   motion, active=(boolean), activity=(double), mean-diff=(double),
+ *           cols=(int)10, rows=(int)9, mask=(uint)< row bitmasks >,
+ *           x=(int), y=(int), width=(int), height=(int)
+ *
+ * on every start and stop of motion and at most every MOTION_POST_INTERVAL
+ * while it lasts; x/y/width/height bound the active blocks in frame pixels.
+ * When a frame costs more than the budget, following frames are skipped
+ * until the average cost fits again.
+ */
+
+#ifndef __MOTION_DETECT_H__
+#define __MOTION_DETECT_H__
+
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#define MOTION_USE_NEON 1
+#endif
+
+G_BEGIN_DECLS
+
+#define MOTION_WIDTH   160
+#define MOTION_HEIGHT  90
+#define MOTION_BLOCK_W 16
+#define MOTION_BLOCK_H 10
+#define MOTION_COLS    (MOTION_WIDTH / MOTION_BLOCK_W)
+#define MOTION_ROWS    (MOTION_HEIGHT / MOTION_BLOCK_H)
+
+/* mean absolute difference per pixel for a block to count as moving */
+#define MOTION_BLOCK_THRESHOLD 14
+/* share of moving blocks to enter / leave the active state */
+#define MOTION_START_ACTIVITY  0.02
+#define MOTION_STOP_ACTIVITY   0.01
+#define MOTION_POST_INTERVAL   (200 * GST_MSECOND)
+
+typedef struct
+{
+  guint8 cur[MOTION_WIDTH * MOTION_HEIGHT] __attribute__ ((aligned (16)));
+  guint8 bg[MOTION_WIDTH * MOTION_HEIGHT] __attribute__ ((aligned (16)));
+  guint sad[MOTION_ROWS * MOTION_COLS];
+  guint32 mask[MOTION_ROWS];
+
+  GstElement *element;
+  GstVideoInfo info;
+  gboolean have_info;
+  gboolean rgb;
+  guint x_offset[MOTION_WIDTH];
+  guint y_offset[MOTION_HEIGHT];
+
+  gboolean have_bg;
+  gboolean active;
+  gint shared_active;
+  gint64 last_motion_us;
+  gint64 last_analysed_us;
+  gdouble activity;
+  gdouble mean_diff;
+  GstClockTime last_post;
+
+  /* per-frame cost control */
+  gint64 budget_us;
+  gint64 cost_avg_us;
+  guint skip;
+  guint skipped_in_row;
+  guint64 analysed;
+  guint64 skipped;
+} MotionDetector;
+
+/*
+ * Kernels
+ */
+
+/* SAD of one MOTION_BLOCK_W x MOTION_BLOCK_H block, rows MOTION_WIDTH apart */
+static inline guint
+motion_block_sad (const guint8 * a, const guint8 * b)
+{
+  guint y;
+#if defined (__SSE2__)
+  __m128i acc = _mm_setzero_si128 ();
+
+  for (y = 0; y < MOTION_BLOCK_H; y++) {
+    __m128i va = _mm_load_si128 ((const __m128i *) (a + y * MOTION_WIDTH));
+    __m128i vb = _mm_load_si128 ((const __m128i *) (b + y * MOTION_WIDTH));
+
+    acc = _mm_add_epi64 (acc, _mm_sad_epu8 (va, vb));
+  }
+  return _mm_cvtsi128_si32 (acc) + _mm_cvtsi128_si32 (_mm_srli_si128 (acc, 8));
+#elif defined (MOTION_USE_NEON)
+  uint16x8_t acc = vdupq_n_u16 (0);
+  uint64x2_t sum;
+
+  for (y = 0; y < MOTION_BLOCK_H; y++)
+    acc = vpadalq_u8 (acc, vabdq_u8 (vld1q_u8 (a + y * MOTION_WIDTH),
+            vld1q_u8 (b + y * MOTION_WIDTH)));
+  sum = vpaddlq_u32 (vpaddlq_u16 (acc));
+  return vgetq_lane_u64 (sum, 0) + vgetq_lane_u64 (sum, 1);
+#else
+  guint x, sad = 0;
+
+  for (y = 0; y < MOTION_BLOCK_H; y++)
+    for (x = 0; x < MOTION_BLOCK_W; x++)
+      sad += ABS ((gint) a[y * MOTION_WIDTH + x] - b[y * MOTION_WIDTH + x]);
+  return sad;
+#endif
+}
+
+/* bg = 7/8 bg + 1/8 cur, as three rounding averages */
+static inline void
+motion_update_background (guint8 * bg, const guint8 * cur)
+{
+  guint i;
+#if defined (__SSE2__)
+  for (i = 0; i < MOTION_WIDTH * MOTION_HEIGHT; i += 16) {
+    __m128i b = _mm_load_si128 ((const __m128i *) (bg + i));
+    __m128i c = _mm_load_si128 ((const __m128i *) (cur + i));
+
+    c = _mm_avg_epu8 (b, _mm_avg_epu8 (b, _mm_avg_epu8 (b, c)));
+    _mm_store_si128 ((__m128i *) (bg + i), c);
+  }
+#elif defined (MOTION_USE_NEON)
+  for (i = 0; i < MOTION_WIDTH * MOTION_HEIGHT; i += 16) {
+    uint8x16_t b = vld1q_u8 (bg + i);
+    uint8x16_t c = vld1q_u8 (cur + i);
+
+    c = vrhaddq_u8 (b, vrhaddq_u8 (b, vrhaddq_u8 (b, c)));
+    vst1q_u8 (bg + i, c);
+  }
+#else
+  for (i = 0; i < MOTION_WIDTH * MOTION_HEIGHT; i++) {
+    guint c = cur[i];
+
+    c = (bg[i] + c + 1) >> 1;
+    c = (bg[i] + c + 1) >> 1;
+    bg[i] = (bg[i] + c + 1) >> 1;
+  }
+#endif
+}
+
+/*
+ * Analysis
+ */
+static void
+motion_detector_set_caps (MotionDetector * md, GstCaps * caps)
+{
+  const GstVideoFormatInfo *finfo;
+  guint i;
+
+  md->have_info = gst_video_info_from_caps (&md->info, caps);
+  if (!md->have_info)
+    return;
+
+  finfo = md->info.finfo;
+  md->rgb = GST_VIDEO_FORMAT_INFO_IS_RGB (finfo);
+  if ((!md->rgb && !GST_VIDEO_FORMAT_INFO_IS_YUV (finfo)) ||
+      (md->rgb && (GST_VIDEO_FORMAT_INFO_N_PLANES (finfo) != 1 ||
+              GST_VIDEO_FORMAT_INFO_BITS (finfo) != 8))) {
+    GST_WARNING ("motion detection needs YUV or packed RGB input, got %s",
+        GST_VIDEO_FORMAT_INFO_NAME (finfo));
+    md->have_info = FALSE;
+    return;
+  }
+
+  for (i = 0; i < MOTION_WIDTH; i++)
+    md->x_offset[i] = (i * GST_VIDEO_INFO_WIDTH (&md->info) / MOTION_WIDTH) *
+        GST_VIDEO_FORMAT_INFO_PSTRIDE (finfo, 0);
+  for (i = 0; i < MOTION_HEIGHT; i++)
+    md->y_offset[i] = i * GST_VIDEO_INFO_HEIGHT (&md->info) / MOTION_HEIGHT;
+
+  md->have_bg = FALSE;
+}
+
+static void
+motion_detector_sample_luma (MotionDetector * md, GstVideoFrame * frame)
+{
+  const guint8 *y_plane = GST_VIDEO_FRAME_COMP_DATA (frame, 0);
+  gint stride = GST_VIDEO_FRAME_COMP_STRIDE (frame, 0);
+  guint x, y;
+
+  if (md->rgb) {
+    /* packed RGB: BT.601 luma of the sampled pixels only */
+    const guint8 *g_plane = GST_VIDEO_FRAME_COMP_DATA (frame, 1);
+    const guint8 *b_plane = GST_VIDEO_FRAME_COMP_DATA (frame, 2);
+
+    for (y = 0; y < MOTION_HEIGHT; y++) {
+      guint row = md->y_offset[y] * stride;
+      guint8 *out = md->cur + y * MOTION_WIDTH;
+
+      for (x = 0; x < MOTION_WIDTH; x++) {
+        guint off = row + md->x_offset[x];
+
+        out[x] = (77 * y_plane[off] + 150 * g_plane[off] +
+            29 * b_plane[off]) >> 8;
+      }
+    }
+    return;
+  }
+
+  for (y = 0; y < MOTION_HEIGHT; y++) {
+    const guint8 *row = y_plane + md->y_offset[y] * stride;
+    guint8 *out = md->cur + y * MOTION_WIDTH;
+
+    for (x = 0; x < MOTION_WIDTH; x++)
+      out[x] = row[md->x_offset[x]];
+  }
+}
+
+static void
+motion_detector_post (MotionDetector * md, GstClockTime ts)
+{
+  GValue mask = G_VALUE_INIT, v = G_VALUE_INIT;
+  gint x0 = MOTION_COLS, y0 = MOTION_ROWS, x1 = -1, y1 = -1, r, c;
+  gint bw = GST_VIDEO_INFO_WIDTH (&md->info) / MOTION_COLS;
+  gint bh = GST_VIDEO_INFO_HEIGHT (&md->info) / MOTION_ROWS;
+  GstStructure *s;
+
+  g_value_init (&mask, GST_TYPE_ARRAY);
+  g_value_init (&v, G_TYPE_UINT);
+  for (r = 0; r < MOTION_ROWS; r++) {
+    g_value_set_uint (&v, md->mask[r]);
+    gst_value_array_append_value (&mask, &v);
+    for (c = 0; c < MOTION_COLS; c++) {
+      if (md->mask[r] & (1u << c)) {
+        x0 = MIN (x0, c);
+        x1 = MAX (x1, c);
+        y0 = MIN (y0, r);
+        y1 = MAX (y1, r);
+      }
+    }
+  }
+  g_value_unset (&v);
+
+  if (x1 < 0) {
+    /* empty mask, report an empty box at the origin */
+    x0 = y0 = 0;
+    x1 = y1 = -1;
+  }
+
+  s = gst_structure_new ("motion",
+      "active", G_TYPE_BOOLEAN, md->active,
+      "activity", G_TYPE_DOUBLE, md->activity,
+      "mean-diff", G_TYPE_DOUBLE, md->mean_diff,
+      "cols", G_TYPE_INT, MOTION_COLS, "rows", G_TYPE_INT, MOTION_ROWS,
+      "x", G_TYPE_INT, x0 * bw, "y", G_TYPE_INT, y0 * bh,
+      "width", G_TYPE_INT, (x1 - x0 + 1) * bw,
+      "height", G_TYPE_INT, (y1 - y0 + 1) * bh,
+      "timestamp", G_TYPE_UINT64, ts, NULL);
+  gst_structure_take_value (s, "mask", &mask);
+
+  gst_element_post_message (md->element,
+      gst_message_new_element (GST_OBJECT (md->element), s));
+  md->last_post = ts;
+}
+
+static void
+motion_detector_analyse (MotionDetector * md, GstClockTime ts)
+{
+  guint r, c, moving = 0;
+  guint64 total = 0;
+  gboolean was_active = md->active;
+
+  if (!md->have_bg) {
+    memcpy (md->bg, md->cur, sizeof (md->bg));
+    md->have_bg = TRUE;
+    return;
+  }
+
+  for (r = 0; r < MOTION_ROWS; r++) {
+    guint32 row_mask = 0;
+
+    for (c = 0; c < MOTION_COLS; c++) {
+      guint off = r * MOTION_BLOCK_H * MOTION_WIDTH + c * MOTION_BLOCK_W;
+      guint sad = motion_block_sad (md->cur + off, md->bg + off);
+
+      md->sad[r * MOTION_COLS + c] = sad;
+      total += sad;
+      if (sad > MOTION_BLOCK_THRESHOLD * MOTION_BLOCK_W * MOTION_BLOCK_H) {
+        row_mask |= 1u << c;
+        moving++;
+      }
+    }
+    g_atomic_int_set (&md->mask[r], row_mask);
+  }
+  motion_update_background (md->bg, md->cur);
+
+  __atomic_store_n (&md->last_analysed_us, g_get_monotonic_time (),
+      __ATOMIC_RELAXED);
+  if (moving > 0)
+    __atomic_store_n (&md->last_motion_us, md->last_analysed_us,
+        __ATOMIC_RELAXED);
+  md->activity = (gdouble) moving / (MOTION_ROWS * MOTION_COLS);
+  md->mean_diff = (gdouble) total / (MOTION_WIDTH * MOTION_HEIGHT);
+
+  if (md->activity >= MOTION_START_ACTIVITY)
+    md->active = TRUE;
+  else if (md->activity < MOTION_STOP_ACTIVITY)
+    md->active = FALSE;
+  g_atomic_int_set (&md->shared_active, md->active);
+
+  if (md->active != was_active || (md->active &&
+          (!GST_CLOCK_TIME_IS_VALID (md->last_post) ||
+              !GST_CLOCK_TIME_IS_VALID (ts) ||
+              ts >= md->last_post + MOTION_POST_INTERVAL)))
+    motion_detector_post (md, ts);
+}
+
+static GstPadProbeReturn
+motion_detector_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  MotionDetector *md = user_data;
+  GstVideoFrame frame;
+  GstBuffer *buffer;
+  gint64 start;
+
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+
+    if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS) {
+      GstCaps *caps;
+
+      gst_event_parse_caps (event, &caps);
+      motion_detector_set_caps (md, caps);
+    }
+    return GST_PAD_PROBE_OK;
+  }
+
+  if (!md->have_info)
+    return GST_PAD_PROBE_OK;
+
+  if (md->skipped_in_row < md->skip) {
+    md->skipped_in_row++;
+    __atomic_add_fetch (&md->skipped, 1, __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_OK;
+  }
+  md->skipped_in_row = 0;
+
+  buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  start = g_get_monotonic_time ();
+  if (!gst_video_frame_map (&frame, &md->info, buffer, GST_MAP_READ))
+    return GST_PAD_PROBE_OK;
+  motion_detector_sample_luma (md, &frame);
+  gst_video_frame_unmap (&frame);
+
+  motion_detector_analyse (md, GST_BUFFER_PTS (buffer));
+  __atomic_add_fetch (&md->analysed, 1, __ATOMIC_RELAXED);
+
+  /* keep the average cost per analysed frame under the budget by skipping
+   * frames, and come back to every frame once there is headroom */
+  md->cost_avg_us = (md->cost_avg_us * 7 + (g_get_monotonic_time () - start))
+      / 8;
+  if (md->cost_avg_us > md->budget_us && md->skip < 8)
+    md->skip++;
+  else if (md->cost_avg_us < md->budget_us / 2 && md->skip > 0)
+    md->skip--;
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Copy the block mask of the last analysed frame into @mask, from any
+ * thread. Returns FALSE, with an empty mask, while no motion is detected. */
+static gboolean G_GNUC_UNUSED
+motion_detector_get_mask (MotionDetector * md, guint32 mask[MOTION_ROWS])
+{
+  gboolean active = g_atomic_int_get (&md->shared_active);
+  guint r;
+
+  for (r = 0; r < MOTION_ROWS; r++)
+    mask[r] = active ? (guint32) g_atomic_int_get (&md->mask[r]) : 0;
+
+  return active;
+}
+
+/* Time since any block last moved, from any thread. 0 while no frame was
+ * analysed in the last second, as a stalled analysis proves nothing. */
+static gint64 G_GNUC_UNUSED
+motion_detector_quiet_us (MotionDetector * md)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if (now - __atomic_load_n (&md->last_analysed_us, __ATOMIC_RELAXED) >
+      G_USEC_PER_SEC)
+    return 0;
+  return now - __atomic_load_n (&md->last_motion_us, __ATOMIC_RELAXED);
+}
+
+/* Analyse every buffer reaching @sink, typically a fakesink at the end of a
+ * tee branch, within @budget_us per frame. Messages are posted from @sink.
+ * Free with motion_detector_free() once the pipeline is back in NULL. */
+static MotionDetector * G_GNUC_UNUSED
+motion_detector_attach (GstElement * sink, gint64 budget_us)
+{
+  MotionDetector *md;
+  GstPad *pad;
+
+  md = g_malloc0 (sizeof (MotionDetector));
+  md->element = sink;
+  md->budget_us = budget_us;
+  md->last_post = GST_CLOCK_TIME_NONE;
+  md->last_motion_us = g_get_monotonic_time ();
+
+  pad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      motion_detector_probe, md, NULL);
+  gst_object_unref (pad);
+
+  return md;
+}
+
+static void G_GNUC_UNUSED
+motion_detector_free (MotionDetector * md)
+{
+  g_free (md);
+}
+
+#ifdef __STREAM_METRICS_H__
+static void G_GNUC_UNUSED
+motion_detector_collect_metrics (StreamMetricsScrape * scrape,
+    gpointer user_data)
+{
+  MotionDetector *md = user_data;
+
+  stream_metrics_emit (scrape, "motion_active", "gauge",
+      "Whether motion is currently detected", NULL, md->active);
+  stream_metrics_emit (scrape, "motion_activity", "gauge",
+      "Share of moving blocks in the last analysed frame", NULL,
+      md->activity);
+  stream_metrics_emit (scrape, "motion_cost_seconds", "gauge",
+      "Average analysis cost per frame", NULL, md->cost_avg_us / 1e6);
+  stream_metrics_emit (scrape, "motion_frames_total", "counter",
+      "Frames analysed for motion", "result=\"analysed\"",
+      __atomic_load_n (&md->analysed, __ATOMIC_RELAXED));
+  stream_metrics_emit (scrape, "motion_frames_total", "counter",
+      "Frames analysed for motion", "result=\"skipped\"",
+      __atomic_load_n (&md->skipped, __ATOMIC_RELAXED));
+}
+#endif
+
+G_END_DECLS
+
+#endif /* __MOTION_DETECT_H__ */
@@ -18,12 +18,165 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#include <math.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
 #include <gst/gst.h>
+#include <glib-unix.h>
 
 #include <gst/net/gstnettimeprovider.h>
 #include <gst/rtsp-server/rtsp-server.h>
+#include <gst/app/gstappsink.h>
+
+#include "pipeline-trace.h"
+#include "stream-metrics.h"
+#include "queue-policy.h"
+#include "motion-detect.h"
+#include "roi-encode.h"
+#include "static-throttle.h"
+#include "encoder-control.h"
+#include "cpu-affinity.h"
+#include "startup-timing.h"
+#include "plugin-preload.h"
+#include "rtsp-client-stats.h"
+#include "admission-control.h"
+
+/* One capture source: its capture pipeline feeds an intervideo channel that
+ * the RTSP media of its mount reads. Source 0 carries the motion analytics
+ * that ROI encoding, static throttling and encoder control act upon. */
+typedef struct
+{
+  guint index;
+  gchar *name;
+  gchar *channel;
+  gchar *mount;
+  gchar *launch;
+  const gchar *encoder_props;
+  GstElement *pipeline;
+  guint restart_id;
+  guint restarts;
+  gint64 playing_since;
+} CaptureSource;
+
+#define CAPTURE_RESTART_MAX_SECONDS 16
+
+/* frame size of the /mosaic mount, divided into a grid of tiles */
+#define MOSAIC_WIDTH 1280
+#define MOSAIC_HEIGHT 720
 
 GstClock *global_clock;
+static GPtrArray *sources;
+static PluginPreload preload;
+static StartupTimer *startup;
+static StreamMetrics *metrics;
+static MotionDetector *motion;
+static RoiEncoder *roi;
+static StaticThrottle *throttle;
+static EncoderControl *encoder_control;
+static RtspClientStats *client_stats;
+static AdmissionControl *admission;
+static gint n_clients;
+/* medias not unprepared yet, they use the helpers above */
+static GMutex medias_lock;
+static GPtrArray *medias;
+
+static gchar *trace_prefix = NULL;
+static gchar *metrics_address = NULL;
+static gchar **queue_policies = NULL;
+static gchar **roi_rects = NULL;
+static gboolean roi_motion = FALSE;
+static gint roi_qp = 8;
+static gboolean roi_pixelate = FALSE;
+static gint roi_bench_frames = 0;
+static gint static_fps = 0;
+static gchar *control_address = NULL;
+static gchar **source_specs = NULL;
+static gint test_sources = 0;
+static gchar **encoder_specs = NULL;
+static gboolean mosaic = FALSE;
+static gint mosaic_bench_sources = 0;
+static gint client_log_seconds = 0;
+static gdouble max_egress_mbps = 0;
+static gint max_load_percent = 0;
+static gchar *redirect_url = NULL;
+
+/* elements every configuration uses, preloaded with --fast-start */
+static const gchar *server_factories[] = {
+  "tee", "queue", "videoconvert", "videoscale", "videorate", "capsfilter",
+  "intervideosink", "intervideosrc", "fakesink", "x264enc", "rtph264pay",
+  "rtpbin", NULL
+};
+
+/* applied first, --queue-policy entries for the same queue override them;
+ * the capture and encoder queues block as they always did, only the motion
+ * analysis gives way so it never holds back the tee */
+static const gchar *default_queue_policies[] = {
+  "stream_queue=block",
+  "preview_queue=block",
+  "motion_queue=leak-oldest:80",
+  "enc_queue=block",
+  NULL
+};
+
+static GOptionEntry entries[] = {
+  {"trace", 0, 0, G_OPTION_ARG_STRING, &trace_prefix,
+      "Trace the capture and RTSP pipelines; SIGUSR1 or exit writes "
+        "PREFIX.txt (summary) and PREFIX.json (Chrome trace)", "PREFIX"},
+  {"metrics", 0, 0, G_OPTION_ARG_STRING, &metrics_address,
+      "Serve Prometheus metrics on [HOST:]PORT or unix:PATH", "ADDRESS"},
+  {"queue-policy", 0, 0, G_OPTION_ARG_STRING_ARRAY, &queue_policies,
+        "Set a queue policy: block, leak-oldest, leak-newest or keyframe, "
+        "with an optional max latency (repeatable)", "NAME=POLICY[:MS]"},
+  {"roi", 0, 0, G_OPTION_ARG_STRING_ARRAY, &roi_rects,
+      "Encode a region of the stream at higher quality (repeatable)",
+        "X,Y,W,H"},
+  {"roi-motion", 0, 0, G_OPTION_ARG_NONE, &roi_motion,
+      "Encode moving regions at higher quality", NULL},
+  {"roi-qp", 0, 0, G_OPTION_ARG_INT, &roi_qp,
+      "QP difference between regions of interest and the rest (default 8)",
+        "QP"},
+  {"roi-pixelate", 0, 0, G_OPTION_ARG_NONE, &roi_pixelate,
+      "Pixelate the background for encoders without ROI support, such as "
+        "x264enc (lossy emulation)", NULL},
+  {"roi-bench", 0, 0, G_OPTION_ARG_INT, &roi_bench_frames,
+      "Encode FRAMES test frames with and without regions of interest, "
+        "print quality per bit and exit", "FRAMES"},
+  {"static-fps", 0, 0, G_OPTION_ARG_INT, &static_fps,
+      "Encode at FPS after 2 s without motion, full rate again on motion "
+        "(default 0, off)", "FPS"},
+  {"control", 0, 0, G_OPTION_ARG_STRING, &control_address,
+      "Accept encoder commands (get, set NAME=VALUE ..., report) and "
+        "clients, the RTSP client statistics, on [HOST:]PORT or unix:PATH",
+        "ADDRESS"},
+  {"source", 0, 0, G_OPTION_ARG_STRING_ARRAY, &source_specs,
+      "Capture from a launch line instead of the camera, served at /NAME "
+        "(repeatable)", "NAME=PIPELINE"},
+  {"test-sources", 0, 0, G_OPTION_ARG_INT, &test_sources,
+      "Add N live videotestsrc sources, served at /cam0 ... /camN-1", "N"},
+  {"encoder", 0, 0, G_OPTION_ARG_STRING_ARRAY, &encoder_specs,
+      "x264enc properties for the mount NAME, e.g. "
+        "cam1=\"bitrate=1200 speed-preset=fast\" (repeatable)", "NAME=PROPS"},
+  {"mosaic", 0, 0, G_OPTION_ARG_NONE, &mosaic,
+      "Also serve all sources as one grid at /mosaic", NULL},
+  {"mosaic-bench", 0, 0, G_OPTION_ARG_INT, &mosaic_bench_sources,
+      "Compare encoding 1 to N test sources as a mosaic and separately, "
+        "print the cost per frame and exit", "N"},
+  {"client-log", 0, 0, G_OPTION_ARG_INT, &client_log_seconds,
+      "Print the statistics of every RTSP client every SECONDS (default 0, "
+        "only when a client closes)", "SECONDS"},
+  {"max-egress", 0, 0, G_OPTION_ARG_DOUBLE, &max_egress_mbps,
+      "Refuse new RTSP sessions that would take the sent payload over MBPS "
+        "Mbit/s (default 0, no limit)", "MBPS"},
+  {"max-load", 0, 0, G_OPTION_ARG_INT, &max_load_percent,
+      "Refuse new RTSP sessions while the server uses more than PERCENT of "
+        "all cores (default 0, no limit)", "PERCENT"},
+  {"redirect", 0, 0, G_OPTION_ARG_STRING, &redirect_url,
+      "Redirect refused sessions to the same path on URL instead, e.g. "
+        "rtsp://host:8554", "URL"},
+  {NULL}
+};
 
 #define TEST_TYPE_RTSP_MEDIA_FACTORY      (test_rtsp_media_factory_get_type ())
 #define TEST_TYPE_RTSP_MEDIA              (test_rtsp_media_get_type ())
@@ -66,9 +219,750 @@ custom_setup_rtpbin (GstRTSPMedia * media, GstElement * rtpbin)
   return TRUE;
 }
 
+/* called when the media is prepared, its rtpbin sessions exist by now */
+static void
+media_prepared (GstRTSPMedia * media, gpointer user_data)
+{
+  guint i;
+
+  if (admission)
+    admission_control_watch_media (admission, media);
+
+  for (i = 0; metrics && i < gst_rtsp_media_n_streams (media); i++) {
+    GstRTSPStream *stream = gst_rtsp_media_get_stream (media, i);
+    GObject *session = gst_rtsp_stream_get_rtpsession (stream);
+    gchar *labels;
+
+    labels = g_strdup_printf ("pipeline=\"rtsp\",stream=\"%u\"", i);
+    stream_metrics_add_entry (metrics, STREAM_METRICS_ROLE_RTP_SESSION,
+        session, labels);
+    g_free (labels);
+    g_object_unref (session);
+  }
+}
+
+static void
+media_unprepared (GstRTSPMedia * media, gpointer user_data)
+{
+  g_mutex_lock (&medias_lock);
+  if (medias)
+    g_ptr_array_remove_fast (medias, media);
+  g_mutex_unlock (&medias_lock);
+}
+
+/* called when a new media pipeline is constructed, @source is NULL for the
+ * mosaic */
+static void
+media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media,
+    CaptureSource * source)
+{
+  GstElement *element = gst_rtsp_media_get_element (media);
+  GstElement *encoder = gst_bin_get_by_name (GST_BIN (element), "encoder");
+  guint n_encoders = sources->len + (mosaic ? 1 : 0);
+  gchar *label;
+
+  queue_policy_apply_specs (element, (gchar **) default_queue_policies);
+  queue_policy_apply_specs (element, queue_policies);
+  /* first, so the frames it holds back are never traced nor encoded */
+  if (throttle && source && source->index == 0)
+    static_throttle_attach (throttle, encoder);
+  label = g_strdup_printf ("rtsp-%s", source ? source->name : "mosaic");
+  pipeline_trace_attach (element, label);
+  /* the mosaic encoder takes the last share of the cores */
+  cpu_affinity_spread_encoder (encoder, source ? source->index : sources->len,
+      n_encoders);
+  if (source && source->index == 0) {
+    if (encoder_control)
+      encoder_control_attach (encoder_control, encoder);
+    if (roi)
+      roi_encoder_attach (roi, encoder);
+  }
+  gst_object_unref (encoder);
+  if (metrics)
+    stream_metrics_watch_pipeline (metrics, element, label);
+  g_free (label);
+  g_signal_connect (media, "prepared", (GCallback) media_prepared, NULL);
+  g_signal_connect (media, "unprepared", (GCallback) media_unprepared, NULL);
+  g_mutex_lock (&medias_lock);
+  g_ptr_array_add (medias, g_object_ref (media));
+  g_mutex_unlock (&medias_lock);
+  gst_object_unref (element);
+}
+
+static void
+client_closed (GstRTSPClient * client, gpointer user_data)
+{
+  g_atomic_int_add (&n_clients, -1);
+}
+
+static void
+client_connected (GstRTSPServer * server, GstRTSPClient * client,
+    gpointer user_data)
+{
+  g_atomic_int_inc (&n_clients);
+  g_signal_connect (client, "closed", (GCallback) client_closed, NULL);
+}
+
+static GstRTSPFilterResult
+remove_client (GstRTSPServer * server, GstRTSPClient * client,
+    gpointer user_data)
+{
+  return GST_RTSP_FILTER_REMOVE;
+}
+
+static GstRTSPFilterResult
+remove_session (GstRTSPSessionPool * pool, GstRTSPSession * session,
+    gpointer user_data)
+{
+  return GST_RTSP_FILTER_REMOVE;
+}
+
+/* Close every client and session and unprepare every media, so no
+ * streaming thread runs into the helpers freed after this. */
+static void
+stop_serving (GstRTSPServer * server, guint server_id)
+{
+  GstRTSPMountPoints *mounts = gst_rtsp_server_get_mount_points (server);
+  GstRTSPSessionPool *pool = gst_rtsp_server_get_session_pool (server);
+  GPtrArray *prepared;
+  guint i;
+
+  g_source_remove (server_id);
+  for (i = 0; i < sources->len; i++)
+    gst_rtsp_mount_points_remove_factory (mounts,
+        ((CaptureSource *) g_ptr_array_index (sources, i))->mount);
+  if (mosaic)
+    gst_rtsp_mount_points_remove_factory (mounts, "/mosaic");
+  g_object_unref (mounts);
+
+  gst_rtsp_server_client_filter (server, remove_client, NULL);
+  gst_rtsp_session_pool_filter (pool, remove_session, NULL);
+  g_object_unref (pool);
+
+  /* shared medias prepared for a DESCRIBE have no session; "unprepared"
+   * takes the lock, so unprepare from a stolen array */
+  g_mutex_lock (&medias_lock);
+  prepared = medias;
+  medias = g_ptr_array_new_with_free_func (g_object_unref);
+  g_mutex_unlock (&medias_lock);
+  for (i = 0; i < prepared->len; i++) {
+    GstRTSPMedia *media = g_ptr_array_index (prepared, i);
+
+    if (gst_rtsp_media_get_status (media) != GST_RTSP_MEDIA_STATUS_UNPREPARED)
+      gst_rtsp_media_unprepare (media);
+  }
+  g_ptr_array_unref (prepared);
+}
+
+/* "clients" on the control socket */
+static gchar *
+clients_command (const gchar * args, gpointer user_data)
+{
+  return rtsp_client_stats_query (user_data, "; ");
+}
+
+static void
+collect_server_metrics (StreamMetricsScrape * scrape, gpointer user_data)
+{
+  GstRTSPServer *server = user_data;
+  GstRTSPSessionPool *pool = gst_rtsp_server_get_session_pool (server);
+
+  stream_metrics_emit (scrape, "rtsp_sessions", "gauge",
+      "Active RTSP sessions", NULL, gst_rtsp_session_pool_get_n_sessions (pool));
+  stream_metrics_emit (scrape, "rtsp_clients", "gauge",
+      "Connected RTSP clients", NULL, g_atomic_int_get (&n_clients));
+  g_object_unref (pool);
+}
+
+static void
+write_trace_report (void)
+{
+  gchar *path;
+  FILE *f;
+  GError *error = NULL;
 
+  path = g_strdup_printf ("%s.txt", trace_prefix);
+  f = fopen (path, "w");
+  if (f) {
+    pipeline_trace_report (f);
+    fclose (f);
+  }
+  pipeline_trace_report (stdout);
+  g_free (path);
 
+  path = g_strdup_printf ("%s.json", trace_prefix);
+  if (!pipeline_trace_write_chrome (path, &error)) {
+    g_printerr ("Failed to write trace: %s\n", error->message);
+    g_clear_error (&error);
+  } else {
+    g_print ("trace written to %s.txt and %s\n", trace_prefix, path);
+  }
+  g_free (path);
+}
 
+static gboolean
+on_trace_report (gpointer user_data)
+{
+  write_trace_report ();
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+on_interrupt (gpointer user_data)
+{
+  g_main_loop_quit ((GMainLoop *) user_data);
+  return G_SOURCE_REMOVE;
+}
+
+/* Log how long startup took, once the first capture pipeline plays */
+static void
+startup_report (void)
+{
+  gchar *summary;
+
+  if (startup_timer_get_ms (startup, "first-pipeline-playing") >= 0)
+    return;
+
+  startup_timer_mark (startup, "first-pipeline-playing");
+  summary = startup_timer_summary (startup);
+  g_print ("startup (%s registry): %s\n", plugin_preload_describe (&preload),
+      summary);
+  g_free (summary);
+}
+
+/* Validate the registry cache and preload the elements of the configured
+ * pipelines */
+static void
+fast_start (void)
+{
+  GPtrArray *factories = g_ptr_array_new ();
+  const gchar **name;
+
+  for (name = server_factories; *name; name++)
+    g_ptr_array_add (factories, (gpointer) * name);
+  if (!source_specs && test_sources <= 0) {
+    g_ptr_array_add (factories, "avfvideosrc");
+    g_ptr_array_add (factories, "osxvideosink");
+  }
+  if (test_sources > 0)
+    g_ptr_array_add (factories, "videotestsrc");
+  if (mosaic)
+    g_ptr_array_add (factories, "compositor");
+  g_ptr_array_add (factories, NULL);
+
+  startup_timer_begin (startup, "registry");
+  plugin_preload_validate (&preload, (const gchar **) factories->pdata);
+  startup_timer_end (startup, "registry");
+  startup_timer_begin (startup, "preload");
+  plugin_preload_load ((const gchar **) factories->pdata);
+  startup_timer_end (startup, "preload");
+
+  g_ptr_array_unref (factories);
+}
+
+static gboolean
+capture_source_restart (CaptureSource * source)
+{
+  source->restart_id = 0;
+  g_print ("restarting source %s\n", source->name);
+  gst_element_set_state (source->pipeline, GST_STATE_PLAYING);
+  return G_SOURCE_REMOVE;
+}
+
+/* A failing source is stopped and restarted with a growing delay; the
+ * other sources and the RTSP sessions of its mount are left alone. The
+ * RTSP media keeps streaming the last frame of the channel meanwhile. */
+static void
+capture_source_failed (CaptureSource * source, GstMessage * message)
+{
+  GError *err = NULL;
+  guint delay;
+
+  if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR)
+    gst_message_parse_error (message, &err, NULL);
+  if (source->restart_id)
+    goto done;
+
+  /* a source that ran for a while starts over with a short delay */
+  if (source->playing_since &&
+      g_get_monotonic_time () - source->playing_since > 30 * G_USEC_PER_SEC)
+    source->restarts = 0;
+  source->playing_since = 0;
+  delay = MIN (1u << MIN (source->restarts, 4), CAPTURE_RESTART_MAX_SECONDS);
+  g_printerr ("source %s %s: %s, restarting in %u s\n", source->name,
+      err ? "failed" : "ended", err ? err->message : "end of stream", delay);
+  gst_element_set_state (source->pipeline, GST_STATE_NULL);
+  source->restarts++;
+  source->restart_id = g_timeout_add_seconds (delay,
+      (GSourceFunc) capture_source_restart, source);
+
+done:
+  g_clear_error (&err);
+}
+
+/* Restarts, and motion start / stop with the bounding box of the moving
+ * blocks */
+static gboolean
+capture_bus_cb (GstBus * bus, GstMessage * message, gpointer user_data)
+{
+  CaptureSource *source = user_data;
+  const GstStructure *s = gst_message_get_structure (message);
+  static gboolean was_active;
+  gboolean active = FALSE;
+  gint x = 0, y = 0, w = 0, h = 0;
+
+  switch (GST_MESSAGE_TYPE (message)) {
+    case GST_MESSAGE_ERROR:
+    case GST_MESSAGE_EOS:
+      capture_source_failed (source, message);
+      return G_SOURCE_CONTINUE;
+    case GST_MESSAGE_STATE_CHANGED:
+      if (GST_MESSAGE_SRC (message) == GST_OBJECT (source->pipeline)) {
+        GstState state;
+
+        gst_message_parse_state_changed (message, NULL, &state, NULL);
+        if (state == GST_STATE_PLAYING) {
+          source->playing_since = g_get_monotonic_time ();
+          startup_report ();
+        }
+      }
+      return G_SOURCE_CONTINUE;
+    case GST_MESSAGE_ELEMENT:
+      if (gst_structure_has_name (s, "motion"))
+        break;
+      return G_SOURCE_CONTINUE;
+    default:
+      return G_SOURCE_CONTINUE;
+  }
+
+  gst_structure_get_boolean (s, "active", &active);
+  if (active != was_active) {
+    gst_structure_get (s, "x", G_TYPE_INT, &x, "y", G_TYPE_INT, &y,
+        "width", G_TYPE_INT, &w, "height", G_TYPE_INT, &h, NULL);
+    g_print ("motion %s, region %dx%d+%d+%d\n",
+        active ? "started" : "stopped", w, h, x, y);
+    was_active = active;
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GstPadProbeReturn
+count_bytes_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  guint64 *bytes = user_data;
+
+  *bytes += gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info));
+  return GST_PAD_PROBE_OK;
+}
+
+/* Accumulate the luma squared error of @dec against @ref, split between
+ * the regions carried by @ref (index 1) and the rest (index 0) */
+static void
+roi_bench_compare (GstSample * ref, GstSample * dec, gdouble sse[2],
+    guint64 n[2])
+{
+  GstVideoInfo ref_info, dec_info;
+  GstVideoFrame ref_frame, dec_frame;
+  GstVideoRegionOfInterestMeta *meta;
+  guint8 *inside;
+  gint width, height, x, y;
+
+  gst_video_info_from_caps (&ref_info, gst_sample_get_caps (ref));
+  gst_video_info_from_caps (&dec_info, gst_sample_get_caps (dec));
+  if (!gst_video_frame_map (&ref_frame, &ref_info, gst_sample_get_buffer (ref),
+          GST_MAP_READ))
+    return;
+  if (!gst_video_frame_map (&dec_frame, &dec_info, gst_sample_get_buffer (dec),
+          GST_MAP_READ)) {
+    gst_video_frame_unmap (&ref_frame);
+    return;
+  }
+
+  width = MIN (GST_VIDEO_FRAME_WIDTH (&ref_frame),
+      GST_VIDEO_FRAME_WIDTH (&dec_frame));
+  height = MIN (GST_VIDEO_FRAME_HEIGHT (&ref_frame),
+      GST_VIDEO_FRAME_HEIGHT (&dec_frame));
+  inside = g_malloc0 (width);
+
+  for (y = 0; y < height; y++) {
+    const guint8 *r = (const guint8 *) GST_VIDEO_FRAME_COMP_DATA (&ref_frame,
+        0) + y * GST_VIDEO_FRAME_COMP_STRIDE (&ref_frame, 0);
+    const guint8 *d = (const guint8 *) GST_VIDEO_FRAME_COMP_DATA (&dec_frame,
+        0) + y * GST_VIDEO_FRAME_COMP_STRIDE (&dec_frame, 0);
+    gpointer state = NULL;
+
+    memset (inside, 0, width);
+    while ((meta = (GstVideoRegionOfInterestMeta *)
+            gst_buffer_iterate_meta_filtered (gst_sample_get_buffer (ref),
+                &state, GST_VIDEO_REGION_OF_INTEREST_META_API_TYPE))) {
+      if (y >= (gint) meta->y && y < (gint) (meta->y + meta->h) &&
+          (gint) meta->x < width)
+        memset (inside + meta->x, 1, MIN (meta->w, width - meta->x));
+    }
+
+    for (x = 0; x < width; x++) {
+      gint diff = r[x] - d[x];
+
+      sse[inside[x]] += diff * diff;
+      n[inside[x]]++;
+    }
+  }
+
+  g_free (inside);
+  gst_video_frame_unmap (&dec_frame);
+  gst_video_frame_unmap (&ref_frame);
+}
+
+static gdouble
+psnr (gdouble sse, guint64 n)
+{
+  if (n == 0)
+    return 0.0;
+  if (sse == 0.0)
+    return 99.0;
+  return 10.0 * log10 (255.0 * 255.0 * n / sse);
+}
+
+/* Encode a textured static scene with a moving ball at bitrate=800, once
+ * as is and once with the moving regions as ROIs, and compare decoded luma
+ * against the source inside and outside the regions. x264enc ignores the
+ * ROI metas, so the second pass uses the pixelated emulation. */
+static gint
+run_roi_bench (gint frames)
+{
+  static const gchar *modes[] = { "off", "on" };
+  gint pass;
+
+  g_print ("ROI bench: %d frames 640x360 at 25 fps, x264enc bitrate=800, "
+      "delta-qp %d, background pixelated\n", frames, roi_qp);
+  g_print ("%-4s %9s %7s %9s %8s %9s %10s\n", "roi", "kbit/s", "bpp",
+      "psnr-roi", "psnr-bg", "psnr-all", "roi dB/bpp");
+
+  for (pass = 0; pass < 2; pass++) {
+    GstElement *pipeline, *motion_sink, *encoder, *tee, *ref_sink, *dec_sink;
+    MotionDetector *bench_motion;
+    RoiEncoder *bench_roi;
+    GstSample *ref, *dec;
+    GstPad *pad;
+    GError *error = NULL;
+    gdouble sse[2] = { 0, 0 }, bpp;
+    guint64 n[2] = { 0, 0 }, bytes = 0;
+    gchar *launch;
+    gint compared = 0;
+
+    launch = g_strdup_printf ("compositor name=mix background=black ! "
+        "video/x-raw,format=I420,width=640,height=360,framerate=25/1 ! "
+        "tee name=t "
+        "videotestsrc num-buffers=%d pattern=zone-plate kx2=20 ky2=20 kt=0 ! "
+        "video/x-raw,width=640,height=360,framerate=25/1 ! mix. "
+        "videotestsrc num-buffers=%d pattern=ball background-color=0 ! "
+        "video/x-raw,format=AYUV,width=640,height=360,framerate=25/1 ! mix. "
+        "t. ! queue ! fakesink name=motion sync=false async=false "
+        "t. ! queue ! appsink name=ref sync=false "
+        "t. ! queue ! x264enc name=encoder tune=zerolatency "
+        "speed-preset=superfast bitrate=800 key-int-max=25 ! h264parse ! "
+        "avdec_h264 ! appsink name=decoded sync=false", frames, frames);
+    pipeline = gst_parse_launch (launch, &error);
+    g_free (launch);
+    if (error) {
+      g_printerr ("Unable to build bench pipeline: %s\n", error->message);
+      g_clear_error (&error);
+      return -1;
+    }
+
+    motion_sink = gst_bin_get_by_name (GST_BIN (pipeline), "motion");
+    encoder = gst_bin_get_by_name (GST_BIN (pipeline), "encoder");
+    tee = gst_bin_get_by_name (GST_BIN (pipeline), "t");
+    ref_sink = gst_bin_get_by_name (GST_BIN (pipeline), "ref");
+    dec_sink = gst_bin_get_by_name (GST_BIN (pipeline), "decoded");
+
+    /* both passes tag the same regions so they are measured alike; only
+     * the second one lets them reach the encoder */
+    bench_motion = motion_detector_attach (motion_sink, 2000);
+    bench_roi = roi_encoder_new (roi_qp);
+    roi_encoder_set_motion (bench_roi, bench_motion);
+    pad = gst_element_get_static_pad (tee, "sink");
+    roi_encoder_tag_pad (bench_roi, pad);
+    gst_object_unref (pad);
+    if (pass == 1) {
+      roi_encoder_set_pixelate (bench_roi, TRUE);
+      roi_encoder_attach (bench_roi, encoder);
+    }
+    pad = gst_element_get_static_pad (encoder, "src");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, count_bytes_probe,
+        &bytes, NULL);
+    gst_object_unref (pad);
+
+    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+    ref = gst_app_sink_pull_sample (GST_APP_SINK (ref_sink));
+    while (ref && (dec = gst_app_sink_pull_sample (GST_APP_SINK (dec_sink)))) {
+      GstClockTime pts = GST_BUFFER_PTS (gst_sample_get_buffer (dec));
+
+      while (ref && GST_BUFFER_PTS (gst_sample_get_buffer (ref)) < pts) {
+        gst_sample_unref (ref);
+        ref = gst_app_sink_pull_sample (GST_APP_SINK (ref_sink));
+      }
+      if (ref && GST_BUFFER_PTS (gst_sample_get_buffer (ref)) == pts) {
+        roi_bench_compare (ref, dec, sse, n);
+        compared++;
+      }
+      gst_sample_unref (dec);
+    }
+    if (ref)
+      gst_sample_unref (ref);
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+
+    bpp = compared ? bytes * 8.0 / ((gdouble) compared * 640 * 360) : 0.0;
+    g_print ("%-4s %9.1f %7.4f %9.2f %8.2f %9.2f %10.1f\n", modes[pass],
+        frames ? bytes * 8.0 * 25 / frames / 1000 : 0.0, bpp,
+        psnr (sse[1], n[1]), psnr (sse[0], n[0]),
+        psnr (sse[0] + sse[1], n[0] + n[1]),
+        bpp > 0 ? psnr (sse[1], n[1]) / bpp : 0.0);
+
+    gst_object_unref (motion_sink);
+    gst_object_unref (encoder);
+    gst_object_unref (tee);
+    gst_object_unref (ref_sink);
+    gst_object_unref (dec_sink);
+    gst_object_unref (pipeline);
+    roi_encoder_free (bench_roi);
+    motion_detector_free (bench_motion);
+  }
+
+  return 0;
+}
+
+/* Composite @n_tiles launch fragments (each ending in raw video) into a
+ * MOSAIC_WIDTH x MOSAIC_HEIGHT grid, followed by @tail.
+ *
+ * Each tile is scaled in the streaming thread of its own source, so tiles
+ * scale in parallel, then goes through a queue; for @live tiles a one-frame
+ * leaky one. With live tiles the compositor produces a frame every period
+ * after its latency, using the last frame of any tile that has nothing
+ * new, so a late source never holds back the grid. */
+static gchar *
+mosaic_launch (guint n_tiles, gchar ** tiles, gboolean live,
+    const gchar * tail)
+{
+  guint cols = 1, rows, i;
+  gint tile_w, tile_h;
+  GString *launch = g_string_new ("compositor name=mix background=black "
+      "latency=20000000");
+
+  while (cols * cols < n_tiles)
+    cols++;
+  rows = (n_tiles + cols - 1) / cols;
+  /* even sizes for I420 */
+  tile_w = (MOSAIC_WIDTH / cols) & ~1;
+  tile_h = (MOSAIC_HEIGHT / rows) & ~1;
+
+  for (i = 0; i < n_tiles; i++)
+    g_string_append_printf (launch, " sink_%u::xpos=%d sink_%u::ypos=%d", i,
+        (gint) (i % cols) * tile_w, i, (gint) (i / cols) * tile_h);
+  g_string_append_printf (launch, " ! video/x-raw, format=I420, width=%d, "
+      "height=%d, framerate=25/1 ! %s", MOSAIC_WIDTH, MOSAIC_HEIGHT, tail);
+  for (i = 0; i < n_tiles; i++)
+    g_string_append_printf (launch, " %s ! videoscale ! "
+        "video/x-raw, width=%d, height=%d, pixel-aspect-ratio=1/1 ! "
+        "queue name=tile_queue%u %s ! mix.sink_%u", tiles[i], tile_w, tile_h,
+        i, live ? "leaky=downstream max-size-buffers=1 max-size-bytes=0 "
+        "max-size-time=0" : "", i);
+
+  return g_string_free (launch, FALSE);
+}
+
+/* Run @launch to EOS, return the process CPU seconds it took */
+static gdouble
+mosaic_bench_run (const gchar * launch, gdouble * wall_seconds)
+{
+  GstElement *pipeline;
+  GstBus *bus;
+  GstMessage *msg;
+  GError *error = NULL;
+  clock_t cpu_start;
+  gint64 start;
+
+  pipeline = gst_parse_launch (launch, &error);
+  if (error) {
+    g_printerr ("Unable to build bench pipeline: %s\n", error->message);
+    g_clear_error (&error);
+    if (pipeline)
+      gst_object_unref (pipeline);
+    return -1.0;
+  }
+
+  start = g_get_monotonic_time ();
+  cpu_start = clock ();
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  bus = gst_element_get_bus (pipeline);
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    gst_message_parse_error (msg, &error, NULL);
+    g_printerr ("Bench pipeline failed: %s\n", error->message);
+    g_clear_error (&error);
+  }
+  *wall_seconds = (g_get_monotonic_time () - start) / 1e6;
+  gst_message_unref (msg);
+  gst_object_unref (bus);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+
+  return (gdouble) (clock () - cpu_start) / CLOCKS_PER_SEC;
+}
+
+/* For 1 to @max_sources moving test sources, encode them once as a mosaic
+ * and once as separate 640x360 streams, as fast as possible */
+static gint
+run_mosaic_bench (gint max_sources)
+{
+  const gint frames = 250;
+  const gchar *encode = "x264enc tune=zerolatency speed-preset=superfast "
+      "bitrate=2000 ! fakesink";
+  gint n;
+
+  g_print ("Mosaic bench: %d frames per source at %dx%d, %d cores\n", frames,
+      MOSAIC_WIDTH, MOSAIC_HEIGHT, g_get_num_processors ());
+  g_print ("%-7s %13s %12s %15s %12s\n", "sources", "mosaic ms/fr",
+      "mosaic fps", "separate ms/fr", "separate fps");
+
+  for (n = 1; n <= max_sources; n++) {
+    gchar **tiles = g_new0 (gchar *, n + 1);
+    GString *separate = g_string_new (NULL);
+    gchar *launch;
+    gdouble cpu[2], wall[2];
+    gint i;
+
+    for (i = 0; i < n; i++) {
+      tiles[i] = g_strdup_printf ("videotestsrc num-buffers=%d "
+          "pattern=zone-plate kx2=20 ky2=20 kt=%d ! video/x-raw, "
+          "format=I420, width=640, height=360, framerate=25/1", frames, i + 1);
+      g_string_append_printf (separate, " %s ! %s", tiles[i], encode);
+    }
+    launch = mosaic_launch (n, tiles, FALSE, encode);
+    cpu[0] = mosaic_bench_run (launch, &wall[0]);
+    cpu[1] = mosaic_bench_run (separate->str, &wall[1]);
+    g_free (launch);
+    g_string_free (separate, TRUE);
+    g_strfreev (tiles);
+    if (cpu[0] < 0 || cpu[1] < 0)
+      return -1;
+
+    /* CPU time per output frame of the grid, and per frame of all the
+     * separate streams together */
+    g_print ("%-7d %13.2f %12.1f %15.2f %12.1f\n", n, cpu[0] * 1000 / frames,
+        frames / wall[0], cpu[1] * 1000 / frames, frames / wall[1]);
+  }
+
+  return 0;
+}
+
+static CaptureSource *
+capture_source_new (const gchar * name, const gchar * channel,
+    const gchar * mount, const gchar * launch)
+{
+  CaptureSource *source = g_new0 (CaptureSource, 1);
+  gchar **spec;
+
+  source->index = sources->len;
+  source->name = g_strdup (name);
+  source->channel = g_strdup (channel);
+  source->mount = g_strdup (mount);
+  /* source 0 also feeds the motion detector */
+  source->launch = source->index == 0 ?
+      g_strconcat (launch, " t. ! queue name=motion_queue ! "
+      "fakesink name=motion sync=false async=false", NULL) : g_strdup (launch);
+  for (spec = encoder_specs; spec && *spec; spec++) {
+    gsize len = strlen (name);
+
+    if (strncmp (*spec, name, len) == 0 && (*spec)[len] == '=')
+      source->encoder_props = *spec + len + 1;
+  }
+  g_ptr_array_add (sources, source);
+
+  return source;
+}
+
+/* Add a source from "NAME=PIPELINE", served at /NAME */
+static gboolean
+capture_source_add_spec (const gchar * spec)
+{
+  const gchar *eq = strchr (spec, '=');
+  gchar *name, *mount, *launch;
+
+  if (!eq || eq == spec) {
+    g_printerr ("Invalid source '%s', expected NAME=PIPELINE\n", spec);
+    return FALSE;
+  }
+  name = g_strndup (spec, eq - spec);
+  mount = g_strdup_printf ("/%s", name);
+  launch = g_strdup_printf ("%s ! tee name=t ! queue name=stream_queue ! "
+      "videoconvert ! videoscale ! videorate ! "
+      "video/x-raw, framerate=25/1, width=640, height=360, format=I420 ! "
+      "intervideosink channel=%s sync=true", eq + 1, name);
+  capture_source_new (name, name, mount, launch);
+  g_free (launch);
+  g_free (mount);
+  g_free (name);
+
+  return TRUE;
+}
+
+static gboolean
+capture_source_start (CaptureSource * source, GError ** error)
+{
+  GstBus *bus;
+  gchar *label;
+
+  source->pipeline = gst_parse_launch (source->launch, error);
+  if (!source->pipeline)
+    return FALSE;
+
+  queue_policy_apply_specs (source->pipeline,
+      (gchar **) default_queue_policies);
+  queue_policy_apply_specs (source->pipeline, queue_policies);
+  label = g_strdup_printf ("capture-%s", source->name);
+  pipeline_trace_attach (source->pipeline, label);
+  if (source->index == 0) {
+    GstElement *motion_sink =
+        gst_bin_get_by_name (GST_BIN (source->pipeline), "motion");
+
+    /* 2 ms per frame out of the 40 ms a 25 fps frame lasts */
+    motion = motion_detector_attach (motion_sink, 2000);
+    if (roi && roi_motion)
+      roi_encoder_set_motion (roi, motion);
+    if (static_fps > 0)
+      throttle = static_throttle_new (motion, 2000, static_fps);
+    gst_object_unref (motion_sink);
+  }
+  if (metrics)
+    stream_metrics_watch_pipeline (metrics, source->pipeline, label);
+  g_free (label);
+
+  bus = gst_element_get_bus (source->pipeline);
+  gst_bus_add_watch (bus, capture_bus_cb, source);
+  gst_object_unref (bus);
+
+  gst_element_set_state (source->pipeline, GST_STATE_PLAYING);
+  return TRUE;
+}
+
+static void
+capture_source_free (CaptureSource * source)
+{
+  if (source->restart_id)
+    g_source_remove (source->restart_id);
+  if (source->pipeline) {
+    gst_element_set_state (source->pipeline, GST_STATE_NULL);
+    gst_object_unref (source->pipeline);
+  }
+  g_free (source->name);
+  g_free (source->channel);
+  g_free (source->mount);
+  g_free (source->launch);
+  g_free (source);
+}
 
 int
 main (int argc, char *argv[])
@@ -77,12 +971,49 @@ main (int argc, char *argv[])
   GstRTSPServer *server;
   GstRTSPMountPoints *mounts;
   GstRTSPMediaFactory *factory;
-    GstElement *pipeline;
+  gchar **spec;
+  guint i, server_id;
 
+  GOptionContext *optctx;
   GError *error = NULL;
 
-  gst_init (&argc, &argv);
+  startup = startup_timer_new ();
+  startup_timer_begin (startup, "gst-init");
+  optctx = g_option_context_new ("- RTSP server with a net clock");
+  g_option_context_add_main_entries (optctx, entries, NULL);
+  g_option_context_add_group (optctx,
+      plugin_preload_get_option_group (&preload));
+  g_option_context_add_group (optctx, gst_init_get_option_group ());
+  if (!g_option_context_parse (optctx, &argc, &argv, &error)) {
+    g_printerr ("Error parsing options: %s\n", error->message);
+    g_option_context_free (optctx);
+    g_clear_error (&error);
+    return -1;
+  }
+  g_option_context_free (optctx);
+  startup_timer_end (startup, "gst-init");
+  if (preload.enabled)
+    fast_start ();
+
+  if (trace_prefix)
+    pipeline_trace_enable ();
+
+  if (roi_bench_frames > 0)
+    return run_roi_bench (roi_bench_frames);
+  if (mosaic_bench_sources > 0)
+    return run_mosaic_bench (mosaic_bench_sources);
 
+  if (roi_rects || roi_motion) {
+    roi = roi_encoder_new (roi_qp);
+    roi_encoder_set_pixelate (roi, roi_pixelate);
+    for (spec = roi_rects; spec && *spec; spec++) {
+      GstVideoRectangle rect;
+
+      if (!roi_encoder_parse_rect (*spec, &rect))
+        return -1;
+      roi_encoder_add_rect (roi, &rect);
+    }
+  }
 
   loop = g_main_loop_new (NULL, FALSE);
 
@@ -99,45 +1030,187 @@ main (int argc, char *argv[])
    * that be used to map uri mount points to media factories */
   mounts = gst_rtsp_server_get_mount_points (server);
 
-  /* make a media factory for a test stream. The default media factory can use
-   * gst-launch syntax to create pipelines.
-   * any launch line works as long as it contains elements named pay%d. Each
-   * element with pay%d names will be a stream */
-  factory = gst_rtsp_media_factory_new ();
-  gst_rtsp_media_factory_set_shared (factory, TRUE);
-  g_print ("Launching preview ! \n");
-  pipeline= gst_parse_launch( " avfvideosrc ! tee name=t ! queue  ! videoconvert ! videoscale ! video/x-raw, framerate=25/1, width=640, height=360, format=I420 ! intervideosink name=sink channel=liveling sync=true t. ! queue ! videoscale ! video/x-raw, framerate=25/1, width=640, height=360 ! osxvideosink ", &error );
+  if (metrics_address)
+    metrics = stream_metrics_new ();
 
-    if (error) {
-        g_print("Unable to build pipeline: %s", error->message);
-        g_clear_error (&error);
+  sources = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      capture_source_free);
+  medias = g_ptr_array_new_with_free_func (g_object_unref);
+  for (spec = source_specs; spec && *spec; spec++)
+    if (!capture_source_add_spec (*spec))
+      return -1;
+  for (i = 0; i < (guint) MAX (test_sources, 0); i++) {
+    gchar *source_spec = g_strdup_printf ("cam%u=videotestsrc is-live=true "
+        "pattern=%u", i, i % 20);
 
-        return 0;
+    capture_source_add_spec (source_spec);
+    g_free (source_spec);
+  }
+  if (sources->len == 0) {
+    g_print ("Launching preview ! \n");
+    capture_source_new ("test", "liveling", "/test", " avfvideosrc ! tee name=t ! queue name=stream_queue ! videoconvert ! videoscale ! video/x-raw, framerate=25/1, width=640, height=360, format=I420 ! intervideosink name=sink channel=liveling sync=true t. ! queue name=preview_queue ! videoscale ! video/x-raw, framerate=25/1, width=640, height=360 ! osxvideosink ");
+  }
+
+  /* each source gets its own shared media factory; media-configure spreads
+   * the encoders over the cores */
+  startup_timer_begin (startup, "first-pipeline");
+  for (i = 0; i < sources->len; i++) {
+    CaptureSource *source = g_ptr_array_index (sources, i);
+    gchar *launch;
+
+    if (!capture_source_start (source, &error)) {
+      g_print ("Unable to build pipeline for %s: %s\n", source->name,
+          error->message);
+      g_clear_error (&error);
+      return 0;
     }
-    else
 
-        gst_element_set_state (pipeline, GST_STATE_PLAYING);
+    launch = g_strdup_printf ("( intervideosrc channel=%s !  video/x-raw, "
+        "framerate=25/1, width=640, height=360, format=I420  ! "
+        "queue name=enc_queue ! x264enc name=encoder tune=zerolatency %s ! "
+        "rtph264pay name=pay0 pt=96 config-interval=-1 )", source->channel,
+        source->encoder_props ? source->encoder_props : "");
+    factory = gst_rtsp_media_factory_new ();
+    gst_rtsp_media_factory_set_shared (factory, TRUE);
+    gst_rtsp_media_factory_set_launch (factory, launch);
+    g_free (launch);
 
-  g_print ("launcing rtsp server. . .\n");
-  gst_rtsp_media_factory_set_launch (factory, "( intervideosrc channel=liveling !  video/x-raw, framerate=25/1, width=640, height=360, format=I420  ! x264enc tune=zerolatency ! rtph264pay name=pay0 pt=96 )");
+    gst_rtsp_media_factory_set_media_gtype (factory, TEST_TYPE_RTSP_MEDIA);
+    gst_rtsp_media_factory_set_clock (factory, global_clock);
+    g_signal_connect (factory, "media-configure", (GCallback) media_configure,
+        source);
 
-  gst_rtsp_media_factory_set_media_gtype (factory, TEST_TYPE_RTSP_MEDIA);
-  gst_rtsp_media_factory_set_clock (factory, global_clock);
+    gst_rtsp_mount_points_add_factory (mounts, source->mount, factory);
+    startup_timer_end (startup, "first-pipeline");
+  }
+  if (mosaic) {
+    gchar **tiles = g_new0 (gchar *, sources->len + 1);
+    gchar *launch, *grid;
 
-  /* attach the test factory to the /test url */
-  gst_rtsp_mount_points_add_factory (mounts, "/test", factory);
+    /* intervideosrc repeats the last frame of a source that is late */
+    for (i = 0; i < sources->len; i++)
+      tiles[i] = g_strdup_printf ("intervideosrc channel=%s",
+          ((CaptureSource *) g_ptr_array_index (sources, i))->channel);
+    grid = mosaic_launch (sources->len, tiles, TRUE, "queue name=enc_queue ! "
+        "x264enc name=encoder tune=zerolatency ! "
+        "rtph264pay name=pay0 pt=96 config-interval=-1");
+    launch = g_strdup_printf ("( %s )", grid);
+    g_free (grid);
+    g_strfreev (tiles);
+
+    factory = gst_rtsp_media_factory_new ();
+    gst_rtsp_media_factory_set_shared (factory, TRUE);
+    gst_rtsp_media_factory_set_launch (factory, launch);
+    g_free (launch);
+    gst_rtsp_media_factory_set_media_gtype (factory, TEST_TYPE_RTSP_MEDIA);
+    gst_rtsp_media_factory_set_clock (factory, global_clock);
+    g_signal_connect (factory, "media-configure", (GCallback) media_configure,
+        NULL);
+    gst_rtsp_mount_points_add_factory (mounts, "/mosaic", factory);
+  }
+  g_print ("launcing rtsp server. . .\n");
+  g_signal_connect (server, "client-connected", (GCallback) client_connected,
+      NULL);
+  client_stats = rtsp_client_stats_new ();
+  rtsp_client_stats_attach (client_stats, server);
+  if (client_log_seconds > 0)
+    rtsp_client_stats_start_log (client_stats, stdout, client_log_seconds);
+  if (max_egress_mbps > 0 || max_load_percent > 0) {
+    admission = admission_control_new (client_stats, max_egress_mbps,
+        max_load_percent);
+    if (redirect_url)
+      admission_control_set_redirect (admission, redirect_url);
+    admission_control_attach (admission, server);
+  }
 
   /* don't need the ref to the mapper anymore */
   g_object_unref (mounts);
 
   /* attach the server to the default maincontext */
-  gst_rtsp_server_attach (server, NULL);
+  server_id = gst_rtsp_server_attach (server, NULL);
+
+  if (control_address) {
+    encoder_control = encoder_control_new ();
+    encoder_control_add_command (encoder_control, "clients", clients_command,
+        client_stats);
+    if (!encoder_control_listen (encoder_control, control_address, &error)) {
+      g_printerr ("Failed to accept encoder commands: %s\n", error->message);
+      g_clear_error (&error);
+    } else {
+      g_print ("encoder commands accepted at %s\n", control_address);
+    }
+  }
+
+  if (metrics) {
+    stream_metrics_add_collector (metrics, collect_server_metrics, server);
+    stream_metrics_add_collector (metrics, queue_policy_collect_metrics, NULL);
+    stream_metrics_add_collector (metrics, rtsp_client_stats_collect_metrics,
+        client_stats);
+    if (admission)
+      stream_metrics_add_collector (metrics,
+          admission_control_collect_metrics, admission);
+    stream_metrics_add_collector (metrics, startup_timer_collect_metrics,
+        startup);
+    stream_metrics_add_collector (metrics, motion_detector_collect_metrics,
+        motion);
+    if (roi)
+      stream_metrics_add_collector (metrics, roi_encoder_collect_metrics, roi);
+    if (throttle)
+      stream_metrics_add_collector (metrics, static_throttle_collect_metrics,
+          throttle);
+    if (encoder_control)
+      stream_metrics_add_collector (metrics, encoder_control_collect_metrics,
+          encoder_control);
+    if (!stream_metrics_listen (metrics, metrics_address, &error)) {
+      g_printerr ("Failed to serve metrics: %s\n", error->message);
+      g_clear_error (&error);
+    } else {
+      g_print ("metrics served at %s\n", metrics_address);
+    }
+  }
 
   /* start serving */
-  g_print ("stream ready at rtsp://127.0.0.1:8554/test\n");
+  for (i = 0; i < sources->len; i++)
+    g_print ("stream ready at rtsp://127.0.0.1:8554%s\n",
+        ((CaptureSource *) g_ptr_array_index (sources, i))->mount);
+  if (mosaic)
+    g_print ("stream ready at rtsp://127.0.0.1:8554/mosaic\n");
+  if (trace_prefix)
+    g_unix_signal_add (SIGUSR1, on_trace_report, NULL);
+  g_unix_signal_add (SIGINT, on_interrupt, loop);
+
   g_main_loop_run (loop);
 
-  gst_object_unref (pipeline);
+  if (trace_prefix)
+    write_trace_report ();
+  queue_policy_print_summary (stdout);
+  if (throttle)
+    static_throttle_print_summary (throttle, stdout);
+  if (admission)
+    admission_control_print_summary (admission, stdout);
+
+  /* the medias, the capture pipelines and the clients use the helpers and
+   * the metrics, stop them before any of those is freed */
+  stop_serving (server, server_id);
+  g_object_unref (server);
+  g_mutex_lock (&medias_lock);
+  g_clear_pointer (&medias, g_ptr_array_unref);
+  g_mutex_unlock (&medias_lock);
+  g_ptr_array_unref (sources);
+  if (metrics)
+    stream_metrics_free (metrics);
+
+  motion_detector_free (motion);
+  if (roi)
+    roi_encoder_free (roi);
+  if (throttle)
+    static_throttle_free (throttle);
+  if (encoder_control)
+    encoder_control_free (encoder_control);
+  if (admission)
+    admission_control_free (admission);
+  rtsp_client_stats_free (client_stats);
+  startup_timer_free (startup);
 
   return 0;
 }
@@ -0,0 +1,747 @@
+/* Per-element latency and CPU tracer for the capture and RTSP pipelines
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   pipeline_trace_enable ();
+ *   pipeline_trace_attach (pipeline, "capture");
+ *   ...
+ *   pipeline_trace_report (stdout);
+ *   pipeline_trace_write_chrome ("/tmp/trace.json", &error);
+ *
+ * Every buffer crossing a pad of an attached element is recorded as one
+ * small event in a ring owned by the streaming thread that pushed it, so the
+ * hot path never takes a lock. All pairing and statistics are done offline
+ * by the report functions:
+ *
+ *  - processing time: sink-in to the next src-out of the same element on the
+ *    same thread (videoscale, x264enc, rtph264pay ...)
+ *  - residence time: sink-in to src-out of the same PTS on another thread
+ *    (queue)
+ *  - hop time: intervideosink sink-in to the next intervideosrc src-out on
+ *    the same channel
+ */
+
+#ifndef __PIPELINE_TRACE_H__
+#define __PIPELINE_TRACE_H__
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define PIPELINE_TRACE_EVENTS_PER_THREAD (1 << 16)
+#define PIPELINE_TRACE_CPU_SAMPLE_MASK   0xff
+
+typedef enum
+{
+  PIPELINE_TRACE_SINK_IN,
+  PIPELINE_TRACE_SRC_OUT
+} PipelineTraceKind;
+
+typedef struct
+{
+  guint64 ts;
+  GstClockTime pts;
+  guint32 pad;
+  guint32 kind;
+} PipelineTraceEvent;
+
+typedef struct
+{
+  guint tid;
+  gchar name[16];
+  guint64 cpu_start;
+  guint64 cpu_end;
+  /* total number of events ever written; only the writer thread stores it */
+  gint head;
+  PipelineTraceEvent events[PIPELINE_TRACE_EVENTS_PER_THREAD];
+} PipelineTraceThread;
+
+typedef struct
+{
+  gchar *label;
+  gchar *name;
+  gchar *factory;
+  gchar *channel;
+} PipelineTraceElement;
+
+typedef struct
+{
+  guint element;
+  gchar *name;
+} PipelineTracePad;
+
+static struct
+{
+  GMutex lock;
+  gint enabled;
+  guint64 origin;
+  GPtrArray *threads;
+  GPtrArray *elements;
+  GPtrArray *pads;
+} pipeline_trace;
+
+static GPrivate pipeline_trace_thread_key = G_PRIVATE_INIT (NULL);
+static GQuark pipeline_trace_quark;
+
+static guint64
+pipeline_trace_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (guint64) ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+static guint64
+pipeline_trace_thread_cpu (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return 0;
+  return (guint64) ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+static void
+pipeline_trace_thread_name (gchar * name, gsize len)
+{
+  name[0] = '\0';
+#if defined (__linux__)
+  prctl (PR_GET_NAME, name, 0, 0, 0);
+#elif defined (__APPLE__)
+  pthread_getname_np (pthread_self (), name, len);
+#endif
+  name[len - 1] = '\0';
+}
+
+/* Only called the first time a streaming thread hits a probe. */
+static PipelineTraceThread *
+pipeline_trace_thread_register (void)
+{
+  PipelineTraceThread *thread;
+
+  thread = g_malloc0 (sizeof (PipelineTraceThread));
+  pipeline_trace_thread_name (thread->name, sizeof (thread->name));
+  thread->cpu_start = thread->cpu_end = pipeline_trace_thread_cpu ();
+
+  g_mutex_lock (&pipeline_trace.lock);
+  thread->tid = pipeline_trace.threads->len + 1;
+  g_ptr_array_add (pipeline_trace.threads, thread);
+  g_mutex_unlock (&pipeline_trace.lock);
+
+  /* the ring outlives the thread so it can still be reported */
+  g_private_set (&pipeline_trace_thread_key, thread);
+  return thread;
+}
+
+static GstPadProbeReturn
+pipeline_trace_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  PipelineTraceThread *thread;
+  PipelineTraceEvent *ev;
+  GstClockTime pts = GST_CLOCK_TIME_NONE;
+  gint head;
+
+  if (!g_atomic_int_get (&pipeline_trace.enabled))
+    return GST_PAD_PROBE_OK;
+
+  thread = g_private_get (&pipeline_trace_thread_key);
+  if (G_UNLIKELY (thread == NULL))
+    thread = pipeline_trace_thread_register ();
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+    pts = GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info));
+  } else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+
+    if (gst_buffer_list_length (list) > 0)
+      pts = GST_BUFFER_PTS (gst_buffer_list_get (list, 0));
+  }
+
+  head = thread->head;
+  ev = &thread->events[head % PIPELINE_TRACE_EVENTS_PER_THREAD];
+  ev->ts = pipeline_trace_now ();
+  ev->pts = pts;
+  ev->pad = GPOINTER_TO_UINT (user_data);
+  ev->kind = GST_PAD_IS_SINK (pad) ?
+      PIPELINE_TRACE_SINK_IN : PIPELINE_TRACE_SRC_OUT;
+
+  if ((head & PIPELINE_TRACE_CPU_SAMPLE_MASK) == 0)
+    thread->cpu_end = pipeline_trace_thread_cpu ();
+
+  g_atomic_int_set (&thread->head, head + 1);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Must be called before pipeline_trace_attach(), from any thread. */
+static void G_GNUC_UNUSED
+pipeline_trace_enable (void)
+{
+  g_mutex_lock (&pipeline_trace.lock);
+  if (pipeline_trace.threads == NULL) {
+    pipeline_trace_quark = g_quark_from_static_string ("pipeline-trace-index");
+    pipeline_trace.threads = g_ptr_array_new ();
+    pipeline_trace.elements = g_ptr_array_new ();
+    pipeline_trace.pads = g_ptr_array_new ();
+    pipeline_trace.origin = pipeline_trace_now ();
+  }
+  g_mutex_unlock (&pipeline_trace.lock);
+
+  g_atomic_int_set (&pipeline_trace.enabled, 1);
+}
+
+static void G_GNUC_UNUSED
+pipeline_trace_disable (void)
+{
+  g_atomic_int_set (&pipeline_trace.enabled, 0);
+}
+
+static gboolean G_GNUC_UNUSED
+pipeline_trace_is_enabled (void)
+{
+  return g_atomic_int_get (&pipeline_trace.enabled);
+}
+
+static void
+pipeline_trace_attach_pad (GstPad * pad, guint element)
+{
+  PipelineTracePad *tpad;
+  guint index;
+
+  /* pads are registered once even if the element is attached again */
+  if (g_object_get_qdata (G_OBJECT (pad), pipeline_trace_quark))
+    return;
+
+  tpad = g_new0 (PipelineTracePad, 1);
+  tpad->element = element;
+  tpad->name = gst_pad_get_name (pad);
+
+  g_mutex_lock (&pipeline_trace.lock);
+  index = pipeline_trace.pads->len;
+  g_ptr_array_add (pipeline_trace.pads, tpad);
+  g_mutex_unlock (&pipeline_trace.lock);
+
+  g_object_set_qdata (G_OBJECT (pad), pipeline_trace_quark,
+      GUINT_TO_POINTER (index + 1));
+  gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      pipeline_trace_probe, GUINT_TO_POINTER (index), NULL);
+}
+
+static void
+pipeline_trace_pad_added (GstElement * element, GstPad * pad, gpointer user_data)
+{
+  pipeline_trace_attach_pad (pad, GPOINTER_TO_UINT (user_data));
+}
+
+static void
+pipeline_trace_attach_element (GstElement * element, const gchar * label)
+{
+  PipelineTraceElement *tel;
+  GstElementFactory *factory;
+  GstIterator *it;
+  GValue item = G_VALUE_INIT;
+  guint index;
+
+  if (GST_IS_BIN (element))
+    return;
+
+  index = GPOINTER_TO_UINT (g_object_get_qdata (G_OBJECT (element),
+          pipeline_trace_quark));
+  if (index == 0) {
+    tel = g_new0 (PipelineTraceElement, 1);
+    tel->label = g_strdup (label);
+    tel->name = gst_element_get_name (element);
+    factory = gst_element_get_factory (element);
+    tel->factory = g_strdup (factory ?
+        GST_OBJECT_NAME (factory) : G_OBJECT_TYPE_NAME (element));
+    if (g_object_class_find_property (G_OBJECT_GET_CLASS (element), "channel")
+        && g_str_has_prefix (tel->factory, "inter"))
+      g_object_get (element, "channel", &tel->channel, NULL);
+
+    g_mutex_lock (&pipeline_trace.lock);
+    g_ptr_array_add (pipeline_trace.elements, tel);
+    index = pipeline_trace.elements->len;
+    g_mutex_unlock (&pipeline_trace.lock);
+
+    g_object_set_qdata (G_OBJECT (element), pipeline_trace_quark,
+        GUINT_TO_POINTER (index));
+    g_signal_connect (element, "pad-added",
+        G_CALLBACK (pipeline_trace_pad_added), GUINT_TO_POINTER (index - 1));
+  }
+
+  it = gst_element_iterate_pads (element);
+  while (gst_iterator_next (it, &item) == GST_ITERATOR_OK) {
+    pipeline_trace_attach_pad (g_value_get_object (&item), index - 1);
+    g_value_reset (&item);
+  }
+  g_value_unset (&item);
+  gst_iterator_free (it);
+}
+
+/* Install buffer probes on every pad of every element in @pipeline. @label
+ * names the pipeline in the report, e.g. "capture" or "rtsp". */
+static void G_GNUC_UNUSED
+pipeline_trace_attach (GstElement * pipeline, const gchar * label)
+{
+  GstIterator *it;
+  GValue item = G_VALUE_INIT;
+  gboolean done = FALSE;
+
+  if (!pipeline_trace_is_enabled () || pipeline == NULL)
+    return;
+
+  if (!GST_IS_BIN (pipeline)) {
+    pipeline_trace_attach_element (pipeline, label);
+    return;
+  }
+
+  it = gst_bin_iterate_recurse (GST_BIN (pipeline));
+  while (!done) {
+    switch (gst_iterator_next (it, &item)) {
+      case GST_ITERATOR_OK:
+        pipeline_trace_attach_element (g_value_get_object (&item), label);
+        g_value_reset (&item);
+        break;
+      case GST_ITERATOR_RESYNC:
+        gst_iterator_resync (it);
+        break;
+      default:
+        done = TRUE;
+        break;
+    }
+  }
+  g_value_unset (&item);
+  gst_iterator_free (it);
+}
+
+/*
+ * Offline analysis
+ */
+typedef struct
+{
+  GArray *proc;
+  GArray *latency;
+  guint64 in, out;
+} PipelineTraceStats;
+
+typedef struct
+{
+  guint thread;
+  guint element;
+  guint64 start;
+  guint64 dur;
+  gboolean cross_thread;
+} PipelineTraceSpan;
+
+typedef void (*PipelineTraceSpanFunc) (const PipelineTraceSpan * span,
+    gpointer user_data);
+
+static gint
+pipeline_trace_cmp_u64 (gconstpointer a, gconstpointer b)
+{
+  guint64 x = *(const guint64 *) a, y = *(const guint64 *) b;
+
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Visit the events of @thread that are still in its ring, oldest first. */
+#define PIPELINE_TRACE_FOREACH_EVENT(thread, ev, i, end)                   \
+  for (i = MAX (0, end - PIPELINE_TRACE_EVENTS_PER_THREAD);                \
+      i < end && ((ev = &(thread)->events[i % PIPELINE_TRACE_EVENTS_PER_THREAD]), 1); \
+      i++)
+
+static PipelineTraceStats *
+pipeline_trace_analyse (PipelineTraceSpanFunc func, gpointer user_data)
+{
+  PipelineTraceStats *stats;
+  GHashTable **by_pts, *hop_in;
+  guint64 *pending;
+  guint n_elements, n_threads, t, e;
+
+  n_elements = pipeline_trace.elements->len;
+  n_threads = pipeline_trace.threads->len;
+
+  stats = g_new0 (PipelineTraceStats, n_elements);
+  by_pts = g_new0 (GHashTable *, n_elements);
+  pending = g_new0 (guint64, n_elements);
+  hop_in = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) g_array_unref);
+
+  for (e = 0; e < n_elements; e++) {
+    stats[e].proc = g_array_new (FALSE, FALSE, sizeof (guint64));
+    stats[e].latency = g_array_new (FALSE, FALSE, sizeof (guint64));
+    by_pts[e] = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free,
+        g_free);
+  }
+
+  /* pass 1: same-thread processing spans and sink-in index for the rest */
+  for (t = 0; t < n_threads; t++) {
+    PipelineTraceThread *thread = g_ptr_array_index (pipeline_trace.threads, t);
+    PipelineTraceEvent *ev;
+    gint i, end = g_atomic_int_get (&thread->head);
+
+    memset (pending, 0, sizeof (guint64) * n_elements);
+
+    PIPELINE_TRACE_FOREACH_EVENT (thread, ev, i, end) {
+      PipelineTracePad *pad = g_ptr_array_index (pipeline_trace.pads, ev->pad);
+      PipelineTraceElement *el;
+      guint idx = pad->element;
+
+      el = g_ptr_array_index (pipeline_trace.elements, idx);
+
+      if (ev->kind == PIPELINE_TRACE_SINK_IN) {
+        stats[idx].in++;
+        pending[idx] = ev->ts;
+        if (GST_CLOCK_TIME_IS_VALID (ev->pts)) {
+          gint64 *key = g_new (gint64, 1);
+          guint64 *val = g_new (guint64, 1);
+
+          *key = ev->pts;
+          *val = ev->ts;
+          g_hash_table_replace (by_pts[idx], key, val);
+        }
+        if (el->channel && g_str_equal (el->factory, "intervideosink")) {
+          GArray *arr = g_hash_table_lookup (hop_in, el->channel);
+
+          if (arr == NULL) {
+            arr = g_array_new (FALSE, FALSE, sizeof (guint64));
+            g_hash_table_insert (hop_in, el->channel, arr);
+          }
+          g_array_append_val (arr, ev->ts);
+        }
+      } else {
+        stats[idx].out++;
+        if (pending[idx] != 0) {
+          PipelineTraceSpan span = { thread->tid, idx, pending[idx],
+            ev->ts - pending[idx], FALSE
+          };
+
+          g_array_append_val (stats[idx].proc, span.dur);
+          if (func)
+            func (&span, user_data);
+          pending[idx] = 0;
+        }
+      }
+    }
+  }
+
+  /* pass 2: cross-thread residence (queue) and intervideo hops */
+  {
+    GHashTableIter iter;
+    gpointer arr;
+
+    g_hash_table_iter_init (&iter, hop_in);
+    while (g_hash_table_iter_next (&iter, NULL, &arr))
+      g_array_sort (arr, pipeline_trace_cmp_u64);
+  }
+
+  for (t = 0; t < n_threads; t++) {
+    PipelineTraceThread *thread = g_ptr_array_index (pipeline_trace.threads, t);
+    PipelineTraceEvent *ev;
+    gint i, end = g_atomic_int_get (&thread->head);
+
+    memset (pending, 0, sizeof (guint64) * n_elements);
+
+    PIPELINE_TRACE_FOREACH_EVENT (thread, ev, i, end) {
+      PipelineTracePad *pad = g_ptr_array_index (pipeline_trace.pads, ev->pad);
+      PipelineTraceElement *el;
+      PipelineTraceSpan span = { thread->tid, pad->element, 0, 0, TRUE };
+      guint idx = pad->element;
+
+      el = g_ptr_array_index (pipeline_trace.elements, idx);
+
+      if (ev->kind == PIPELINE_TRACE_SINK_IN) {
+        pending[idx] = ev->ts;
+        continue;
+      }
+      if (pending[idx] != 0) {
+        /* already accounted as a same-thread processing span */
+        pending[idx] = 0;
+        continue;
+      }
+
+      if (el->channel && g_str_equal (el->factory, "intervideosrc")) {
+        GArray *arr = g_hash_table_lookup (hop_in, el->channel);
+        guint lo = 0, hi = arr ? arr->len : 0;
+
+        /* latest intervideosink frame that was written before this one */
+        while (lo < hi) {
+          guint mid = (lo + hi) / 2;
+
+          if (g_array_index (arr, guint64, mid) <= ev->ts)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+        if (lo > 0)
+          span.start = g_array_index (arr, guint64, lo - 1);
+      } else if (GST_CLOCK_TIME_IS_VALID (ev->pts)) {
+        gint64 key = ev->pts;
+        guint64 *in = g_hash_table_lookup (by_pts[idx], &key);
+
+        if (in && *in <= ev->ts)
+          span.start = *in;
+      }
+
+      if (span.start != 0) {
+        span.dur = ev->ts - span.start;
+        g_array_append_val (stats[idx].latency, span.dur);
+        if (func)
+          func (&span, user_data);
+      }
+    }
+  }
+
+  for (e = 0; e < n_elements; e++)
+    g_hash_table_unref (by_pts[e]);
+  g_free (by_pts);
+  g_free (pending);
+  g_hash_table_unref (hop_in);
+
+  return stats;
+}
+
+static void
+pipeline_trace_stats_free (PipelineTraceStats * stats, guint n)
+{
+  guint e;
+
+  for (e = 0; e < n; e++) {
+    g_array_unref (stats[e].proc);
+    g_array_unref (stats[e].latency);
+  }
+  g_free (stats);
+}
+
+static void
+pipeline_trace_percentiles (GArray * samples, gdouble * avg, guint64 * p50,
+    guint64 * p95, guint64 * max)
+{
+  guint64 sum = 0;
+  guint i;
+
+  *avg = 0;
+  *p50 = *p95 = *max = 0;
+  if (samples->len == 0)
+    return;
+
+  g_array_sort (samples, pipeline_trace_cmp_u64);
+  for (i = 0; i < samples->len; i++)
+    sum += g_array_index (samples, guint64, i);
+
+  *avg = (gdouble) sum / samples->len;
+  *p50 = g_array_index (samples, guint64, samples->len / 2);
+  *p95 = g_array_index (samples, guint64, (samples->len * 95) / 100);
+  *max = g_array_index (samples, guint64, samples->len - 1);
+}
+
+/* Print the per-element summary table and per-thread CPU usage. Safe to call
+ * while the pipelines are running; events written concurrently may be
+ * missing from the report. */
+static void G_GNUC_UNUSED
+pipeline_trace_report (FILE * out)
+{
+  PipelineTraceStats *stats;
+  guint64 wall;
+  guint e, t;
+
+  if (pipeline_trace.threads == NULL) {
+    fprintf (out, "tracing was not enabled\n");
+    return;
+  }
+
+  g_mutex_lock (&pipeline_trace.lock);
+  stats = pipeline_trace_analyse (NULL, NULL);
+  wall = pipeline_trace_now () - pipeline_trace.origin;
+
+  fprintf (out, "%-8s %-20s %-16s %8s %8s %9s %9s %9s %9s %9s %9s\n",
+      "pipeline", "element", "factory", "in", "out", "proc-avg", "proc-p95",
+      "proc-max", "lat-avg", "lat-p95", "lat-max");
+
+  for (e = 0; e < pipeline_trace.elements->len; e++) {
+    PipelineTraceElement *el = g_ptr_array_index (pipeline_trace.elements, e);
+    gdouble proc_avg, lat_avg;
+    guint64 proc_p50, proc_p95, proc_max, lat_p50, lat_p95, lat_max;
+
+    if (stats[e].in == 0 && stats[e].out == 0)
+      continue;
+
+    pipeline_trace_percentiles (stats[e].proc, &proc_avg, &proc_p50,
+        &proc_p95, &proc_max);
+    pipeline_trace_percentiles (stats[e].latency, &lat_avg, &lat_p50,
+        &lat_p95, &lat_max);
+
+    /* all times in microseconds */
+    fprintf (out, "%-8s %-20s %-16s %8" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT
+        " %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+        el->label, el->name, el->factory, stats[e].in, stats[e].out,
+        proc_avg / 1000.0, proc_p95 / 1000.0, proc_max / 1000.0,
+        lat_avg / 1000.0, lat_p95 / 1000.0, lat_max / 1000.0);
+  }
+
+  fprintf (out, "\n%-4s %-16s %10s %10s %8s\n", "tid", "thread", "events",
+      "dropped", "cpu-%");
+  for (t = 0; t < pipeline_trace.threads->len; t++) {
+    PipelineTraceThread *thread = g_ptr_array_index (pipeline_trace.threads, t);
+    gint head = g_atomic_int_get (&thread->head);
+
+    fprintf (out, "%-4u %-16s %10d %10d %8.1f\n", thread->tid, thread->name,
+        head, MAX (0, head - PIPELINE_TRACE_EVENTS_PER_THREAD),
+        wall ? 100.0 * (thread->cpu_end - thread->cpu_start) / wall : 0.0);
+  }
+
+  pipeline_trace_stats_free (stats, pipeline_trace.elements->len);
+  g_mutex_unlock (&pipeline_trace.lock);
+}
+
+typedef struct
+{
+  FILE *f;
+  gboolean first;
+} PipelineTraceChrome;
+
+/* @str as the contents of a JSON string, free with g_free() */
+static gchar *
+pipeline_trace_json_escape (const gchar * str)
+{
+  GString *out = g_string_sized_new (strlen (str));
+  const gchar *p;
+
+  for (p = str; *p; p++) {
+    switch (*p) {
+      case '"':
+        g_string_append (out, "\\\"");
+        break;
+      case '\\':
+        g_string_append (out, "\\\\");
+        break;
+      case '\n':
+        g_string_append (out, "\\n");
+        break;
+      case '\r':
+        g_string_append (out, "\\r");
+        break;
+      case '\t':
+        g_string_append (out, "\\t");
+        break;
+      default:
+        if ((guchar) * p < 0x20)
+          g_string_append_printf (out, "\\u%04x", (guchar) * p);
+        else
+          g_string_append_c (out, *p);
+        break;
+    }
+  }
+  return g_string_free (out, FALSE);
+}
+
+static void
+pipeline_trace_chrome_span (const PipelineTraceSpan * span, gpointer user_data)
+{
+  PipelineTraceChrome *chrome = user_data;
+  PipelineTraceElement *el;
+  gchar *name, *label;
+
+  el = g_ptr_array_index (pipeline_trace.elements, span->element);
+  name = pipeline_trace_json_escape (el->name);
+  label = pipeline_trace_json_escape (el->label);
+
+  /* cross-thread spans get their own track per element so they don't
+   * overlap the streaming thread's processing slices */
+  fprintf (chrome->f,
+      "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+      "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", chrome->first ? "" : ",",
+      name, label,
+      span->cross_thread ? 1000 + span->element : span->thread,
+      (span->start - pipeline_trace.origin) / 1000.0, span->dur / 1000.0);
+  chrome->first = FALSE;
+  g_free (name);
+  g_free (label);
+}
+
+/* Write a Chrome trace-event JSON file, loadable in chrome://tracing and
+ * ui.perfetto.dev. */
+static gboolean G_GNUC_UNUSED
+pipeline_trace_write_chrome (const gchar * path, GError ** error)
+{
+  PipelineTraceChrome chrome;
+  PipelineTraceStats *stats;
+  guint e, t;
+
+  if (pipeline_trace.threads == NULL) {
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+        "tracing was not enabled");
+    return FALSE;
+  }
+
+  chrome.f = fopen (path, "w");
+  if (chrome.f == NULL) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "Could not open %s: %s", path, g_strerror (errno));
+    return FALSE;
+  }
+  chrome.first = TRUE;
+
+  g_mutex_lock (&pipeline_trace.lock);
+  fprintf (chrome.f, "{\"traceEvents\":[");
+
+  for (t = 0; t < pipeline_trace.threads->len; t++) {
+    PipelineTraceThread *thread = g_ptr_array_index (pipeline_trace.threads, t);
+    gchar *name = pipeline_trace_json_escape (thread->name[0] ? thread->name :
+        "streaming");
+
+    fprintf (chrome.f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+        "\"tid\":%u,\"args\":{\"name\":\"%s\"}}", chrome.first ? "" : ",",
+        thread->tid, name);
+    chrome.first = FALSE;
+    g_free (name);
+  }
+  for (e = 0; e < pipeline_trace.elements->len; e++) {
+    PipelineTraceElement *el = g_ptr_array_index (pipeline_trace.elements, e);
+    gchar *name = pipeline_trace_json_escape (el->name);
+    gchar *label = pipeline_trace_json_escape (el->label);
+
+    fprintf (chrome.f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+        "\"tid\":%u,\"args\":{\"name\":\"%s %s\"}}", chrome.first ? "" : ",",
+        1000 + e, label, name);
+    chrome.first = FALSE;
+    g_free (name);
+    g_free (label);
+  }
+
+  stats = pipeline_trace_analyse (pipeline_trace_chrome_span, &chrome);
+  pipeline_trace_stats_free (stats, pipeline_trace.elements->len);
+
+  fprintf (chrome.f, "\n]}\n");
+  g_mutex_unlock (&pipeline_trace.lock);
+
+  fclose (chrome.f);
+  return TRUE;
+}
+
+G_END_DECLS
+
+#endif /* __PIPELINE_TRACE_H__ */
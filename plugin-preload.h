@@ -0,0 +1,232 @@
+/* Registry cache and plugin preloading for a faster GStreamer start
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   static PluginPreload preload;
+ *
+ *   g_option_context_add_group (ctx, plugin_preload_get_option_group (&preload));
+ *   g_option_context_add_group (ctx, gst_init_get_option_group ());
+ *   g_option_context_parse (ctx, ...);
+ *   plugin_preload_validate (&preload, factories);
+ *   plugin_preload_load (factories);
+ *
+ * By default gst_init() stats every plugin file and rescans the changed
+ * ones before it returns. With --fast-start the registry is kept in its own
+ * cache file, and once that cache exists gst_init() loads it as is.
+ * plugin_preload_validate() then checks the cache against the plugin files
+ * and the factories the program needs, and only rescans when a plugin
+ * directory or file is newer than the cache or a factory is missing.
+ *
+ * plugin_preload_load() loads the plugins of exactly @factories up front,
+ * where parse_launch would load them one at a time while building the
+ * first pipeline.
+ *
+ * The option group must come before GStreamer's: its parse hook sets the
+ * environment the registry is loaded with.
+ */
+
+#ifndef __PLUGIN_PRELOAD_H__
+#define __PLUGIN_PRELOAD_H__
+
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct
+{
+  gboolean enabled;             /* --fast-start */
+  gchar *cache;                 /* --registry-cache */
+
+  gboolean cache_loaded;        /* gst_init() used the cache without a scan */
+  gboolean rebuilt;             /* the cache was missing or stale */
+} PluginPreload;
+
+static gboolean
+plugin_preload_post_parse (GOptionContext * context, GOptionGroup * group,
+    gpointer data, GError ** error)
+{
+  PluginPreload *pp = data;
+  gchar *dir;
+
+  if (!pp->enabled)
+    return TRUE;
+
+  if (!pp->cache)
+    pp->cache = g_build_filename (g_get_user_cache_dir (), "gstcameraapp",
+        "registry-" G_STRINGIFY (GLIB_SIZEOF_VOID_P) ".bin", NULL);
+  dir = g_path_get_dirname (pp->cache);
+  g_mkdir_with_parents (dir, 0755);
+  g_free (dir);
+
+  /* an explicit GST_REGISTRY or GST_REGISTRY_UPDATE wins */
+  g_setenv ("GST_REGISTRY", pp->cache, FALSE);
+  if (g_file_test (pp->cache, G_FILE_TEST_EXISTS)) {
+    pp->cache_loaded = g_setenv ("GST_REGISTRY_UPDATE", "no", FALSE) &&
+        strcmp (g_getenv ("GST_REGISTRY_UPDATE"), "no") == 0;
+  } else {
+    pp->rebuilt = TRUE;
+  }
+
+  return TRUE;
+}
+
+static GOptionGroup * G_GNUC_UNUSED
+plugin_preload_get_option_group (PluginPreload * pp)
+{
+  GOptionEntry entries[] = {
+    {"fast-start", 0, 0, G_OPTION_ARG_NONE, &pp->enabled,
+        "Start from a validated registry cache and preload the plugins in "
+          "use", NULL},
+    {"registry-cache", 0, 0, G_OPTION_ARG_FILENAME, &pp->cache,
+        "Registry cache for --fast-start (default in the user cache "
+          "directory)", "FILE"},
+    {NULL}
+  };
+  GOptionGroup *group = g_option_group_new ("startup", "Startup options:",
+      "Show startup options", pp, NULL);
+
+  g_option_group_add_entries (group, entries);
+  g_option_group_set_parse_hooks (group, NULL, plugin_preload_post_parse);
+
+  return group;
+}
+
+static gboolean
+plugin_preload_newer (const gchar * path, GStatBuf * than)
+{
+  GStatBuf st;
+
+  return g_stat (path, &st) == 0 && st.st_mtime > than->st_mtime;
+}
+
+/* TRUE when a plugin file or directory changed after @cache was written;
+ * a plugin added or removed changes the mtime of its directory */
+static gboolean
+plugin_preload_cache_stale (const gchar * cache)
+{
+  GList *plugins, *l;
+  GStatBuf cache_st;
+  GHashTable *dirs;
+  gboolean stale = FALSE;
+
+  if (g_stat (cache, &cache_st) != 0)
+    return TRUE;
+
+  dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  plugins = gst_registry_get_plugin_list (gst_registry_get ());
+  for (l = plugins; l && !stale; l = l->next) {
+    const gchar *filename = gst_plugin_get_filename (l->data);
+    gchar *dir;
+
+    /* static plugins have no file */
+    if (!filename)
+      continue;
+    stale = plugin_preload_newer (filename, &cache_st);
+    dir = g_path_get_dirname (filename);
+    if (!g_hash_table_contains (dirs, dir))
+      stale |= plugin_preload_newer (dir, &cache_st);
+    g_hash_table_add (dirs, dir);
+    if (stale)
+      GST_INFO ("registry cache older than %s", filename);
+  }
+  gst_plugin_list_free (plugins);
+  g_hash_table_unref (dirs);
+
+  return stale;
+}
+
+static gboolean
+plugin_preload_has_factories (const gchar ** factories)
+{
+  GstRegistry *registry = gst_registry_get ();
+  const gchar **name;
+
+  for (name = factories; name && *name; name++) {
+    GstPluginFeature *feature = gst_registry_find_feature (registry, *name,
+        GST_TYPE_ELEMENT_FACTORY);
+
+    if (!feature) {
+      GST_INFO ("registry cache has no %s", *name);
+      return FALSE;
+    }
+    gst_object_unref (feature);
+  }
+  return TRUE;
+}
+
+/* Call after gst_init(). Rescans the plugins when the cache gst_init()
+ * loaded is stale or lacks one of @factories. Returns FALSE when
+ * --fast-start is off. */
+static gboolean G_GNUC_UNUSED
+plugin_preload_validate (PluginPreload * pp, const gchar ** factories)
+{
+  if (!pp->enabled)
+    return FALSE;
+  if (!pp->cache_loaded)
+    return TRUE;
+
+  if (plugin_preload_cache_stale (pp->cache) ||
+      !plugin_preload_has_factories (factories)) {
+    g_setenv ("GST_REGISTRY_UPDATE", "yes", TRUE);
+    gst_update_registry ();
+    pp->cache_loaded = FALSE;
+    pp->rebuilt = TRUE;
+  }
+  return TRUE;
+}
+
+/* "warm" when gst_init() started from a valid cache, "cold" when the cache
+ * had to be written, "default" without --fast-start */
+static const gchar * G_GNUC_UNUSED
+plugin_preload_describe (PluginPreload * pp)
+{
+  if (!pp->enabled)
+    return "default";
+  return pp->rebuilt ? "cold" : "warm";
+}
+
+/* Load the plugins of @factories; returns how many are missing */
+static guint G_GNUC_UNUSED
+plugin_preload_load (const gchar ** factories)
+{
+  GstRegistry *registry = gst_registry_get ();
+  const gchar **name;
+  guint missing = 0;
+
+  for (name = factories; name && *name; name++) {
+    GstPluginFeature *feature = gst_registry_find_feature (registry, *name,
+        GST_TYPE_ELEMENT_FACTORY);
+    GstPluginFeature *loaded;
+
+    if (!feature) {
+      GST_WARNING ("No element %s to preload", *name);
+      missing++;
+      continue;
+    }
+    loaded = gst_plugin_feature_load (feature);
+    if (loaded)
+      gst_object_unref (loaded);
+    gst_object_unref (feature);
+  }
+
+  return missing;
+}
+
+G_END_DECLS
+
+#endif /* __PLUGIN_PRELOAD_H__ */
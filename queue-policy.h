@@ -0,0 +1,499 @@
+/* Backpressure policies with drop accounting for the pipeline queues
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * A policy is a mode plus a max-latency bound, written "mode[:ms]":
+ *
+ *   block         upstream waits once max-latency is queued (queue default)
+ *   leak-oldest   queued buffers are dropped to make room (leaky=downstream)
+ *   leak-newest   incoming buffers are dropped while full (leaky=upstream)
+ *   keyframe      above half the bound, delta frames are dropped up to the
+ *                 next keyframe; keyframes are only held back by the bound
+ *
+ * The bound replaces the queue's buffer and byte limits so a queue holds at
+ * most max-latency of data whatever the frame size. Every drop is counted
+ * with its reason. leak-newest refuses buffers in its own probe while the
+ * queue is full; for leak-oldest each buffer arriving at a full queue
+ * counts as one leaked from the head, so the queue's own locking is left
+ * untouched. Buffers a flush, the READY state or finalizing removes from
+ * the queue are no drops: they are counted apart as flushed, from the
+ * level at FLUSH_START and from the buffers that never left once the
+ * queue is gone. Each queue has its own counters; reports sum them per
+ * queue name, so the queue of every new RTSP media adds to those that
+ * came before it.
+ */
+
+#ifndef __QUEUE_POLICY_H__
+#define __QUEUE_POLICY_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+  QUEUE_POLICY_BLOCK,
+  QUEUE_POLICY_LEAK_OLDEST,
+  QUEUE_POLICY_LEAK_NEWEST,
+  QUEUE_POLICY_KEYFRAME
+} QueuePolicyMode;
+
+typedef enum
+{
+  QUEUE_DROP_OLDEST,            /* leaked from the head of the queue */
+  QUEUE_DROP_NEWEST,            /* refused at the tail of the queue */
+  QUEUE_DROP_LATENCY,           /* refused above the keyframe watermark */
+  QUEUE_DROP_GOP,               /* delta frame after a dropped reference */
+  QUEUE_DROP_N_REASONS
+} QueueDropReason;
+
+static const gchar *queue_policy_mode_names[] = {
+  "block", "leak-oldest", "leak-newest", "keyframe"
+};
+
+static const gchar *queue_drop_reason_names[] = {
+  "oldest", "newest", "latency", "gop"
+};
+
+typedef struct _QueuePolicyGroup QueuePolicyGroup;
+
+/* One per queue, kept as qdata on it */
+typedef struct
+{
+  QueuePolicyGroup *group;
+  QueuePolicyMode mode;
+  GstClockTime max_latency;
+
+  /* written from streaming threads */
+  guint64 in;
+  guint64 out;
+  guint64 dropped[QUEUE_DROP_N_REASONS];
+  guint64 blocked;
+  guint64 flushed;              /* at FLUSH_START */
+  gint dropping_gop;
+} QueuePolicy;
+
+/* Every queue of one name, e.g. the q0 of each RTSP media */
+struct _QueuePolicyGroup
+{
+  gchar *name;
+  QueuePolicyMode mode;         /* of the queue applied last */
+  GstClockTime max_latency;
+  GList *policies;              /* QueuePolicy of the queues still alive */
+
+  /* counts of the queues that are gone */
+  guint64 dropped[QUEUE_DROP_N_REASONS];
+  guint64 blocked;
+  guint64 flushed;
+};
+
+static GMutex queue_policy_lock;
+static GHashTable *queue_policy_registry;
+
+static GQuark
+queue_policy_quark (void)
+{
+  return g_quark_from_static_string ("queue-policy");
+}
+
+/* Parse "mode[:ms]". @max_latency is left untouched when no bound is
+ * given. */
+static gboolean G_GNUC_UNUSED
+queue_policy_parse (const gchar * spec, QueuePolicyMode * mode,
+    GstClockTime * max_latency)
+{
+  const gchar *colon = strchr (spec, ':');
+  gsize len = colon ? (gsize) (colon - spec) : strlen (spec);
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (queue_policy_mode_names); i++) {
+    if (strlen (queue_policy_mode_names[i]) == len &&
+        strncmp (spec, queue_policy_mode_names[i], len) == 0)
+      break;
+  }
+  if (i == G_N_ELEMENTS (queue_policy_mode_names))
+    return FALSE;
+
+  *mode = i;
+  if (colon) {
+    gint ms = atoi (colon + 1);
+
+    if (ms <= 0)
+      return FALSE;
+    *max_latency = ms * GST_MSECOND;
+  }
+  return TRUE;
+}
+
+
+static void
+queue_policy_drop (QueuePolicy * policy, QueueDropReason reason,
+    GstBuffer * buffer)
+{
+  __atomic_fetch_add (&policy->dropped[reason], 1, __ATOMIC_RELAXED);
+  GST_LOG ("%s: dropping %" GST_PTR_FORMAT " (%s)", policy->group->name,
+      buffer, queue_drop_reason_names[reason]);
+}
+
+/* Call with the lock held */
+static guint64
+queue_policy_group_dropped (QueuePolicyGroup * group, QueueDropReason reason)
+{
+  guint64 dropped = group->dropped[reason];
+  GList *l;
+
+  for (l = group->policies; l; l = l->next)
+    dropped += __atomic_load_n (&((QueuePolicy *) l->data)->dropped[reason],
+        __ATOMIC_RELAXED);
+  return dropped;
+}
+
+/* Call with the lock held */
+static guint64
+queue_policy_group_flushed (QueuePolicyGroup * group)
+{
+  guint64 flushed = group->flushed;
+  GList *l;
+
+  for (l = group->policies; l; l = l->next)
+    flushed += __atomic_load_n (&((QueuePolicy *) l->data)->flushed,
+        __ATOMIC_RELAXED);
+  return flushed;
+}
+
+/* Call with the lock held */
+static guint64
+queue_policy_group_blocked (QueuePolicyGroup * group)
+{
+  guint64 blocked = group->blocked;
+  GList *l;
+
+  for (l = group->policies; l; l = l->next)
+    blocked += __atomic_load_n (&((QueuePolicy *) l->data)->blocked,
+        __ATOMIC_RELAXED);
+  return blocked;
+}
+
+/* The queue is finalized, no probe runs anymore: its counts move to the
+ * group. Whatever went in and neither came out nor leaked was flushed, at
+ * a FLUSH_START, going to READY or just now; that includes the flushes
+ * already counted. */
+static void
+queue_policy_retire (QueuePolicy * policy)
+{
+  QueuePolicyGroup *group = policy->group;
+  guint64 gone = policy->out + policy->dropped[QUEUE_DROP_OLDEST];
+  guint r;
+
+  g_mutex_lock (&queue_policy_lock);
+  for (r = 0; r < QUEUE_DROP_N_REASONS; r++)
+    group->dropped[r] += policy->dropped[r];
+  group->blocked += policy->blocked;
+  group->flushed += MAX (policy->flushed,
+      policy->in > gone ? policy->in - gone : 0);
+  group->policies = g_list_remove (group->policies, policy);
+  g_mutex_unlock (&queue_policy_lock);
+
+  g_free (policy);
+}
+
+static GstPadProbeReturn
+queue_policy_sink_probe (GstPad * pad, GstPadProbeInfo * info,
+    QueuePolicy * policy)
+{
+  GstElement *queue = GST_ELEMENT (GST_PAD_PARENT (pad));
+  GstClockTime level = 0;
+  GstBuffer *buffer;
+  guint n = 1;
+
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_FLUSH) {
+    guint queued = 0;
+
+    /* the queue empties itself once the event reaches it, right after */
+    if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) ==
+        GST_EVENT_FLUSH_START) {
+      g_object_get (queue, "current-level-buffers", &queued, NULL);
+      __atomic_fetch_add (&policy->flushed, queued, __ATOMIC_RELAXED);
+    }
+    return GST_PAD_PROBE_OK;
+  }
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    n = gst_buffer_list_length (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+    buffer = n ? gst_buffer_list_get (GST_PAD_PROBE_INFO_BUFFER_LIST (info),
+        0) : NULL;
+  } else {
+    buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  }
+
+  if (policy->mode != QUEUE_POLICY_BLOCK)
+    g_object_get (queue, "current-level-time", &level, NULL);
+
+  /* full: the queue would refuse it or leak its head to make room */
+  if (policy->mode == QUEUE_POLICY_LEAK_NEWEST && level >= policy->max_latency) {
+    __atomic_fetch_add (&policy->dropped[QUEUE_DROP_NEWEST], n,
+        __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_DROP;
+  }
+  if (policy->mode == QUEUE_POLICY_LEAK_OLDEST && level >= policy->max_latency)
+    __atomic_fetch_add (&policy->dropped[QUEUE_DROP_OLDEST], n,
+        __ATOMIC_RELAXED);
+
+  if (policy->mode == QUEUE_POLICY_KEYFRAME && buffer) {
+    gboolean delta = GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    if (!delta)
+      g_atomic_int_set (&policy->dropping_gop, 0);
+
+    if (delta && g_atomic_int_get (&policy->dropping_gop)) {
+      queue_policy_drop (policy, QUEUE_DROP_GOP, buffer);
+      return GST_PAD_PROBE_DROP;
+    }
+
+    if (level >= policy->max_latency / 2) {
+      if (delta) {
+        /* everything up to the next keyframe references this one */
+        g_atomic_int_set (&policy->dropping_gop, 1);
+        queue_policy_drop (policy, QUEUE_DROP_GOP, buffer);
+        return GST_PAD_PROBE_DROP;
+      }
+      /* raw video has no delta units, each frame stands alone */
+      if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_HEADER) &&
+          level >= policy->max_latency * 3 / 4) {
+        queue_policy_drop (policy, QUEUE_DROP_LATENCY, buffer);
+        return GST_PAD_PROBE_DROP;
+      }
+    }
+  }
+
+  __atomic_fetch_add (&policy->in, n, __ATOMIC_RELAXED);
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+queue_policy_src_probe (GstPad * pad, GstPadProbeInfo * info,
+    QueuePolicy * policy)
+{
+  guint n = 1;
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+    n = gst_buffer_list_length (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+
+  __atomic_fetch_add (&policy->out, n, __ATOMIC_RELAXED);
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+queue_policy_overrun (GstElement * queue, QueuePolicy * policy)
+{
+  if (policy->mode == QUEUE_POLICY_BLOCK
+      || policy->mode == QUEUE_POLICY_KEYFRAME)
+    __atomic_fetch_add (&policy->blocked, 1, __ATOMIC_RELAXED);
+}
+
+/* Configure @queue for @mode with at most @max_latency queued and start
+ * counting. The counters belong to @queue; they are reported together with
+ * those of every other queue of the same name, alive or gone. */
+static QueuePolicy * G_GNUC_UNUSED
+queue_policy_apply (GstElement * queue, QueuePolicyMode mode,
+    GstClockTime max_latency)
+{
+  static const gint leaky[] = { 0, 2, 1, 0 };
+  QueuePolicyGroup *group;
+  QueuePolicy *policy;
+  GstPad *pad;
+  gchar *name;
+
+  /* re-applying only retunes, the probes are already in place */
+  policy = g_object_get_qdata (G_OBJECT (queue), queue_policy_quark ());
+  if (policy) {
+    g_mutex_lock (&queue_policy_lock);
+    policy->mode = policy->group->mode = mode;
+    policy->max_latency = policy->group->max_latency = max_latency;
+    g_mutex_unlock (&queue_policy_lock);
+    g_object_set (queue, "leaky", leaky[mode], "max-size-time", max_latency,
+        NULL);
+    return policy;
+  }
+
+  name = gst_element_get_name (queue);
+
+  g_mutex_lock (&queue_policy_lock);
+  if (queue_policy_registry == NULL)
+    queue_policy_registry = g_hash_table_new (g_str_hash, g_str_equal);
+
+  group = g_hash_table_lookup (queue_policy_registry, name);
+  if (group == NULL) {
+    group = g_new0 (QueuePolicyGroup, 1);
+    group->name = name;
+    g_hash_table_insert (queue_policy_registry, group->name, group);
+  } else {
+    g_free (name);
+  }
+  policy = g_new0 (QueuePolicy, 1);
+  policy->group = group;
+  policy->mode = group->mode = mode;
+  policy->max_latency = group->max_latency = max_latency;
+  group->policies = g_list_prepend (group->policies, policy);
+  g_mutex_unlock (&queue_policy_lock);
+
+  g_object_set_qdata_full (G_OBJECT (queue), queue_policy_quark (), policy,
+      (GDestroyNotify) queue_policy_retire);
+
+  g_object_set (queue, "leaky", leaky[mode], "max-size-time", max_latency,
+      "max-size-buffers", 0, "max-size-bytes", 0, NULL);
+
+  pad = gst_element_get_static_pad (queue, "sink");
+  gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST |
+      GST_PAD_PROBE_TYPE_EVENT_FLUSH,
+      (GstPadProbeCallback) queue_policy_sink_probe, policy, NULL);
+  gst_object_unref (pad);
+
+  pad = gst_element_get_static_pad (queue, "src");
+  gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      (GstPadProbeCallback) queue_policy_src_probe, policy, NULL);
+  gst_object_unref (pad);
+
+  g_signal_connect (queue, "overrun", G_CALLBACK (queue_policy_overrun),
+      policy);
+
+  GST_INFO ("%s: policy %s, max latency %" GST_TIME_FORMAT, group->name,
+      queue_policy_mode_names[mode], GST_TIME_ARGS (max_latency));
+
+  return policy;
+}
+
+/* Apply the "name=mode[:ms]" entries of @specs to the matching queues of
+ * @bin; names that are not found are ignored. */
+static void G_GNUC_UNUSED
+queue_policy_apply_specs (GstElement * bin, gchar ** specs)
+{
+  gchar **spec;
+
+  for (spec = specs; spec && *spec; spec++) {
+    gchar **kv = g_strsplit (*spec, "=", 2);
+    QueuePolicyMode mode;
+    GstClockTime max_latency;
+    GstElement *queue = NULL;
+
+    if (kv[0] && kv[1])
+      queue = gst_bin_get_by_name (GST_BIN (bin), kv[0]);
+
+    if (queue) {
+      /* without an explicit bound the queue keeps its max-size-time */
+      g_object_get (queue, "max-size-time", &max_latency, NULL);
+      if (queue_policy_parse (kv[1], &mode, &max_latency))
+        queue_policy_apply (queue, mode, max_latency);
+      else
+        g_printerr ("Invalid queue policy '%s'\n", *spec);
+      gst_object_unref (queue);
+    }
+    g_strfreev (kv);
+  }
+}
+
+/* Buffers dropped so far by the queues named @name, whatever the reason;
+ * 0 for a name no policy was applied to. */
+static guint64 G_GNUC_UNUSED
+queue_policy_dropped_total (const gchar * name)
+{
+  QueuePolicyGroup *group = NULL;
+  guint64 dropped = 0;
+  guint r;
+
+  g_mutex_lock (&queue_policy_lock);
+  if (queue_policy_registry)
+    group = g_hash_table_lookup (queue_policy_registry, name);
+  for (r = 0; group && r < QUEUE_DROP_N_REASONS; r++)
+    dropped += queue_policy_group_dropped (group, r);
+  g_mutex_unlock (&queue_policy_lock);
+
+  return dropped;
+}
+
+/* One line per queue and drop reason. */
+static void G_GNUC_UNUSED
+queue_policy_print_summary (FILE * out)
+{
+  GHashTableIter iter;
+  QueuePolicyGroup *group;
+  guint r;
+
+  g_mutex_lock (&queue_policy_lock);
+  if (queue_policy_registry) {
+    g_hash_table_iter_init (&iter, queue_policy_registry);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) & group)) {
+      fprintf (out, "%-16s %-12s max %4" G_GUINT64_FORMAT " ms  blocked %"
+          G_GUINT64_FORMAT, group->name, queue_policy_mode_names[group->mode],
+          group->max_latency / GST_MSECOND, queue_policy_group_blocked (group));
+      for (r = 0; r < QUEUE_DROP_N_REASONS; r++)
+        fprintf (out, "  %s %" G_GUINT64_FORMAT, queue_drop_reason_names[r],
+            queue_policy_group_dropped (group, r));
+      fprintf (out, "  (flushed %" G_GUINT64_FORMAT ")\n",
+          queue_policy_group_flushed (group));
+    }
+  }
+  g_mutex_unlock (&queue_policy_lock);
+}
+
+#ifdef __STREAM_METRICS_H__
+static void G_GNUC_UNUSED
+queue_policy_collect_metrics (StreamMetricsScrape * scrape, gpointer user_data)
+{
+  GHashTableIter iter;
+  QueuePolicyGroup *group;
+  gchar *name, *labels;
+  guint r;
+
+  g_mutex_lock (&queue_policy_lock);
+  if (queue_policy_registry) {
+    g_hash_table_iter_init (&iter, queue_policy_registry);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) & group)) {
+      name = stream_metrics_escape_label (group->name);
+      labels = g_strdup_printf ("queue=\"%s\",policy=\"%s\"", name,
+          queue_policy_mode_names[group->mode]);
+      stream_metrics_emit (scrape, "queue_max_latency_seconds", "gauge",
+          "Latency bound of a queue", labels,
+          (gdouble) group->max_latency / GST_SECOND);
+      stream_metrics_emit (scrape, "queue_blocked_total", "counter",
+          "Times upstream was blocked by a full queue", labels,
+          queue_policy_group_blocked (group));
+      stream_metrics_emit (scrape, "queue_flushed_total", "counter",
+          "Buffers removed by a flush or stop, not dropped by the policy",
+          labels, queue_policy_group_flushed (group));
+      g_free (labels);
+
+      for (r = 0; r < QUEUE_DROP_N_REASONS; r++) {
+        labels = g_strdup_printf ("queue=\"%s\",reason=\"%s\"", name,
+            queue_drop_reason_names[r]);
+        stream_metrics_emit (scrape, "queue_dropped_total", "counter",
+            "Buffers dropped by a queue policy", labels,
+            queue_policy_group_dropped (group, r));
+        g_free (labels);
+      }
+      g_free (name);
+    }
+  }
+  g_mutex_unlock (&queue_policy_lock);
+}
+#endif
+
+G_END_DECLS
+
+#endif /* __QUEUE_POLICY_H__ */
@@ -0,0 +1,485 @@
+/* Region-of-interest encoding for the RTSP encode path
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   RoiEncoder *roi = roi_encoder_new (8);
+ *   roi_encoder_add_rect (roi, &rect);        (static regions, and/or)
+ *   roi_encoder_set_motion (roi, motion);     (regions from motion-detect.h)
+ *   roi_encoder_set_pixelate (roi, TRUE);     (optional, see below)
+ *   roi_encoder_attach (roi, encoder);
+ *
+ * Frames reaching the encoder keep the GstVideoRegionOfInterestMeta they
+ * already carry. Frames without any get one meta per motion region or
+ * static rectangle; roi_encoder_tag_pad() does the same at any other pad.
+ * Every ROI meta gets a "roi/<encoder>" (or "roi/vaapi") param with
+ * delta-qp = -delta_qp; roi_encoder_tag_pad() knows no encoder and uses
+ * "roi/x264enc".
+ *
+ * Encoders that read those params (vaapi, msdk, qsv) lower QP inside the
+ * regions themselves, and rate control raises it elsewhere. x264enc has no
+ * per-macroblock QP input in GStreamer and ignores the metas, so for it,
+ * and any other encoder, the frames are left untouched by default.
+ *
+ * roi_encoder_set_pixelate() opts into a crude emulation for those
+ * encoders: everything outside the regions is flattened to its block
+ * averages before encoding, in blocks of 2, 4 or 8 pixels for a delta of
+ * up to 6, 12 or more. This is not a QP offset: the background detail is
+ * destroyed, not coarsely quantized, and shows as visible blocks. Only
+ * the bits it saves go to the regions.
+ */
+
+#ifndef __ROI_ENCODE_H__
+#define __ROI_ENCODE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include "motion-detect.h"
+
+G_BEGIN_DECLS
+
+#define ROI_MAX_RECTS 16
+
+typedef struct
+{
+  GMutex lock;
+  GArray *rects;                /* GstVideoRectangle in encoded pixels */
+  MotionDetector *motion;
+  gint delta_qp;
+  gboolean pixelate;
+
+  guint64 frames;
+  guint64 roi_frames;
+  guint64 inside_blocks;
+  guint64 total_blocks;
+} RoiEncoder;
+
+/* One encoder input, owned by its probe; streaming thread only */
+typedef struct
+{
+  RoiEncoder *re;
+  gchar *param_name;
+  gboolean native;
+  GstVideoInfo info;
+  gboolean have_info;
+  guint8 *inside;
+  gsize inside_size;
+} RoiEncoderPad;
+
+/* the param of metas tagged away from an encoder */
+#define ROI_DEFAULT_PARAM "roi/x264enc"
+
+static RoiEncoder * G_GNUC_UNUSED
+roi_encoder_new (gint delta_qp)
+{
+  RoiEncoder *re = g_new0 (RoiEncoder, 1);
+
+  g_mutex_init (&re->lock);
+  re->rects = g_array_new (FALSE, FALSE, sizeof (GstVideoRectangle));
+  re->delta_qp = ABS (delta_qp);
+
+  return re;
+}
+
+/* Free once the pipelines using @re are back in NULL */
+static void G_GNUC_UNUSED
+roi_encoder_free (RoiEncoder * re)
+{
+  g_array_free (re->rects, TRUE);
+  g_mutex_clear (&re->lock);
+  g_free (re);
+}
+
+/* Parse "X,Y,W,H" in encoded pixels */
+static gboolean G_GNUC_UNUSED
+roi_encoder_parse_rect (const gchar * spec, GstVideoRectangle * rect)
+{
+  if (sscanf (spec, "%d,%d,%d,%d", &rect->x, &rect->y, &rect->w,
+          &rect->h) != 4 || rect->x < 0 || rect->y < 0 || rect->w <= 0 ||
+      rect->h <= 0) {
+    g_printerr ("Invalid region '%s', expected X,Y,W,H\n", spec);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void G_GNUC_UNUSED
+roi_encoder_add_rect (RoiEncoder * re, const GstVideoRectangle * rect)
+{
+  g_mutex_lock (&re->lock);
+  g_array_append_val (re->rects, *rect);
+  g_mutex_unlock (&re->lock);
+}
+
+/* Also use the moving blocks of @motion as regions, scaled to each frame */
+static void G_GNUC_UNUSED
+roi_encoder_set_motion (RoiEncoder * re, MotionDetector * motion)
+{
+  g_mutex_lock (&re->lock);
+  re->motion = motion;
+  g_mutex_unlock (&re->lock);
+}
+
+/* Pixelate the background for encoders that ignore the ROI metas; has no
+ * effect on those that read them */
+static void G_GNUC_UNUSED
+roi_encoder_set_pixelate (RoiEncoder * re, gboolean pixelate)
+{
+  re->pixelate = pixelate;
+}
+
+/*
+ * Tagging
+ */
+static guint
+roi_encoder_count_metas (GstBuffer * buffer)
+{
+  gpointer state = NULL;
+  guint n = 0;
+
+  while (gst_buffer_iterate_meta_filtered (buffer, &state,
+          GST_VIDEO_REGION_OF_INTEREST_META_API_TYPE))
+    n++;
+  return n;
+}
+
+static void
+roi_encoder_add_meta (RoiEncoder * re, GstBuffer * buffer,
+    const gchar * param_name, const gchar * type, gint x, gint y, gint w,
+    gint h)
+{
+  GstVideoRegionOfInterestMeta *meta;
+
+  meta = gst_buffer_add_video_region_of_interest_meta (buffer, type, x, y, w,
+      h);
+  gst_video_region_of_interest_meta_add_param (meta,
+      gst_structure_new (param_name, "delta-qp", G_TYPE_INT,
+          -re->delta_qp, NULL));
+}
+
+/* Moving blocks are merged into rectangles: runs of blocks within a row,
+ * then identical runs in consecutive rows. */
+static guint
+roi_encoder_add_motion_metas (RoiEncoder * re, GstBuffer * buffer,
+    const gchar * param_name, gint width, gint height)
+{
+  guint32 mask[MOTION_ROWS];
+  gint run_start[MOTION_ROWS * MOTION_COLS], run_end[MOTION_ROWS * MOTION_COLS];
+  gint run_top[MOTION_ROWS * MOTION_COLS], run_rows[MOTION_ROWS * MOTION_COLS];
+  gint n_runs = 0, first_of_row, r, c, i;
+  guint added = 0;
+
+  if (!re->motion || !motion_detector_get_mask (re->motion, mask))
+    return 0;
+
+  for (r = 0; r < MOTION_ROWS; r++) {
+    first_of_row = n_runs;
+    for (c = 0; c < MOTION_COLS; c++) {
+      gint start;
+
+      if (!(mask[r] & (1u << c)))
+        continue;
+      start = c;
+      while (c + 1 < MOTION_COLS && (mask[r] & (1u << (c + 1))))
+        c++;
+
+      /* extend a run ending on the previous row with the same columns */
+      for (i = 0; i < first_of_row; i++) {
+        if (run_start[i] == start && run_end[i] == c &&
+            run_top[i] + run_rows[i] == r) {
+          run_rows[i]++;
+          break;
+        }
+      }
+      if (i == first_of_row) {
+        run_start[n_runs] = start;
+        run_end[n_runs] = c;
+        run_top[n_runs] = r;
+        run_rows[n_runs] = 1;
+        n_runs++;
+      }
+    }
+  }
+
+  for (i = 0; i < n_runs && added < ROI_MAX_RECTS; i++, added++) {
+    gint x0 = run_start[i] * width / MOTION_COLS;
+    gint x1 = (run_end[i] + 1) * width / MOTION_COLS;
+    gint y0 = run_top[i] * height / MOTION_ROWS;
+    gint y1 = (run_top[i] + run_rows[i]) * height / MOTION_ROWS;
+
+    roi_encoder_add_meta (re, buffer, param_name, "motion", x0, y0, x1 - x0, y1 - y0);
+  }
+
+  return added;
+}
+
+/* Add ROI metas with a @param_name param to @buffer from the configured
+ * sources unless it already has some. @buffer must be writable. Returns
+ * the number of regions. */
+static guint
+roi_encoder_tag_for (RoiEncoder * re, GstBuffer * buffer,
+    const gchar * param_name, gint width, gint height)
+{
+  guint n = roi_encoder_count_metas (buffer), i;
+
+  if (n > 0)
+    return n;
+
+  g_mutex_lock (&re->lock);
+  for (i = 0; i < re->rects->len && n < ROI_MAX_RECTS; i++) {
+    GstVideoRectangle *rect = &g_array_index (re->rects, GstVideoRectangle, i);
+
+    if (rect->x >= width || rect->y >= height)
+      continue;
+    roi_encoder_add_meta (re, buffer, param_name, "static", rect->x, rect->y,
+        MIN (rect->w, width - rect->x), MIN (rect->h, height - rect->y));
+    n++;
+  }
+  n += roi_encoder_add_motion_metas (re, buffer, param_name, width, height);
+  g_mutex_unlock (&re->lock);
+
+  return n;
+}
+
+/* roi_encoder_tag_for() with the param x264enc would get */
+static guint G_GNUC_UNUSED
+roi_encoder_tag (RoiEncoder * re, GstBuffer * buffer, gint width, gint height)
+{
+  return roi_encoder_tag_for (re, buffer, ROI_DEFAULT_PARAM, width, height);
+}
+
+static GstPadProbeReturn
+roi_encoder_tag_probe (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  RoiEncoder *re = user_data;
+  GstVideoInfo vinfo;
+  GstBuffer *buffer;
+  GstCaps *caps;
+
+  caps = gst_pad_get_current_caps (pad);
+  if (!caps)
+    return GST_PAD_PROBE_OK;
+  if (gst_video_info_from_caps (&vinfo, caps)) {
+    buffer = gst_buffer_make_writable (GST_PAD_PROBE_INFO_BUFFER (info));
+    GST_PAD_PROBE_INFO_DATA (info) = buffer;
+    roi_encoder_tag (re, buffer, GST_VIDEO_INFO_WIDTH (&vinfo),
+        GST_VIDEO_INFO_HEIGHT (&vinfo));
+  }
+  gst_caps_unref (caps);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Tag buffers passing @pad, e.g. ahead of a tee so every branch sees the
+ * same regions */
+static void G_GNUC_UNUSED
+roi_encoder_tag_pad (RoiEncoder * re, GstPad * pad)
+{
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, roi_encoder_tag_probe,
+      re, NULL);
+}
+
+/*
+ * Encoder side
+ */
+
+/* Mark the blocks of @box pixels touched by a region; returns how many */
+static guint
+roi_encoder_mark_blocks (RoiEncoderPad * rp, GstBuffer * buffer, guint box,
+    guint cols, guint rows)
+{
+  GstVideoRegionOfInterestMeta *meta;
+  gpointer state = NULL;
+  guint x, y, x1, y1, marked = 0;
+
+  if (rp->inside_size < cols * rows) {
+    g_free (rp->inside);
+    rp->inside_size = cols * rows;
+    rp->inside = g_malloc (rp->inside_size);
+  }
+  memset (rp->inside, 0, cols * rows);
+
+  while ((meta = (GstVideoRegionOfInterestMeta *)
+          gst_buffer_iterate_meta_filtered (buffer, &state,
+              GST_VIDEO_REGION_OF_INTEREST_META_API_TYPE))) {
+    if (meta->w == 0 || meta->h == 0)
+      continue;
+    x1 = MIN ((meta->x + meta->w - 1) / box, cols - 1);
+    y1 = MIN ((meta->y + meta->h - 1) / box, rows - 1);
+    for (y = meta->y / box; y <= y1; y++)
+      for (x = meta->x / box; x <= x1; x++)
+        if (!rp->inside[y * cols + x]) {
+          rp->inside[y * cols + x] = 1;
+          marked++;
+        }
+  }
+
+  return marked;
+}
+
+/* Replace each block outside the regions by its average, per component */
+static void
+roi_encoder_flatten (RoiEncoderPad * rp, GstVideoFrame * frame, guint box,
+    guint cols, guint rows)
+{
+  const GstVideoFormatInfo *finfo = frame->info.finfo;
+  guint comp, bx, by, x, y;
+
+  for (comp = 0; comp < GST_VIDEO_FRAME_N_COMPONENTS (frame); comp++) {
+    guint8 *data = GST_VIDEO_FRAME_COMP_DATA (frame, comp);
+    gint stride = GST_VIDEO_FRAME_COMP_STRIDE (frame, comp);
+    gint pstride = GST_VIDEO_FRAME_COMP_PSTRIDE (frame, comp);
+    guint width = GST_VIDEO_FRAME_COMP_WIDTH (frame, comp);
+    guint height = GST_VIDEO_FRAME_COMP_HEIGHT (frame, comp);
+    guint bw = MAX (box >> GST_VIDEO_FORMAT_INFO_W_SUB (finfo, comp), 1);
+    guint bh = MAX (box >> GST_VIDEO_FORMAT_INFO_H_SUB (finfo, comp), 1);
+
+    for (by = 0; by < rows; by++) {
+      guint y0 = by * bh, y1 = MIN (y0 + bh, height);
+
+      for (bx = 0; bx < cols; bx++) {
+        guint x0 = bx * bw, x1 = MIN (x0 + bw, width), sum = 0, n, avg;
+
+        if (rp->inside[by * cols + bx] || x0 >= width || y0 >= height)
+          continue;
+
+        n = (x1 - x0) * (y1 - y0);
+        for (y = y0; y < y1; y++)
+          for (x = x0; x < x1; x++)
+            sum += data[y * stride + x * pstride];
+        avg = (sum + n / 2) / n;
+        for (y = y0; y < y1; y++)
+          for (x = x0; x < x1; x++)
+            data[y * stride + x * pstride] = avg;
+      }
+    }
+  }
+}
+
+static void
+roi_encoder_pad_free (RoiEncoderPad * rp)
+{
+  g_free (rp->param_name);
+  g_free (rp->inside);
+  g_free (rp);
+}
+
+static GstPadProbeReturn
+roi_encoder_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  RoiEncoderPad *rp = user_data;
+  RoiEncoder *re = rp->re;
+  GstVideoFrame frame;
+  GstBuffer *buffer;
+  guint box, cols, rows, marked;
+
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+
+    if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS) {
+      GstCaps *caps;
+
+      gst_event_parse_caps (event, &caps);
+      rp->have_info = gst_video_info_from_caps (&rp->info, caps) &&
+          GST_VIDEO_INFO_IS_YUV (&rp->info) &&
+          GST_VIDEO_FORMAT_INFO_BITS (rp->info.finfo) == 8;
+      if (!rp->have_info)
+        GST_WARNING ("ROI encoding needs 8-bit YUV, regions are ignored");
+    }
+    return GST_PAD_PROBE_OK;
+  }
+
+  if (!rp->have_info)
+    return GST_PAD_PROBE_OK;
+
+  buffer = gst_buffer_make_writable (GST_PAD_PROBE_INFO_BUFFER (info));
+  GST_PAD_PROBE_INFO_DATA (info) = buffer;
+  __atomic_add_fetch (&re->frames, 1, __ATOMIC_RELAXED);
+  if (roi_encoder_tag_for (re, buffer, rp->param_name,
+          GST_VIDEO_INFO_WIDTH (&rp->info),
+          GST_VIDEO_INFO_HEIGHT (&rp->info)) == 0)
+    return GST_PAD_PROBE_OK;
+  __atomic_add_fetch (&re->roi_frames, 1, __ATOMIC_RELAXED);
+
+  box = 1 << CLAMP ((re->delta_qp + 5) / 6, 1, 3);
+  cols = (GST_VIDEO_INFO_WIDTH (&rp->info) + box - 1) / box;
+  rows = (GST_VIDEO_INFO_HEIGHT (&rp->info) + box - 1) / box;
+  marked = roi_encoder_mark_blocks (rp, buffer, box, cols, rows);
+  __atomic_add_fetch (&re->inside_blocks, marked, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&re->total_blocks, cols * rows, __ATOMIC_RELAXED);
+
+  if (rp->native || !re->pixelate)
+    return GST_PAD_PROBE_OK;
+
+  if (!gst_video_frame_map (&frame, &rp->info, buffer, GST_MAP_READWRITE))
+    return GST_PAD_PROBE_OK;
+  roi_encoder_flatten (rp, &frame, box, cols, rows);
+  gst_video_frame_unmap (&frame);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Apply regions to the frames entering @encoder; each encoder keeps its
+ * own state, so encoders of several medias can run at once */
+static void G_GNUC_UNUSED
+roi_encoder_attach (RoiEncoder * re, GstElement * encoder)
+{
+  GstElementFactory *factory = gst_element_get_factory (encoder);
+  const gchar *name = factory ? GST_OBJECT_NAME (factory) : "encoder";
+  RoiEncoderPad *rp = g_new0 (RoiEncoderPad, 1);
+  GstPad *pad;
+
+  rp->re = re;
+  /* these read GstVideoRegionOfInterestMeta delta-qp themselves */
+  rp->native = g_str_has_prefix (name, "vaapi") ||
+      g_str_has_prefix (name, "msdk") || g_str_has_prefix (name, "qsv");
+  rp->param_name = g_strdup_printf ("roi/%s",
+      g_str_has_prefix (name, "vaapi") ? "vaapi" : name);
+  if (!rp->native && !re->pixelate)
+    GST_WARNING ("%s ignores regions of interest, frames are only tagged",
+        name);
+
+  pad = gst_element_get_static_pad (encoder, "sink");
+  gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+      roi_encoder_probe, rp, (GDestroyNotify) roi_encoder_pad_free);
+  gst_object_unref (pad);
+}
+
+#ifdef __STREAM_METRICS_H__
+static void G_GNUC_UNUSED
+roi_encoder_collect_metrics (StreamMetricsScrape * scrape, gpointer user_data)
+{
+  RoiEncoder *re = user_data;
+  guint64 inside = __atomic_load_n (&re->inside_blocks, __ATOMIC_RELAXED);
+  guint64 total = __atomic_load_n (&re->total_blocks, __ATOMIC_RELAXED);
+
+  stream_metrics_emit (scrape, "roi_frames_total", "counter",
+      "Frames encoded with regions of interest", NULL,
+      __atomic_load_n (&re->roi_frames, __ATOMIC_RELAXED));
+  stream_metrics_emit (scrape, "roi_area_ratio", "gauge",
+      "Average share of the frame inside regions of interest", NULL,
+      total ? (gdouble) inside / total : 0.0);
+}
+#endif
+
+G_END_DECLS
+
+#endif /* __ROI_ENCODE_H__ */
@@ -0,0 +1,592 @@
+/* Statistics of every RTSP client of the server
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   RtspClientStats *cs = rtsp_client_stats_new ();
+ *   rtsp_client_stats_attach (cs, server);
+ *   rtsp_client_stats_start_log (cs, stdout, 10);
+ *
+ *   gchar *report = rtsp_client_stats_query (cs, "; ");   from any thread
+ *
+ * Every client is tracked from its connection until it closes: its
+ * address, when it joined, the mount and session it plays, the lower
+ * transport, and how long after PLAY the first packet of the media left.
+ * While it plays, from a PLAY until its PAUSE or TEARDOWN, each query
+ * samples
+ *
+ *   - bytes and packets sent to it, from the get-stats of the media's
+ *     multiudpsinks for its RTP port; TCP interleaved data goes through
+ *     the client's own connection and is not counted
+ *   - the latest RTCP receiver report it sent, from the rtpsession of each
+ *     stream, matched by the address its RTCP came from: fraction and
+ *     packets lost, jitter and round trip
+ *
+ * All clients of a shared media get the same packets, so the one with the
+ * loss, jitter or round trip that stands out is the one with the problem.
+ * A line is printed when a client closes.
+ */
+
+#ifndef __RTSP_CLIENT_STATS_H__
+#define __RTSP_CLIENT_STATS_H__
+
+#include <stdio.h>
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/rtsp-server/rtsp-server.h>
+
+#include "stream-metrics.h"
+
+G_BEGIN_DECLS
+
+typedef struct
+{
+  GMutex lock;
+  GPtrArray *clients;           /* RtspClientEntry */
+  guint next_id;
+
+  /* main thread */
+  FILE *log;
+  guint log_id;
+} RtspClientStats;
+
+typedef struct
+{
+  guint id;
+  gchar *address;
+  gint64 join_us;
+  gint64 play_us;
+  gint64 first_packet_us;
+  gchar *path;
+  gchar *session;
+  GPtrArray *transports;        /* GstRTSPStreamTransport, one per stream */
+} RtspClientEntry;
+
+typedef struct
+{
+  const gchar *lower;           /* udp, udp-mcast, tcp */
+  gboolean have_counts;
+  guint64 bytes;
+  guint64 packets;
+  gboolean have_rb;
+  gdouble fraction_lost;        /* worst stream, 0-1 */
+  gint64 packets_lost;
+  gdouble jitter_ms;            /* worst stream */
+  gdouble rtt_ms;               /* worst stream */
+} RtspClientSample;
+
+typedef void (*RtspClientStreamFunc) (GstRTSPStream * stream,
+    gpointer user_data);
+
+/* Finds the first packet sent after a PLAY */
+typedef struct
+{
+  RtspClientStats *cs;
+  guint id;
+} RtspClientProbe;
+
+static void
+rtsp_client_entry_free (RtspClientEntry * entry)
+{
+  g_free (entry->address);
+  g_free (entry->path);
+  g_free (entry->session);
+  g_ptr_array_unref (entry->transports);
+  g_free (entry);
+}
+
+static RtspClientStats * G_GNUC_UNUSED
+rtsp_client_stats_new (void)
+{
+  RtspClientStats *cs = g_new0 (RtspClientStats, 1);
+
+  g_mutex_init (&cs->lock);
+  cs->clients = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      rtsp_client_entry_free);
+
+  return cs;
+}
+
+/* Free once the server is gone */
+static void G_GNUC_UNUSED
+rtsp_client_stats_free (RtspClientStats * cs)
+{
+  if (cs->log_id)
+    g_source_remove (cs->log_id);
+  g_ptr_array_unref (cs->clients);
+  g_mutex_clear (&cs->lock);
+  g_free (cs);
+}
+
+/* Call with the lock held */
+static RtspClientEntry *
+rtsp_client_stats_find (RtspClientStats * cs, guint id, guint * index)
+{
+  guint i;
+
+  for (i = 0; i < cs->clients->len; i++) {
+    RtspClientEntry *entry = g_ptr_array_index (cs->clients, i);
+
+    if (entry->id == id) {
+      if (index)
+        *index = i;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static guint
+rtsp_client_stats_id (GstRTSPClient * client)
+{
+  return GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (client),
+          "rtsp-client-stats-id"));
+}
+
+/* Sums the get-stats of every multiudpsink in @pipeline for a client */
+static void
+rtsp_client_sample_udp (GstElement * pipeline, const gchar * host, gint port,
+    RtspClientSample * s)
+{
+  GstIterator *it = gst_bin_iterate_recurse (GST_BIN (pipeline));
+  GValue item = G_VALUE_INIT;
+  gboolean done = FALSE;
+
+  while (!done) {
+    switch (gst_iterator_next (it, &item)) {
+      case GST_ITERATOR_OK:{
+        GstElement *element = g_value_get_object (&item);
+        GstElementFactory *factory = gst_element_get_factory (element);
+        GstStructure *stats = NULL;
+
+        if (factory &&
+            g_str_equal (GST_OBJECT_NAME (factory), "multiudpsink")) {
+          g_signal_emit_by_name (element, "get-stats", host, port, &stats);
+          if (stats) {
+            s->bytes += stream_metrics_struct_u64 (stats, "bytes-sent");
+            s->packets += stream_metrics_struct_u64 (stats, "packets-sent");
+            gst_structure_free (stats);
+          }
+        }
+        g_value_reset (&item);
+        break;
+      }
+      case GST_ITERATOR_RESYNC:
+        gst_iterator_resync (it);
+        break;
+      default:
+        done = TRUE;
+        break;
+    }
+  }
+  g_value_unset (&item);
+  gst_iterator_free (it);
+}
+
+/* The receiver report from @host:@rtcp_port in the stats of @session */
+static void
+rtsp_client_sample_rtcp (GObject * session, const gchar * host,
+    gint rtcp_port, RtspClientSample * s)
+{
+  GstStructure *stats = stream_metrics_get_stats (session);
+  GValueArray *sources = NULL;
+  gchar *address;
+  guint i;
+
+  if (!stats)
+    return;
+
+  /* as rtpsource formats rtcp-from; a part of it could be another host */
+  address = g_strdup_printf ("%s:%d", host, rtcp_port);
+  G_GNUC_BEGIN_IGNORE_DEPRECATIONS;
+  if (gst_structure_has_field_typed (stats, "source-stats",
+          G_TYPE_VALUE_ARRAY))
+    gst_structure_get (stats, "source-stats", G_TYPE_VALUE_ARRAY, &sources,
+        NULL);
+
+  for (i = 0; sources && i < sources->n_values; i++) {
+    const GstStructure *src;
+    gboolean internal = FALSE, have_rb = FALSE;
+    const gchar *from;
+    gint clock_rate = 0;
+    guint rtt = 0;
+
+    src = gst_value_get_structure (g_value_array_get_nth (sources, i));
+    gst_structure_get_boolean (src, "internal", &internal);
+    gst_structure_get_boolean (src, "have-rb", &have_rb);
+    from = gst_structure_get_string (src, "rtcp-from");
+    if (internal || !have_rb || !from || !g_str_equal (from, address))
+      continue;
+
+    s->have_rb = TRUE;
+    s->fraction_lost = MAX (s->fraction_lost,
+        stream_metrics_struct_u64 (src, "rb-fractionlost") / 256.0);
+    s->packets_lost += (gint) stream_metrics_struct_u64 (src,
+        "rb-packetslost");
+    gst_structure_get_int (src, "clock-rate", &clock_rate);
+    if (clock_rate > 0)
+      s->jitter_ms = MAX (s->jitter_ms, 1000.0 *
+          stream_metrics_struct_u64 (src, "rb-jitter") / clock_rate);
+    /* rb-round-trip is compact NTP, 1/65536 s */
+    gst_structure_get_uint (src, "rb-round-trip", &rtt);
+    s->rtt_ms = MAX (s->rtt_ms, rtt * 1000.0 / 65536);
+  }
+  if (sources)
+    g_value_array_free (sources);
+  G_GNUC_END_IGNORE_DEPRECATIONS;
+
+  g_free (address);
+  gst_structure_free (stats);
+}
+
+/* The pipeline a stream of a media runs in */
+static GstElement *
+rtsp_client_stream_pipeline (GstRTSPStream * stream)
+{
+  GstPad *pad = gst_rtsp_stream_get_srcpad (stream);
+  GstObject *object, *parent;
+
+  if (!pad)
+    return NULL;
+  object = GST_OBJECT (gst_pad_get_parent_element (pad));
+  gst_object_unref (pad);
+  while (object && (parent = gst_object_get_parent (object))) {
+    gst_object_unref (object);
+    object = parent;
+  }
+  return (GstElement *) object;
+}
+
+/* Call with the lock held */
+static void
+rtsp_client_stats_sample (RtspClientEntry * entry, RtspClientSample * s)
+{
+  guint i;
+
+  memset (s, 0, sizeof (*s));
+  for (i = 0; i < entry->transports->len; i++) {
+    GstRTSPStreamTransport *trans = g_ptr_array_index (entry->transports, i);
+    const GstRTSPTransport *tr = gst_rtsp_stream_transport_get_transport
+        (trans);
+    GstRTSPStream *stream = gst_rtsp_stream_transport_get_stream (trans);
+    GstElement *pipeline;
+    GObject *session;
+
+    switch (tr->lower_transport) {
+      case GST_RTSP_LOWER_TRANS_TCP:
+        s->lower = "tcp";
+        continue;
+      case GST_RTSP_LOWER_TRANS_UDP_MCAST:
+        s->lower = "udp-mcast";
+        continue;
+      default:
+        s->lower = "udp";
+        break;
+    }
+    if (!tr->destination)
+      continue;
+
+    pipeline = rtsp_client_stream_pipeline (stream);
+    if (pipeline) {
+      rtsp_client_sample_udp (pipeline, tr->destination, tr->client_port.min,
+          s);
+      s->have_counts = TRUE;
+      gst_object_unref (pipeline);
+    }
+    session = gst_rtsp_stream_get_rtpsession (stream);
+    if (session) {
+      rtsp_client_sample_rtcp (session, tr->destination, tr->client_port.max,
+          s);
+      g_object_unref (session);
+    }
+  }
+}
+
+static GstPadProbeReturn
+rtsp_client_first_packet_probe (GstPad * pad, GstPadProbeInfo * info,
+    RtspClientProbe * probe)
+{
+  RtspClientEntry *entry;
+
+  g_mutex_lock (&probe->cs->lock);
+  entry = rtsp_client_stats_find (probe->cs, probe->id, NULL);
+  if (entry && !entry->first_packet_us)
+    entry->first_packet_us = g_get_monotonic_time ();
+  g_mutex_unlock (&probe->cs->lock);
+
+  return GST_PAD_PROBE_REMOVE;
+}
+
+static void
+rtsp_client_stats_play (GstRTSPClient * client, GstRTSPContext * ctx,
+    RtspClientStats * cs)
+{
+  GstRTSPMedia *media;
+  RtspClientEntry *entry;
+  RtspClientProbe *probe;
+  gboolean first;
+  GstPad *pad;
+  guint i;
+
+  if (!ctx->sessmedia)
+    return;
+  media = gst_rtsp_session_media_get_media (ctx->sessmedia);
+
+  g_mutex_lock (&cs->lock);
+  entry = rtsp_client_stats_find (cs, rtsp_client_stats_id (client), NULL);
+  if (!entry) {
+    g_mutex_unlock (&cs->lock);
+    return;
+  }
+  first = !entry->play_us;
+  if (first)
+    entry->play_us = g_get_monotonic_time ();
+  g_free (entry->path);
+  entry->path = g_strdup (ctx->uri ? ctx->uri->abspath : NULL);
+  g_free (entry->session);
+  entry->session = g_strdup (gst_rtsp_session_get_sessionid (ctx->session));
+  g_ptr_array_set_size (entry->transports, 0);
+  for (i = 0; i < gst_rtsp_media_n_streams (media); i++) {
+    GstRTSPStreamTransport *trans =
+        gst_rtsp_session_media_get_transport (ctx->sessmedia, i);
+
+    if (trans)
+      g_ptr_array_add (entry->transports, g_object_ref (trans));
+  }
+  g_mutex_unlock (&cs->lock);
+
+  /* the transport is in the media's sinks by now, the next packet of the
+   * shared media is the first one the client gets */
+  if (!first || gst_rtsp_media_n_streams (media) == 0)
+    return;
+  pad = gst_rtsp_stream_get_srcpad (gst_rtsp_media_get_stream (media, 0));
+  if (!pad)
+    return;
+  probe = g_new0 (RtspClientProbe, 1);
+  probe->cs = cs;
+  probe->id = rtsp_client_stats_id (client);
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+      GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      (GstPadProbeCallback) rtsp_client_first_packet_probe, probe, g_free);
+  gst_object_unref (pad);
+}
+
+/* PAUSE and TEARDOWN: nothing is streamed to the client until its next
+ * PLAY */
+static void
+rtsp_client_stats_stop (GstRTSPClient * client, GstRTSPContext * ctx,
+    RtspClientStats * cs)
+{
+  RtspClientEntry *entry;
+
+  g_mutex_lock (&cs->lock);
+  entry = rtsp_client_stats_find (cs, rtsp_client_stats_id (client), NULL);
+  if (entry)
+    g_ptr_array_set_size (entry->transports, 0);
+  g_mutex_unlock (&cs->lock);
+}
+
+/* "id address path transport ..." of @entry, call with the lock held */
+static gchar *
+rtsp_client_stats_describe (RtspClientEntry * entry)
+{
+  RtspClientSample s;
+  GString *out = g_string_new (NULL);
+  gint64 now = g_get_monotonic_time ();
+
+  rtsp_client_stats_sample (entry, &s);
+  g_string_append_printf (out, "client %u %s %s %s joined %.1f s ago",
+      entry->id, entry->address, entry->path ? entry->path : "-",
+      s.lower ? s.lower : "-", (now - entry->join_us) / 1e6);
+  if (entry->first_packet_us)
+    g_string_append_printf (out, ", first packet %.1f ms after PLAY",
+        (entry->first_packet_us - entry->play_us) / 1000.0);
+  if (s.have_counts)
+    g_string_append_printf (out, ", sent %" G_GUINT64_FORMAT " bytes in %"
+        G_GUINT64_FORMAT " packets", s.bytes, s.packets);
+  if (s.have_rb)
+    g_string_append_printf (out, ", lost %.1f%% (%" G_GINT64_FORMAT
+        "), jitter %.1f ms, rtt %.1f ms", s.fraction_lost * 100,
+        s.packets_lost, s.jitter_ms, s.rtt_ms);
+
+  return g_string_free (out, FALSE);
+}
+
+/* A line per client, separated by @separator, free with g_free() */
+static gchar * G_GNUC_UNUSED
+rtsp_client_stats_query (RtspClientStats * cs, const gchar * separator)
+{
+  GString *out = g_string_new (NULL);
+  guint i;
+
+  g_mutex_lock (&cs->lock);
+  g_string_append_printf (out, "%u clients", cs->clients->len);
+  for (i = 0; i < cs->clients->len; i++) {
+    gchar *line = rtsp_client_stats_describe (g_ptr_array_index (cs->clients,
+            i));
+
+    g_string_append_printf (out, "%s%s", separator, line);
+    g_free (line);
+  }
+  g_mutex_unlock (&cs->lock);
+
+  return g_string_free (out, FALSE);
+}
+
+static void
+rtsp_client_stats_closed (GstRTSPClient * client, RtspClientStats * cs)
+{
+  RtspClientEntry *entry;
+  gchar *line;
+  guint index;
+
+  g_mutex_lock (&cs->lock);
+  entry = rtsp_client_stats_find (cs, rtsp_client_stats_id (client), &index);
+  if (entry) {
+    line = rtsp_client_stats_describe (entry);
+    g_print ("%s, closed\n", line);
+    g_free (line);
+    g_ptr_array_remove_index (cs->clients, index);
+  }
+  g_mutex_unlock (&cs->lock);
+}
+
+static void
+rtsp_client_stats_connected (GstRTSPServer * server, GstRTSPClient * client,
+    RtspClientStats * cs)
+{
+  GstRTSPConnection *conn = gst_rtsp_client_get_connection (client);
+  RtspClientEntry *entry = g_new0 (RtspClientEntry, 1);
+
+  entry->address = g_strdup (conn ? gst_rtsp_connection_get_ip (conn) : "-");
+  entry->join_us = g_get_monotonic_time ();
+  entry->transports = g_ptr_array_new_with_free_func (g_object_unref);
+
+  g_mutex_lock (&cs->lock);
+  entry->id = ++cs->next_id;
+  g_ptr_array_add (cs->clients, entry);
+  g_mutex_unlock (&cs->lock);
+
+  g_object_set_data (G_OBJECT (client), "rtsp-client-stats-id",
+      GUINT_TO_POINTER (entry->id));
+  g_signal_connect (client, "play-request",
+      G_CALLBACK (rtsp_client_stats_play), cs);
+  g_signal_connect (client, "pause-request",
+      G_CALLBACK (rtsp_client_stats_stop), cs);
+  g_signal_connect (client, "teardown-request",
+      G_CALLBACK (rtsp_client_stats_stop), cs);
+  g_signal_connect (client, "closed", G_CALLBACK (rtsp_client_stats_closed),
+      cs);
+}
+
+/* Track the clients of @server from now on */
+static void G_GNUC_UNUSED
+rtsp_client_stats_attach (RtspClientStats * cs, GstRTSPServer * server)
+{
+  g_signal_connect (server, "client-connected",
+      G_CALLBACK (rtsp_client_stats_connected), cs);
+}
+
+/* Calls @func for every stream of every client streaming between a PLAY
+ * and its PAUSE or TEARDOWN, once per client;
+ * @func runs with the lock held and must not call back in */
+static guint G_GNUC_UNUSED
+rtsp_client_stats_foreach_stream (RtspClientStats * cs,
+    RtspClientStreamFunc func, gpointer user_data)
+{
+  guint i, j, playing = 0;
+
+  g_mutex_lock (&cs->lock);
+  for (i = 0; i < cs->clients->len; i++) {
+    RtspClientEntry *entry = g_ptr_array_index (cs->clients, i);
+
+    if (entry->transports->len)
+      playing++;
+    for (j = 0; j < entry->transports->len; j++)
+      func (gst_rtsp_stream_transport_get_stream (g_ptr_array_index
+              (entry->transports, j)), user_data);
+  }
+  g_mutex_unlock (&cs->lock);
+
+  return playing;
+}
+
+static gboolean
+rtsp_client_stats_log_tick (RtspClientStats * cs)
+{
+  gchar *report = rtsp_client_stats_query (cs, "\n  ");
+
+  fprintf (cs->log, "%s\n", report);
+  fflush (cs->log);
+  g_free (report);
+  return G_SOURCE_CONTINUE;
+}
+
+/* Print all clients to @log every @interval_s, from the default main
+ * context */
+static void G_GNUC_UNUSED
+rtsp_client_stats_start_log (RtspClientStats * cs, FILE * log,
+    guint interval_s)
+{
+  cs->log = log;
+  cs->log_id = g_timeout_add_seconds (MAX (interval_s, 1),
+      (GSourceFunc) rtsp_client_stats_log_tick, cs);
+}
+
+/* The receiver reports are not repeated here: they are the rtcp_* series
+ * of the stream's rtpsession, whose peer label is the address the
+ * client's RTCP came from. */
+static void G_GNUC_UNUSED
+rtsp_client_stats_collect_metrics (StreamMetricsScrape * scrape,
+    gpointer user_data)
+{
+  RtspClientStats *cs = user_data;
+  guint i;
+
+  g_mutex_lock (&cs->lock);
+  for (i = 0; i < cs->clients->len; i++) {
+    RtspClientEntry *entry = g_ptr_array_index (cs->clients, i);
+    RtspClientSample s;
+    gchar *peer, *path, *labels;
+
+    rtsp_client_stats_sample (entry, &s);
+    peer = stream_metrics_escape_label (entry->address);
+    path = stream_metrics_escape_label (entry->path);
+    labels = g_strdup_printf ("client=\"%u\",peer=\"%s\",path=\"%s\","
+        "transport=\"%s\"", entry->id, peer, path, s.lower ? s.lower : "");
+    g_free (path);
+    g_free (peer);
+    stream_metrics_emit (scrape, "rtsp_client_connected_seconds", "gauge",
+        "Time since the client connected", labels,
+        (g_get_monotonic_time () - entry->join_us) / 1e6);
+    if (entry->first_packet_us)
+      stream_metrics_emit (scrape, "rtsp_client_first_packet_seconds",
+          "gauge", "PLAY to the first packet of the media sent", labels,
+          (entry->first_packet_us - entry->play_us) / 1e6);
+    if (s.have_counts) {
+      stream_metrics_emit (scrape, "rtsp_client_sent_bytes_total", "counter",
+          "RTP bytes sent to the client over UDP", labels, s.bytes);
+      stream_metrics_emit (scrape, "rtsp_client_sent_packets_total",
+          "counter", "RTP packets sent to the client over UDP", labels,
+          s.packets);
+    }
+    g_free (labels);
+  }
+  g_mutex_unlock (&cs->lock);
+}
+
+G_END_DECLS
+
+#endif /* __RTSP_CLIENT_STATS_H__ */
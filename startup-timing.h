@@ -0,0 +1,212 @@
+/* Timing of the startup phases of a program
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   StartupTimer *timer = startup_timer_new ();
+ *
+ *   startup_timer_begin (timer, "clock");
+ *   ...
+ *   startup_timer_end (timer, "clock");
+ *   startup_timer_mark (timer, "first-frame");
+ *
+ *   gchar *summary = startup_timer_summary (timer);
+ *
+ * A phase runs from begin to end and may overlap others; phases can be
+ * timed from any thread. A mark is a milestone, a phase that starts with
+ * the timer. Times are in ms since the timer was created, so the summary
+ * shows what ran in parallel:
+ *
+ *   clock 0.1-182.4 (182.3 ms), pipeline 0.2-61.0 (60.8 ms), ...
+ */
+
+#ifndef __STARTUP_TIMING_H__
+#define __STARTUP_TIMING_H__
+
+#include <string.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct
+{
+  gchar *name;
+  gint64 begin_us;
+  gint64 end_us;                /* 0 while running */
+} StartupPhase;
+
+typedef struct
+{
+  GMutex lock;
+  gint64 start_us;
+  GArray *phases;               /* StartupPhase, in begin order */
+} StartupTimer;
+
+static void
+startup_phase_clear (StartupPhase * phase)
+{
+  g_free (phase->name);
+}
+
+static StartupTimer * G_GNUC_UNUSED
+startup_timer_new (void)
+{
+  StartupTimer *timer = g_new0 (StartupTimer, 1);
+
+  g_mutex_init (&timer->lock);
+  timer->start_us = g_get_monotonic_time ();
+  timer->phases = g_array_new (FALSE, TRUE, sizeof (StartupPhase));
+  g_array_set_clear_func (timer->phases, (GDestroyNotify) startup_phase_clear);
+
+  return timer;
+}
+
+static void G_GNUC_UNUSED
+startup_timer_free (StartupTimer * timer)
+{
+  g_array_unref (timer->phases);
+  g_mutex_clear (&timer->lock);
+  g_free (timer);
+}
+
+/* Call with the lock held */
+static StartupPhase *
+startup_timer_find (StartupTimer * timer, const gchar * name)
+{
+  guint i;
+
+  for (i = 0; i < timer->phases->len; i++) {
+    StartupPhase *phase = &g_array_index (timer->phases, StartupPhase, i);
+
+    if (strcmp (phase->name, name) == 0)
+      return phase;
+  }
+  return NULL;
+}
+
+static void
+startup_timer_add (StartupTimer * timer, const gchar * name, gint64 begin_us,
+    gint64 end_us)
+{
+  StartupPhase phase = { g_strdup (name), begin_us, end_us };
+
+  g_mutex_lock (&timer->lock);
+  if (!startup_timer_find (timer, name))
+    g_array_append_val (timer->phases, phase);
+  else
+    g_free (phase.name);
+  g_mutex_unlock (&timer->lock);
+}
+
+static void G_GNUC_UNUSED
+startup_timer_begin (StartupTimer * timer, const gchar * name)
+{
+  startup_timer_add (timer, name, g_get_monotonic_time (), 0);
+}
+
+static void G_GNUC_UNUSED
+startup_timer_end (StartupTimer * timer, const gchar * name)
+{
+  StartupPhase *phase;
+
+  g_mutex_lock (&timer->lock);
+  phase = startup_timer_find (timer, name);
+  if (phase && !phase->end_us)
+    phase->end_us = g_get_monotonic_time ();
+  g_mutex_unlock (&timer->lock);
+}
+
+/* Only the first mark of @name counts */
+static void G_GNUC_UNUSED
+startup_timer_mark (StartupTimer * timer, const gchar * name)
+{
+  startup_timer_add (timer, name, timer->start_us, g_get_monotonic_time ());
+}
+
+/* ms from the start of the timer to the end of @name, or -1 if it has not
+ * ended yet */
+static gdouble G_GNUC_UNUSED
+startup_timer_get_ms (StartupTimer * timer, const gchar * name)
+{
+  StartupPhase *phase;
+  gdouble ms = -1.0;
+
+  g_mutex_lock (&timer->lock);
+  phase = startup_timer_find (timer, name);
+  if (phase && phase->end_us)
+    ms = (phase->end_us - timer->start_us) / 1000.0;
+  g_mutex_unlock (&timer->lock);
+
+  return ms;
+}
+
+/* "name begin-end (duration ms), ..." of the phases that ended, free with
+ * g_free() */
+static gchar * G_GNUC_UNUSED
+startup_timer_summary (StartupTimer * timer)
+{
+  GString *out = g_string_new (NULL);
+  guint i;
+
+  g_mutex_lock (&timer->lock);
+  for (i = 0; i < timer->phases->len; i++) {
+    StartupPhase *phase = &g_array_index (timer->phases, StartupPhase, i);
+
+    if (!phase->end_us)
+      continue;
+    g_string_append_printf (out, "%s%s %.1f-%.1f (%.1f ms)",
+        out->len ? ", " : "", phase->name,
+        (phase->begin_us - timer->start_us) / 1000.0,
+        (phase->end_us - timer->start_us) / 1000.0,
+        (phase->end_us - phase->begin_us) / 1000.0);
+  }
+  g_mutex_unlock (&timer->lock);
+
+  return g_string_free (out, FALSE);
+}
+
+#ifdef __STREAM_METRICS_H__
+static void G_GNUC_UNUSED
+startup_timer_collect_metrics (StreamMetricsScrape * scrape,
+    gpointer user_data)
+{
+  StartupTimer *timer = user_data;
+  guint i;
+
+  g_mutex_lock (&timer->lock);
+  for (i = 0; i < timer->phases->len; i++) {
+    StartupPhase *phase = &g_array_index (timer->phases, StartupPhase, i);
+    gchar *name, *labels;
+
+    if (!phase->end_us)
+      continue;
+    name = stream_metrics_escape_label (phase->name);
+    labels = g_strdup_printf ("phase=\"%s\"", name);
+    g_free (name);
+    stream_metrics_emit (scrape, "startup_phase_seconds", "gauge",
+        "Duration of a startup phase", labels,
+        (phase->end_us - phase->begin_us) / 1e6);
+    stream_metrics_emit (scrape, "startup_phase_end_seconds", "gauge",
+        "Time from startup to the end of a startup phase", labels,
+        (phase->end_us - timer->start_us) / 1e6);
+    g_free (labels);
+  }
+  g_mutex_unlock (&timer->lock);
+}
+#endif
+
+G_END_DECLS
+
+#endif /* __STARTUP_TIMING_H__ */
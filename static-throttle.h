@@ -0,0 +1,265 @@
+/* Frame-rate throttling of static scenes at the encoder input
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   StaticThrottle *st = static_throttle_new (motion, 2000, 2);
+ *   static_throttle_attach (st, encoder);
+ *
+ * Once the motion detector has seen no moving block for the hold time,
+ * frames entering the encoder are dropped down to the static frame rate.
+ * Fewer frames are encoded, which saves CPU, and at a fixed per-frame rate
+ * budget fewer bytes are sent. The first frame after any block moves
+ * passes again, so full rate resumes with the next frame. A static frame
+ * rate of 0 turns throttling off; static_throttle_set_fps() changes it
+ * while running.
+ *
+ * Savings are estimated from what the dropped frames would have cost: the
+ * average encode time per frame, and the average size of frames encoded
+ * while static.
+ */
+
+#ifndef __STATIC_THROTTLE_H__
+#define __STATIC_THROTTLE_H__
+
+#include <stdio.h>
+
+#include <gst/gst.h>
+
+#include "motion-detect.h"
+
+G_BEGIN_DECLS
+
+typedef struct
+{
+  MotionDetector *motion;
+  gint64 hold_us;
+  /* atomics, 0 while off */
+  guint static_fps;
+  GstClockTime static_interval;
+
+  /* streaming threads */
+  GstClockTime last_pts;
+  gint64 static_since_us;
+  gint64 encode_start_us;
+
+  /* read by reports, atomics */
+  gint throttled;
+  guint64 frames;
+  guint64 dropped;
+  guint64 static_us;
+  guint64 encoded;
+  guint64 encode_us;
+  guint64 bytes;
+  guint64 static_encoded;
+  guint64 static_bytes;
+} StaticThrottle;
+
+/* Encode at @static_fps, 0 for full rate, after @hold_ms without motion.
+ * Can be called from any thread. */
+static void G_GNUC_UNUSED
+static_throttle_set_fps (StaticThrottle * st, guint static_fps)
+{
+  __atomic_store_n (&st->static_interval,
+      static_fps ? GST_SECOND / static_fps : 0, __ATOMIC_RELAXED);
+  g_atomic_int_set (&st->static_fps, static_fps);
+}
+
+/* Throttle to @static_fps after @hold_ms without motion; 0 starts off */
+static StaticThrottle * G_GNUC_UNUSED
+static_throttle_new (MotionDetector * motion, guint hold_ms, guint static_fps)
+{
+  StaticThrottle *st = g_new0 (StaticThrottle, 1);
+
+  st->motion = motion;
+  st->hold_us = hold_ms * (gint64) 1000;
+  st->last_pts = GST_CLOCK_TIME_NONE;
+  static_throttle_set_fps (st, static_fps);
+
+  return st;
+}
+
+/* Free once the pipelines using @st are back in NULL */
+static void G_GNUC_UNUSED
+static_throttle_free (StaticThrottle * st)
+{
+  g_free (st);
+}
+
+static void
+static_throttle_set_state (StaticThrottle * st, gboolean throttled, gint64 now)
+{
+  if (throttled == g_atomic_int_get (&st->throttled))
+    return;
+
+  if (throttled) {
+    __atomic_store_n (&st->static_since_us, now, __ATOMIC_RELAXED);
+    GST_INFO ("scene static, encoding at %u fps",
+        g_atomic_int_get (&st->static_fps));
+  } else {
+    __atomic_add_fetch (&st->static_us, now - st->static_since_us,
+        __ATOMIC_RELAXED);
+    GST_INFO ("activity, encoding at full rate");
+  }
+  g_atomic_int_set (&st->throttled, throttled);
+}
+
+static GstPadProbeReturn
+static_throttle_sink_probe (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  StaticThrottle *st = user_data;
+  GstClockTime pts = GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info));
+  GstClockTime interval = __atomic_load_n (&st->static_interval,
+      __ATOMIC_RELAXED);
+  gint64 now = g_get_monotonic_time ();
+
+  __atomic_add_fetch (&st->frames, 1, __ATOMIC_RELAXED);
+  static_throttle_set_state (st, interval > 0 &&
+      motion_detector_quiet_us (st->motion) >= st->hold_us, now);
+
+  if (g_atomic_int_get (&st->throttled) && GST_CLOCK_TIME_IS_VALID (pts) &&
+      GST_CLOCK_TIME_IS_VALID (st->last_pts) && pts > st->last_pts &&
+      pts - st->last_pts < interval) {
+    __atomic_add_fetch (&st->dropped, 1, __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_DROP;
+  }
+
+  st->last_pts = pts;
+  st->encode_start_us = now;
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+static_throttle_src_probe (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  StaticThrottle *st = user_data;
+  gsize size = gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info));
+
+  /* with tune=zerolatency the frame comes out within the chain call, so
+   * this is the encode time of the frame that just went in */
+  if (st->encode_start_us) {
+    __atomic_add_fetch (&st->encode_us,
+        g_get_monotonic_time () - st->encode_start_us, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&st->encoded, 1, __ATOMIC_RELAXED);
+    st->encode_start_us = 0;
+  }
+  __atomic_add_fetch (&st->bytes, size, __ATOMIC_RELAXED);
+  if (g_atomic_int_get (&st->throttled)) {
+    __atomic_add_fetch (&st->static_bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&st->static_encoded, 1, __ATOMIC_RELAXED);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Throttle the frames entering @encoder; can be attached to the encoder of
+ * each new RTSP media in turn. Attach before other probes on the encoder
+ * input so dropped frames skip them too. */
+static void G_GNUC_UNUSED
+static_throttle_attach (StaticThrottle * st, GstElement * encoder)
+{
+  GstPad *pad;
+
+  st->last_pts = GST_CLOCK_TIME_NONE;
+  st->encode_start_us = 0;
+
+  pad = gst_element_get_static_pad (encoder, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      static_throttle_sink_probe, st, NULL);
+  gst_object_unref (pad);
+
+  pad = gst_element_get_static_pad (encoder, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      static_throttle_src_probe, st, NULL);
+  gst_object_unref (pad);
+}
+
+typedef struct
+{
+  guint64 frames, dropped;
+  gdouble static_seconds;
+  gdouble saved_cpu_seconds;
+  gdouble saved_bytes;
+  guint64 bytes;
+} StaticThrottleSavings;
+
+static void G_GNUC_UNUSED
+static_throttle_get_savings (StaticThrottle * st, StaticThrottleSavings * s)
+{
+  guint64 encoded = __atomic_load_n (&st->encoded, __ATOMIC_RELAXED);
+  guint64 static_encoded =
+      __atomic_load_n (&st->static_encoded, __ATOMIC_RELAXED);
+  guint64 static_us = __atomic_load_n (&st->static_us, __ATOMIC_RELAXED);
+
+  if (g_atomic_int_get (&st->throttled))
+    static_us += g_get_monotonic_time () -
+        __atomic_load_n (&st->static_since_us, __ATOMIC_RELAXED);
+
+  s->frames = __atomic_load_n (&st->frames, __ATOMIC_RELAXED);
+  s->dropped = __atomic_load_n (&st->dropped, __ATOMIC_RELAXED);
+  s->bytes = __atomic_load_n (&st->bytes, __ATOMIC_RELAXED);
+  s->static_seconds = static_us / 1e6;
+  s->saved_cpu_seconds = encoded ? s->dropped *
+      (gdouble) __atomic_load_n (&st->encode_us, __ATOMIC_RELAXED) /
+      encoded / 1e6 : 0.0;
+  s->saved_bytes = static_encoded ? s->dropped *
+      (gdouble) __atomic_load_n (&st->static_bytes, __ATOMIC_RELAXED) /
+      static_encoded : 0.0;
+}
+
+static void G_GNUC_UNUSED
+static_throttle_print_summary (StaticThrottle * st, FILE * out)
+{
+  StaticThrottleSavings s;
+
+  static_throttle_get_savings (st, &s);
+  fprintf (out, "static scenes: %.1f s throttled to %u fps, %"
+      G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " frames not encoded\n",
+      s.static_seconds, g_atomic_int_get (&st->static_fps), s.dropped,
+      s.frames);
+  fprintf (out, "  saved about %.2f s of encoder CPU and %.0f kB, "
+      "%.1f%% of the stream (%.0f kB sent)\n", s.saved_cpu_seconds,
+      s.saved_bytes / 1000, s.bytes + s.saved_bytes > 0 ?
+      100.0 * s.saved_bytes / (s.bytes + s.saved_bytes) : 0.0,
+      s.bytes / 1000.0);
+}
+
+#ifdef __STREAM_METRICS_H__
+static void G_GNUC_UNUSED
+static_throttle_collect_metrics (StreamMetricsScrape * scrape,
+    gpointer user_data)
+{
+  StaticThrottle *st = user_data;
+  StaticThrottleSavings s;
+
+  static_throttle_get_savings (st, &s);
+  stream_metrics_emit (scrape, "static_throttled", "gauge",
+      "Whether the encoder runs at the static frame rate", NULL,
+      g_atomic_int_get (&st->throttled));
+  stream_metrics_emit (scrape, "static_seconds_total", "counter",
+      "Time spent throttled on static scenes", NULL, s.static_seconds);
+  stream_metrics_emit (scrape, "static_frames_dropped_total", "counter",
+      "Frames not encoded because the scene was static", NULL, s.dropped);
+  stream_metrics_emit (scrape, "static_saved_cpu_seconds_total", "counter",
+      "Estimated encoder CPU time saved", NULL, s.saved_cpu_seconds);
+  stream_metrics_emit (scrape, "static_saved_bytes_total", "counter",
+      "Estimated encoded bytes saved", NULL, s.saved_bytes);
+}
+#endif
+
+G_END_DECLS
+
+#endif /* __STATIC_THROTTLE_H__ */
@@ -0,0 +1,795 @@
+/* Prometheus-style metrics endpoint for the RTSP server and client
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   metrics = stream_metrics_new ();
+ *   stream_metrics_watch_pipeline (metrics, pipeline, "capture");
+ *   stream_metrics_add_collector (metrics, my_collector, data);
+ *   stream_metrics_listen (metrics, "127.0.0.1:9100", &error);
+ *
+ * then `curl http://127.0.0.1:9100/metrics`, or with "unix:/tmp/m.sock"
+ * `curl --unix-socket /tmp/m.sock http://localhost/metrics`.
+ *
+ * Pipelines are walked for queues, sinks, encoders, pay%d payloaders and
+ * rtpsession elements; streaming threads only bump atomic counters from pad
+ * probes. Rates are derived once a second from the main context the endpoint
+ * was started in, and scrapes are served from a separate thread so a slow
+ * scraper never stalls the RTSP main loop.
+ */
+
+#ifndef __STREAM_METRICS_H__
+#define __STREAM_METRICS_H__
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#ifdef G_OS_UNIX
+#include <gio/gunixsocketaddress.h>
+#endif
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define STREAM_METRICS_TICK_SECONDS 1
+/* a scraper that stalls longer is dropped, stream_metrics_free() waits */
+#define STREAM_METRICS_TIMEOUT_SECONDS 5
+
+typedef struct _StreamMetrics StreamMetrics;
+typedef struct _StreamMetricsScrape StreamMetricsScrape;
+
+typedef void (*StreamMetricsCollectFunc) (StreamMetricsScrape * scrape,
+    gpointer user_data);
+
+typedef enum
+{
+  STREAM_METRICS_ROLE_BRANCH,
+  STREAM_METRICS_ROLE_QUEUE,
+  STREAM_METRICS_ROLE_SINK,
+  STREAM_METRICS_ROLE_ENCODER,
+  STREAM_METRICS_ROLE_RTP_SESSION
+} StreamMetricsRole;
+
+typedef struct
+{
+  StreamMetricsRole role;
+  gchar *labels;
+  GWeakRef object;
+
+  /* written from streaming threads */
+  guint64 buffers;
+  guint64 bytes;
+  guint64 overruns;
+
+  /* derived on the tick */
+  guint64 last_buffers;
+  guint64 last_bytes;
+  gdouble fps;
+  gdouble bps;
+} StreamMetricsEntry;
+
+typedef struct
+{
+  StreamMetricsCollectFunc func;
+  gpointer user_data;
+} StreamMetricsCollector;
+
+struct _StreamMetrics
+{
+  GMutex lock;
+  GPtrArray *entries;
+  GArray *collectors;
+  GSocketService *service;
+  GCond idle;                   /* signalled when scrapes drops to 0 */
+  guint scrapes;                /* running in the service, under lock */
+  gboolean closing;
+  GSource *tick;
+  gint64 last_tick;
+};
+
+typedef struct
+{
+  gchar *name;
+  const gchar *type;
+  const gchar *help;
+  GString *samples;
+} StreamMetricsFamily;
+
+struct _StreamMetricsScrape
+{
+  GHashTable *families;
+  GPtrArray *order;
+};
+
+static void
+stream_metrics_entry_free (StreamMetricsEntry * entry)
+{
+  g_weak_ref_clear (&entry->object);
+  g_free (entry->labels);
+  g_free (entry);
+}
+
+static StreamMetrics * G_GNUC_UNUSED
+stream_metrics_new (void)
+{
+  StreamMetrics *metrics = g_new0 (StreamMetrics, 1);
+
+  g_mutex_init (&metrics->lock);
+  g_cond_init (&metrics->idle);
+  metrics->entries =
+      g_ptr_array_new_with_free_func ((GDestroyNotify)
+      stream_metrics_entry_free);
+  metrics->collectors = g_array_new (FALSE, FALSE,
+      sizeof (StreamMetricsCollector));
+  return metrics;
+}
+
+/* Free once the watched pipelines are in NULL; waits for the scrapes
+ * still running */
+static void G_GNUC_UNUSED
+stream_metrics_free (StreamMetrics * metrics)
+{
+  if (metrics->tick) {
+    g_source_destroy (metrics->tick);
+    g_source_unref (metrics->tick);
+  }
+  if (metrics->service) {
+    g_socket_service_stop (metrics->service);
+    g_socket_listener_close (G_SOCKET_LISTENER (metrics->service));
+    g_signal_handlers_disconnect_by_data (metrics->service, metrics);
+    g_mutex_lock (&metrics->lock);
+    metrics->closing = TRUE;
+    while (metrics->scrapes)
+      g_cond_wait (&metrics->idle, &metrics->lock);
+    g_mutex_unlock (&metrics->lock);
+    g_object_unref (metrics->service);
+  }
+  g_ptr_array_unref (metrics->entries);
+  g_array_unref (metrics->collectors);
+  g_cond_clear (&metrics->idle);
+  g_mutex_clear (&metrics->lock);
+  g_free (metrics);
+}
+
+/* Register an extra collector, called from the endpoint thread on every
+ * scrape. Collectors must be added before stream_metrics_listen(). */
+static void G_GNUC_UNUSED
+stream_metrics_add_collector (StreamMetrics * metrics,
+    StreamMetricsCollectFunc func, gpointer user_data)
+{
+  StreamMetricsCollector c = { func, user_data };
+
+  g_mutex_lock (&metrics->lock);
+  g_array_append_val (metrics->collectors, c);
+  g_mutex_unlock (&metrics->lock);
+}
+
+/*
+ * Rendering
+ */
+
+/* @value escaped for a label value of the text exposition format: a
+ * backslash, double quote and newline are backslash-escaped. Free with
+ * g_free(). */
+static gchar * G_GNUC_UNUSED
+stream_metrics_escape_label (const gchar * value)
+{
+  GString *out;
+  const gchar *p;
+
+  if (value == NULL)
+    return g_strdup ("");
+
+  out = g_string_sized_new (strlen (value));
+  for (p = value; *p; p++) {
+    switch (*p) {
+      case '\\':
+        g_string_append (out, "\\\\");
+        break;
+      case '"':
+        g_string_append (out, "\\\"");
+        break;
+      case '\n':
+        g_string_append (out, "\\n");
+        break;
+      default:
+        g_string_append_c (out, *p);
+        break;
+    }
+  }
+  return g_string_free (out, FALSE);
+}
+
+/* Append one sample. @labels is the inside of the braces, e.g.
+ * "pipeline=\"rtsp\",branch=\"pay0\"", or NULL. */
+static void G_GNUC_UNUSED
+stream_metrics_emit (StreamMetricsScrape * scrape, const gchar * name,
+    const gchar * type, const gchar * help, const gchar * labels,
+    gdouble value)
+{
+  StreamMetricsFamily *family;
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  family = g_hash_table_lookup (scrape->families, name);
+  if (family == NULL) {
+    family = g_new0 (StreamMetricsFamily, 1);
+    family->name = g_strdup (name);
+    family->type = type;
+    family->help = help;
+    family->samples = g_string_new (NULL);
+    g_hash_table_insert (scrape->families, family->name, family);
+    g_ptr_array_add (scrape->order, family);
+  }
+
+  g_ascii_dtostr (buf, sizeof (buf), value);
+  if (labels && *labels)
+    g_string_append_printf (family->samples, "%s{%s} %s\n", name, labels, buf);
+  else
+    g_string_append_printf (family->samples, "%s %s\n", name, buf);
+}
+
+static void
+stream_metrics_family_free (StreamMetricsFamily * family)
+{
+  g_string_free (family->samples, TRUE);
+  g_free (family->name);
+  g_free (family);
+}
+
+static GstStructure *
+stream_metrics_get_stats (GObject * object)
+{
+  GstStructure *stats = NULL;
+
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (object), "stats"))
+    g_object_get (object, "stats", &stats, NULL);
+  return stats;
+}
+
+static guint64
+stream_metrics_struct_u64 (const GstStructure * s, const gchar * field)
+{
+  const GValue *v = gst_structure_get_value (s, field);
+
+  if (v == NULL)
+    return 0;
+  if (G_VALUE_HOLDS_UINT64 (v))
+    return g_value_get_uint64 (v);
+  if (G_VALUE_HOLDS_UINT (v))
+    return g_value_get_uint (v);
+  if (G_VALUE_HOLDS_INT (v))
+    return MAX (0, g_value_get_int (v));
+  if (G_VALUE_HOLDS_INT64 (v))
+    return MAX (0, g_value_get_int64 (v));
+  return 0;
+}
+
+/* Receiver-report and reception stats for every remote source of an
+ * rtpsession element or an internal RTPSession object. */
+static void G_GNUC_UNUSED
+stream_metrics_collect_rtp_session (StreamMetricsScrape * scrape,
+    GObject * session, const gchar * labels)
+{
+  GstStructure *stats;
+  GValueArray *sources = NULL;
+  guint i;
+
+  stats = stream_metrics_get_stats (session);
+  if (stats == NULL)
+    return;
+
+  /* rtpsession still hands out a GValueArray here */
+  G_GNUC_BEGIN_IGNORE_DEPRECATIONS;
+  if (gst_structure_has_field_typed (stats, "source-stats",
+          G_TYPE_VALUE_ARRAY))
+    gst_structure_get (stats, "source-stats", G_TYPE_VALUE_ARRAY, &sources,
+        NULL);
+
+  for (i = 0; sources && i < sources->n_values; i++) {
+    const GstStructure *s;
+    gboolean internal = FALSE, have_rb = FALSE, is_sender = FALSE;
+    guint ssrc = 0;
+    gchar *from, *l;
+
+    s = gst_value_get_structure (g_value_array_get_nth (sources, i));
+    gst_structure_get_boolean (s, "internal", &internal);
+    gst_structure_get_boolean (s, "have-rb", &have_rb);
+    gst_structure_get_boolean (s, "is-sender", &is_sender);
+    gst_structure_get_uint (s, "ssrc", &ssrc);
+    if (internal)
+      continue;
+
+    from = stream_metrics_escape_label (gst_structure_get_string (s,
+            "rtcp-from"));
+    l = g_strdup_printf ("%s%sssrc=\"%u\",peer=\"%s\"", labels ? labels : "",
+        labels && *labels ? "," : "", ssrc, from);
+    g_free (from);
+
+    if (have_rb) {
+      guint rtt = 0;
+
+      gst_structure_get_uint (s, "rb-round-trip", &rtt);
+      stream_metrics_emit (scrape, "rtcp_fraction_lost", "gauge",
+          "Fraction lost from the last RTCP receiver report (0-1)", l,
+          stream_metrics_struct_u64 (s, "rb-fractionlost") / 256.0);
+      stream_metrics_emit (scrape, "rtcp_packets_lost", "gauge",
+          "Cumulative packets lost from the last RTCP receiver report", l,
+          (gint) stream_metrics_struct_u64 (s, "rb-packetslost"));
+      stream_metrics_emit (scrape, "rtcp_jitter", "gauge",
+          "Interarrival jitter from the last RTCP receiver report (RTP units)",
+          l, stream_metrics_struct_u64 (s, "rb-jitter"));
+      /* rb-round-trip is compact NTP, 1/65536 s */
+      stream_metrics_emit (scrape, "rtcp_round_trip_seconds", "gauge",
+          "Round trip time from the last RTCP receiver report", l,
+          rtt / 65536.0);
+    }
+    if (is_sender) {
+      stream_metrics_emit (scrape, "rtp_packets_received_total", "counter",
+          "RTP packets received from a remote sender", l,
+          stream_metrics_struct_u64 (s, "packets-received"));
+      stream_metrics_emit (scrape, "rtp_packets_lost_total", "counter",
+          "RTP packets lost from a remote sender", l,
+          stream_metrics_struct_u64 (s, "packets-lost"));
+    }
+    g_free (l);
+  }
+  if (sources)
+    g_value_array_free (sources);
+  G_GNUC_END_IGNORE_DEPRECATIONS;
+
+  gst_structure_free (stats);
+}
+
+static void
+stream_metrics_collect_entry (StreamMetricsScrape * scrape,
+    StreamMetricsEntry * e, GObject * obj)
+{
+  GstStructure *stats;
+  guint level_buffers = 0, max_buffers = 0, bitrate = 0;
+  guint64 level_time = 0;
+
+  switch (e->role) {
+    case STREAM_METRICS_ROLE_BRANCH:
+      stream_metrics_emit (scrape, "stream_fps", "gauge",
+          "Buffers per second through a branch", e->labels, e->fps);
+      stream_metrics_emit (scrape, "stream_buffers_total", "counter",
+          "Buffers through a branch", e->labels, e->buffers);
+      stream_metrics_emit (scrape, "stream_bytes_total", "counter",
+          "Bytes through a branch", e->labels, e->bytes);
+      break;
+    case STREAM_METRICS_ROLE_QUEUE:
+      g_object_get (obj, "current-level-buffers", &level_buffers,
+          "current-level-time", &level_time, "max-size-buffers", &max_buffers,
+          NULL);
+      stream_metrics_emit (scrape, "queue_level_buffers", "gauge",
+          "Buffers currently held by a queue", e->labels, level_buffers);
+      stream_metrics_emit (scrape, "queue_level_seconds", "gauge",
+          "Data currently held by a queue", e->labels,
+          (gdouble) level_time / GST_SECOND);
+      stream_metrics_emit (scrape, "queue_max_buffers", "gauge",
+          "Configured buffer limit of a queue", e->labels, max_buffers);
+      stream_metrics_emit (scrape, "queue_overruns_total", "counter",
+          "Times a queue was full when a buffer arrived", e->labels,
+          e->overruns);
+      break;
+    case STREAM_METRICS_ROLE_SINK:
+      stats = stream_metrics_get_stats (obj);
+      if (stats) {
+        stream_metrics_emit (scrape, "sink_rendered_total", "counter",
+            "Buffers rendered by a sink", e->labels,
+            stream_metrics_struct_u64 (stats, "rendered"));
+        stream_metrics_emit (scrape, "sink_dropped_total", "counter",
+            "Buffers dropped by a sink for being late", e->labels,
+            stream_metrics_struct_u64 (stats, "dropped"));
+        gst_structure_free (stats);
+      }
+      break;
+    case STREAM_METRICS_ROLE_ENCODER:
+      if (GST_IS_PAD (obj)) {
+        stream_metrics_emit (scrape, "encoder_output_bps", "gauge",
+            "Measured encoder output bitrate", e->labels, e->bps);
+      } else if (g_object_class_find_property (G_OBJECT_GET_CLASS (obj),
+              "bitrate")) {
+        g_object_get (obj, "bitrate", &bitrate, NULL);
+        /* x264enc and friends configure kbit/s */
+        stream_metrics_emit (scrape, "encoder_target_bps", "gauge",
+            "Configured encoder bitrate", e->labels, bitrate * 1000.0);
+      }
+      break;
+    case STREAM_METRICS_ROLE_RTP_SESSION:
+      stream_metrics_collect_rtp_session (scrape, obj, e->labels);
+      break;
+  }
+}
+
+static gchar *
+stream_metrics_render (StreamMetrics * metrics)
+{
+  StreamMetricsScrape scrape;
+  GString *out;
+  GPtrArray *entries;
+  guint i;
+
+  scrape.families = g_hash_table_new (g_str_hash, g_str_equal);
+  scrape.order = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      stream_metrics_family_free);
+
+  /* the strong refs are dropped outside the lock since disposing an
+   * element can re-enter us through the weak refs */
+  entries = g_ptr_array_new ();
+  g_mutex_lock (&metrics->lock);
+  for (i = 0; i < metrics->entries->len;) {
+    StreamMetricsEntry *e = g_ptr_array_index (metrics->entries, i);
+    GObject *obj = g_weak_ref_get (&e->object);
+
+    if (obj == NULL) {
+      g_ptr_array_remove_index (metrics->entries, i);
+      continue;
+    }
+    stream_metrics_collect_entry (&scrape, e, obj);
+    g_ptr_array_add (entries, obj);
+    i++;
+  }
+  g_mutex_unlock (&metrics->lock);
+  g_ptr_array_foreach (entries, (GFunc) g_object_unref, NULL);
+  g_ptr_array_unref (entries);
+
+  for (i = 0; i < metrics->collectors->len; i++) {
+    StreamMetricsCollector *c = &g_array_index (metrics->collectors,
+        StreamMetricsCollector, i);
+
+    c->func (&scrape, c->user_data);
+  }
+
+  out = g_string_new (NULL);
+  for (i = 0; i < scrape.order->len; i++) {
+    StreamMetricsFamily *f = g_ptr_array_index (scrape.order, i);
+
+    g_string_append_printf (out, "# HELP %s %s\n# TYPE %s %s\n%s",
+        f->name, f->help, f->name, f->type, f->samples->str);
+  }
+
+  g_hash_table_unref (scrape.families);
+  g_ptr_array_unref (scrape.order);
+  return g_string_free (out, FALSE);
+}
+
+/*
+ * Pipeline discovery
+ */
+static GstPadProbeReturn
+stream_metrics_count_probe (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  StreamMetricsEntry *e = user_data;
+  gsize size;
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+
+    size = gst_buffer_list_calculate_size (list);
+    __atomic_fetch_add (&e->buffers, gst_buffer_list_length (list),
+        __ATOMIC_RELAXED);
+  } else {
+    size = gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info));
+    __atomic_fetch_add (&e->buffers, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add (&e->bytes, size, __ATOMIC_RELAXED);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+stream_metrics_overrun (GstElement * queue, StreamMetricsEntry * e)
+{
+  __atomic_fetch_add (&e->overruns, 1, __ATOMIC_RELAXED);
+}
+
+static StreamMetricsEntry *
+stream_metrics_add_entry (StreamMetrics * metrics, StreamMetricsRole role,
+    GObject * object, const gchar * labels)
+{
+  StreamMetricsEntry *e = g_new0 (StreamMetricsEntry, 1);
+
+  e->role = role;
+  e->labels = g_strdup (labels);
+  g_weak_ref_init (&e->object, object);
+
+  g_mutex_lock (&metrics->lock);
+  g_ptr_array_add (metrics->entries, e);
+  g_mutex_unlock (&metrics->lock);
+
+  return e;
+}
+
+/* Count buffers and bytes through @pad. The entry stays alive as long as
+ * @metrics, the probe only holds a borrowed pointer. */
+static void G_GNUC_UNUSED
+stream_metrics_watch_pad (StreamMetrics * metrics, GstPad * pad,
+    StreamMetricsRole role, const gchar * labels)
+{
+  StreamMetricsEntry *e;
+
+  e = stream_metrics_add_entry (metrics, role, G_OBJECT (pad), labels);
+  gst_pad_add_probe (pad,
+      GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+      stream_metrics_count_probe, e, NULL);
+}
+
+static void
+stream_metrics_watch_element (StreamMetrics * metrics, GstElement * element,
+    const gchar * pipeline)
+{
+  GstElementFactory *factory = gst_element_get_factory (element);
+  const gchar *factory_name, *klass;
+  gchar *name, *esc_name, *esc_pipeline, *labels;
+  GstPad *pad;
+
+  if (factory == NULL || GST_IS_BIN (element))
+    return;
+
+  factory_name = GST_OBJECT_NAME (factory);
+  klass = gst_element_factory_get_metadata (factory,
+      GST_ELEMENT_METADATA_KLASS);
+  name = gst_element_get_name (element);
+  esc_pipeline = stream_metrics_escape_label (pipeline);
+  esc_name = stream_metrics_escape_label (name);
+  labels = g_strdup_printf ("pipeline=\"%s\",element=\"%s\"", esc_pipeline,
+      esc_name);
+
+  if (g_str_equal (factory_name, "queue")) {
+    StreamMetricsEntry *e;
+
+    e = stream_metrics_add_entry (metrics, STREAM_METRICS_ROLE_QUEUE,
+        G_OBJECT (element), labels);
+    g_signal_connect (element, "overrun",
+        G_CALLBACK (stream_metrics_overrun), e);
+  } else if (g_str_equal (factory_name, "rtpsession")) {
+    stream_metrics_add_entry (metrics, STREAM_METRICS_ROLE_RTP_SESSION,
+        G_OBJECT (element), labels);
+  } else if (GST_OBJECT_FLAG_IS_SET (element, GST_ELEMENT_FLAG_SINK)) {
+    stream_metrics_add_entry (metrics, STREAM_METRICS_ROLE_SINK,
+        G_OBJECT (element), labels);
+    if ((pad = gst_element_get_static_pad (element, "sink"))) {
+      g_free (labels);
+      labels = g_strdup_printf ("pipeline=\"%s\",branch=\"%s\"",
+          esc_pipeline, esc_name);
+      stream_metrics_watch_pad (metrics, pad, STREAM_METRICS_ROLE_BRANCH,
+          labels);
+      gst_object_unref (pad);
+    }
+  } else if (klass && strstr (klass, "Encoder")) {
+    if ((pad = gst_element_get_static_pad (element, "src"))) {
+      stream_metrics_watch_pad (metrics, pad, STREAM_METRICS_ROLE_ENCODER,
+          labels);
+      gst_object_unref (pad);
+    }
+    /* the pad entry is used for the rate, this one for the properties */
+    stream_metrics_add_entry (metrics, STREAM_METRICS_ROLE_ENCODER,
+        G_OBJECT (element), labels);
+  } else if (g_str_has_prefix (name, "pay")) {
+    if ((pad = gst_element_get_static_pad (element, "src"))) {
+      g_free (labels);
+      labels = g_strdup_printf ("pipeline=\"%s\",branch=\"%s\"",
+          esc_pipeline, esc_name);
+      stream_metrics_watch_pad (metrics, pad, STREAM_METRICS_ROLE_BRANCH,
+          labels);
+      gst_object_unref (pad);
+    }
+  }
+
+  g_free (labels);
+  g_free (esc_name);
+  g_free (esc_pipeline);
+  g_free (name);
+}
+
+static void
+stream_metrics_deep_element_added (GstBin * bin, GstBin * sub_bin,
+    GstElement * element, StreamMetrics * metrics)
+{
+  stream_metrics_watch_element (metrics, element,
+      g_object_get_data (G_OBJECT (bin), "stream-metrics-label"));
+}
+
+/* Register every interesting element of @pipeline now and as they get
+ * added later (decodebin children, rtpbin sessions, auto sinks). */
+static void G_GNUC_UNUSED
+stream_metrics_watch_pipeline (StreamMetrics * metrics, GstElement * pipeline,
+    const gchar * label)
+{
+  GstIterator *it;
+  GValue item = G_VALUE_INIT;
+  gboolean done = FALSE;
+
+  if (!GST_IS_BIN (pipeline)) {
+    stream_metrics_watch_element (metrics, pipeline, label);
+    return;
+  }
+
+  g_object_set_data_full (G_OBJECT (pipeline), "stream-metrics-label",
+      g_strdup (label), g_free);
+  g_signal_connect (pipeline, "deep-element-added",
+      G_CALLBACK (stream_metrics_deep_element_added), metrics);
+
+  it = gst_bin_iterate_recurse (GST_BIN (pipeline));
+  while (!done) {
+    switch (gst_iterator_next (it, &item)) {
+      case GST_ITERATOR_OK:
+        stream_metrics_watch_element (metrics, g_value_get_object (&item),
+            label);
+        g_value_reset (&item);
+        break;
+      case GST_ITERATOR_RESYNC:
+        gst_iterator_resync (it);
+        break;
+      default:
+        done = TRUE;
+        break;
+    }
+  }
+  g_value_unset (&item);
+  gst_iterator_free (it);
+}
+
+/*
+ * Endpoint
+ */
+static gboolean
+stream_metrics_tick (StreamMetrics * metrics)
+{
+  gint64 now = g_get_monotonic_time ();
+  gdouble dt;
+  guint i;
+
+  g_mutex_lock (&metrics->lock);
+  dt = (now - metrics->last_tick) / (gdouble) G_USEC_PER_SEC;
+  metrics->last_tick = now;
+
+  for (i = 0; i < metrics->entries->len && dt > 0; i++) {
+    StreamMetricsEntry *e = g_ptr_array_index (metrics->entries, i);
+    guint64 buffers = __atomic_load_n (&e->buffers, __ATOMIC_RELAXED);
+    guint64 bytes = __atomic_load_n (&e->bytes, __ATOMIC_RELAXED);
+
+    e->fps = (buffers - e->last_buffers) / dt;
+    e->bps = (bytes - e->last_bytes) * 8 / dt;
+    e->last_buffers = buffers;
+    e->last_bytes = bytes;
+  }
+  g_mutex_unlock (&metrics->lock);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+stream_metrics_serve (GThreadedSocketService * service,
+    GSocketConnection * connection, GObject * source_object,
+    StreamMetrics * metrics)
+{
+  GInputStream *in;
+  GOutputStream *out;
+  gchar request[1024];
+  gchar *body, *header;
+
+  g_mutex_lock (&metrics->lock);
+  if (metrics->closing) {
+    g_mutex_unlock (&metrics->lock);
+    return TRUE;
+  }
+  metrics->scrapes++;
+  g_mutex_unlock (&metrics->lock);
+
+  g_socket_set_timeout (g_socket_connection_get_socket (connection),
+      STREAM_METRICS_TIMEOUT_SECONDS);
+  in = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+  out = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+
+  /* any request gets the metrics, only the request line matters */
+  if (g_input_stream_read (in, request, sizeof (request), NULL, NULL) <= 0)
+    goto done;
+
+  body = stream_metrics_render (metrics);
+  header = g_strdup_printf ("HTTP/1.0 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+      "Connection: close\r\n\r\n", strlen (body));
+
+  g_output_stream_write_all (out, header, strlen (header), NULL, NULL, NULL);
+  g_output_stream_write_all (out, body, strlen (body), NULL, NULL, NULL);
+
+  g_free (header);
+  g_free (body);
+
+done:
+  g_mutex_lock (&metrics->lock);
+  if (--metrics->scrapes == 0)
+    g_cond_broadcast (&metrics->idle);
+  g_mutex_unlock (&metrics->lock);
+  return TRUE;
+}
+
+/* Parse "unix:PATH", "host:port" or "port" (bound to 127.0.0.1); an
+ * existing socket file at PATH is removed. Also used by other listeners. */
+static GSocketAddress * G_GNUC_UNUSED
+stream_metrics_parse_address (const gchar * address, GError ** error)
+{
+  GSocketAddress *saddr = NULL;
+  const gchar *colon;
+  gchar *host;
+  guint port;
+
+#ifdef G_OS_UNIX
+  if (g_str_has_prefix (address, "unix:")) {
+    const gchar *path = address + strlen ("unix:");
+
+    g_unlink (path);
+    return g_unix_socket_address_new (path);
+  }
+#endif
+
+  colon = strrchr (address, ':');
+  host = colon ? g_strndup (address, colon - address) : g_strdup ("127.0.0.1");
+  port = atoi (colon ? colon + 1 : address);
+  saddr = g_inet_socket_address_new_from_string (host, port);
+  g_free (host);
+  if (saddr == NULL || port == 0) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+        "Invalid address '%s'", address);
+    g_clear_object (&saddr);
+  }
+
+  return saddr;
+}
+
+/* Start serving on @address: "unix:/path/to/socket", "host:port" or just
+ * "port" (bound to 127.0.0.1). Rates are computed from the thread-default
+ * main context of the caller. */
+static gboolean G_GNUC_UNUSED
+stream_metrics_listen (StreamMetrics * metrics, const gchar * address,
+    GError ** error)
+{
+  GSocketAddress *saddr;
+
+  saddr = stream_metrics_parse_address (address, error);
+  if (!saddr)
+    return FALSE;
+
+  metrics->service = g_threaded_socket_service_new (2);
+  if (!g_socket_listener_add_address (G_SOCKET_LISTENER (metrics->service),
+          saddr, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL,
+          error)) {
+    g_clear_object (&metrics->service);
+    g_object_unref (saddr);
+    return FALSE;
+  }
+  g_object_unref (saddr);
+
+  g_signal_connect (metrics->service, "run",
+      G_CALLBACK (stream_metrics_serve), metrics);
+  g_socket_service_start (metrics->service);
+
+  metrics->last_tick = g_get_monotonic_time ();
+  metrics->tick = g_timeout_source_new_seconds (STREAM_METRICS_TICK_SECONDS);
+  g_source_set_callback (metrics->tick, (GSourceFunc) stream_metrics_tick,
+      metrics, NULL);
+  g_source_attach (metrics->tick, g_main_context_get_thread_default ());
+
+  return TRUE;
+}
+
+G_END_DECLS
+
+#endif /* __STREAM_METRICS_H__ */
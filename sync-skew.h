@@ -0,0 +1,259 @@
+/* Render time skew of the same frame across synchronised receivers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ */
+
+/*
+ * Usage:
+ *
+ *   SyncSkew *ss = sync_skew_new (n_receivers, 10.0);
+ *
+ *   sync_skew_add (ss, receiver, frame, render_time);   from any thread
+ *   sync_skew_add_unmeasured (ss);
+ *   sync_skew_print_report (ss, stdout);
+ *
+ * @frame identifies a frame exactly the same way in every receiver, the
+ * sender's NTP time of it, and @render_time is when a receiver rendered
+ * it on a reference clock all receivers share. Frames a receiver cannot
+ * identify that way are only counted as unmeasured: anything derived on
+ * the receiver, such as a rounded render target, can match different
+ * frames or miss the same one. Receivers are numbered from 0 to
+ * n_receivers - 1. Once every receiver has
+ * rendered a frame, its skew is the spread between the earliest and the
+ * latest render. The report gives skew percentiles and how many frames
+ * were within the sync target.
+ *
+ * Frames that not all receivers render (dropped as late, or rendered
+ * before a receiver started) are given up on once SYNC_SKEW_PENDING_MAX
+ * newer frames are pending, and counted as incomplete.
+ */
+
+#ifndef __SYNC_SKEW_H__
+#define __SYNC_SKEW_H__
+
+#include <stdio.h>
+#include <string.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define SYNC_SKEW_PENDING_MAX 600
+
+typedef struct
+{
+  guint64 frame;
+  guint seen;
+  GstClockTime first, last;
+  guint32 rendered[];           /* bit per receiver that rendered it */
+} SyncSkewFrame;
+
+typedef struct
+{
+  guint n_receivers;
+  GstClockTime target;
+
+  GMutex lock;
+  GHashTable *pending;          /* frame -> SyncSkewFrame */
+  GQueue order;                 /* pending frames, oldest first */
+  GArray *skews;                /* guint64 ns, one per complete frame */
+  guint64 incomplete;
+  guint64 within_target;
+  guint64 unmeasured;
+} SyncSkew;
+
+/* Skews up to @target_ms count as in sync */
+static SyncSkew * G_GNUC_UNUSED
+sync_skew_new (guint n_receivers, gdouble target_ms)
+{
+  SyncSkew *ss = g_new0 (SyncSkew, 1);
+
+  ss->n_receivers = n_receivers;
+  ss->target = target_ms * GST_MSECOND;
+  g_mutex_init (&ss->lock);
+  ss->pending = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL,
+      g_free);
+  g_queue_init (&ss->order);
+  ss->skews = g_array_new (FALSE, FALSE, sizeof (guint64));
+
+  return ss;
+}
+
+static void G_GNUC_UNUSED
+sync_skew_free (SyncSkew * ss)
+{
+  g_queue_clear (&ss->order);
+  g_hash_table_unref (ss->pending);
+  g_array_unref (ss->skews);
+  g_mutex_clear (&ss->lock);
+  g_free (ss);
+}
+
+/* Receiver @receiver rendered @frame at @render_time */
+static void G_GNUC_UNUSED
+sync_skew_add (SyncSkew * ss, guint receiver, guint64 frame,
+    GstClockTime render_time)
+{
+  SyncSkewFrame *f;
+  guint32 bit = 1u << (receiver % 32);
+
+  g_return_if_fail (receiver < ss->n_receivers);
+
+  g_mutex_lock (&ss->lock);
+  f = g_hash_table_lookup (ss->pending, &frame);
+  if (!f) {
+    f = g_malloc0 (sizeof (SyncSkewFrame) +
+        (ss->n_receivers + 31) / 32 * sizeof (guint32));
+    f->frame = frame;
+    f->first = f->last = render_time;
+    g_hash_table_insert (ss->pending, &f->frame, f);
+    g_queue_push_tail (&ss->order, f);
+  }
+  /* a receiver rendering the frame again does not complete it */
+  if (f->rendered[receiver / 32] & bit)
+    goto done;
+  f->rendered[receiver / 32] |= bit;
+  f->first = MIN (f->first, render_time);
+  f->last = MAX (f->last, render_time);
+
+  if (++f->seen == ss->n_receivers) {
+    guint64 skew = f->last - f->first;
+
+    g_array_append_val (ss->skews, skew);
+    if (skew <= ss->target)
+      ss->within_target++;
+    g_queue_remove (&ss->order, f);
+    g_hash_table_remove (ss->pending, &frame);
+  }
+
+  while (ss->order.length > SYNC_SKEW_PENDING_MAX) {
+    f = g_queue_pop_head (&ss->order);
+    ss->incomplete++;
+    g_hash_table_remove (ss->pending, &f->frame);
+  }
+
+done:
+  g_mutex_unlock (&ss->lock);
+}
+
+/* A receiver rendered a frame it could not identify */
+static void G_GNUC_UNUSED
+sync_skew_add_unmeasured (SyncSkew * ss)
+{
+  g_mutex_lock (&ss->lock);
+  ss->unmeasured++;
+  g_mutex_unlock (&ss->lock);
+}
+
+static gint
+sync_skew_cmp_u64 (gconstpointer a, gconstpointer b)
+{
+  guint64 x = *(const guint64 *) a, y = *(const guint64 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+typedef struct
+{
+  guint64 frames;
+  guint64 incomplete;
+  guint64 within_target;
+  guint64 unmeasured;
+  gdouble avg_ms;
+  gdouble p50_ms, p90_ms, p99_ms, max_ms;
+} SyncSkewStats;
+
+static void G_GNUC_UNUSED
+sync_skew_get_stats (SyncSkew * ss, SyncSkewStats * s)
+{
+  GArray *sorted;
+  guint64 sum = 0;
+  guint i;
+
+  memset (s, 0, sizeof (*s));
+  g_mutex_lock (&ss->lock);
+  sorted = g_array_sized_new (FALSE, FALSE, sizeof (guint64), ss->skews->len);
+  g_array_append_vals (sorted, ss->skews->data, ss->skews->len);
+  s->incomplete = ss->incomplete;
+  s->within_target = ss->within_target;
+  s->unmeasured = ss->unmeasured;
+  g_mutex_unlock (&ss->lock);
+
+  s->frames = sorted->len;
+  if (sorted->len) {
+    g_array_sort (sorted, sync_skew_cmp_u64);
+    for (i = 0; i < sorted->len; i++)
+      sum += g_array_index (sorted, guint64, i);
+    s->avg_ms = (gdouble) sum / sorted->len / GST_MSECOND;
+    s->p50_ms = (gdouble) g_array_index (sorted, guint64,
+        sorted->len / 2) / GST_MSECOND;
+    s->p90_ms = (gdouble) g_array_index (sorted, guint64,
+        (sorted->len * 90) / 100) / GST_MSECOND;
+    s->p99_ms = (gdouble) g_array_index (sorted, guint64,
+        (sorted->len * 99) / 100) / GST_MSECOND;
+    s->max_ms = (gdouble) g_array_index (sorted, guint64,
+        sorted->len - 1) / GST_MSECOND;
+  }
+  g_array_unref (sorted);
+}
+
+static void G_GNUC_UNUSED
+sync_skew_print_report (SyncSkew * ss, FILE * out)
+{
+  SyncSkewStats s;
+
+  sync_skew_get_stats (ss, &s);
+  fprintf (out, "sync skew over %u receivers: %" G_GUINT64_FORMAT
+      " frames (%" G_GUINT64_FORMAT " incomplete)\n", ss->n_receivers,
+      s.frames, s.incomplete);
+  if (s.unmeasured)
+    fprintf (out, "  %" G_GUINT64_FORMAT " renders unmeasured, without the "
+        "sender's NTP time\n", s.unmeasured);
+  if (!s.frames)
+    return;
+  fprintf (out, "  avg %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, "
+      "max %.2f ms\n", s.avg_ms, s.p50_ms, s.p90_ms, s.p99_ms, s.max_ms);
+  fprintf (out, "  %.1f%% of frames within the %.1f ms target: %s\n",
+      100.0 * s.within_target / s.frames, (gdouble) ss->target / GST_MSECOND,
+      s.p99_ms <= (gdouble) ss->target / GST_MSECOND ? "PASS" : "FAIL");
+}
+
+#ifdef __STREAM_METRICS_H__
+static void G_GNUC_UNUSED
+sync_skew_collect_metrics (StreamMetricsScrape * scrape, gpointer user_data)
+{
+  SyncSkew *ss = user_data;
+  SyncSkewStats s;
+
+  sync_skew_get_stats (ss, &s);
+  stream_metrics_emit (scrape, "sync_skew_seconds", "summary",
+      "Render time spread of a frame across receivers", "quantile=\"0.5\"",
+      s.p50_ms / 1000);
+  stream_metrics_emit (scrape, "sync_skew_seconds", "summary", NULL,
+      "quantile=\"0.9\"", s.p90_ms / 1000);
+  stream_metrics_emit (scrape, "sync_skew_seconds", "summary", NULL,
+      "quantile=\"0.99\"", s.p99_ms / 1000);
+  stream_metrics_emit (scrape, "sync_skew_frames_total", "counter",
+      "Frames rendered by every receiver", NULL, s.frames);
+  stream_metrics_emit (scrape, "sync_skew_frames_within_target_total",
+      "counter", "Frames whose skew was within the sync target", NULL,
+      s.within_target);
+  stream_metrics_emit (scrape, "sync_skew_frames_incomplete_total",
+      "counter", "Frames not every receiver rendered", NULL, s.incomplete);
+  stream_metrics_emit (scrape, "sync_skew_renders_unmeasured_total",
+      "counter", "Renders of frames without the sender's NTP time", NULL,
+      s.unmeasured);
+}
+#endif
+
+G_END_DECLS
+
+#endif /* __SYNC_SKEW_H__ */